@@ -43,6 +43,11 @@ Block 0: Master block
 Blocks 1 ... N_INODE_BLOCKS: inodes
 Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
    (Block N_BLOCKS+1 is allocated for the root directory)
+
+With the block-group layout, the disk is also cut into N_GROUPS groups of
+N_BLOCKS_PER_GROUP blocks.  Each group has its own free list, its own
+slice of the inodes (and so of the inode bitmap and inode table) and
+summary counters; their descriptors are in the master block.
 */
 
 
@@ -84,8 +89,9 @@ typedef struct data_block_s
 
 
 /**********************************************************************/
-// Inode Types
-typedef enum {UNUSED_TYPE=0, DIRECTORY_TYPE, FILE_TYPE} INODE_TYPE;
+// Inode Types (a RESERVED inode has been set aside for a thread, with
+//  the block that is its content, and is not in any directory yet)
+typedef enum {UNUSED_TYPE=0, DIRECTORY_TYPE, FILE_TYPE, RESERVED_TYPE} INODE_TYPE;
 
 // Single inode
 typedef struct inode_s
@@ -117,6 +123,27 @@ typedef struct inode_block_s
 } INODE_BLOCK;
 
 
+/**********************************************************************/
+// Block groups
+#define N_BLOCKS_PER_GROUP 16
+#define N_GROUPS (N_BLOCKS / N_BLOCKS_PER_GROUP)
+#define N_INODES_PER_GROUP (N_INODES / N_GROUPS)
+
+typedef struct group_descriptor_s
+{
+  // Free blocks of the group, as a list like the master block's
+  BLOCK_REFERENCE unallocated_front;
+  BLOCK_REFERENCE unallocated_end;
+
+  // Summary counters
+  unsigned char free_blocks;
+  unsigned char free_inodes;
+} GROUP_DESCRIPTOR;
+
+// Layouts of the free space
+#define LAYOUT_LIST 0      // one free list (disks formatted before there was a choice)
+#define LAYOUT_GROUPS 1    // one free list per block group
+
 /**********************************************************************/
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
@@ -133,6 +160,15 @@ typedef struct master_block_s
   BLOCK_REFERENCE unallocated_front;
   BLOCK_REFERENCE unallocated_end;
 
+  // Where the blocks of new directories are taken from (OUFS_ALLOC_*;
+  //  0, the front of the list, on disks formatted before there was a choice)
+  unsigned char allocation_policy;
+
+  // LAYOUT_LIST: the free blocks are on the list above.  LAYOUT_GROUPS:
+  //  that list is empty and each group has its own.
+  unsigned char layout;
+  GROUP_DESCRIPTOR group[N_GROUPS];
+
 } MASTER_BLOCK;
 
 /**********************************************************************/
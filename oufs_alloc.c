@@ -0,0 +1,441 @@
+/**
+ *  oufs_alloc.c
+ *
+ *  Allocation policies: which free block a new directory gets.  The disk
+ *  records its policy in the master block when it is formatted.  Every
+ *  policy but "front" looks at the whole free list (the blocks are in the
+ *  cache after the first time) and takes the block it picks out of the
+ *  middle of the list.
+ *
+ *  Block groups are runs of N_BLOCKS_PER_GROUP blocks.  "near" and "group"
+ *  keep a directory next to its parent, so that a directory's children are
+ *  read together; "spread" puts each new directory in the emptiest group,
+ *  which leaves room next to it for its own children and spreads the tree
+ *  over the backing files of a striped disk.
+ *
+ *  A disk formatted with the block-group layout has a free list and
+ *  counters per group (see oufs.h).  The policy then picks a group from
+ *  the counters alone and looks only at that group's list, and a new
+ *  directory gets an inode from the group's slice of the inodes.  Freed
+ *  blocks go back on the list of their own group.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib_support.h"
+
+// Picks a free block: is_free has one entry per block; front is the
+//  front of the free list and near the block of the parent directory
+typedef BLOCK_REFERENCE (*OUFS_ALLOC_CHOOSE)(const unsigned char *is_free, BLOCK_REFERENCE front,
+                                             BLOCK_REFERENCE near);
+
+/**
+ * @return The front of the free list
+ */
+static BLOCK_REFERENCE choose_front(const unsigned char *is_free, BLOCK_REFERENCE front,
+                                    BLOCK_REFERENCE near)
+{
+    return(front);
+}
+
+/**
+ * @return The free block closest to near (after it if there is a tie)
+ */
+static BLOCK_REFERENCE choose_near(const unsigned char *is_free, BLOCK_REFERENCE front,
+                                   BLOCK_REFERENCE near)
+{
+    for(int d = 1; d < N_BLOCKS; ++d) {
+        if(near + d < N_BLOCKS && is_free[near + d])
+            return(near + d);
+        if(near - d >= 0 && is_free[near - d])
+            return(near - d);
+    }
+    return(front);
+}
+
+/**
+ * @param skip Group to look at only if it is the only one with free blocks
+ * @return The group with the most free blocks, looking from the one
+ *         after near's (so that ties go round the disk)
+ */
+static int emptiest_group(const unsigned char *is_free, BLOCK_REFERENCE near, int skip)
+{
+    int count[N_GROUPS];
+    memset(count, 0, sizeof(count));
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+        count[b / N_BLOCKS_PER_GROUP] += is_free[b];
+    }
+    int best = skip;
+    for(int k = 1; k <= N_GROUPS; ++k) {
+        int g = (near / N_BLOCKS_PER_GROUP + k) % N_GROUPS;
+        if(g != skip && count[g] > 0 && (best == skip || count[g] > count[best]))
+            best = g;
+    }
+    return(best);
+}
+
+/**
+ * @return The first free block of a group at or after near, or else the
+ *         first one in the group; UNALLOCATED_BLOCK if it has none
+ */
+static BLOCK_REFERENCE first_in_group(const unsigned char *is_free, int group, BLOCK_REFERENCE near)
+{
+    BLOCK_REFERENCE start = group * N_BLOCKS_PER_GROUP;
+    BLOCK_REFERENCE end = MIN(start + N_BLOCKS_PER_GROUP, N_BLOCKS);
+    for(BLOCK_REFERENCE b = near > start ? near : start; b < end; ++b) {
+        if(is_free[b])
+            return(b);
+    }
+    for(BLOCK_REFERENCE b = start; b < end; ++b) {
+        if(is_free[b])
+            return(b);
+    }
+    return(UNALLOCATED_BLOCK);
+}
+
+/**
+ * @return A free block in near's group; failing that, the first free
+ *         block of the emptiest group
+ */
+static BLOCK_REFERENCE choose_group(const unsigned char *is_free, BLOCK_REFERENCE front,
+                                    BLOCK_REFERENCE near)
+{
+    BLOCK_REFERENCE b = first_in_group(is_free, near / N_BLOCKS_PER_GROUP, near);
+    if(b != UNALLOCATED_BLOCK)
+        return(b);
+    b = first_in_group(is_free, emptiest_group(is_free, near, -1), 0);
+    return(b != UNALLOCATED_BLOCK ? b : front);
+}
+
+/**
+ * @return The first free block of the emptiest group other than near's
+ */
+static BLOCK_REFERENCE choose_spread(const unsigned char *is_free, BLOCK_REFERENCE front,
+                                     BLOCK_REFERENCE near)
+{
+    int group = near / N_BLOCKS_PER_GROUP;
+    BLOCK_REFERENCE b = first_in_group(is_free, emptiest_group(is_free, near, group), 0);
+    return(b != UNALLOCATED_BLOCK ? b : front);
+}
+
+// The policies, by OUFS_ALLOC_* number
+static const struct
+{
+    const char *name;
+    OUFS_ALLOC_CHOOSE choose;
+} POLICY[OUFS_N_ALLOC_POLICIES] = {
+    {"front", choose_front},
+    {"near", choose_near},
+    {"group", choose_group},
+    {"spread", choose_spread},
+};
+
+/**
+ * @param name Name of a policy
+ * @return Its OUFS_ALLOC_* number; -1 if there is no such policy
+ */
+int oufs_alloc_policy(const char *name)
+{
+    for(int k = 0; k < OUFS_N_ALLOC_POLICIES; ++k) {
+        if(strcmp(name, POLICY[k].name) == 0)
+            return(k);
+    }
+    return(-1);
+}
+
+/**
+ * @param policy OUFS_ALLOC_* number
+ * @return The name of the policy ("unknown" if there is none)
+ */
+const char *oufs_alloc_policy_name(int policy)
+{
+    return(policy >= 0 && policy < OUFS_N_ALLOC_POLICIES ? POLICY[policy].name : "unknown");
+}
+
+/**
+ * @return Number of free lists: one per block group, or just the master
+ *         block's
+ */
+int oufs_n_free_lists(const MASTER_BLOCK *m)
+{
+    return(m->layout == LAYOUT_GROUPS ? N_GROUPS : 1);
+}
+
+/**
+ * @return The free list that a block goes back on
+ */
+int oufs_free_list_of(const MASTER_BLOCK *m, BLOCK_REFERENCE b)
+{
+    return(m->layout == LAYOUT_GROUPS ? b / N_BLOCKS_PER_GROUP : 0);
+}
+
+/**
+ * @param k Free list (0 .. oufs_n_free_lists() - 1)
+ * @return Where the front of the list is kept
+ */
+BLOCK_REFERENCE *oufs_free_front(MASTER_BLOCK *m, int k)
+{
+    return(m->layout == LAYOUT_GROUPS ? &m->group[k].unallocated_front : &m->unallocated_front);
+}
+
+/**
+ * @param k Free list (0 .. oufs_n_free_lists() - 1)
+ * @return Where the end of the list is kept
+ */
+BLOCK_REFERENCE *oufs_free_end(MASTER_BLOCK *m, int k)
+{
+    return(m->layout == LAYOUT_GROUPS ? &m->group[k].unallocated_end : &m->unallocated_end);
+}
+
+/**
+ * @return 1 if inode i is allocated; 0 if not
+ */
+int oufs_master_inode_allocated(const MASTER_BLOCK *m, INODE_REFERENCE i)
+{
+    return((m->inode_allocated_flag[i >> 3] >> (7 - (i & 7))) & 1);
+}
+
+/**
+ * Mark an inode allocated or free, keeping its group's counter in step
+ */
+void oufs_master_set_inode(MASTER_BLOCK *m, INODE_REFERENCE i, int allocated)
+{
+    if(oufs_master_inode_allocated(m, i) == (allocated != 0))
+        return;
+    if(allocated)
+        m->inode_allocated_flag[i >> 3] |= 0x80 >> (i & 7);
+    else
+        m->inode_allocated_flag[i >> 3] &= ~(0x80 >> (i & 7));
+    if(m->layout == LAYOUT_GROUPS)
+        m->group[i / N_INODES_PER_GROUP].free_inodes += allocated ? -1 : 1;
+}
+
+/**
+ * A block has gone on (delta 1) or come off (delta -1) a free list: keep
+ *   its group's counter in step
+ */
+void oufs_master_count_block(MASTER_BLOCK *m, BLOCK_REFERENCE b, int delta)
+{
+    if(m->layout == LAYOUT_GROUPS && b < N_BLOCKS)
+        m->group[b / N_BLOCKS_PER_GROUP].free_blocks += delta;
+}
+
+/**
+ * Set the counters of the groups from scratch
+ *
+ * @param is_free One entry per block: 1 if it is on a free list
+ */
+void oufs_master_recount(MASTER_BLOCK *m, const unsigned char *is_free)
+{
+    if(m->layout != LAYOUT_GROUPS)
+        return;
+    for(int g = 0; g < N_GROUPS; ++g) {
+        m->group[g].free_blocks = 0;
+        m->group[g].free_inodes = 0;
+    }
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+        m->group[b / N_BLOCKS_PER_GROUP].free_blocks += is_free[b] != 0;
+    }
+    for(INODE_REFERENCE i = 0; i < N_GROUPS * N_INODES_PER_GROUP; ++i) {
+        m->group[i / N_INODES_PER_GROUP].free_inodes += !oufs_master_inode_allocated(m, i);
+    }
+}
+
+/**
+ * Pick the group a new directory goes in, from the counters alone
+ *
+ * @param near Block of the parent directory
+ * @return The group; -1 if no group has a free block
+ */
+static int choose_group_of(const MASTER_BLOCK *m, int policy, BLOCK_REFERENCE near)
+{
+    int home = near / N_BLOCKS_PER_GROUP;
+    if(policy == OUFS_ALLOC_FRONT) {
+        for(int g = 0; g < N_GROUPS; ++g) {
+            if(m->group[g].free_blocks > 0)
+                return(g);
+        }
+        return(-1);
+    }
+    if(policy != OUFS_ALLOC_SPREAD && m->group[home].free_blocks > 0)
+        return(home);
+
+    // The emptiest other group, looking from the one after home's; home's
+    //  only if there is no other
+    int best = -1;
+    for(int k = 1; k < N_GROUPS; ++k) {
+        int g = (home + k) % N_GROUPS;
+        if(m->group[g].free_blocks > 0
+           && (best < 0 || m->group[g].free_blocks > m->group[best].free_blocks))
+            best = g;
+    }
+    return(best >= 0 || m->group[home].free_blocks == 0 ? best : home);
+}
+
+/**
+ * Take a free block off a free list within an update, where the disk's
+ *   policy says.  The caller holds the allocator lock.
+ *
+ * @param near Block the new one belongs next to (the parent directory's)
+ * @return The block, still linked to its old successor
+ *         UNALLOCATED_BLOCK if there is none or the free list is damaged
+ */
+BLOCK_REFERENCE oufs_update_take_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE near)
+{
+    BLOCK *master = oufs_update_block(mount, update, MASTER_BLOCK_REFERENCE);
+    if(master == NULL)
+        return(UNALLOCATED_BLOCK);
+    MASTER_BLOCK *m = &master->content.master;
+    int policy = m->allocation_policy < OUFS_N_ALLOC_POLICIES ? m->allocation_policy : OUFS_ALLOC_FRONT;
+    near = near < N_BLOCKS ? near : ROOT_DIRECTORY_BLOCK;
+
+    // With block groups, only the list of the group the counters point to
+    int list = 0;
+    if(m->layout == LAYOUT_GROUPS)
+        list = choose_group_of(m, policy, near);
+    if(list < 0 || *oufs_free_front(m, list) == UNALLOCATED_BLOCK) {
+        if(list < 0 || m->layout != LAYOUT_GROUPS)
+            fprintf(stderr, "oufs_update_take_block: no blocks left\n");
+        else
+            fprintf(stderr, "oufs_update_take_block: the counters of group %d are damaged\n", list);
+        return(UNALLOCATED_BLOCK);
+    }
+    BLOCK_REFERENCE *front = oufs_free_front(m, list);
+    BLOCK_REFERENCE *end = oufs_free_end(m, list);
+
+    // The whole list, with the block before each one
+    unsigned char is_free[N_BLOCKS];
+    BLOCK_REFERENCE before[N_BLOCKS];
+    memset(is_free, 0, sizeof(is_free));
+    BLOCK_REFERENCE prev = UNALLOCATED_BLOCK;
+    for(BLOCK_REFERENCE b = *front; b != UNALLOCATED_BLOCK; ) {
+        // The list mostly runs up the disk: load ahead of it
+        if(policy != OUFS_ALLOC_FRONT && b < N_BLOCKS && !update->loaded[b]
+           && __atomic_load_n(&mount->cache->block[b].seq, __ATOMIC_ACQUIRE) == 0) {
+            BLOCK_REFERENCE refs[OUFS_READAHEAD_MAX];
+            int n_refs = 0;
+            while(n_refs < OUFS_READAHEAD_MAX && b + n_refs < N_BLOCKS
+                  && oufs_free_list_of(m, b + n_refs) == list) {
+                refs[n_refs] = b + n_refs;
+                ++n_refs;
+            }
+            oufs_prefetch_blocks(mount, refs, n_refs);
+        }
+        BLOCK *block = b < N_BLOCKS ? oufs_update_block(mount, update, b) : NULL;
+        if(block == NULL || is_free[b] || oufs_free_list_of(m, b) != list
+           || (block->next_block != UNALLOCATED_BLOCK && block->next_block >= N_BLOCKS)) {
+            fprintf(stderr, "oufs_update_take_block: free block %d is damaged\n", b);
+            return(UNALLOCATED_BLOCK);
+        }
+        is_free[b] = 1;
+        before[b] = prev;
+        prev = b;
+
+        // Only the front is needed
+        if(policy == OUFS_ALLOC_FRONT)
+            break;
+        b = block->next_block;
+    }
+
+    BLOCK_REFERENCE b = POLICY[policy].choose(is_free, *front, near);
+    BLOCK_REFERENCE next = update->block[b].next_block;
+    update->dirty[MASTER_BLOCK_REFERENCE] = 1;
+    if(before[b] == UNALLOCATED_BLOCK)
+        *front = next;
+    else
+        oufs_update_change(mount, update, before[b])->next_block = next;
+    if(*end == b)
+        *end = before[b];
+    oufs_master_count_block(m, b, -1);
+    return(b);
+}
+
+/**
+ * Take a free inode within an update.  The caller holds the allocator
+ *   lock.
+ *
+ * @param near Block the inode's directory or file has (with block groups,
+ *             the inode comes from that block's group if it can)
+ * @return The inode
+ *         UNALLOCATED_INODE if there is none left
+ */
+INODE_REFERENCE oufs_update_take_inode(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE near)
+{
+    BLOCK *master = oufs_update_block(mount, update, MASTER_BLOCK_REFERENCE);
+    if(master == NULL)
+        return(UNALLOCATED_INODE);
+    MASTER_BLOCK *m = &master->content.master;
+    INODE_REFERENCE i = N_INODES;
+    if(m->layout == LAYOUT_GROUPS && near < N_BLOCKS) {
+        INODE_REFERENCE first = near / N_BLOCKS_PER_GROUP * N_INODES_PER_GROUP;
+        for(i = first; i < first + N_INODES_PER_GROUP && oufs_master_inode_allocated(m, i); ++i)
+            ;
+        if(i == first + N_INODES_PER_GROUP)
+            i = N_INODES;
+    }
+    if(i == N_INODES) {
+        for(i = 0; i < N_INODES && oufs_master_inode_allocated(m, i); ++i)
+            ;
+    }
+    if(i == N_INODES) {
+        fprintf(stderr, "oufs_update_take_inode: no inodes left\n");
+        return(UNALLOCATED_INODE);
+    }
+    oufs_master_set_inode(m, i, 1);
+    update->dirty[MASTER_BLOCK_REFERENCE] = 1;
+    return(i);
+}
+
+/**
+ * Put a block at the end of its free list within an update.  The caller
+ *   holds the allocator lock.
+ *
+ * @return 0 if success
+ *         -1 if the end of the list cannot be read
+ */
+int oufs_update_put_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref)
+{
+    BLOCK *master = oufs_update_change(mount, update, MASTER_BLOCK_REFERENCE);
+    BLOCK *b = oufs_update_change(mount, update, block_ref);
+    if(master == NULL || b == NULL)
+        return(-1);
+    MASTER_BLOCK *m = &master->content.master;
+    int list = oufs_free_list_of(m, block_ref);
+    if(*oufs_free_front(m, list) == UNALLOCATED_BLOCK) {
+        *oufs_free_front(m, list) = block_ref;
+    }else{
+        BLOCK *end = oufs_update_change(mount, update, *oufs_free_end(m, list));
+        if(end == NULL)
+            return(-1);
+        end->next_block = block_ref;
+    }
+    *oufs_free_end(m, list) = block_ref;
+    b->next_block = UNALLOCATED_BLOCK;
+    oufs_master_count_block(m, block_ref, 1);
+    return(0);
+}
+
+/**
+ * Put a block that was taken but not used back at the front of its free
+ *   list, within an update, so that the list is as it was.  The caller
+ *   holds the allocator lock.
+ *
+ * @return 0 if success
+ *         -1 if the block cannot be read
+ */
+int oufs_update_return_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref)
+{
+    BLOCK *master = oufs_update_change(mount, update, MASTER_BLOCK_REFERENCE);
+    BLOCK *b = oufs_update_change(mount, update, block_ref);
+    if(master == NULL || b == NULL)
+        return(-1);
+    MASTER_BLOCK *m = &master->content.master;
+    int list = oufs_free_list_of(m, block_ref);
+    b->next_block = *oufs_free_front(m, list);
+    if(*oufs_free_front(m, list) == UNALLOCATED_BLOCK)
+        *oufs_free_end(m, list) = block_ref;
+    *oufs_free_front(m, list) = block_ref;
+    oufs_master_count_block(m, block_ref, 1);
+    return(0);
+}
@@ -0,0 +1,153 @@
+/**
+ *  oufs_batch
+ *
+ *  Makes and removes many directories at once.  Each line of the input
+ *  is "mkdir <name>" or "rmdir <name>"; empty lines and lines that start
+ *  with # are skipped.  The operations are run by several threads (see
+ *  oufs_ops.c): a directory is made before anything below it and removed
+ *  after everything below it, and the rest run in any order.
+ *
+ *  Usage: oufs_batch [-j threads] [<file>]     (no file: standard input)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+
+#define USAGE "Usage: oufs_batch [-j threads] [<file>]\n"
+
+// The operations as read, and the line each came from
+typedef struct
+{
+  OUFS_OP *op;
+  int *line;
+  int n;
+  int size;
+} BATCH;
+
+/**
+ *  Add the operation on one line of the input
+ *
+ *  @return 0 if success (or nothing on the line); -1 if the line is not
+ *          an operation or out of memory
+ */
+static int add_line(BATCH *batch, char *text, int line)
+{
+  char *save_ptr;
+  char *command = strtok_r(text, " \t\r\n", &save_ptr);
+  if(command == NULL || command[0] == '#')
+    return(0);
+  char *path = strtok_r(NULL, " \t\r\n", &save_ptr);
+  OUFS_OP_TYPE type;
+  if(strcmp(command, "mkdir") == 0)
+    type = OUFS_OP_MKDIR;
+  else if(strcmp(command, "rmdir") == 0)
+    type = OUFS_OP_RMDIR;
+  else
+    path = NULL;
+  if(path == NULL || strtok_r(NULL, " \t\r\n", &save_ptr) != NULL) {
+    fprintf(stderr, "oufs_batch: line %d: expected mkdir or rmdir and a name\n", line);
+    return(-1);
+  }
+
+  if(batch->n == batch->size) {
+    int size = batch->size ? 2 * batch->size : 256;
+    OUFS_OP *op = realloc(batch->op, size * sizeof(OUFS_OP));
+    if(op != NULL)
+      batch->op = op;
+    int *lines = realloc(batch->line, size * sizeof(int));
+    if(lines != NULL)
+      batch->line = lines;
+    if(op == NULL || lines == NULL) {
+      fprintf(stderr, "oufs_batch: out of memory\n");
+      return(-1);
+    }
+    batch->size = size;
+  }
+  batch->op[batch->n].type = type;
+  batch->op[batch->n].path = strdup(path);
+  batch->op[batch->n].result = 0;
+  batch->line[batch->n] = line;
+  if(batch->op[batch->n].path == NULL) {
+    fprintf(stderr, "oufs_batch: out of memory\n");
+    return(-1);
+  }
+  ++batch->n;
+  return(0);
+}
+
+int main(int argc, char **argv)
+{
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int threads = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "j:")) != -1) {
+    switch(opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return(-1);
+    }
+  }
+  if(argc - optind > 1) {
+    fprintf(stderr, USAGE);
+    return(-1);
+  }
+
+  // Read the operations
+  FILE *input = optind < argc ? fopen(argv[optind], "r") : stdin;
+  if(input == NULL) {
+    perror(argv[optind]);
+    return(-1);
+  }
+  BATCH batch = {NULL, NULL, 0, 0};
+  char *text = NULL;
+  size_t text_size = 0;
+  int ret = 0;
+  for(int line = 1; ret == 0 && getline(&text, &text_size, input) >= 0; ++line) {
+    ret = add_line(&batch, text, line);
+  }
+  free(text);
+  if(input != stdin)
+    fclose(input);
+
+  if(ret == 0) {
+    // Open the virtual disk
+    OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+    if(mount == NULL) {
+      ret = -1;
+    }else{
+      int failed = oufs_run_ops(mount, cwd, batch.op, batch.n, threads);
+      if(failed >= 0) {
+        for(int k = 0; k < batch.n; ++k) {
+          if(batch.op[k].result != 0)
+            fprintf(stderr, "oufs_batch: line %d: %s %s: error (%d)\n", batch.line[k],
+                    batch.op[k].type == OUFS_OP_MKDIR ? "mkdir" : "rmdir",
+                    batch.op[k].path, batch.op[k].result);
+        }
+        printf("%d operations, %d failed\n", batch.n, failed);
+      }
+      ret = failed == 0 ? 0 : -1;
+
+      // Clean up
+      if(oufs_unmount(mount) != 0)
+        ret = -1;
+    }
+  }
+  for(int k = 0; k < batch.n; ++k) {
+    free(batch.op[k].path);
+  }
+  free(batch.op);
+  free(batch.line);
+  return(ret);
+}
@@ -0,0 +1,576 @@
+/**
+ *  oufs_bulk.c
+ *
+ *  Whole trees at once.  oufs_add_tree() lays a tree of directories and
+ *  files out in memory before anything is written: the directories take
+ *  the lowest free blocks, in breadth-first order, and the data of the
+ *  files follows, each file in one run.  The new blocks are written with
+ *  a few large writes.  Nothing refers to them until the transaction
+ *  that changes the master block, the inode blocks and the target
+ *  directory (each written once) commits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib_support.h"
+#include "virtual_disk.h"
+
+// A node of the new tree, in breadth-first order
+typedef struct
+{
+    OUFS_TREE_NODE *node;
+
+    // Index of the parent (-1: the target directory)
+    int parent;
+
+    INODE_REFERENCE inode;
+
+    // First of the node's blocks within the new blocks; number of blocks
+    int first_block;
+    int n_blocks;
+} BULK_NODE;
+
+static int compare_blocks(const void *a, const void *b)
+{
+    return((int) *(const BLOCK_REFERENCE *) a - (int) *(const BLOCK_REFERENCE *) b);
+}
+
+/**
+ * @return 1 if the nodes can go into one directory: good, distinct names
+ *         and no more than fit in a directory block
+ */
+static int good_children(OUFS_TREE_NODE *nodes, int n)
+{
+    if(n > N_DIRECTORY_ENTRIES_PER_BLOCK - 2)
+        return(0);
+    for(int k = 0; k < n; ++k) {
+        char *name = nodes[k].name;
+        if(name[0] == 0 || memchr(name, 0, FILE_NAME_SIZE - 1) == NULL
+           || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            return(0);
+        if(nodes[k].type == FILE_TYPE
+           && nodes[k].size > (unsigned int) MAX_BLOCKS_IN_FILE * OUFS_FILE_BLOCK_DATA)
+            return(0);
+        if(nodes[k].type != FILE_TYPE && nodes[k].type != DIRECTORY_TYPE)
+            return(0);
+        for(int j = 0; j < k; ++j) {
+            if(strcmp(nodes[j].name, name) == 0)
+                return(0);
+        }
+    }
+    return(1);
+}
+
+/**
+ * List the nodes of a tree in breadth-first order
+ *
+ * @param n_nodes Set to the number of nodes
+ * @param n_blocks Set to the number of blocks they need
+ * @return The list (to be freed); NULL if the tree cannot be added
+ */
+static BULK_NODE *bulk_list(OUFS_TREE_NODE *nodes, int n, int *n_nodes, int *n_blocks)
+{
+    int size = 64;
+    BULK_NODE *list = malloc(size * sizeof(BULK_NODE));
+    if(list == NULL || !good_children(nodes, n)) {
+        free(list);
+        return(NULL);
+    }
+    int count = 0;
+    for(int k = 0; k < n; ++k) {
+        list[count++] = (BULK_NODE) {&nodes[k], -1, UNALLOCATED_INODE, 0, 0};
+        if(count == size) {
+            size *= 2;
+            BULK_NODE *l = realloc(list, size * sizeof(BULK_NODE));
+            if(l == NULL) {
+                free(list);
+                return(NULL);
+            }
+            list = l;
+        }
+    }
+
+    // Each directory's children go at the end; blocks are counted on the way
+    int blocks = 0;
+    for(int j = 0; j < count; ++j) {
+        OUFS_TREE_NODE *node = list[j].node;
+        if(node->type == FILE_TYPE) {
+            list[j].n_blocks = (node->size + OUFS_FILE_BLOCK_DATA - 1) / OUFS_FILE_BLOCK_DATA;
+            blocks += list[j].n_blocks;
+            continue;
+        }
+        list[j].n_blocks = 1;
+        ++blocks;
+        if(!good_children(node->child, node->n_children)) {
+            free(list);
+            return(NULL);
+        }
+        for(int k = 0; k < node->n_children; ++k) {
+            list[count++] = (BULK_NODE) {&node->child[k], j, UNALLOCATED_INODE, 0, 0};
+            if(count == size) {
+                size *= 2;
+                BULK_NODE *l = realloc(list, size * sizeof(BULK_NODE));
+                if(l == NULL) {
+                    free(list);
+                    return(NULL);
+                }
+                list = l;
+            }
+        }
+    }
+    *n_nodes = count;
+    *n_blocks = blocks;
+    return(list);
+}
+
+/**
+ * Take blocks off the free lists: the lowest numbered ones, so that they
+ *   come in runs.  The blocks that stay free keep their order; only those
+ *   whose successor has gone are relinked.
+ *
+ * @param n Number of blocks to take
+ * @param taken Set to the blocks, in ascending order
+ * @return 0 if success
+ *         -1 if the free list cannot be read
+ *         -3 if there are not enough free blocks
+ */
+static int bulk_take_blocks(OUFS_MOUNT *mount, OUFS_UPDATE *update, int n, BLOCK_REFERENCE *taken)
+{
+    BLOCK_REFERENCE chain[N_BLOCKS];
+    unsigned char in_chain[N_BLOCKS];
+    int start[N_GROUPS + 1];
+    int length = 0;
+    memset(in_chain, 0, sizeof(in_chain));
+
+    BLOCK *master = oufs_update_change(mount, update, MASTER_BLOCK_REFERENCE);
+    if(master == NULL)
+        return(-1);
+    MASTER_BLOCK *m = &master->content.master;
+    int n_lists = oufs_n_free_lists(m);
+    for(int list = 0; list < n_lists; ++list) {
+        start[list] = length;
+        for(BLOCK_REFERENCE b = *oufs_free_front(m, list); b != UNALLOCATED_BLOCK; ) {
+            // The chain mostly runs up the disk: load ahead of it
+            if(b < N_BLOCKS && !update->loaded[b]
+               && __atomic_load_n(&mount->cache->block[b].seq, __ATOMIC_ACQUIRE) == 0) {
+                BLOCK_REFERENCE refs[OUFS_READAHEAD_MAX];
+                int n_refs = 0;
+                while(n_refs < OUFS_READAHEAD_MAX && b + n_refs < N_BLOCKS) {
+                    refs[n_refs] = b + n_refs;
+                    ++n_refs;
+                }
+                oufs_prefetch_blocks(mount, refs, n_refs);
+            }
+            BLOCK *block = oufs_update_block(mount, update, b);
+            if(block == NULL || in_chain[b] || length == N_BLOCKS) {
+                fprintf(stderr, "oufs_add_tree: free block list is damaged at block %d\n", b);
+                return(-1);
+            }
+            in_chain[b] = 1;
+            chain[length++] = b;
+            b = block->next_block;
+        }
+    }
+    start[n_lists] = length;
+    if(length < n) {
+        fprintf(stderr, "oufs_add_tree: %d blocks needed, %d free\n", n, length);
+        return(-3);
+    }
+
+    memcpy(taken, chain, length * sizeof(BLOCK_REFERENCE));
+    qsort(taken, length, sizeof(BLOCK_REFERENCE), compare_blocks);
+    for(int k = 0; k < n; ++k) {
+        in_chain[taken[k]] = 0;
+    }
+
+    // Relink what is left of each list
+    for(int list = 0; list < n_lists; ++list) {
+        BLOCK_REFERENCE prev = UNALLOCATED_BLOCK;
+        *oufs_free_front(m, list) = UNALLOCATED_BLOCK;
+        for(int k = start[list]; k <= start[list + 1]; ++k) {
+            BLOCK_REFERENCE b = k < start[list + 1] ? chain[k] : UNALLOCATED_BLOCK;
+            if(b != UNALLOCATED_BLOCK && !in_chain[b])
+                continue;
+            if(prev == UNALLOCATED_BLOCK)
+                *oufs_free_front(m, list) = b;
+            else if(update->block[prev].next_block != b)
+                oufs_update_change(mount, update, prev)->next_block = b;
+            if(b != UNALLOCATED_BLOCK)
+                prev = b;
+        }
+        *oufs_free_end(m, list) = prev;
+    }
+    oufs_master_recount(m, in_chain);
+    return(0);
+}
+
+/**
+ * Take inodes off the allocation table (the lowest numbered ones)
+ *
+ * @param n Number of inodes to take
+ * @param taken Set to the inodes
+ * @return 0 if success
+ *         -3 if there are not enough free inodes
+ */
+static int bulk_take_inodes(OUFS_MOUNT *mount, OUFS_UPDATE *update, int n, BULK_NODE *list)
+{
+    BLOCK *master = oufs_update_change(mount, update, MASTER_BLOCK_REFERENCE);
+    int k = 0;
+    for(INODE_REFERENCE i = 0; i < N_INODES && k < n; ++i) {
+        if(!oufs_master_inode_allocated(&master->content.master, i)) {
+            oufs_master_set_inode(&master->content.master, i, 1);
+            list[k++].inode = i;
+        }
+    }
+    if(k < n) {
+        fprintf(stderr, "oufs_add_tree: %d inodes needed, %d free\n", n, k);
+        return(-3);
+    }
+    return(0);
+}
+
+/**
+ * Lay the new tree out: the directories take the first of the given
+ *   blocks, in breadth-first order, and the data of the files follows.
+ *   Fills in the inodes (already taken), the new blocks and the entries.
+ *
+ * @param list The nodes, with their inodes
+ * @param blocks The blocks to use, in ascending order
+ * @param dir Directory that receives the top of the tree
+ * @return 0 if success
+ *         -1 if a block cannot be read
+ *         -2 if a directory has no room
+ */
+static int bulk_build(OUFS_MOUNT *mount, OUFS_UPDATE *update, BULK_NODE *list, int n_nodes,
+                      BLOCK_REFERENCE *blocks, INODE_REFERENCE dir)
+{
+    int next_block = 0;
+    for(int pass = 0; pass < 2; ++pass) {
+        for(int j = 0; j < n_nodes; ++j) {
+            if((list[j].node->type == DIRECTORY_TYPE) == (pass == 0)) {
+                list[j].first_block = next_block;
+                next_block += list[j].n_blocks;
+            }
+        }
+    }
+
+    // Parents come before their children
+    for(int j = 0; j < n_nodes; ++j) {
+        OUFS_TREE_NODE *node = list[j].node;
+        INODE_REFERENCE parent_inode = list[j].parent < 0 ? dir : list[list[j].parent].inode;
+        INODE *new_inode = oufs_update_inode(mount, update, list[j].inode);
+        if(new_inode == NULL)
+            return(-1);
+        if(node->type == DIRECTORY_TYPE) {
+            BLOCK_REFERENCE b = blocks[list[j].first_block];
+            oufs_init_directory_structures(new_inode, oufs_update_fresh(update, b), b,
+                                           list[j].inode, parent_inode);
+        }else{
+            oufs_set_inode(new_inode, FILE_TYPE, 1,
+                           list[j].n_blocks ? blocks[list[j].first_block] : UNALLOCATED_BLOCK,
+                           node->size);
+            for(int k = 0; k < list[j].n_blocks; ++k) {
+                BLOCK *b = oufs_update_fresh(update, blocks[list[j].first_block + k]);
+                unsigned int offset = k * OUFS_FILE_BLOCK_DATA;
+                b->next_block = k + 1 < list[j].n_blocks ? blocks[list[j].first_block + k + 1]
+                    : UNALLOCATED_BLOCK;
+                memcpy(b->content.data.data, node->data + offset,
+                       MIN((unsigned int) OUFS_FILE_BLOCK_DATA, node->size - offset));
+            }
+        }
+        if(oufs_update_add_entry(mount, update, parent_inode, node->name, list[j].inode) != 0)
+            return(-2);
+    }
+    return(0);
+}
+
+/**
+ * Write the new blocks, one large write for every run of consecutive
+ *   block numbers
+ *
+ * @param blocks The new blocks, in ascending order
+ * @param n Number of new blocks
+ * @return 0 if success; -1 if a write fails
+ */
+static int bulk_write(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE *blocks, int n)
+{
+    unsigned char *buf = malloc((size_t) n * BLOCK_SIZE + 1);
+    if(buf == NULL)
+        return(-1);
+    int ret = 0;
+    for(int first = 0, k = 0; k < n && ret == 0; first = k) {
+        do {
+            memcpy(buf + k * BLOCK_SIZE, &update->block[blocks[k]], BLOCK_SIZE);
+            // Written here, not with the transaction
+            update->dirty[blocks[k]] = 0;
+            ++k;
+        } while(k < n && blocks[k] == blocks[k - 1] + 1);
+        ret = oufs_write_blocks(mount, blocks[first], k - first, buf + first * BLOCK_SIZE);
+    }
+    free(buf);
+    return(ret);
+}
+
+/**
+ * oufs_add_tree(), with the trace tag set by the caller
+ */
+static int add_tree(OUFS_MOUNT *mount, char *cwd, char *path, OUFS_TREE_NODE *nodes, int n)
+{
+    INODE_REFERENCE parent;
+    INODE_REFERENCE dir;
+
+    int n_nodes;
+    int n_blocks;
+    BULK_NODE *list = bulk_list(nodes, n, &n_nodes, &n_blocks);
+    if(list == NULL) {
+        fprintf(stderr, "oufs_add_tree: bad names, too many entries or files too large\n");
+        return(-2);
+    }
+    if(n_nodes > N_INODES || n_blocks > N_BLOCKS) {
+        free(list);
+        return(-3);
+    }
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if(update == NULL || oufs_cache_lock(mount) != 0) {
+        free(list);
+        free(update);
+        return(-1);
+    }
+    if(oufs_find_file(mount, cwd, path, &parent, &dir, NULL) != 0 || dir == UNALLOCATED_INODE) {
+        fprintf(stderr, "Not found\n");
+        free(list);
+        free(update);
+        return(-1);
+    }
+
+    // The directory must still be there under the lock, and have room
+    pthread_rwlock_wrlock(&mount->inode_lock[dir]);
+    INODE inode;
+    int ret = 0;
+    if(oufs_read_inode_by_reference(mount, dir, &inode) != 0 || inode.type != DIRECTORY_TYPE) {
+        ret = -1;
+    }else if(inode.size + n > N_DIRECTORY_ENTRIES_PER_BLOCK) {
+        ret = -2;
+    }else{
+        for(int k = 0; k < n && ret == 0; ++k) {
+            if(oufs_find_directory_element(mount, &inode, nodes[k].name) != UNALLOCATED_INODE) {
+                fprintf(stderr, "oufs_add_tree: %s exists\n", nodes[k].name);
+                ret = -2;
+            }
+        }
+    }
+    if(ret != 0) {
+        pthread_rwlock_unlock(&mount->inode_lock[dir]);
+        free(list);
+        free(update);
+        return(ret);
+    }
+
+    virtual_disk_begin_transaction(mount->disk);
+    oufs_write_begin(mount, dir);
+    oufs_lock_allocation(mount);
+    oufs_update_init(update);
+    BLOCK_REFERENCE blocks[N_BLOCKS];
+    ret = bulk_take_blocks(mount, update, n_blocks, blocks);
+    if(ret == 0)
+        ret = bulk_take_inodes(mount, update, n_nodes, list);
+
+    if(ret == 0)
+        ret = bulk_build(mount, update, list, n_nodes, blocks, dir);
+
+    // The new blocks, then everything that points to them
+    if(ret == 0 && bulk_write(mount, update, blocks, n_blocks) != 0)
+        ret = -1;
+    if(ret == 0 && oufs_update_write(mount, update) != 0)
+        ret = -1;
+    oufs_unlock_allocation(mount);
+    oufs_write_end(mount, dir);
+    virtual_disk_end_transaction(mount->disk);
+    pthread_rwlock_unlock(&mount->inode_lock[dir]);
+    free(list);
+    free(update);
+    return(ret);
+}
+
+/**
+ * Add a tree of directories and files to a directory
+ *
+ * Either all of it is added or none of it is.
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path of the directory to add to
+ * @param nodes The top of the tree (entries to add to the directory)
+ * @param n Number of nodes at the top
+ * @return 0 if success
+ *         -1 if the directory is not found or the disk cannot be read
+ *         -2 if a name is bad or exists, or a directory would be too full
+ *         -3 if there are not enough inodes or blocks
+ */
+int oufs_add_tree(OUFS_MOUNT *mount, char *cwd, char *path, OUFS_TREE_NODE *nodes, int n)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_IMPORT);
+    int ret = add_tree(mount, cwd, path, nodes, n);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+/**
+ * Lay out a whole disk in memory: a fresh file system holding a tree.
+ *   Inodes are numbered and blocks placed in breadth-first order, the
+ *   entries of each directory keep the order of the nodes, and the free
+ *   blocks are chained in ascending order, so the same tree always gives
+ *   the same bytes.
+ *
+ * @param nodes The top of the tree (entries of the root directory)
+ * @param n Number of nodes at the top
+ * @param image Buffer for the N_BLOCKS blocks (N_BLOCKS * BLOCK_SIZE bytes)
+ * @return 0 if success
+ *         -2 if a name is bad or a directory would be too full
+ *         -3 if there are not enough inodes or blocks
+ */
+int oufs_build_image(OUFS_TREE_NODE *nodes, int n, unsigned char *image)
+{
+    int n_nodes;
+    int n_blocks;
+    BULK_NODE *list = bulk_list(nodes, n, &n_nodes, &n_blocks);
+    if(list == NULL) {
+        fprintf(stderr, "oufs_build_image: bad names, too many entries or files too large\n");
+        return(-2);
+    }
+    if(n_nodes > N_INODES - 1 || n_blocks > N_BLOCKS - ROOT_DIRECTORY_BLOCK - 1) {
+        fprintf(stderr, "oufs_build_image: %d inodes and %d blocks needed\n", n_nodes + 1,
+                n_blocks + ROOT_DIRECTORY_BLOCK + 1);
+        free(list);
+        return(-3);
+    }
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if(update == NULL) {
+        free(list);
+        return(-1);
+    }
+
+    // Every block is built here: nothing is read
+    oufs_update_init(update);
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b)
+        oufs_update_fresh(update, b);
+    BLOCK *master = &update->block[MASTER_BLOCK_REFERENCE];
+    master->next_block = UNALLOCATED_BLOCK;
+    master->content.master.inode_allocated_flag[0] = 0x80;
+    oufs_init_directory_structures(oufs_update_inode(NULL, update, ROOT_DIRECTORY_INODE),
+                                   &update->block[ROOT_DIRECTORY_BLOCK], ROOT_DIRECTORY_BLOCK,
+                                   ROOT_DIRECTORY_INODE, ROOT_DIRECTORY_INODE);
+
+    BLOCK_REFERENCE blocks[N_BLOCKS];
+    for(int j = 0; j < n_nodes; ++j) {
+        INODE_REFERENCE i = ROOT_DIRECTORY_INODE + 1 + j;
+        list[j].inode = i;
+        master->content.master.inode_allocated_flag[i >> 3] |= 0x80 >> (i & 7);
+    }
+    for(int k = 0; k < n_blocks; ++k)
+        blocks[k] = ROOT_DIRECTORY_BLOCK + 1 + k;
+    int ret = bulk_build(NULL, update, list, n_nodes, blocks, ROOT_DIRECTORY_INODE);
+
+    // The rest is free
+    BLOCK_REFERENCE front = ROOT_DIRECTORY_BLOCK + 1 + n_blocks;
+    master->content.master.unallocated_front = front < N_BLOCKS ? front : UNALLOCATED_BLOCK;
+    master->content.master.unallocated_end = front < N_BLOCKS ? N_BLOCKS - 1 : UNALLOCATED_BLOCK;
+    for(BLOCK_REFERENCE b = front; b < N_BLOCKS; ++b)
+        update->block[b].next_block = b + 1 < N_BLOCKS ? b + 1 : UNALLOCATED_BLOCK;
+
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b)
+        memcpy(image + b * BLOCK_SIZE, &update->block[b], BLOCK_SIZE);
+    free(update);
+    free(list);
+    return(ret);
+}
+
+/**
+ * oufs_write_image(), with the trace tag set by the caller
+ */
+static int write_image(char *virtual_disk_name, char *pipe_name_base, unsigned char *image)
+{
+    OUFS_MOUNT *mount = oufs_mount(virtual_disk_name, pipe_name_base);
+    if(mount == NULL)
+        return(-1);
+    mount->debug = 0;
+    if(oufs_cache_lock(mount) != 0) {
+        oufs_unmount(mount);
+        return(-1);
+    }
+    char *checksums = getenv("OUFS_CHECKSUMS");
+    int enable = checksums == NULL || strcmp(checksums, "0") != 0;
+    int ret = 0;
+    if(oufs_write_blocks(mount, 0, N_BLOCKS, image) != 0
+       || virtual_disk_create_journal(mount->disk) != 0
+       || virtual_disk_create_checksums(mount->disk, enable) != 0
+       || oufs_discard_free_blocks(mount, 0) < 0)
+        ret = -1;
+    if(oufs_unmount(mount) != 0)
+        ret = -1;
+    return(ret);
+}
+
+/**
+ * Write a disk laid out by oufs_build_image(), replacing whatever the
+ *   disk held, with an empty journal and (unless OUFS_CHECKSUMS=0) fresh
+ *   checksums.  The blocks go out in one sequential write; the space of
+ *   the free ones is then given back to the host.
+ *
+ * @param virtual_disk_name Name of the virtual disk
+ * @param pipe_name_base Base name of the pipes
+ * @param image The N_BLOCKS blocks
+ * @return 0 if success; -1 if the disk cannot be opened or written
+ */
+int oufs_write_image(char *virtual_disk_name, char *pipe_name_base, unsigned char *image)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_FORMAT);
+    int ret = write_image(virtual_disk_name, pipe_name_base, image);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+/**
+ * Read the contents of a file.  The blocks a file is expected to use
+ *   (the run that starts at its first block) are loaded together.
+ *
+ * @param i Inode of the file
+ * @param buf Buffer for the contents
+ * @param size Size of the buffer
+ * @return The number of bytes read (the file size, or size if smaller)
+ *         -1 if i is not a file or a block cannot be read
+ */
+int oufs_read_file(OUFS_MOUNT *mount, INODE_REFERENCE i, unsigned char *buf, unsigned int size)
+{
+    INODE inode;
+    if(i >= N_INODES || oufs_read_inode_by_reference(mount, i, &inode) != 0
+       || inode.type != FILE_TYPE)
+        return(-1);
+    unsigned int len = MIN(size, inode.size);
+    BLOCK_REFERENCE b = inode.content;
+    for(unsigned int done = 0; done < len; ) {
+        if(b >= N_BLOCKS) {
+            fprintf(stderr, "oufs_read_file: bad block %d in file %d\n", b, i);
+            return(-1);
+        }
+        if(__atomic_load_n(&mount->cache->block[b].seq, __ATOMIC_ACQUIRE) == 0) {
+            BLOCK_REFERENCE refs[OUFS_READAHEAD_MAX];
+            int n = 0;
+            int left = (len - done + OUFS_FILE_BLOCK_DATA - 1) / OUFS_FILE_BLOCK_DATA;
+            while(n < left && n < OUFS_READAHEAD_MAX && b + n < N_BLOCKS) {
+                refs[n] = b + n;
+                ++n;
+            }
+            oufs_prefetch_blocks(mount, refs, n);
+        }
+
+        BLOCK block;
+        if(oufs_read_block(mount, b, &block) != 0)
+            return(-1);
+        unsigned int k = MIN((unsigned int) OUFS_FILE_BLOCK_DATA, len - done);
+        memcpy(buf + done, block.content.data.data, k);
+        done += k;
+        b = block.next_block;
+    }
+    return(len);
+}
@@ -0,0 +1,380 @@
+/**
+ *  oufs_cache.c
+ *
+ *  The block cache and directory versions of a mount.  Normally they are
+ *  private to the mount.  With OUFS_SHARED_CACHE=1 they live in a POSIX
+ *  shared memory segment named after the disk image (its device and inode
+ *  numbers), so that every process that mounts the same image, even one
+ *  after another, starts with the blocks that the others have already read.
+ *
+ *  Readers never lock (see oufs_read_block()).  Changes are made by one
+ *  process at a time, the writer: a process becomes the writer before its
+ *  first change and stays the writer until it unmounts, when everything it
+ *  changed is on the disk.  Attaching also waits for the writer, because
+ *  it may replay the journal.
+ *
+ *  Blocks that the writer changed are marked with its pid.  If it dies,
+ *  the next process to become the writer drops those blocks (and any
+ *  change it left half made) and replays the journal.  If the image file
+ *  has been changed by a process that does not use the segment, the whole
+ *  cache is dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "oufs_lib_support.h"
+
+#define OUFS_CACHE_MAGIC 0x4843554f
+
+// Time between looks at a busy writer slot (us)
+#define OUFS_CACHE_WAIT_US 1000
+
+// Times to look at a segment that another process is setting up
+#define OUFS_CACHE_SETUP_TRIES 1000
+
+/**
+ * @return 1 if the process exists; 0 if it is gone
+ */
+static int process_alive(pid_t pid)
+{
+    return(kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/**
+ * Forget the cached copy of a block
+ *
+ * @param force The block may be held odd by a process that has died
+ */
+static void cache_drop(OUFS_CACHE *cache, BLOCK_REFERENCE i, int force)
+{
+    OUFS_CACHED_BLOCK *c = &cache->block[i];
+    unsigned int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    if(!force) {
+        // Like a writer: make it odd first
+        while(seq == 0 || (seq & 1) ||
+              !__atomic_compare_exchange_n(&c->seq, &seq, seq + 1, 0,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            if(seq == 0)
+                return;
+            seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+        }
+    }
+    cache->owner[i] = 0;
+    __atomic_store_n(&c->seq, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock the segment header.  A holder that died was filling a block.
+ */
+static void header_lock(OUFS_CACHE *cache)
+{
+    if(pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+            if((cache->block[i].seq & 1) && cache->owner[i] == 0)
+                cache_drop(cache, i, 1);
+        }
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+/**
+ * Has the image file changed since the last writer left it?  If so, drop
+ *   the whole cache.  Either way, remember how the file looks now.
+ *   Called by the writer.
+ */
+static void cache_validate(OUFS_MOUNT *mount)
+{
+    OUFS_CACHE *cache = mount->cache;
+    struct stat st;
+    if(stat(mount->cache_file, &st) != 0)
+        memset(&st, 0, sizeof(st));
+    if(st.st_size != cache->stamp_size || st.st_mtim.tv_sec != cache->stamp_mtime.tv_sec
+       || st.st_mtim.tv_nsec != cache->stamp_mtime.tv_nsec) {
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i)
+            cache_drop(cache, i, 0);
+    }
+    cache->stamp_size = st.st_size;
+    cache->stamp_mtime = st.st_mtim;
+}
+
+/**
+ * Map (creating and setting up if needed) the segment of an image file
+ *
+ * @return The segment; NULL if it cannot be used
+ */
+static OUFS_CACHE *cache_map(char *file)
+{
+    struct stat st;
+    if(stat(file, &st) != 0)
+        return(NULL);
+    char name[64];
+    snprintf(name, sizeof(name), "/oufs-%lx-%lx", (unsigned long) st.st_dev,
+             (unsigned long) st.st_ino);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(fd < 0) {
+        fprintf(stderr, "oufs_cache: cannot open %s\n", name);
+        return(NULL);
+    }
+    // A new segment is all zeros: every block empty
+    if(fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, sizeof(OUFS_CACHE)) != 0)
+       || (st.st_size != 0 && st.st_size != sizeof(OUFS_CACHE))) {
+        fprintf(stderr, "oufs_cache: cannot use %s\n", name);
+        close(fd);
+        return(NULL);
+    }
+    OUFS_CACHE *cache = mmap(NULL, sizeof(OUFS_CACHE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(cache == MAP_FAILED)
+        return(NULL);
+
+    // The first process sets up the header lock
+    unsigned int state = 0;
+    if(__atomic_compare_exchange_n(&cache->state, &state, 1, 0, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_ACQUIRE)) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&cache->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        cache->magic = OUFS_CACHE_MAGIC;
+        cache->size = sizeof(OUFS_CACHE);
+        __atomic_store_n(&cache->state, 2, __ATOMIC_RELEASE);
+    }
+    for(int i = 0; __atomic_load_n(&cache->state, __ATOMIC_ACQUIRE) != 2; ++i) {
+        if(i == OUFS_CACHE_SETUP_TRIES) {
+            fprintf(stderr, "oufs_cache: %s was never set up\n", name);
+            munmap(cache, sizeof(OUFS_CACHE));
+            return(NULL);
+        }
+        usleep(OUFS_CACHE_WAIT_US);
+    }
+    if(cache->magic != OUFS_CACHE_MAGIC || cache->size != sizeof(OUFS_CACHE)) {
+        fprintf(stderr, "oufs_cache: %s belongs to another version\n", name);
+        munmap(cache, sizeof(OUFS_CACHE));
+        return(NULL);
+    }
+    return(cache);
+}
+
+/**
+ * Set up the cache of a new mount.  If a shared cache was asked for but
+ *   cannot be used, the mount gets a private one.
+ *
+ * @param disk_name Name of the disk (possibly with a storage scheme)
+ * @return 0 if success
+ *         -1 if out of memory
+ */
+int oufs_cache_open(OUFS_MOUNT *mount, char *disk_name)
+{
+    char *str = getenv("OUFS_SHARED_CACHE");
+    if(str != NULL && strcmp(str, "1") == 0) {
+        // The image file behind any "scheme:" prefix (none in memory)
+        char *file = storage_file_name(disk_name);
+        mount->cache = file == NULL ? NULL : cache_map(file);
+        if(mount->cache != NULL) {
+            mount->cache_file = strdup(file);
+            if(mount->cache_file == NULL) {
+                munmap(mount->cache, sizeof(OUFS_CACHE));
+                return(-1);
+            }
+            mount->cache_shared = 1;
+            mount->cache_writer = 0;
+            pthread_mutex_init(&mount->cache_writer_lock, NULL);
+            return(0);
+        }
+    }
+
+    // Per-block and per-inode state is laid out a cache line apart
+    if(posix_memalign((void **) &mount->cache, OUFS_CACHE_LINE, sizeof(OUFS_CACHE)) != 0) {
+        fprintf(stderr, "oufs_cache_open: out of memory\n");
+        return(-1);
+    }
+    memset(mount->cache, 0, sizeof(OUFS_CACHE));
+    mount->cache_shared = 0;
+    return(0);
+}
+
+/**
+ * Release the cache of a mount.  Called once the disk has been detached,
+ *   so nothing this process changed is only in the cache any more.
+ *
+ * @return 0 if success
+ */
+int oufs_cache_close(OUFS_MOUNT *mount)
+{
+    if(!mount->cache_shared) {
+        free(mount->cache);
+        return(0);
+    }
+
+    oufs_cache_unlock(mount);
+    pthread_mutex_destroy(&mount->cache_writer_lock);
+    munmap(mount->cache, sizeof(OUFS_CACHE));
+    free(mount->cache_file);
+    return(0);
+}
+
+/**
+ * Make this process the writer (if it is not already).  Waits for the
+ *   current writer to unmount; takes over from one that has died.
+ *
+ * @return 0 if success
+ *         -1 if the disk could not be brought up to date
+ */
+int oufs_cache_lock(OUFS_MOUNT *mount)
+{
+    if(!mount->cache_shared)
+        return(0);
+    pthread_mutex_lock(&mount->cache_writer_lock);
+    if(mount->cache_writer) {
+        pthread_mutex_unlock(&mount->cache_writer_lock);
+        return(0);
+    }
+
+    OUFS_CACHE *cache = mount->cache;
+    pid_t self = getpid();
+    pid_t dead = 0;
+    for(;;) {
+        header_lock(cache);
+        if(cache->writer != 0 && !process_alive(cache->writer)) {
+            dead = cache->writer;
+            cache->writer = 0;
+        }
+        if(cache->writer == 0) {
+            cache->writer = self;
+            pthread_mutex_unlock(&cache->lock);
+            break;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        usleep(OUFS_CACHE_WAIT_US);
+    }
+
+    if(dead != 0) {
+        // Drop whatever the dead writer had not made durable
+        fprintf(stderr, "oufs_cache: writer %d died; recovering\n", (int) dead);
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+            if(cache->owner[i] == dead)
+                cache_drop(cache, i, 1);
+        }
+        for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+            unsigned int *seq = &cache->inode_seq[i].seq;
+            if(*seq & 1)
+                __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Another writer may have moved the journal since this process attached
+    if(mount->disk != NULL && virtual_disk_refresh(mount->disk) != 0) {
+        header_lock(cache);
+        cache->writer = 0;
+        pthread_mutex_unlock(&cache->lock);
+        pthread_mutex_unlock(&mount->cache_writer_lock);
+        return(-1);
+    }
+    cache_validate(mount);
+    mount->cache_writer = 1;
+    pthread_mutex_unlock(&mount->cache_writer_lock);
+    return(0);
+}
+
+/**
+ * Stop being the writer.  Everything this process changed must be on the
+ *   disk.
+ */
+void oufs_cache_unlock(OUFS_MOUNT *mount)
+{
+    if(!mount->cache_shared)
+        return;
+    pthread_mutex_lock(&mount->cache_writer_lock);
+    if(mount->cache_writer) {
+        OUFS_CACHE *cache = mount->cache;
+        pid_t self = getpid();
+        int wrote = 0;
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+            if(cache->owner[i] == self) {
+                cache->owner[i] = 0;
+                wrote = 1;
+            }
+        }
+        // Changes by this process are in the cache already; anything else
+        //  (such as a journal replay) is not
+        if(wrote) {
+            struct stat st;
+            if(stat(mount->cache_file, &st) == 0) {
+                cache->stamp_size = st.st_size;
+                cache->stamp_mtime = st.st_mtim;
+            }
+        }else{
+            cache_validate(mount);
+        }
+
+        header_lock(cache);
+        cache->writer = 0;
+        pthread_mutex_unlock(&cache->lock);
+        mount->cache_writer = 0;
+    }
+    pthread_mutex_unlock(&mount->cache_writer_lock);
+}
+
+/**
+ * A reader has waited a long time for a change to finish: if the writer
+ *   has died, recover from it.
+ */
+void oufs_cache_check(OUFS_MOUNT *mount)
+{
+    if(!mount->cache_shared)
+        return;
+    pid_t writer = __atomic_load_n(&mount->cache->writer, __ATOMIC_RELAXED);
+    if(writer != 0 && !process_alive(writer) && oufs_cache_lock(mount) == 0)
+        oufs_cache_unlock(mount);
+}
+
+/**
+ * Replace the cached copy of a block.  Writers of the same block exclude
+ *   each other by making seq odd.
+ *
+ * @param only_if_empty Give up if the block has already been loaded
+ */
+void oufs_cache_publish(OUFS_CACHED_BLOCK *c, BLOCK *block, int only_if_empty)
+{
+    unsigned int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    for(;;) {
+        if(only_if_empty && seq != 0)
+            return;
+        if(!(seq & 1) && __atomic_compare_exchange_n(&c->seq, &seq, seq + 1, 0,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    }
+    // The odd seq must be visible before any of the new bytes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(c->data, block, BLOCK_SIZE);
+    // 0 means "never loaded": skip it when the counter wraps
+    seq += 2;
+    if(seq == 0)
+        seq = 2;
+    __atomic_store_n(&c->seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * Fill an empty block of the cache from the disk.  In a shared cache, the
+ *   header lock is held so that a process that dies part way through
+ *   does not leave the block looking busy forever.
+ *
+ * @param c Cache entry
+ * @param block Contents read from the disk
+ */
+void oufs_cache_fill(OUFS_MOUNT *mount, OUFS_CACHED_BLOCK *c, BLOCK *block)
+{
+    if(mount->cache_shared)
+        header_lock(mount->cache);
+    oufs_cache_publish(c, block, 1);
+    if(mount->cache_shared)
+        pthread_mutex_unlock(&mount->cache->lock);
+}
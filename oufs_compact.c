@@ -0,0 +1,86 @@
+/**
+ *  oufs_compact
+ *
+ *  Packs the blocks in use towards the front of the disk, keeping their
+ *  order, so that the free blocks form one run at the end; the space of
+ *  the free blocks then goes back to the host in one piece.  The disk is
+ *  rewritten as one transaction (see oufs_image.c).  A damaged disk is
+ *  left alone: run oufs_fsck -r first.
+ *
+ *  Usage: oufs_compact
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "oufs_lib_support.h"
+
+/**
+ *  Space the disk takes on the host
+ *
+ *  @return Bytes allocated to the storage file; -1 if it is not a file
+ */
+static long long host_space(char *disk_name)
+{
+  char *file_name = storage_file_name(disk_name);
+  struct stat st;
+  if(file_name == NULL || stat(file_name, &st) != 0)
+    return(-1);
+  return((long long) st.st_blocks * 512);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  if(argc != 1) {
+    fprintf(stderr, "Usage: oufs_compact\n");
+    return(-1);
+  }
+
+  long long before = host_space(disk_name);
+  OUFS_IMAGE *image = oufs_image_load(disk_name, pipe_name_base);
+  if(image == NULL)
+    return(-1);
+  virtual_disk_set_caller(VDISK_CALLER_COMPACT);
+
+  int ret = 0;
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+    if(image->damaged[b]) {
+      fprintf(stderr, "oufs_compact: block %d cannot be read\n", b);
+      ret = -1;
+    }
+  }
+  int moved = ret == 0 ? oufs_image_relocate(image, NULL, 0) : -1;
+  if(moved < 0)
+    ret = -1;
+  else
+    ret = oufs_image_save(image);
+  int free_blocks = 0;
+  MASTER_BLOCK *master = &image->block[MASTER_BLOCK_REFERENCE].content.master;
+  for(int k = 0; k < oufs_n_free_lists(master); ++k) {
+    // Each list is one run now
+    if(*oufs_free_front(master, k) != UNALLOCATED_BLOCK)
+      free_blocks += *oufs_free_end(master, k) - *oufs_free_front(master, k) + 1;
+  }
+  if(ret == 0 && oufs_discard_free_blocks(image->mount, 0) < 0)
+    ret = -1;
+  if(oufs_image_close(image) != 0)
+    ret = -1;
+
+  if(ret != 0) {
+    fprintf(stderr, "oufs_compact: the disk is damaged or cannot be written (see oufs_fsck)\n");
+    return(-1);
+  }
+  printf("%s: %d blocks moved, %d free blocks at the end\n", disk_name, moved, free_blocks);
+  long long after = host_space(disk_name);
+  if(before >= 0 && after >= 0)
+    printf("Space on the host: %lld KiB (was %lld KiB)\n", after / 1024, before / 1024);
+  return(0);
+}
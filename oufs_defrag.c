@@ -0,0 +1,199 @@
+/**
+ *  oufs_defrag
+ *
+ *  Lays the disk out again in tree order, so that a walk of the tree reads
+ *  it front to back.  The blocks of the children of a directory (each
+ *  subdirectory's block and each file's chain, in the order of the
+ *  entries) form one run, which comes just after the run that holds the
+ *  directory itself; the runs of the subdirectories follow depth first.
+ *  The free blocks form one run at the end, and their space goes back to
+ *  the host.
+ *
+ *  The disk is rewritten as one transaction (see oufs_image.c), so it may
+ *  stay in use: processes that share the block cache (OUFS_SHARED_CACHE=1)
+ *  wait to change it, and their lookups and listings see it either before
+ *  or after.  A damaged disk is left alone: run oufs_fsck -r first.
+ *
+ *  Usage: oufs_defrag [-n]     (-n: only report how scattered the tree is)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oufs_lib_support.h"
+
+#define USAGE "Usage: oufs_defrag [-n]\n"
+
+/**
+ *  Add a block to the tree order, unless it is bad or already there
+ *
+ *  @return 1 if added; 0 if not
+ */
+static int place(BLOCK_REFERENCE b, BLOCK_REFERENCE *order, int *n, unsigned char *placed)
+{
+  if(b <= ROOT_DIRECTORY_BLOCK || b >= N_BLOCKS || placed[b])
+    return(0);
+  placed[b] = 1;
+  order[(*n)++] = b;
+  return(1);
+}
+
+/**
+ *  The blocks of the tree, children of a directory together, directories
+ *   depth first.  Blocks that cannot be reached are left out.
+ *
+ *  @param order Set to the blocks (not the root directory's)
+ *  @return Number of blocks in order
+ */
+static int tree_order(OUFS_IMAGE *image, BLOCK_REFERENCE *order)
+{
+  unsigned char placed[N_BLOCKS];
+  unsigned char visited[N_INODES];
+  INODE_REFERENCE stack[N_INODES];
+  int depth = 0;
+  int n = 0;
+  memset(placed, 0, sizeof(placed));
+  memset(visited, 0, sizeof(visited));
+  visited[ROOT_DIRECTORY_INODE] = 1;
+  stack[depth++] = ROOT_DIRECTORY_INODE;
+
+  while(depth > 0) {
+    INODE *dir = oufs_image_inode(image, stack[--depth]);
+    if(dir->content >= N_BLOCKS)
+      continue;
+    DIRECTORY_BLOCK *block = &image->block[dir->content].content.directory;
+    INODE_REFERENCE subdirs[N_DIRECTORY_ENTRIES_PER_BLOCK];
+    int n_subdirs = 0;
+    for(int k = 0; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+      INODE_REFERENCE i = block->entry[k].inode_reference;
+      if(i >= N_INODES || visited[i] || strcmp(block->entry[k].name, ".") == 0
+         || strcmp(block->entry[k].name, "..") == 0 || !oufs_image_inode_allocated(image, i))
+        continue;
+      INODE *inode = oufs_image_inode(image, i);
+      visited[i] = 1;
+      if(inode->type == DIRECTORY_TYPE) {
+        if(place(inode->content, order, &n, placed))
+          subdirs[n_subdirs++] = i;
+      }else if(inode->type == FILE_TYPE) {
+        for(BLOCK_REFERENCE b = inode->content; place(b, order, &n, placed); )
+          b = image->block[b].next_block;
+      }
+    }
+
+    // The first subdirectory is taken next
+    while(n_subdirs > 0)
+      stack[depth++] = subdirs[--n_subdirs];
+  }
+  return(n);
+}
+
+/**
+ *  Runs of consecutive blocks that a walk in tree order reads
+ */
+static int count_runs(BLOCK_REFERENCE *order, int n)
+{
+  int runs = 1;
+  BLOCK_REFERENCE last = ROOT_DIRECTORY_BLOCK;
+  for(int k = 0; k < n; ++k) {
+    runs += order[k] != last + 1;
+    last = order[k];
+  }
+  return(runs);
+}
+
+/**
+ *  How far, on average, the blocks of directories are from their parents'
+ *   (to compare allocation policies)
+ *
+ *  @return Average distance in blocks; 0 if there is only the root
+ */
+static double parent_distance(OUFS_IMAGE *image)
+{
+  long total = 0;
+  int n = 0;
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    INODE *inode = oufs_image_inode(image, i);
+    if(i == ROOT_DIRECTORY_INODE || !oufs_image_inode_allocated(image, i)
+       || inode->type != DIRECTORY_TYPE || inode->content >= N_BLOCKS)
+      continue;
+    INODE_REFERENCE parent = image->block[inode->content].content.directory.entry[1].inode_reference;
+    if(parent >= N_INODES || oufs_image_inode(image, parent)->content >= N_BLOCKS)
+      continue;
+    total += abs((int) inode->content - (int) oufs_image_inode(image, parent)->content);
+    ++n;
+  }
+  return(n == 0 ? 0 : (double) total / n);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int report_only = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "n")) != -1) {
+    switch(opt) {
+    case 'n':
+      report_only = 1;
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return(-1);
+    }
+  }
+  if(argc != optind) {
+    fprintf(stderr, USAGE);
+    return(-1);
+  }
+
+  OUFS_IMAGE *image = oufs_image_load(disk_name, pipe_name_base);
+  if(image == NULL)
+    return(-1);
+  virtual_disk_set_caller(VDISK_CALLER_DEFRAG);
+
+  int ret = 0;
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+    if(image->damaged[b]) {
+      fprintf(stderr, "oufs_defrag: block %d cannot be read\n", b);
+      ret = -1;
+    }
+  }
+  BLOCK_REFERENCE order[N_BLOCKS];
+  int n = tree_order(image, order);
+  int runs = count_runs(order, n);
+  double distance = parent_distance(image);
+  int moved = 0;
+  if(ret == 0 && report_only) {
+    for(int k = 0; k < n; ++k)
+      moved += order[k] != ROOT_DIRECTORY_BLOCK + 1 + k;
+  }else if(ret == 0) {
+    moved = oufs_image_relocate(image, order, n);
+    if(moved < 0)
+      ret = -1;
+    else
+      ret = oufs_image_save(image);
+    if(ret == 0 && oufs_discard_free_blocks(image->mount, 0) < 0)
+      ret = -1;
+  }
+  if(oufs_image_close(image) != 0)
+    ret = -1;
+
+  if(ret != 0) {
+    fprintf(stderr, "oufs_defrag: the disk is damaged or cannot be written (see oufs_fsck)\n");
+    return(-1);
+  }
+  if(report_only)
+    printf("%s: %d of %d blocks out of place; runs of blocks in tree order: %d; "
+           "directories are %.1f blocks from their parents\n",
+           disk_name, moved, n + 1, runs, distance);
+  else
+    printf("%s: %d blocks moved; runs of blocks in tree order: 1 (was %d)\n",
+           disk_name, moved, runs);
+  return(0);
+}
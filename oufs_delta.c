@@ -0,0 +1,246 @@
+/**
+ *  oufs_delta
+ *
+ *  Incremental copies of a disk, from its changed-block tracking (see
+ *  vdisk_cbt.c).  Exporting ends the disk's current epoch and writes the
+ *  blocks changed since a given epoch to a delta file; applying a delta
+ *  to a replica writes those blocks and records how far the replica has
+ *  got, so that deltas are only ever applied in order and without gaps.
+ *
+ *  A replica starts from a full delta (since epoch 0).  After that, each
+ *  delta is exported since the epoch the replica reports as its next one.
+ *
+ *  Usage: oufs_delta                        show the tracking state
+ *         oufs_delta -e <since> <delta>     export the changes since an epoch
+ *         oufs_delta -a <delta>             apply a delta to the disk
+ *  ("-" as the delta: standard output / input)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oufs_lib_support.h"
+
+#define USAGE "Usage: oufs_delta [-e <since> <delta> | -a <delta>]\n"
+
+#define DELTA_MAGIC 0x44554f44
+#define DELTA_VERSION 1
+
+// Delta file: the header, then count records of a block reference (4
+//  bytes) followed by the block's BLOCK_SIZE bytes, in block order
+typedef struct __attribute__((packed))
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_blocks;
+  uint32_t block_size;
+
+  // History the blocks come from; the epochs the delta covers are
+  //  base .. next - 1 (base 0: the whole disk)
+  uint64_t source;
+  uint32_t base;
+  uint32_t next;
+  uint32_t count;
+} DELTA_HEADER;
+
+/**
+ *  Print the tracking state of the disk
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int show(OUFS_MOUNT *mount)
+{
+  VDISK_CBT_INFO info;
+  virtual_disk_cbt_info(mount->disk, &info);
+  if(info.id == 0) {
+    printf("No changes tracked yet\n");
+    return(0);
+  }
+  printf("History %016llx, epoch %u, %d blocks changed in it\n",
+         (unsigned long long) info.id, info.epoch, info.changed);
+  if(info.source != 0)
+    printf("Replica of %016llx, next epoch %u\n", (unsigned long long) info.source,
+           info.synced);
+  return(0);
+}
+
+/**
+ *  End the current epoch and write the blocks changed since an earlier one
+ *
+ *  @param since First epoch to include (0: every block)
+ *  @return 0 if success; -1 if error; -2 if since is a future epoch
+ */
+static int export_delta(OUFS_MOUNT *mount, unsigned int since, char *delta_name)
+{
+  unsigned char changed[N_BLOCKS];
+  unsigned int epoch;
+  int ret = virtual_disk_cbt_next_epoch(mount->disk, since, changed, &epoch);
+  if(ret != 0)
+    return(ret);
+  VDISK_CBT_INFO info;
+  virtual_disk_cbt_info(mount->disk, &info);
+
+  DELTA_HEADER header = {DELTA_MAGIC, DELTA_VERSION, N_BLOCKS, BLOCK_SIZE, info.id, since,
+                         epoch + 1, 0};
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b)
+    header.count += changed[b];
+  FILE *delta = strcmp(delta_name, "-") == 0 ? stdout : fopen(delta_name, "w");
+  if(delta == NULL) {
+    fprintf(stderr, "oufs_delta: cannot create %s\n", delta_name);
+    return(-1);
+  }
+  if(fwrite(&header, sizeof(header), 1, delta) != 1)
+    ret = -1;
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS && ret == 0; ++b) {
+    BLOCK block;
+    uint32_t ref = b;
+    if(!changed[b])
+      continue;
+    if(virtual_disk_read_block(mount->disk, b, &block) != 0
+       || fwrite(&ref, sizeof(ref), 1, delta) != 1 || fwrite(&block, BLOCK_SIZE, 1, delta) != 1)
+      ret = -1;
+  }
+  if(delta == stdout ? fflush(delta) != 0 : fclose(delta) != 0)
+    ret = -1;
+  if(ret != 0) {
+    fprintf(stderr, "oufs_delta: cannot write %s\n", delta_name);
+    return(ret);
+  }
+  fprintf(stderr, "%d blocks changed in epochs %u..%u; the next delta starts at %u\n",
+          header.count, since, epoch, epoch + 1);
+  return(0);
+}
+
+/**
+ *  Write the blocks of a delta to the disk (in runs of consecutive blocks)
+ *   and record the epoch of the source that the disk has reached
+ *
+ *  @return 0 if success; -1 if error; -2 if the delta does not follow on
+ *          from what the disk has seen
+ */
+static int apply_delta(OUFS_MOUNT *mount, char *delta_name)
+{
+  FILE *delta = strcmp(delta_name, "-") == 0 ? stdin : fopen(delta_name, "r");
+  if(delta == NULL) {
+    fprintf(stderr, "oufs_delta: cannot open %s\n", delta_name);
+    return(-1);
+  }
+  DELTA_HEADER header;
+  unsigned char *blocks = malloc(N_BLOCKS * BLOCK_SIZE);
+  unsigned char present[N_BLOCKS];
+  memset(present, 0, sizeof(present));
+  int ret = blocks == NULL ? -1 : 0;
+  if(ret == 0 && (fread(&header, sizeof(header), 1, delta) != 1 || header.magic != DELTA_MAGIC
+                  || header.version != DELTA_VERSION || header.n_blocks != N_BLOCKS
+                  || header.block_size != BLOCK_SIZE || header.count > N_BLOCKS)) {
+    fprintf(stderr, "oufs_delta: %s is not a delta for this disk format\n", delta_name);
+    ret = -1;
+  }
+  for(unsigned int k = 0; ret == 0 && k < header.count; ++k) {
+    uint32_t ref;
+    if(fread(&ref, sizeof(ref), 1, delta) != 1 || ref >= N_BLOCKS || present[ref]
+       || fread(blocks + ref * BLOCK_SIZE, BLOCK_SIZE, 1, delta) != 1) {
+      fprintf(stderr, "oufs_delta: %s is truncated or damaged\n", delta_name);
+      ret = -1;
+    }else{
+      present[ref] = 1;
+    }
+  }
+  if(delta != stdin)
+    fclose(delta);
+
+  // A full delta can always be applied; otherwise the replica must have
+  //  seen everything before the delta's first epoch, and nothing past it
+  VDISK_CBT_INFO info;
+  virtual_disk_cbt_info(mount->disk, &info);
+  if(ret == 0 && header.base != 0
+     && (info.source != header.source || info.synced < header.base || info.synced > header.next)) {
+    fprintf(stderr, "oufs_delta: the delta covers epochs %u..%u of %016llx; "
+            "the disk needs epoch %u of %016llx next\n", header.base, header.next - 1,
+            (unsigned long long) header.source, info.synced, (unsigned long long) info.source);
+    ret = -2;
+  }
+
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS && ret == 0; ) {
+    if(!present[b]) {
+      ++b;
+      continue;
+    }
+    BLOCK_REFERENCE first = b;
+    while(b < N_BLOCKS && present[b])
+      ++b;
+    ret = oufs_write_blocks(mount, first, b - first, blocks + first * BLOCK_SIZE);
+  }
+  if(ret == 0)
+    ret = virtual_disk_cbt_set_source(mount->disk, header.source, header.next);
+  if(ret == 0)
+    fprintf(stderr, "%u blocks applied; the next delta starts at %u\n", header.count,
+            header.next);
+  free(blocks);
+  return(ret);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int op = 's';
+  long since = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "e:a")) != -1) {
+    switch(opt) {
+    case 'e':
+      if(op != 's' || (since = strtol(optarg, NULL, 10)) < 0) {
+        fprintf(stderr, USAGE);
+        return(-1);
+      }
+      op = 'e';
+      break;
+    case 'a':
+      if(op != 's') {
+        fprintf(stderr, USAGE);
+        return(-1);
+      }
+      op = 'a';
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return(-1);
+    }
+  }
+  if(argc - optind != (op == 's' ? 0 : 1)) {
+    fprintf(stderr, USAGE);
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL)
+    return(-1);
+  virtual_disk_set_caller(VDISK_CALLER_DELTA);
+
+  // Nothing else writes while the blocks are collected or replaced
+  int ret = oufs_cache_lock(mount);
+  if(ret == 0) {
+    if(op == 'e')
+      ret = export_delta(mount, since, argv[optind]);
+    else if(op == 'a')
+      ret = apply_delta(mount, argv[optind]);
+    else
+      ret = show(mount);
+  }
+  if(oufs_unmount(mount) != 0)
+    ret = -1;
+  if(ret == -2 && op == 'e')
+    fprintf(stderr, "oufs_delta: epoch %ld has not started\n", since);
+  else if(ret == -1)
+    fprintf(stderr, "Error (%d)\n", ret);
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,151 @@
+/**
+ *  oufs_du
+ *
+ *  Shows the space used by every directory of a subtree (its own block
+ *  and everything below it), in bytes.  The tree is walked by several
+ *  threads (see oufs_walk.c); the totals are added up afterwards, deepest
+ *  directories first.
+ *
+ *  Usage: oufs_du [-s] [-j threads] [<name>]
+ *    -s  only show the total for <name>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+typedef struct
+{
+  char *path;
+  INODE_REFERENCE inode;
+  INODE_REFERENCE parent;
+  int depth;
+  int directory;
+
+  // Blocks used by the entry itself
+  int blocks;
+} DU_ENTRY;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  DU_ENTRY *entry;
+  int n;
+  int size;
+} DU;
+
+/**
+ *  Keep an entry (called by the walk)
+ */
+static int collect(const OUFS_WALK_ENTRY *entry, void *arg)
+{
+  DU *du = arg;
+  int ret = 0;
+  pthread_mutex_lock(&du->lock);
+  if(du->n == du->size) {
+    int size = du->size ? 2 * du->size : 256;
+    DU_ENTRY *e = realloc(du->entry, size * sizeof(DU_ENTRY));
+    if(e == NULL) {
+      pthread_mutex_unlock(&du->lock);
+      fprintf(stderr, "oufs_du: out of memory\n");
+      return(-1);
+    }
+    du->entry = e;
+    du->size = size;
+  }
+  DU_ENTRY *e = &du->entry[du->n];
+  e->path = strdup(entry->path);
+  e->inode = entry->inode;
+  e->parent = entry->parent;
+  e->depth = entry->depth;
+  e->directory = entry->type == DIRECTORY_TYPE;
+  e->blocks = e->directory ? 1
+    : (entry->size + OUFS_FILE_BLOCK_DATA - 1) / OUFS_FILE_BLOCK_DATA;
+  if(e->path == NULL)
+    ret = -1;
+  else
+    ++du->n;
+  pthread_mutex_unlock(&du->lock);
+  return(ret);
+}
+
+static int deepest_first(const void *a, const void *b)
+{
+  return(((const DU_ENTRY *) b)->depth - ((const DU_ENTRY *) a)->depth);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+  return(oufs_walk_compare_paths(((const DU_ENTRY *) a)->path, ((const DU_ENTRY *) b)->path));
+}
+
+int main(int argc, char **argv)
+{
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int summary = 0;
+  int threads = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "sj:")) != -1) {
+    switch(opt) {
+    case 's':
+      summary = 1;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: oufs_du [-s] [-j threads] [<name>]\n");
+      return(-1);
+    }
+  }
+  if(argc - optind > 1) {
+    fprintf(stderr, "Usage: oufs_du [-s] [-j threads] [<name>]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL) {
+    return(-1);
+  }
+
+  DU du = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+  int ret = oufs_walk(mount, cwd, optind < argc ? argv[optind] : "", threads, collect, &du);
+  if(ret == 0) {
+    // A directory has one block, a file as many as its data needs.  Hand
+    //  each total up to the parent.
+    long total[N_INODES];
+    memset(total, 0, sizeof(total));
+    qsort(du.entry, du.n, sizeof(DU_ENTRY), deepest_first);
+    for(int i = 0; i < du.n; ++i) {
+      total[du.entry[i].inode] += (long) du.entry[i].blocks * BLOCK_SIZE;
+      if(du.entry[i].depth > 0)
+        total[du.entry[i].parent] += total[du.entry[i].inode];
+    }
+
+    qsort(du.entry, du.n, sizeof(DU_ENTRY), compare_paths);
+    for(int i = 0; i < du.n; ++i) {
+      if(du.entry[i].directory && (!summary || du.entry[i].depth == 0))
+        printf("%ld\t%s\n", total[du.entry[i].inode], du.entry[i].path);
+    }
+  }else{
+    fprintf(stderr, "Error (%d)\n", ret);
+  }
+  for(int i = 0; i < du.n; ++i) {
+    free(du.entry[i].path);
+  }
+  free(du.entry);
+
+  // Clean up
+  oufs_unmount(mount);
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,149 @@
+/**
+ *  oufs_export
+ *
+ *  Copies a directory of the disk, with everything below it, into a
+ *  directory of the host (created if needed).  The disk is walked by
+ *  several threads (see oufs_walk.c); each file is read in runs of blocks
+ *  and written to the host in one go.
+ *
+ *  Usage: oufs_export [-j threads] <host dir> [<oufs dir>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "oufs_lib.h"
+
+typedef struct
+{
+  OUFS_MOUNT *mount;
+  char *host;
+
+  // Length of the path of the starting point
+  size_t prefix;
+} EXPORT;
+
+/**
+ *  Write the contents of a file to the host
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int export_file(EXPORT *export, const OUFS_WALK_ENTRY *entry, char *host_path)
+{
+  unsigned char *buf = malloc(entry->size + 1);
+  if(buf == NULL) {
+    fprintf(stderr, "oufs_export: out of memory\n");
+    return(-1);
+  }
+  int n = oufs_read_file(export->mount, entry->inode, buf, entry->size);
+  if(n < 0) {
+    fprintf(stderr, "oufs_export: cannot read %s\n", entry->path);
+    free(buf);
+    return(-1);
+  }
+  int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "oufs_export: cannot create %s\n", host_path);
+    free(buf);
+    return(-1);
+  }
+  int ret = 0;
+  for(int done = 0; done < n; ) {
+    ssize_t k = write(fd, buf + done, n - done);
+    if(k <= 0) {
+      fprintf(stderr, "oufs_export: cannot write %s\n", host_path);
+      ret = -1;
+      break;
+    }
+    done += k;
+  }
+  if(close(fd) != 0)
+    ret = -1;
+  free(buf);
+  return(ret);
+}
+
+/**
+ *  Copy one entry (called by the walk)
+ */
+static int copy(const OUFS_WALK_ENTRY *entry, void *arg)
+{
+  EXPORT *export = arg;
+  char host_path[2 * MAX_PATH_LENGTH];
+  if(entry->depth == 0) {
+    export->prefix = strlen(entry->path);
+    if(entry->type == DIRECTORY_TYPE) {
+      snprintf(host_path, sizeof(host_path), "%s", export->host);
+    }else{
+      snprintf(host_path, sizeof(host_path), "%s/%s", export->host, entry->name);
+      if(mkdir(export->host, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "oufs_export: cannot create %s\n", export->host);
+        return(-1);
+      }
+    }
+  }else{
+    const char *rel = entry->path + export->prefix;
+    if(*rel == '/')
+      ++rel;
+    snprintf(host_path, sizeof(host_path), "%s/%s", export->host, rel);
+  }
+
+  if(entry->type == DIRECTORY_TYPE) {
+    if(mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "oufs_export: cannot create %s\n", host_path);
+      return(-1);
+    }
+    return(0);
+  }
+  if(entry->type == FILE_TYPE)
+    return(export_file(export, entry, host_path));
+  return(0);
+}
+
+int main(int argc, char **argv)
+{
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int threads = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "j:")) != -1) {
+    switch(opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: oufs_export [-j threads] <host dir> [<oufs dir>]\n");
+      return(-1);
+    }
+  }
+  if(argc - optind < 1 || argc - optind > 2) {
+    fprintf(stderr, "Usage: oufs_export [-j threads] <host dir> [<oufs dir>]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL) {
+    return(-1);
+  }
+
+  EXPORT export = {mount, argv[optind], 0};
+  int ret = oufs_walk(mount, cwd, argc - optind > 1 ? argv[optind + 1] : "", threads,
+                      copy, &export);
+  if(ret != 0) {
+    fprintf(stderr, "Error (%d)\n", ret);
+  }
+
+  // Clean up
+  oufs_unmount(mount);
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,141 @@
+/**
+ *  oufs_find
+ *
+ *  Lists the entries of a subtree that match every test given.  The tree
+ *  is walked by several threads (see oufs_walk.c); the matches are shown
+ *  in order.
+ *
+ *  Usage: oufs_find [<name>] [-name <pattern>] [-type d|f] [-maxdepth <n>]
+ *                   [-j <threads>]
+ *    -name      the name (not the path) matches a shell pattern
+ *    -type      d for directories, f for files
+ *    -maxdepth  go no more than n levels below <name>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+typedef struct
+{
+  // Tests (NULL, UNUSED_TYPE and -1 when not given)
+  char *pattern;
+  INODE_TYPE type;
+  int max_depth;
+
+  // Paths that match
+  pthread_mutex_t lock;
+  char **path;
+  int n;
+  int size;
+} FIND;
+
+/**
+ *  Test an entry and keep it if it matches (called by the walk)
+ *
+ *  @return 1 at the deepest level to be searched (skip what is below it)
+ */
+static int test(const OUFS_WALK_ENTRY *entry, void *arg)
+{
+  FIND *find = arg;
+  int ret = find->max_depth >= 0 && entry->depth >= find->max_depth;
+  if(find->pattern != NULL && fnmatch(find->pattern, entry->name, 0) != 0)
+    return(ret);
+  if(find->type != UNUSED_TYPE && entry->type != find->type)
+    return(ret);
+
+  char *path = strdup(entry->path);
+  pthread_mutex_lock(&find->lock);
+  if(path != NULL && find->n == find->size) {
+    int size = find->size ? 2 * find->size : 256;
+    char **p = realloc(find->path, size * sizeof(char *));
+    if(p == NULL) {
+      free(path);
+      path = NULL;
+    }else{
+      find->path = p;
+      find->size = size;
+    }
+  }
+  if(path != NULL)
+    find->path[find->n++] = path;
+  pthread_mutex_unlock(&find->lock);
+  if(path == NULL) {
+    fprintf(stderr, "oufs_find: out of memory\n");
+    return(-1);
+  }
+  return(ret);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+  return(oufs_walk_compare_paths(*(char * const *) a, *(char * const *) b));
+}
+
+static int usage(void)
+{
+  fprintf(stderr, "Usage: oufs_find [<name>] [-name <pattern>] [-type d|f] [-maxdepth <n>] [-j <threads>]\n");
+  return(-1);
+}
+
+int main(int argc, char **argv)
+{
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // The starting point comes first, then the tests
+  FIND find = {NULL, UNUSED_TYPE, -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+  char *start = "";
+  int threads = 0;
+  int i = 1;
+  if(i < argc && argv[i][0] != '-')
+    start = argv[i++];
+  for(; i < argc; i += 2) {
+    if(i + 1 == argc)
+      return(usage());
+    if(strcmp(argv[i], "-name") == 0) {
+      find.pattern = argv[i + 1];
+    }else if(strcmp(argv[i], "-type") == 0 && strcmp(argv[i + 1], "d") == 0) {
+      find.type = DIRECTORY_TYPE;
+    }else if(strcmp(argv[i], "-type") == 0 && strcmp(argv[i + 1], "f") == 0) {
+      find.type = FILE_TYPE;
+    }else if(strcmp(argv[i], "-maxdepth") == 0) {
+      find.max_depth = atoi(argv[i + 1]);
+    }else if(strcmp(argv[i], "-j") == 0) {
+      threads = atoi(argv[i + 1]);
+    }else{
+      return(usage());
+    }
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL) {
+    return(-1);
+  }
+
+  int ret = oufs_walk(mount, cwd, start, threads, test, &find);
+  if(ret == 0) {
+    qsort(find.path, find.n, sizeof(char *), compare_paths);
+    for(int k = 0; k < find.n; ++k) {
+      printf("%s\n", find.path[k]);
+    }
+  }else{
+    fprintf(stderr, "Error (%d)\n", ret);
+  }
+  for(int k = 0; k < find.n; ++k) {
+    free(find.path[k]);
+  }
+  free(find.path);
+
+  // Clean up
+  oufs_unmount(mount);
+  return(ret == 0 ? 0 : -1);
+}
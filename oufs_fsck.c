@@ -0,0 +1,790 @@
+/**
+ *  oufs_fsck
+ *
+ *  Checks that a disk is consistent, and optionally repairs it.  The whole
+ *  disk is loaded with one read (see oufs_image.c) and then checked in
+ *  phases.  The work of each phase is shared out among threads:
+ *
+ *  1. Inode table: allocation flags against inode types, directory blocks,
+ *     the block chains of files against their sizes, inodes left reserved
+ *     by a process that did not unmount
+ *  2. Directory tree: ".", "..", entries, sizes, links, reachability
+ *  3. Free block chain: bad links, cycles, blocks in use, leaked blocks
+ *     (with block groups: each group's chain, blocks on the wrong group's
+ *     chain, and the groups' counters)
+ *
+ *  A repair keeps every directory and file that can be reached from the
+ *  root through sound entries.  Everything else is released, the directories
+ *  are made to agree with their inodes, and the free chain is rebuilt
+ *  from the blocks that are left.  The repaired disk is checked again.
+ *
+ *  Usage: oufs_fsck [-r] [-j threads]
+ *
+ *  Exit status: 0 clean, 1 problems repaired, 4 problems left, 8 error
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib_support.h"
+
+// Most threads used for a phase
+#define FSCK_MAX_THREADS 64
+
+// Items handed to a thread at a time
+#define FSCK_CHUNK 8
+
+// Problems with an inode
+#define I_FREE_IN_USE   0x001
+#define I_BAD_TYPE      0x002
+#define I_BAD_BLOCK     0x004
+#define I_DAMAGED_BLOCK 0x008
+#define I_SHARED_BLOCK  0x010
+#define I_REFERENCES    0x020
+#define I_UNLINKED      0x040
+#define I_UNREACHABLE   0x080
+
+// Problems with a directory block as a whole
+#define D_NEXT          0x100
+#define D_DOT           0x200
+#define D_DOTDOT        0x400
+#define D_SIZE          0x800
+
+// Problem with a file
+#define F_SIZE          0x1000
+
+// Inode reserved by a process that did not hand it back (see oufs_reserve.c)
+#define I_RESERVED      0x2000
+
+// Problems with one directory entry
+#define E_BAD_NAME      1
+#define E_BAD_INODE     2
+#define E_DUPLICATE     3
+#define E_EXTRA_LINK    4
+
+// Problems with a block
+#define B_BAD_LINK      0x01
+#define B_CYCLE         0x02
+#define B_IN_USE        0x04
+#define B_DAMAGED       0x08
+#define B_LEAKED        0x10
+#define B_BAD_END       0x20
+#define B_WRONG_GROUP   0x40
+
+// Problems with a block group
+#define G_BAD_LINK      0x01
+#define G_CYCLE         0x02
+#define G_BAD_END       0x04
+#define G_COUNTS        0x08
+
+typedef struct fsck_s
+{
+  OUFS_IMAGE *image;
+  int threads;
+
+  // What is wrong, by inode, by directory entry and by block
+  unsigned int inode_problem[N_INODES];
+  unsigned char entry_problem[N_INODES][N_DIRECTORY_ENTRIES_PER_BLOCK];
+  unsigned int block_problem[N_BLOCKS];
+
+  // Lowest inode that claims each block
+  INODE_REFERENCE block_owner[N_BLOCKS];
+
+  // Block that an inode problem is about
+  BLOCK_REFERENCE problem_block[N_INODES];
+
+  // Lowest directory that has an entry for each inode
+  INODE_REFERENCE parent[N_INODES];
+
+  // Directories and files with a sound inode and blocks; those reachable
+  //  from the root
+  unsigned char valid[N_INODES];
+  unsigned char reachable[N_INODES];
+
+  // Blocks on a free chain (1 + the chain they are on) and where each
+  //  chain went wrong
+  unsigned char free_block[N_BLOCKS];
+  BLOCK_REFERENCE chain_end[N_GROUPS];
+
+  // What is wrong with each block group
+  unsigned int group_problem[N_GROUPS];
+} FSCK;
+
+// A phase: one call of item() for every item, spread over the threads
+typedef struct
+{
+  FSCK *f;
+  void (*item)(FSCK *f, int i);
+  int n;
+  int next;
+} FSCK_PHASE;
+
+/**
+ *  Lower *slot to value (atomically)
+ */
+static void atomic_min(INODE_REFERENCE *slot, INODE_REFERENCE value)
+{
+  INODE_REFERENCE old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  while(value < old
+        && !__atomic_compare_exchange_n(slot, &old, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void inode_problem(FSCK *f, INODE_REFERENCE i, unsigned int problem)
+{
+  __atomic_fetch_or(&f->inode_problem[i], problem, __ATOMIC_RELAXED);
+}
+
+/**
+ *  @return How a message names an inode, by its type
+ */
+static const char *kind(FSCK *f, INODE_REFERENCE i)
+{
+  return(oufs_image_inode(f->image, i)->type == FILE_TYPE ? "file" : "directory");
+}
+
+static const char *Kind(FSCK *f, INODE_REFERENCE i)
+{
+  return(oufs_image_inode(f->image, i)->type == FILE_TYPE ? "File" : "Directory");
+}
+
+static void *phase_worker(void *arg)
+{
+  FSCK_PHASE *p = arg;
+  int first;
+  while((first = __atomic_fetch_add(&p->next, FSCK_CHUNK, __ATOMIC_RELAXED)) < p->n) {
+    for(int i = first; i < first + FSCK_CHUNK && i < p->n; ++i)
+      p->item(p->f, i);
+  }
+  return(NULL);
+}
+
+/**
+ *  Run a phase on the calling thread and f->threads - 1 others
+ *
+ *  @param item Function to call for each item
+ *  @param n Number of items
+ */
+static void run_phase(FSCK *f, void (*item)(FSCK *f, int i), int n)
+{
+  FSCK_PHASE p = {f, item, n, 0};
+  pthread_t thread[FSCK_MAX_THREADS];
+  int started = 0;
+  for(int t = 1; t < f->threads && (t - 1) * FSCK_CHUNK < n; ++t) {
+    if(pthread_create(&thread[started], NULL, phase_worker, &p) == 0)
+      ++started;
+  }
+  phase_worker(&p);
+  for(int t = 0; t < started; ++t)
+    pthread_join(thread[t], NULL);
+}
+
+/**********************************************************************/
+// Phase 1: inode table
+
+/**
+ *  Follow the chain of a file for as many blocks as its size needs,
+ *   claiming them.  The chain must end there.
+ */
+static void check_file_blocks(FSCK *f, INODE_REFERENCE i)
+{
+  OUFS_IMAGE *image = f->image;
+  INODE *inode = oufs_image_inode(image, i);
+  unsigned char seen[N_BLOCKS];
+  memset(seen, 0, sizeof(seen));
+  unsigned int n = (inode->size + OUFS_FILE_BLOCK_DATA - 1) / OUFS_FILE_BLOCK_DATA;
+  BLOCK_REFERENCE b = inode->content;
+  if(inode->size > (unsigned int) MAX_BLOCKS_IN_FILE * OUFS_FILE_BLOCK_DATA) {
+    inode_problem(f, i, F_SIZE);
+    return;
+  }
+  for(unsigned int k = 0; k < n; ++k) {
+    f->problem_block[i] = b;
+    if(b == UNALLOCATED_BLOCK) {
+      inode_problem(f, i, F_SIZE);
+      return;
+    }
+    if(b < ROOT_DIRECTORY_BLOCK || b >= N_BLOCKS || seen[b]) {
+      inode_problem(f, i, I_BAD_BLOCK);
+      return;
+    }
+    seen[b] = 1;
+    atomic_min(&f->block_owner[b], i);
+    if(image->damaged[b]) {
+      inode_problem(f, i, I_DAMAGED_BLOCK);
+      return;
+    }
+    b = image->block[b].next_block;
+  }
+  if(b != UNALLOCATED_BLOCK)
+    inode_problem(f, i, F_SIZE);
+}
+
+static void check_inode(FSCK *f, int i)
+{
+  OUFS_IMAGE *image = f->image;
+  INODE *inode = oufs_image_inode(image, i);
+
+  if(!oufs_image_inode_allocated(image, i)) {
+    if(inode->type != UNUSED_TYPE)
+      inode_problem(f, i, I_FREE_IN_USE);
+    return;
+  }
+  if(inode->type == RESERVED_TYPE) {
+    // Its block is accounted for: only the reservation is reported
+    f->problem_block[i] = inode->content;
+    if(inode->content >= ROOT_DIRECTORY_BLOCK && inode->content < N_BLOCKS)
+      atomic_min(&f->block_owner[inode->content], i);
+    inode_problem(f, i, I_RESERVED);
+    return;
+  }
+  if(inode->type != DIRECTORY_TYPE && inode->type != FILE_TYPE) {
+    inode_problem(f, i, I_BAD_TYPE);
+    return;
+  }
+  if(inode->n_references != 1)
+    inode_problem(f, i, I_REFERENCES);
+  if(inode->type == FILE_TYPE) {
+    check_file_blocks(f, i);
+    return;
+  }
+  f->problem_block[i] = inode->content;
+  if(inode->content < ROOT_DIRECTORY_BLOCK || inode->content >= N_BLOCKS) {
+    inode_problem(f, i, I_BAD_BLOCK);
+    return;
+  }
+  atomic_min(&f->block_owner[inode->content], i);
+  if(image->damaged[inode->content])
+    inode_problem(f, i, I_DAMAGED_BLOCK);
+}
+
+static void check_block_owner(FSCK *f, int i)
+{
+  INODE *inode = oufs_image_inode(f->image, i);
+  if(!oufs_image_inode_allocated(f->image, i)
+     || (f->inode_problem[i] & (I_BAD_TYPE | I_RESERVED | I_BAD_BLOCK | I_DAMAGED_BLOCK | F_SIZE)))
+    return;
+  BLOCK_REFERENCE b = inode->content;
+  unsigned int n = 1;
+  if(inode->type == FILE_TYPE)
+    n = (inode->size + OUFS_FILE_BLOCK_DATA - 1) / OUFS_FILE_BLOCK_DATA;
+  for(unsigned int k = 0; k < n; ++k) {
+    if(f->block_owner[b] != i) {
+      f->problem_block[i] = b;
+      inode_problem(f, i, I_SHARED_BLOCK);
+      return;
+    }
+    b = f->image->block[b].next_block;
+  }
+  f->valid[i] = 1;
+}
+
+/**********************************************************************/
+// Phase 2: directory tree
+
+/**
+ *  @return 1 if the entry holds a name that may be given to a directory
+ */
+static int good_name(DIRECTORY_ENTRY *e)
+{
+  return(e->name[0] != 0 && memchr(e->name, 0, FILE_NAME_SIZE) != NULL
+         && strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0
+         && strchr(e->name, '/') == NULL);
+}
+
+static void check_directory(FSCK *f, int d)
+{
+  INODE *inode = oufs_image_inode(f->image, d);
+  if(!f->valid[d] || inode->type != DIRECTORY_TYPE)
+    return;
+  BLOCK *b = &f->image->block[inode->content];
+  DIRECTORY_ENTRY *entry = b->content.directory.entry;
+
+  if(b->next_block != UNALLOCATED_BLOCK)
+    inode_problem(f, d, D_NEXT);
+  if(strcmp(entry[0].name, ".") != 0 || entry[0].inode_reference != d)
+    inode_problem(f, d, D_DOT);
+
+  unsigned int live = 0;
+  for(int k = 0; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+    INODE_REFERENCE c = entry[k].inode_reference;
+    if(c == UNALLOCATED_INODE)
+      continue;
+    ++live;
+    if(k < 2)
+      continue;
+    if(!good_name(&entry[k])) {
+      f->entry_problem[d][k] = E_BAD_NAME;
+      continue;
+    }
+    if(c >= N_INODES || c == ROOT_DIRECTORY_INODE || c == d || !f->valid[c]) {
+      f->entry_problem[d][k] = E_BAD_INODE;
+      continue;
+    }
+    int duplicate = 0;
+    for(int j = 2; j < k && !duplicate; ++j) {
+      duplicate = entry[j].inode_reference != UNALLOCATED_INODE && f->entry_problem[d][j] == 0
+        && strncmp(entry[j].name, entry[k].name, FILE_NAME_SIZE) == 0;
+    }
+    if(duplicate) {
+      f->entry_problem[d][k] = E_DUPLICATE;
+      continue;
+    }
+    atomic_min(&f->parent[c], d);
+  }
+  if(live != inode->size)
+    inode_problem(f, d, D_SIZE);
+}
+
+static void check_links(FSCK *f, int d)
+{
+  if(!f->valid[d])
+    return;
+  INODE *inode = oufs_image_inode(f->image, d);
+  DIRECTORY_ENTRY *entry = NULL;
+
+  // Each directory and file is named by one entry (in its parent)
+  if(inode->type == DIRECTORY_TYPE) {
+    entry = f->image->block[inode->content].content.directory.entry;
+    for(int k = 2; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+      INODE_REFERENCE c = entry[k].inode_reference;
+      if(c != UNALLOCATED_INODE && f->entry_problem[d][k] == 0 && f->parent[c] != d)
+        f->entry_problem[d][k] = E_EXTRA_LINK;
+    }
+  }
+
+  INODE_REFERENCE parent = d == ROOT_DIRECTORY_INODE ? ROOT_DIRECTORY_INODE : f->parent[d];
+  if(parent == UNALLOCATED_INODE) {
+    inode_problem(f, d, I_UNLINKED);
+    return;
+  }
+  if(entry != NULL && (strcmp(entry[1].name, "..") != 0 || entry[1].inode_reference != parent))
+    inode_problem(f, d, D_DOTDOT);
+
+  // Follow the parents up to the root (a cycle never gets there)
+  INODE_REFERENCE up = d;
+  for(int steps = 0; steps < N_INODES && up != ROOT_DIRECTORY_INODE; ++steps) {
+    up = f->parent[up];
+    if(up == UNALLOCATED_INODE)
+      break;
+  }
+  if(up == ROOT_DIRECTORY_INODE)
+    f->reachable[d] = 1;
+  else
+    inode_problem(f, d, I_UNREACHABLE);
+}
+
+/**********************************************************************/
+// Phase 3: free chain
+
+/**
+ *  @return The directory or file that keeps the block (UNALLOCATED_INODE
+ *          if none)
+ */
+static INODE_REFERENCE block_user(FSCK *f, BLOCK_REFERENCE b)
+{
+  INODE_REFERENCE owner = f->block_owner[b];
+  if(owner != UNALLOCATED_INODE && f->valid[owner] && f->reachable[owner])
+    return(owner);
+  return(UNALLOCATED_INODE);
+}
+
+/**
+ *  Walk one free chain (it is a list: this part cannot be shared out)
+ *
+ *  @param k The chain: the master block's, or a group's
+ */
+static void check_free_list(FSCK *f, int k)
+{
+  OUFS_IMAGE *image = f->image;
+  MASTER_BLOCK *master = &image->block[MASTER_BLOCK_REFERENCE].content.master;
+  BLOCK_REFERENCE prev = MASTER_BLOCK_REFERENCE;
+  BLOCK_REFERENCE b = *oufs_free_front(master, k);
+  while(b != UNALLOCATED_BLOCK) {
+    unsigned int problem = 0;
+    if(b < ROOT_DIRECTORY_BLOCK || b >= N_BLOCKS)
+      problem = B_BAD_LINK;
+    else if(f->free_block[b])
+      problem = B_CYCLE;
+    else if(block_user(f, b) != UNALLOCATED_INODE)
+      problem = B_IN_USE;
+    else if(image->damaged[b])
+      problem = B_DAMAGED;
+    if(problem && prev == MASTER_BLOCK_REFERENCE && master->layout == LAYOUT_GROUPS
+       && (problem == B_BAD_LINK || problem == B_CYCLE)) {
+      // The group's descriptor holds the bad link
+      f->group_problem[k] |= problem == B_BAD_LINK ? G_BAD_LINK : G_CYCLE;
+      f->chain_end[k] = UNALLOCATED_BLOCK;
+      return;
+    }
+    if(problem) {
+      // Reported against the block that holds the bad link
+      f->block_problem[problem == B_IN_USE || problem == B_DAMAGED ? b : prev] |= problem;
+      f->chain_end[k] = UNALLOCATED_BLOCK;
+      return;
+    }
+    if(oufs_free_list_of(master, b) != k)
+      f->block_problem[b] |= B_WRONG_GROUP;
+    f->free_block[b] = 1 + k;
+    prev = b;
+    b = image->block[b].next_block;
+  }
+  f->chain_end[k] = prev == MASTER_BLOCK_REFERENCE ? UNALLOCATED_BLOCK : prev;
+  if(f->chain_end[k] != *oufs_free_end(master, k)) {
+    if(master->layout == LAYOUT_GROUPS)
+      f->group_problem[k] |= G_BAD_END;
+    else
+      f->block_problem[MASTER_BLOCK_REFERENCE] |= B_BAD_END;
+  }
+}
+
+/**
+ *  Walk the free chains, then check the counters of the groups against
+ *   them and the inode allocation flags
+ */
+static void check_free_chain(FSCK *f)
+{
+  MASTER_BLOCK *master = &f->image->block[MASTER_BLOCK_REFERENCE].content.master;
+  for(int k = 0; k < oufs_n_free_lists(master); ++k)
+    check_free_list(f, k);
+  if(master->layout != LAYOUT_GROUPS)
+    return;
+  MASTER_BLOCK counted = *master;
+  oufs_master_recount(&counted, f->free_block);
+  for(int g = 0; g < N_GROUPS; ++g) {
+    if(counted.group[g].free_blocks != master->group[g].free_blocks
+       || counted.group[g].free_inodes != master->group[g].free_inodes)
+      f->group_problem[g] |= G_COUNTS;
+  }
+}
+
+static void check_leak(FSCK *f, int b)
+{
+  if(b < ROOT_DIRECTORY_BLOCK || f->free_block[b] || block_user(f, b) != UNALLOCATED_INODE)
+    return;
+  // Blocks of directories and files that are themselves reported are not
+  //  counted
+  if(f->block_owner[b] == UNALLOCATED_INODE)
+    f->block_problem[b] |= B_LEAKED;
+}
+
+/**********************************************************************/
+
+/**
+ *  Print what is wrong, in inode and block order
+ *
+ *  @return Number of problems
+ */
+static int report(FSCK *f)
+{
+  OUFS_IMAGE *image = f->image;
+  int n = 0;
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    INODE *inode = oufs_image_inode(image, i);
+    unsigned int p = f->inode_problem[i];
+    DIRECTORY_ENTRY *entry = f->valid[i] && inode->type == DIRECTORY_TYPE
+      ? image->block[inode->content].content.directory.entry : NULL;
+    if(p & I_FREE_IN_USE)
+      printf("Inode %d is marked free but has type %d\n", i, inode->type);
+    if(p & I_BAD_TYPE)
+      printf("Inode %d is allocated but is neither a directory nor a file (type %d)\n", i,
+             inode->type);
+    if(p & I_RESERVED)
+      printf("Inode %d is still reserved, with block %d\n", i, f->problem_block[i]);
+    if(p & I_BAD_BLOCK)
+      printf("%s %d: bad block reference %d\n", Kind(f, i), i, f->problem_block[i]);
+    if(p & I_DAMAGED_BLOCK)
+      printf("%s %d: block %d cannot be read\n", Kind(f, i), i, f->problem_block[i]);
+    if(p & I_SHARED_BLOCK)
+      printf("%s %d: block %d belongs to %s %d\n", Kind(f, i), i, f->problem_block[i],
+             kind(f, f->block_owner[f->problem_block[i]]), f->block_owner[f->problem_block[i]]);
+    if(p & I_REFERENCES)
+      printf("%s %d: %d references (expected 1)\n", Kind(f, i), i, inode->n_references);
+    if(p & I_UNLINKED)
+      printf("%s %d is not named in any directory\n", Kind(f, i), i);
+    if(p & I_UNREACHABLE)
+      printf("%s %d cannot be reached from the root\n", Kind(f, i), i);
+    if(p & D_NEXT)
+      printf("Directory %d: block %d has next block %d\n", i, inode->content,
+             image->block[inode->content].next_block);
+    if(p & D_DOT)
+      printf("Directory %d: bad \".\" entry\n", i);
+    if(p & D_DOTDOT)
+      printf("Directory %d: \"..\" is %d (expected %d)\n", i, entry[1].inode_reference,
+             i == ROOT_DIRECTORY_INODE ? ROOT_DIRECTORY_INODE : f->parent[i]);
+    if(p & D_SIZE)
+      printf("Directory %d: size %d does not match its entries\n", i, inode->size);
+    if(p & F_SIZE)
+      printf("File %d: size %d does not match its blocks\n", i, inode->size);
+    for(int b = p; b != 0; b &= b - 1)
+      ++n;
+
+    for(int k = 0; entry != NULL && k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+      switch(f->entry_problem[i][k]) {
+      case E_BAD_NAME:
+        printf("Directory %d: entry %d has a bad name\n", i, k);
+        break;
+      case E_BAD_INODE:
+        printf("Directory %d: entry \"%.*s\" names bad inode %d\n", i, FILE_NAME_SIZE,
+               entry[k].name, entry[k].inode_reference);
+        break;
+      case E_DUPLICATE:
+        printf("Directory %d: entry \"%.*s\" is a duplicate\n", i, FILE_NAME_SIZE, entry[k].name);
+        break;
+      case E_EXTRA_LINK:
+        printf("Directory %d: entry \"%.*s\" is a second link to %s %d\n", i,
+               FILE_NAME_SIZE, entry[k].name, kind(f, entry[k].inode_reference),
+               entry[k].inode_reference);
+        break;
+      }
+      if(f->entry_problem[i][k] != 0)
+        ++n;
+    }
+  }
+
+  MASTER_BLOCK *master = &image->block[MASTER_BLOCK_REFERENCE].content.master;
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+    unsigned int p = f->block_problem[b];
+    BLOCK_REFERENCE next = b == MASTER_BLOCK_REFERENCE ? master->unallocated_front : image->block[b].next_block;
+    if(p & B_BAD_LINK)
+      printf("Free chain: block %d links to bad block %d\n", b, next);
+    if(p & B_CYCLE)
+      printf("Free chain: block %d links back to block %d (cycle)\n", b, next);
+    if(p & B_IN_USE)
+      printf("Free chain: block %d is in use by %s %d\n", b, kind(f, block_user(f, b)),
+             block_user(f, b));
+    if(p & B_DAMAGED)
+      printf("Free chain: block %d cannot be read\n", b);
+    if((p & B_LEAKED) && (b == 0 || !(f->block_problem[b - 1] & B_LEAKED))) {
+      // One line for a run of leaked blocks
+      BLOCK_REFERENCE last = b;
+      while(last + 1 < N_BLOCKS && (f->block_problem[last + 1] & B_LEAKED))
+        ++last;
+      if(last == b)
+        printf("Block %d is neither in use nor free\n", b);
+      else
+        printf("Blocks %d-%d are neither in use nor free\n", b, last);
+    }
+    if(p & B_BAD_END)
+      printf("Free chain: ends at block %d, master block says %d\n", f->chain_end[0],
+             master->unallocated_end);
+    if(p & B_WRONG_GROUP)
+      printf("Free chain: block %d is on the chain of group %d\n", b, f->free_block[b] - 1);
+    for(unsigned int q = p; q != 0; q &= q - 1)
+      ++n;
+  }
+
+  for(int g = 0; master->layout == LAYOUT_GROUPS && g < N_GROUPS; ++g) {
+    unsigned int p = f->group_problem[g];
+    GROUP_DESCRIPTOR *group = &master->group[g];
+    if(p & G_BAD_LINK)
+      printf("Group %d: free chain starts at bad block %d\n", g, group->unallocated_front);
+    if(p & G_CYCLE)
+      printf("Group %d: free chain starts at block %d, which is on another chain\n", g,
+             group->unallocated_front);
+    if(p & G_BAD_END)
+      printf("Group %d: free chain ends at block %d, descriptor says %d\n", g, f->chain_end[g],
+             group->unallocated_end);
+    if(p & G_COUNTS)
+      printf("Group %d: counters say %d free blocks and %d free inodes\n", g,
+             group->free_blocks, group->free_inodes);
+    for(unsigned int q = p; q != 0; q &= q - 1)
+      ++n;
+  }
+  return(n);
+}
+
+/**
+ *  Check the whole image
+ *
+ *  @return Number of problems found
+ */
+static int check(FSCK *f)
+{
+  memset(f->inode_problem, 0, sizeof(f->inode_problem));
+  memset(f->entry_problem, 0, sizeof(f->entry_problem));
+  memset(f->block_problem, 0, sizeof(f->block_problem));
+  memset(f->valid, 0, sizeof(f->valid));
+  memset(f->reachable, 0, sizeof(f->reachable));
+  memset(f->free_block, 0, sizeof(f->free_block));
+  memset(f->group_problem, 0, sizeof(f->group_problem));
+  for(int i = 0; i < N_BLOCKS; ++i)
+    f->block_owner[i] = UNALLOCATED_INODE;
+  for(int i = 0; i < N_INODES; ++i)
+    f->parent[i] = UNALLOCATED_INODE;
+
+  run_phase(f, check_inode, N_INODES);
+  run_phase(f, check_block_owner, N_INODES);
+  run_phase(f, check_directory, N_INODES);
+  run_phase(f, check_links, N_INODES);
+  check_free_chain(f);
+  run_phase(f, check_leak, N_BLOCKS);
+  return(report(f));
+}
+
+/**********************************************************************/
+// Repair
+
+/**
+ *  Keep the reachable directories and files, release everything else and
+ *   rebuild the free chains
+ *
+ *  @return 0 if success; -1 if the disk cannot be repaired
+ */
+static int repair(FSCK *f)
+{
+  OUFS_IMAGE *image = f->image;
+  if(!f->valid[ROOT_DIRECTORY_INODE]) {
+    fprintf(stderr, "The root directory is damaged: cannot repair\n");
+    return(-1);
+  }
+
+  unsigned char in_use[N_BLOCKS];
+  memset(in_use, 0, sizeof(in_use));
+  for(BLOCK_REFERENCE b = 0; b < ROOT_DIRECTORY_BLOCK; ++b)
+    in_use[b] = 1;
+
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    INODE *inode = oufs_image_inode(image, i);
+    BLOCK_REFERENCE inode_block = 1 + i / N_INODES_PER_BLOCK;
+    int keep = f->valid[i] && f->reachable[i];
+    if(oufs_image_inode_allocated(image, i) != keep)
+      oufs_image_set_inode_allocated(image, i, keep);
+    if(!keep) {
+      if(inode->type != UNUSED_TYPE) {
+        oufs_set_inode(inode, UNUSED_TYPE, 0, UNALLOCATED_BLOCK, 0);
+        oufs_image_dirty(image, inode_block);
+      }
+      continue;
+    }
+    if(inode->type == FILE_TYPE) {
+      BLOCK_REFERENCE b = inode->content;
+      for(unsigned int k = 0; k * OUFS_FILE_BLOCK_DATA < inode->size; ++k) {
+        in_use[b] = 1;
+        b = image->block[b].next_block;
+      }
+      if(inode->n_references != 1) {
+        inode->n_references = 1;
+        oufs_image_dirty(image, inode_block);
+      }
+      continue;
+    }
+
+    // Make the directory block agree with the tree
+    BLOCK *b = &image->block[inode->content];
+    DIRECTORY_ENTRY *entry = b->content.directory.entry;
+    INODE_REFERENCE parent = i == ROOT_DIRECTORY_INODE ? ROOT_DIRECTORY_INODE : f->parent[i];
+    BLOCK before = *b;
+    in_use[inode->content] = 1;
+    b->next_block = UNALLOCATED_BLOCK;
+    memset(entry[0].name, 0, FILE_NAME_SIZE);
+    strcpy(entry[0].name, ".");
+    entry[0].inode_reference = i;
+    memset(entry[1].name, 0, FILE_NAME_SIZE);
+    strcpy(entry[1].name, "..");
+    entry[1].inode_reference = parent;
+    unsigned int live = 2;
+    for(int k = 2; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+      INODE_REFERENCE c = entry[k].inode_reference;
+      if(c == UNALLOCATED_INODE)
+        continue;
+      if(f->entry_problem[i][k] != 0 || !f->reachable[c])
+        entry[k].inode_reference = UNALLOCATED_INODE;
+      else
+        ++live;
+    }
+    if(memcmp(&before, b, sizeof(BLOCK)) != 0)
+      oufs_image_dirty(image, inode->content);
+
+    if(inode->n_references != 1 || inode->size != live) {
+      inode->n_references = 1;
+      inode->size = live;
+      oufs_image_dirty(image, inode_block);
+    }
+  }
+
+  // Free chains: every block that is not kept, in order
+  unsigned char is_free[N_BLOCKS];
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b)
+    is_free[b] = !in_use[b];
+  oufs_image_link_free(image, is_free);
+  return(oufs_image_save(image));
+}
+
+int main(int argc, char **argv)
+{
+  // Get the key environment variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int fix = 0;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while((opt = getopt(argc, argv, "rj:")) != -1) {
+    switch(opt) {
+    case 'r':
+      fix = 1;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: oufs_fsck [-r] [-j threads]\n");
+      return(8);
+    }
+  }
+  if(threads < 1)
+    threads = 1;
+  if(threads > FSCK_MAX_THREADS)
+    threads = FSCK_MAX_THREADS;
+
+  FSCK *f = malloc(sizeof(FSCK));
+  if(f == NULL)
+    return(8);
+  f->threads = threads;
+  if((f->image = oufs_image_load(disk_name, pipe_name_base)) == NULL) {
+    free(f);
+    return(8);
+  }
+  virtual_disk_set_caller(VDISK_CALLER_FSCK);
+
+  int status = 0;
+  int problems = check(f);
+  if(problems > 0) {
+    status = 4;
+    if(fix) {
+      if(repair(f) == 0 && (problems = check(f)) == 0) {
+        printf("Repaired\n");
+        status = 1;
+      }else{
+        printf("%d problem(s) left\n", problems);
+      }
+    }else{
+      printf("%d problem(s) found\n", problems);
+    }
+  }
+
+  int directories = 0;
+  int files = 0;
+  int free_blocks = 0;
+  for(int i = 0; i < N_INODES; ++i) {
+    if(f->reachable[i] && oufs_image_inode(f->image, i)->type == FILE_TYPE)
+      ++files;
+    else
+      directories += f->reachable[i];
+  }
+  for(int b = 0; b < N_BLOCKS; ++b)
+    free_blocks += f->free_block[b] != 0;
+  printf("%s: %d directories, %d files, %d free blocks\n", disk_name, directories, files,
+         free_blocks);
+
+  if(oufs_image_close(f->image) != 0 && status < 8)
+    status = 8;
+  free(f);
+  return(status);
+}
@@ -0,0 +1,303 @@
+/**
+ *  oufs_image.c
+ *
+ *  A whole disk in memory, for tools that check or rewrite every block at
+ *  once (oufs_fsck, oufs_compact).  The image is loaded with one large
+ *  read and saved as one transaction, through a mount, so the journal,
+ *  the checksums and any shared block cache stay in step.  The loading
+ *  process is the writer of a shared cache until the image is closed, so
+ *  nothing else changes the disk while the image is out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "virtual_disk.h"
+#include "oufs_lib_support.h"
+
+/**
+ * Load every block of a disk
+ *
+ * @param disk_name Name of the virtual disk
+ * @param pipe_name_base Base name of the pipes (not used)
+ * @return The image; NULL if the disk cannot be mounted or read
+ */
+OUFS_IMAGE *oufs_image_load(char *disk_name, char *pipe_name_base)
+{
+    OUFS_IMAGE *image = malloc(sizeof(OUFS_IMAGE));
+    unsigned char *buf = malloc(N_BLOCKS * BLOCK_SIZE);
+    if(image == NULL || buf == NULL) {
+        fprintf(stderr, "oufs_image_load: out of memory\n");
+        free(image);
+        free(buf);
+        return(NULL);
+    }
+    memset(image, 0, sizeof(OUFS_IMAGE));
+    image->mount = oufs_mount(disk_name, pipe_name_base);
+    if(image->mount == NULL) {
+        free(image);
+        free(buf);
+        return(NULL);
+    }
+    image->mount->debug = 0;
+    if(oufs_cache_lock(image->mount) != 0) {
+        oufs_image_close(image);
+        free(buf);
+        return(NULL);
+    }
+
+    // One read for the whole disk.  If it fails, find the blocks that
+    //  cannot be read one at a time.
+    if(virtual_disk_read_blocks(image->mount->disk, 0, N_BLOCKS, buf) == 0) {
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+            memcpy(&image->block[i], buf + i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }else{
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+            if(virtual_disk_read_block(image->mount->disk, i, &image->block[i]) != 0) {
+                memset(&image->block[i], 0, sizeof(BLOCK));
+                image->damaged[i] = 1;
+            }
+        }
+    }
+    free(buf);
+    return(image);
+}
+
+/**
+ * @param i Inode reference
+ * @return The inode within the image's inode table
+ */
+INODE *oufs_image_inode(OUFS_IMAGE *image, INODE_REFERENCE i)
+{
+    BLOCK *b = &image->block[1 + i / N_INODES_PER_BLOCK];
+    return(&b->content.inodes.inode[i % N_INODES_PER_BLOCK]);
+}
+
+/**
+ * @param i Inode reference
+ * @return 1 if the master block marks the inode as allocated; 0 if not
+ */
+int oufs_image_inode_allocated(OUFS_IMAGE *image, INODE_REFERENCE i)
+{
+    return(oufs_master_inode_allocated(&image->block[MASTER_BLOCK_REFERENCE].content.master, i));
+}
+
+/**
+ * Change the allocation flag of an inode (marks the master block dirty)
+ *
+ * @param i Inode reference
+ * @param allocated 1 to mark it allocated; 0 to mark it free
+ */
+void oufs_image_set_inode_allocated(OUFS_IMAGE *image, INODE_REFERENCE i, int allocated)
+{
+    oufs_master_set_inode(&image->block[MASTER_BLOCK_REFERENCE].content.master, i, allocated);
+    oufs_image_dirty(image, MASTER_BLOCK_REFERENCE);
+}
+
+/**
+ * Link the free blocks up in ascending order: on the master block's list,
+ *   or on their groups' lists.  Only the links that change (and those of
+ *   blocks that could not be read) are marked dirty.  The counters of the
+ *   groups are set again.
+ *
+ * @param is_free One entry per block: 1 if it is free
+ */
+void oufs_image_link_free(OUFS_IMAGE *image, const unsigned char *is_free)
+{
+    MASTER_BLOCK *master = &image->block[MASTER_BLOCK_REFERENCE].content.master;
+    MASTER_BLOCK before = *master;
+    for(int k = 0; k < oufs_n_free_lists(master); ++k) {
+        BLOCK_REFERENCE prev = UNALLOCATED_BLOCK;
+        *oufs_free_front(master, k) = UNALLOCATED_BLOCK;
+        for(BLOCK_REFERENCE b = 0; b <= N_BLOCKS; ++b) {
+            if(b < N_BLOCKS && (!is_free[b] || oufs_free_list_of(master, b) != k))
+                continue;
+            BLOCK_REFERENCE next = b < N_BLOCKS ? b : UNALLOCATED_BLOCK;
+            if(prev == UNALLOCATED_BLOCK) {
+                *oufs_free_front(master, k) = next;
+            }else if(image->block[prev].next_block != next || image->damaged[prev]) {
+                image->block[prev].next_block = next;
+                oufs_image_dirty(image, prev);
+            }
+            if(b < N_BLOCKS)
+                prev = b;
+        }
+        *oufs_free_end(master, k) = prev;
+    }
+    oufs_master_recount(master, is_free);
+    if(memcmp(&before, master, sizeof(MASTER_BLOCK)) != 0)
+        oufs_image_dirty(image, MASTER_BLOCK_REFERENCE);
+}
+
+/**
+ * A block of the image has been changed and must be saved
+ *
+ * @param block_ref Block that has changed
+ */
+void oufs_image_dirty(OUFS_IMAGE *image, BLOCK_REFERENCE block_ref)
+{
+    image->dirty[block_ref] = 1;
+}
+
+/**
+ * Move the blocks of the files and directories to the front of the data
+ *   area and make every other block free (zero filled, linked in
+ *   ascending order on their free lists).  The blocks listed come first,
+ *   in that order; the other blocks in use follow in their current order.
+ *   The inodes and file chains follow their blocks; the root directory
+ *   keeps its block.  Nothing is changed if a block is claimed twice or
+ *   listed wrongly.
+ *
+ * @param order Blocks in use (not the root directory's), in the order
+ *        they are to be laid out
+ * @param n Number of blocks in order (0: keep the current order)
+ * @return The number of blocks that have moved
+ *         -1 if a block is claimed twice, or listed but not in use or twice
+ */
+int oufs_image_relocate(OUFS_IMAGE *image, const BLOCK_REFERENCE *order, int n)
+{
+    const BLOCK_REFERENCE first = ROOT_DIRECTORY_BLOCK + 1;
+    unsigned char live[N_BLOCKS];
+    unsigned char chained[N_BLOCKS];
+    BLOCK_REFERENCE new_ref[N_BLOCKS];
+    memset(live, 0, sizeof(live));
+    memset(chained, 0, sizeof(chained));
+
+    // The blocks in use: one per directory (or reserved inode), a chain
+    //  per file
+    for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+        INODE *inode = oufs_image_inode(image, i);
+        if(!oufs_image_inode_allocated(image, i)
+           || (inode->type != DIRECTORY_TYPE && inode->type != FILE_TYPE
+               && inode->type != RESERVED_TYPE))
+            continue;
+        BLOCK_REFERENCE b = inode->content;
+        while(b != UNALLOCATED_BLOCK) {
+            int root = i == ROOT_DIRECTORY_INODE && b == ROOT_DIRECTORY_BLOCK;
+            if(b >= N_BLOCKS || live[b] || (b < first && !root)) {
+                fprintf(stderr, "oufs_image_relocate: inode %d claims block %d\n", i, b);
+                return(-1);
+            }
+            live[b] = 1;
+            if(inode->type != FILE_TYPE)
+                break;
+            chained[b] = 1;
+            b = image->block[b].next_block;
+        }
+    }
+    // The blocks listed go first; the others in use follow as they are
+    BLOCK_REFERENCE full[N_BLOCKS];
+    int n_full = 0;
+    for(int k = 0; k < n; ++k) {
+        if(order[k] < first || order[k] >= N_BLOCKS || live[order[k]] != 1) {
+            fprintf(stderr, "oufs_image_relocate: block %d is not in use or is listed twice\n",
+                    order[k]);
+            return(-1);
+        }
+        full[n_full++] = order[k];
+        live[order[k]] = 2;
+    }
+    for(BLOCK_REFERENCE b = first; b < N_BLOCKS; ++b) {
+        if(live[b] == 1)
+            full[n_full++] = b;
+    }
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+        new_ref[b] = b;
+    }
+    for(int k = 0; k < n_full; ++k) {
+        new_ref[full[k]] = first + k;
+    }
+    order = full;
+    n = n_full;
+
+    // Lay the blocks out again, pointers first
+    BLOCK *orig = malloc(2 * N_BLOCKS * sizeof(BLOCK));
+    if(orig == NULL) {
+        fprintf(stderr, "oufs_image_relocate: out of memory\n");
+        return(-1);
+    }
+    BLOCK *src = orig + N_BLOCKS;
+    memcpy(orig, image->block, N_BLOCKS * sizeof(BLOCK));
+    for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+        INODE *inode = oufs_image_inode(image, i);
+        if(oufs_image_inode_allocated(image, i) && inode->content < N_BLOCKS
+           && (inode->type == DIRECTORY_TYPE || inode->type == FILE_TYPE
+               || inode->type == RESERVED_TYPE))
+            inode->content = new_ref[inode->content];
+    }
+    memcpy(src, image->block, N_BLOCKS * sizeof(BLOCK));
+    for(BLOCK_REFERENCE b = first; b < N_BLOCKS; ++b) {
+        if(chained[b] && src[b].next_block != UNALLOCATED_BLOCK)
+            src[b].next_block = new_ref[src[b].next_block];
+    }
+    int moved = 0;
+    for(int k = 0; k < n; ++k) {
+        image->block[first + k] = src[order[k]];
+        moved += order[k] != first + k;
+    }
+    unsigned char is_free[N_BLOCKS];
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+        is_free[b] = b >= first + n;
+        if(is_free[b])
+            memset(&image->block[b], 0, sizeof(BLOCK));
+    }
+    oufs_image_link_free(image, is_free);
+
+    // Only what differs is written back
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+        if(memcmp(&orig[b], &image->block[b], BLOCK_SIZE) != 0)
+            oufs_image_dirty(image, b);
+    }
+    free(orig);
+    return(moved);
+}
+
+/**
+ * Write every changed block back to the disk as one transaction
+ *
+ * @return 0 if success
+ *         -1 if a block could not be written
+ */
+int oufs_image_save(OUFS_IMAGE *image)
+{
+    OUFS_MOUNT *mount = image->mount;
+    int ret = 0;
+    virtual_disk_begin_transaction(mount->disk);
+
+    // Lock-free readers that share the cache must look again
+    for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+        oufs_write_begin(mount, i);
+    }
+    for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+        if(image->dirty[i]) {
+            if(oufs_write_block(mount, i, &image->block[i]) != 0) {
+                fprintf(stderr, "oufs_image_save: error writing block %d\n", i);
+                ret = -1;
+            }
+            image->dirty[i] = 0;
+            image->damaged[i] = 0;
+        }
+    }
+    for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+        oufs_write_end(mount, i);
+    }
+
+    if(virtual_disk_end_transaction(mount->disk) != 0 || virtual_disk_flush(mount->disk) != 0) {
+        ret = -1;
+    }
+    return(ret);
+}
+
+/**
+ * Release the image (changes that were not saved are lost)
+ *
+ * @return 0 if success
+ *         -1 if the disk could not be detached cleanly
+ */
+int oufs_image_close(OUFS_IMAGE *image)
+{
+    int ret = oufs_unmount(image->mount);
+    free(image);
+    return(ret);
+}
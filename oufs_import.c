@@ -0,0 +1,281 @@
+/**
+ *  oufs_import
+ *
+ *  Copies a directory of the host, with everything below it, into a
+ *  directory of the disk.  The host tree is read by several threads into
+ *  memory, then added in one go (see oufs_bulk.c): the new directories and
+ *  files are laid out in runs and written with a few large writes.
+ *  Anything but directories and regular files is skipped.
+ *
+ *  Usage: oufs_import [-j threads] <host dir> [<oufs dir>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "oufs_lib.h"
+
+// A host directory waiting to be read
+typedef struct
+{
+  char *path;
+  OUFS_TREE_NODE *node;
+} SCAN_ITEM;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  SCAN_ITEM *item;
+  int n;
+  int size;
+
+  // Directories queued or being read
+  int pending;
+  int error;
+} SCAN;
+
+static int compare_nodes(const void *a, const void *b)
+{
+  return(strcmp(((const OUFS_TREE_NODE *) a)->name, ((const OUFS_TREE_NODE *) b)->name));
+}
+
+/**
+ *  Read the whole of a host file
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int read_host_file(char *path, OUFS_TREE_NODE *node, off_t size)
+{
+  if(size > MAX_BLOCKS_IN_FILE * OUFS_FILE_BLOCK_DATA) {
+    fprintf(stderr, "oufs_import: %s is too large\n", path);
+    return(-1);
+  }
+  node->size = size;
+  node->data = malloc(size + 1);
+  int fd = open(path, O_RDONLY);
+  if(node->data == NULL || fd < 0) {
+    fprintf(stderr, "oufs_import: cannot read %s\n", path);
+    if(fd >= 0)
+      close(fd);
+    return(-1);
+  }
+  for(off_t done = 0; done < size; ) {
+    ssize_t k = read(fd, node->data + done, size - done);
+    if(k <= 0) {
+      fprintf(stderr, "oufs_import: cannot read %s\n", path);
+      close(fd);
+      return(-1);
+    }
+    done += k;
+  }
+  close(fd);
+  return(0);
+}
+
+static void push(SCAN *scan, char *path, OUFS_TREE_NODE *node)
+{
+  if(scan->n == scan->size) {
+    int size = scan->size ? 2 * scan->size : 64;
+    SCAN_ITEM *item = realloc(scan->item, size * sizeof(SCAN_ITEM));
+    if(item == NULL) {
+      fprintf(stderr, "oufs_import: out of memory\n");
+      scan->error = 1;
+      free(path);
+      return;
+    }
+    scan->item = item;
+    scan->size = size;
+  }
+  scan->item[scan->n++] = (SCAN_ITEM) {path, node};
+  ++scan->pending;
+  pthread_cond_signal(&scan->changed);
+}
+
+/**
+ *  Read a host directory into its node: the files are read whole, the
+ *   subdirectories are queued
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int scan_directory(SCAN *scan, char *path, OUFS_TREE_NODE *dir)
+{
+  DIR *d = opendir(path);
+  if(d == NULL) {
+    fprintf(stderr, "oufs_import: cannot open %s\n", path);
+    return(-1);
+  }
+  int size = 0;
+  int ret = 0;
+  struct dirent *e;
+  while(ret == 0 && (e = readdir(d)) != NULL) {
+    if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+    char child_path[PATH_MAX];
+    struct stat st;
+    if(snprintf(child_path, PATH_MAX, "%s/%s", path, e->d_name) >= PATH_MAX) {
+      fprintf(stderr, "oufs_import: path too long in %s\n", path);
+      ret = -1;
+      break;
+    }
+    if(lstat(child_path, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+      fprintf(stderr, "oufs_import: skipping %s\n", child_path);
+      continue;
+    }
+    if(strlen(e->d_name) > FILE_NAME_SIZE - 2) {
+      fprintf(stderr, "oufs_import: name too long: %s\n", child_path);
+      ret = -1;
+      break;
+    }
+    if(dir->n_children == size) {
+      size = size ? 2 * size : 16;
+      OUFS_TREE_NODE *child = realloc(dir->child, size * sizeof(OUFS_TREE_NODE));
+      if(child == NULL) {
+        ret = -1;
+        break;
+      }
+      dir->child = child;
+    }
+    OUFS_TREE_NODE *node = &dir->child[dir->n_children++];
+    memset(node, 0, sizeof(OUFS_TREE_NODE));
+    strcpy(node->name, e->d_name);
+    if(S_ISDIR(st.st_mode)) {
+      node->type = DIRECTORY_TYPE;
+    }else{
+      node->type = FILE_TYPE;
+      ret = read_host_file(child_path, node, st.st_size);
+    }
+  }
+  closedir(d);
+  if(ret != 0)
+    return(ret);
+
+  // The children do not move from here on
+  qsort(dir->child, dir->n_children, sizeof(OUFS_TREE_NODE), compare_nodes);
+  pthread_mutex_lock(&scan->lock);
+  for(int k = 0; k < dir->n_children; ++k) {
+    if(dir->child[k].type == DIRECTORY_TYPE) {
+      char *child_path = malloc(PATH_MAX);
+      if(child_path == NULL) {
+        scan->error = 1;
+        break;
+      }
+      snprintf(child_path, PATH_MAX, "%s/%s", path, dir->child[k].name);
+      push(scan, child_path, &dir->child[k]);
+    }
+  }
+  pthread_mutex_unlock(&scan->lock);
+  return(0);
+}
+
+static void *scan_thread(void *arg)
+{
+  SCAN *scan = arg;
+  pthread_mutex_lock(&scan->lock);
+  for(;;) {
+    while(scan->n == 0 && scan->pending > 0 && !scan->error)
+      pthread_cond_wait(&scan->changed, &scan->lock);
+    if(scan->n == 0 || scan->error)
+      break;
+    SCAN_ITEM item = scan->item[--scan->n];
+    pthread_mutex_unlock(&scan->lock);
+
+    int ret = scan_directory(scan, item.path, item.node);
+    free(item.path);
+
+    pthread_mutex_lock(&scan->lock);
+    if(ret != 0)
+      scan->error = 1;
+    if(--scan->pending == 0 || scan->error)
+      pthread_cond_broadcast(&scan->changed);
+  }
+  pthread_mutex_unlock(&scan->lock);
+  return(NULL);
+}
+
+static void free_tree(OUFS_TREE_NODE *node)
+{
+  for(int k = 0; k < node->n_children; ++k)
+    free_tree(&node->child[k]);
+  free(node->child);
+  free(node->data);
+}
+
+int main(int argc, char **argv)
+{
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int threads = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "j:")) != -1) {
+    switch(opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: oufs_import [-j threads] <host dir> [<oufs dir>]\n");
+      return(-1);
+    }
+  }
+  if(argc - optind < 1 || argc - optind > 2) {
+    fprintf(stderr, "Usage: oufs_import [-j threads] <host dir> [<oufs dir>]\n");
+    return(-1);
+  }
+  if(threads <= 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? MIN(n, 16) : 1;
+  }
+  threads = MIN(threads, 64);
+
+  // Read the host tree
+  OUFS_TREE_NODE root;
+  memset(&root, 0, sizeof(root));
+  root.type = DIRECTORY_TYPE;
+  SCAN scan = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0};
+  char *root_path = strdup(argv[optind]);
+  pthread_t thread[64];
+  if(root_path == NULL) {
+    return(-1);
+  }
+  push(&scan, root_path, &root);
+  for(int i = 0; i < threads; ++i) {
+    if(pthread_create(&thread[i], NULL, scan_thread, &scan) != 0) {
+      threads = i;
+      break;
+    }
+  }
+  if(threads == 0)
+    scan_thread(&scan);
+  for(int i = 0; i < threads; ++i)
+    pthread_join(thread[i], NULL);
+  for(int i = 0; i < scan.n; ++i)
+    free(scan.item[i].path);
+  free(scan.item);
+
+  int ret = -1;
+  if(!scan.error) {
+    // Open the virtual disk
+    OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+    if(mount != NULL) {
+      ret = oufs_add_tree(mount, cwd, argc - optind > 1 ? argv[optind + 1] : "",
+                          root.child, root.n_children);
+      if(ret != 0)
+        fprintf(stderr, "Error (%d)\n", ret);
+      if(oufs_unmount(mount) != 0)
+        ret = -1;
+    }
+  }
+  free_tree(&root);
+  return(ret == 0 ? 0 : -1);
+}
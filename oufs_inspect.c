@@ -30,9 +30,11 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Connect to the virtual disk
-  if(virtual_disk_attach(disk_name, pipe_name_base) != 0) {
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL) {
     return(-1);
   }
+  virtual_disk_set_caller(VDISK_CALLER_INSPECT);
 
   // Respond to the different options
   if(argc == 1){
@@ -42,7 +44,7 @@ int main(int argc, char** argv) {
     if(strncmp(argv[1], "-master", 8) == 0) {
       // Master record
       BLOCK block;
-      if(virtual_disk_read_block(0, &block) != 0) {
+      if(virtual_disk_read_block(mount->disk, 0, &block) != 0) {
 	fprintf(stderr, "Error reading master block\n");
       }else{
 	// Block read: report state
@@ -52,6 +54,19 @@ int main(int argc, char** argv) {
 	}
 	printf("Unallocated front: %d\n", block.content.master.unallocated_front);
 	printf("Unallocated end: %d\n", block.content.master.unallocated_end);
+	printf("Allocation policy: %s\n",
+	       oufs_alloc_policy_name(block.content.master.allocation_policy));
+	if(block.content.master.layout == LAYOUT_GROUPS) {
+	  printf("Layout: groups\n");
+	  for(int g = 0; g < N_GROUPS; ++g) {
+	    GROUP_DESCRIPTOR *group = &block.content.master.group[g];
+	    printf("Group %d: unallocated front %d, end %d; %d free blocks, %d free inodes\n",
+		   g, group->unallocated_front, group->unallocated_end, group->free_blocks,
+		   group->free_inodes);
+	  }
+	}else{
+	  printf("Layout: list\n");
+	}
       }
 
     }else if(strncmp(argv[1], "-help", 6) == 0) {
@@ -76,7 +91,7 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
 	}else{
 	  INODE inode;
-	  oufs_read_inode_by_reference(index, &inode);
+	  oufs_read_inode_by_reference(mount, index, &inode);
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: ");
@@ -91,6 +106,9 @@ int main(int argc, char** argv) {
 	    case FILE_TYPE:
 	      printf("FILE\n");
 	      break;
+	    case RESERVED_TYPE:
+	      printf("RESERVED\n");
+	      break;
 	    }
 	  printf("Nreferences: %d\n", inode.n_references);
 	  printf("Content block: %d\n", inode.content);
@@ -112,7 +130,7 @@ int main(int argc, char** argv) {
 	  // success
 	  BLOCK block;
 	  // Read the block
-	  virtual_disk_read_block(index, &block);
+	  virtual_disk_read_block(mount->disk, index, &block);
 
 	  // display block data
 	  printf("Directory at block %d:\n", index);
@@ -137,7 +155,7 @@ int main(int argc, char** argv) {
 	}else{
 	  // Success
 	  BLOCK block;
-	  virtual_disk_read_block(index, &block);
+	  virtual_disk_read_block(mount->disk, index, &block);
 	  printf("Block %d:\n", index);
 	  printf("Next block: %d\n", block.next_block);
 	}
@@ -156,7 +174,7 @@ int main(int argc, char** argv) {
 	  BLOCK block;
 
 	  // Get the spcified block
-	  virtual_disk_read_block(index, &block);
+	  virtual_disk_read_block(mount->disk, index, &block);
 	  printf("Raw data at block %d:\n", index);
 	  for(int i = 0; i < DATA_BLOCK_SIZE; ++i) {
 	    if(block.content.data.data[i] >= ' ' && block.content.data.data[i] <= '~')
@@ -173,6 +191,6 @@ int main(int argc, char** argv) {
   }
 
   // All done: detach from the disk
-  virtual_disk_detach();
+  oufs_unmount(mount);
 }
 
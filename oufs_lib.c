@@ -6,15 +6,14 @@
  *
  */
 
+#include <pthread.h>
+#include <sched.h>
 #include "oufs_lib.h"
 #include "oufs_lib_support.h"
 #include "virtual_disk.h"
 
-// Yes ... a global variable
-int debug = 1;
-
 // Translate inode types to descriptive strings
-const char *INODE_TYPE_NAME[] = {"UNUSED", "DIRECTORY", "FILE"};
+const char *INODE_TYPE_NAME[] = {"UNUSED", "DIRECTORY", "FILE", "RESERVED"};
 
 /**
  Read the OUFS_PWD, OUFS_DISK, OUFS_PIPE_NAME_BASE environment
@@ -63,35 +62,153 @@ void oufs_get_environment(char *cwd, char *disk_name,
 }
 
 /**
- * Completely format the virtual disk (including creation of the space).
- *
- * NOTE: this function attaches to the virtual disk at the beginning and
- *  detaches after the format is complete.
+ * Attach to a virtual disk and set up the state that is shared by all of
+ *   the threads that use it
  *
- * - Zero out all blocks on the disk.
- * - Initialize the master block: mark inode 0 as allocated and initialize
- *    the linked list of free blocks
- * - Initialize root directory inode
- * - Initialize the root directory in block ROOT_DIRECTORY_BLOCK
+ * @param disk_name File name of the virtual disk
+ * @param pipe_name_base Base name of the named pipes
+ * @return The mount; NULL if the disk cannot be attached
+ */
+OUFS_MOUNT *oufs_mount(char *disk_name, char *pipe_name_base)
+{
+    // Per-block and per-inode state is laid out a cache line apart
+    OUFS_MOUNT *mount;
+    if(posix_memalign((void **)&mount, OUFS_CACHE_LINE, sizeof(OUFS_MOUNT)) != 0) {
+        fprintf(stderr, "oufs_mount: out of memory\n");
+        return(NULL);
+    }
+    memset(mount, 0, sizeof(OUFS_MOUNT));
+    
+    // Block cache (possibly shared with other processes)
+    if(oufs_cache_open(mount, disk_name) != 0) {
+        free(mount);
+        return(NULL);
+    }
+    
+    // Another process may be changing the disk: the journal must not be
+    //  replayed under its feet
+    if(oufs_cache_lock(mount) != 0) {
+        oufs_cache_close(mount);
+        free(mount);
+        return(NULL);
+    }
+    mount->disk = virtual_disk_attach(disk_name, pipe_name_base);
+    oufs_cache_unlock(mount);
+    if(mount->disk == NULL) {
+        oufs_cache_close(mount);
+        free(mount);
+        return(NULL);
+    }
+    mount->debug = 1;
+    
+    // On a striped disk, a miss brings in its whole stripe: every backing
+    //  store reads its unit at the same time
+    mount->readahead = virtual_disk_stripe_blocks(mount->disk);
+    if(mount->readahead > OUFS_READAHEAD_MAX)
+        mount->readahead = OUFS_READAHEAD_MAX;
+    if(mount->readahead < 2)
+        mount->readahead = 0;
+    
+    for(int i = 0; i < N_INODES; ++i) {
+        pthread_rwlock_init(&mount->inode_lock[i], NULL);
+    }
+    for(int i = 0; i < N_INODE_BLOCKS; ++i) {
+        pthread_mutex_init(&mount->inode_block_lock[i], NULL);
+    }
+    pthread_mutex_init(&mount->allocator_lock, NULL);
+    oufs_reserve_init(mount);
+    return(mount);
+}
+
+/**
+ * Hand back the inodes and blocks that threads have reserved but not used
+ *   (see oufs_reserve.c) and make every change so far durable
  *
- * @return 0 if no errors
- *         -x if an error has occurred.
+ * @return 0 if success
+ *         -1 if the disk could not be written
+ */
+int oufs_flush(OUFS_MOUNT *mount)
+{
+    int ret = oufs_reserve_return(mount);
+    if(virtual_disk_flush(mount->disk) != 0)
+        ret = -1;
+    return(ret);
+}
+
+/**
+ * Detach from the virtual disk and release the mount.  No other thread
+ *   may be using the mount.
  *
+ * @return 0 if success
+ *         -1 if the disk could not be detached cleanly
  */
+int oufs_unmount(OUFS_MOUNT *mount)
+{
+    // What is still reserved goes back first
+    int ret = oufs_reserve_return(mount);
+    oufs_reserve_destroy(mount);
+    
+    // Blocks freed since the last batch give their space back too
+    oufs_discard_free_blocks(mount, 1);
+    
+    if(virtual_disk_detach(mount->disk) != 0)
+        ret = -1;
+    
+    // Everything this process changed is on the disk now
+    if(oufs_cache_close(mount) != 0)
+        ret = -1;
+    
+    for(int i = 0; i < N_INODES; ++i) {
+        pthread_rwlock_destroy(&mount->inode_lock[i]);
+    }
+    for(int i = 0; i < N_INODE_BLOCKS; ++i) {
+        pthread_mutex_destroy(&mount->inode_block_lock[i]);
+    }
+    pthread_mutex_destroy(&mount->allocator_lock);
+    free(mount);
+    return(ret);
+}
 
-int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
+/**
+ * oufs_format_disk(), with the trace tag set by the caller
+ */
+static int format_disk(char  *virtual_disk_name, char *pipe_name_base)
 {
+    // Where new directories get their blocks (OUFS_ALLOCATION; "front" if
+    //  not set)
+    char *allocation = getenv("OUFS_ALLOCATION");
+    int policy = allocation == NULL ? OUFS_ALLOC_FRONT : oufs_alloc_policy(allocation);
+    if(policy < 0) {
+        fprintf(stderr, "oufs_format_disk: unknown allocation policy %s\n", allocation);
+        return(-1);
+    }
+    // One free list, or one per block group (OUFS_LAYOUT; "list" if not set)
+    char *layout_name = getenv("OUFS_LAYOUT");
+    int layout = LAYOUT_LIST;
+    if(layout_name != NULL && strcmp(layout_name, "groups") == 0) {
+        layout = LAYOUT_GROUPS;
+    }else if(layout_name != NULL && strcmp(layout_name, "list") != 0) {
+        fprintf(stderr, "oufs_format_disk: unknown layout %s\n", layout_name);
+        return(-1);
+    }
+    
     // Attach to the virtual disk
-    if(virtual_disk_attach(virtual_disk_name, pipe_name_base) != 0) {
+    OUFS_MOUNT *mount = oufs_mount(virtual_disk_name, pipe_name_base);
+    if(mount == NULL) {
+        return(-1);
+    }
+    if(oufs_cache_lock(mount) != 0) {
+        oufs_unmount(mount);
         return(-1);
     }
     
     BLOCK block;
     
-    // Zero out the block
+    // Zero out the inode blocks (the others are all written below)
     memset(&block, 0, BLOCK_SIZE);
-    for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
-        if(virtual_disk_write_block(i, &block) < 0) {
+    for(BLOCK_REFERENCE i = 1; i <= N_INODE_BLOCKS; ++i) {
+        if(oufs_write_block(mount, i, &block) < 0) {
+            oufs_unmount(mount);
             return(-2);
         }
     }
@@ -103,9 +220,26 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
     // configure front and end references
     block.content.master.unallocated_front = N_INODE_BLOCKS+2; // this will be block #6
     block.content.master.unallocated_end = N_BLOCKS-1;    // will be block # 127
+    block.content.master.allocation_policy = policy;
+    block.content.master.layout = layout;
+    if(layout == LAYOUT_GROUPS) {
+        // Each group's free blocks, in order, make up its own list
+        unsigned char is_free[N_BLOCKS];
+        for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i)
+            is_free[i] = i >= N_INODE_BLOCKS+2;
+        block.content.master.unallocated_front = UNALLOCATED_BLOCK;
+        block.content.master.unallocated_end = UNALLOCATED_BLOCK;
+        for(int g = 0; g < N_GROUPS; ++g) {
+            BLOCK_REFERENCE first = g * N_BLOCKS_PER_GROUP;
+            block.content.master.group[g].unallocated_front = first > N_INODE_BLOCKS+2 ? first : N_INODE_BLOCKS+2;
+            block.content.master.group[g].unallocated_end = first + N_BLOCKS_PER_GROUP - 1;
+        }
+        oufs_master_recount(&block.content.master, is_free);
+    }
     // write master block to virtual disk
-    if (virtual_disk_write_block(0, &block)<0)
+    if (oufs_write_block(mount, 0, &block)<0)
     {
+        oufs_unmount(mount);
         return -2;
     }
     
@@ -120,14 +254,16 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
                                    ROOT_DIRECTORY_INODE, ROOT_DIRECTORY_INODE);
     
     // Write the results to the disk
-    if(oufs_write_inode_by_reference(0, &inode) != 0)
+    if(oufs_write_inode_by_reference(mount, 0, &inode) != 0)
     {
+        oufs_unmount(mount);
         return(-3);
     }
     
     // write the directory block to disk
-    if (virtual_disk_write_block(ROOT_DIRECTORY_BLOCK, &block)<0)
+    if (oufs_write_block(mount, ROOT_DIRECTORY_BLOCK, &block)<0)
     {
+        oufs_unmount(mount);
         return -2;
     }
     
@@ -137,24 +273,80 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
     for (BLOCK_REFERENCE i=6; i<N_BLOCKS; i++)
     {
         memset(&block, 0, BLOCK_SIZE);
-        if (i == 127)
+        if (i == 127 || (layout == LAYOUT_GROUPS && (i+1) % N_BLOCKS_PER_GROUP == 0))
         {
             block.next_block = UNALLOCATED_BLOCK;
         }
         else
             block.next_block = i+1;
         // Write each block to the virtual disk
-        if (virtual_disk_write_block(i, &block)<0)
+        if (oufs_write_block(mount, i, &block)<0)
         {
+            oufs_unmount(mount);
             return -2;
         }
     }
+    
+    //////////////////////////////
+    // Empty metadata journal
+    if (virtual_disk_create_journal(mount->disk) != 0)
+    {
+        oufs_unmount(mount);
+        return -4;
+    }
+    
+    //////////////////////////////
+    // Block checksums (unless OUFS_CHECKSUMS=0)
+    char *checksums = getenv("OUFS_CHECKSUMS");
+    int enable = checksums == NULL || strcmp(checksums, "0") != 0;
+    if (virtual_disk_create_checksums(mount->disk, enable) != 0)
+    {
+        oufs_unmount(mount);
+        return -4;
+    }
+    
+    //////////////////////////////
+    // The free blocks take no space on the host: the image is sparse
+    if (oufs_discard_free_blocks(mount, 0) < 0)
+    {
+        oufs_unmount(mount);
+        return -4;
+    }
     // Done
-    virtual_disk_detach();
+    if (oufs_unmount(mount) != 0)
+    {
+        return -2;
+    }
     
     return(0);
 }
 
+/**
+ * Completely format the virtual disk (including creation of the space).
+ *
+ * NOTE: this function mounts the virtual disk at the beginning and
+ *  unmounts after the format is complete.
+ *
+ * - Zero out the inode blocks.
+ * - Initialize the master block: mark inode 0 as allocated, initialize
+ *    the linked list of free blocks (one per block group with
+ *    OUFS_LAYOUT=groups) and record the allocation policy
+ * - Initialize root directory inode
+ * - Initialize the root directory in block ROOT_DIRECTORY_BLOCK
+ *
+ * @return 0 if no errors
+ *         -x if an error has occurred.
+ *
+ */
+
+int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_FORMAT);
+    int ret = format_disk(virtual_disk_name, pipe_name_base);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
 /*
  * Compare two inodes for sorting, handling the
  *  cases where the inodes are not valid
@@ -217,45 +409,37 @@ static int inode_compare_to(const void *d1, const void *d2)
 
 
 /**
- * Print out the specified file (if it exists) or the contents of the
- *   specified directory (if it exists)
- *
- * If a directory is listed, then the valid contents are printed in sorted order
- *   (as defined by strcmp()), one per line.  We know that a directory entry is
- *   valid if the inode_reference is not UNALLOCATED_INODE.
- *   Hint: qsort() will do the sort for you.  You just have to provide a compareTo()
- *   function (just like in Java!)
- *   Note: if an entry is a directory itself, then its name must be followed by "/"
- *
- * @param cwd Absolute path representing the current working directory
- * @param path Absolute or relative path to the file/directory
- * @return 0 if success
- *         -x if error
- *
+ * oufs_list(), with the trace tag set by the caller
  */
-
-int oufs_list(char *cwd, char *path)
+static int list_path(OUFS_MOUNT *mount, char *cwd, char *path)
 {
     INODE_REFERENCE parent;
     INODE_REFERENCE child;
     
     // Look up the inodes for the parent and child
-    int ret = oufs_find_file(cwd, path, &parent, &child, NULL);
+    int ret = oufs_find_file(mount, cwd, path, &parent, &child, NULL);
     
     // Did we find the specified file?
     if(ret == 0 && child != UNALLOCATED_INODE) {
-        // Element found: read the inode
+        // Element found: read the inode and its block as they were at one
+        //  moment (without locking them)
         INODE inode;
-        if(oufs_read_inode_by_reference(child, &inode) != 0) {
-            return(-1);
-        }
-        if(debug)
+        BLOCK b;
+        unsigned int seq;
+        do {
+            seq = oufs_read_begin(mount, child);
+            if(oufs_read_inode_by_reference(mount, child, &inode) != 0) {
+                return(-1);
+            }
+            memset(&b, 0, sizeof(BLOCK));
+            if(oufs_read_block(mount, inode.content, &b) != 0) {
+                return(-1);
+            }
+        } while(oufs_read_retry(mount, child, seq));
+        if(mount->debug)
             fprintf(stderr, "\tDEBUG: Child found (type=%s).\n",  INODE_TYPE_NAME[inode.type]);
         
         // TODO: complete implementation
-        BLOCK b;
-        memset(&b, 0, sizeof(BLOCK));
-        virtual_disk_read_block(inode.content, &b);
         // Have the child inode
         // check if it is a directory or a file inode
         if (inode.type == DIRECTORY_TYPE)
@@ -270,7 +454,7 @@ int oufs_list(char *cwd, char *path)
                     // TODO: STill need to check if the entry is a directory and if so, add a / to the end
                     // TODO: check if I can write over the inode at this point
                     // check to see if inode_reference of the entry is a directory or not
-                    oufs_read_inode_by_reference(b.content.directory.entry[i].inode_reference, &inode);
+                    oufs_read_inode_by_reference(mount, b.content.directory.entry[i].inode_reference, &inode);
                     if (inode.type == DIRECTORY_TYPE)
                     {
                         // add a slash to the directory name
@@ -299,24 +483,23 @@ int oufs_list(char *cwd, char *path)
     {
         // Did not find the specified file/directory
         fprintf(stderr, "Not found\n");
-        if(debug)
+        if(mount->debug)
             fprintf(stderr, "\tDEBUG: (%d)\n", ret);
     }
     // Done: return the status from the search
     return(ret);
 }
 
-
-
-
-///////////////////////////////////
 /**
- * Make a new directory
+ * Print out the specified file (if it exists) or the contents of the
+ *   specified directory (if it exists)
  *
- * To be successful:
- *  - the parent must exist and be a directory
- *  - the parent must have space for the new directory
- *  - the child must not exist
+ * If a directory is listed, then the valid contents are printed in sorted order
+ *   (as defined by strcmp()), one per line.  We know that a directory entry is
+ *   valid if the inode_reference is not UNALLOCATED_INODE.
+ *   Hint: qsort() will do the sort for you.  You just have to provide a compareTo()
+ *   function (just like in Java!)
+ *   Note: if an entry is a directory itself, then its name must be followed by "/"
  *
  * @param cwd Absolute path representing the current working directory
  * @param path Absolute or relative path to the file/directory
@@ -324,7 +507,23 @@ int oufs_list(char *cwd, char *path)
  *         -x if error
  *
  */
-int oufs_mkdir(char *cwd, char *path)
+
+int oufs_list(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_LIST);
+    int ret = list_path(mount, cwd, path);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+
+
+
+///////////////////////////////////
+/**
+ * oufs_mkdir(), with the trace tag set by the caller
+ */
+static int make_directory(OUFS_MOUNT *mount, char *cwd, char *path)
 {
     INODE_REFERENCE parent;
     INODE_REFERENCE child;
@@ -333,23 +532,56 @@ int oufs_mkdir(char *cwd, char *path)
     char local_name[MAX_PATH_LENGTH];
     int ret;
     
-    // Attempt to find the specified directory
-    if((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
-        if(debug)
-            fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
+    // Everything below is read to be changed: no other process may write
+    if(oufs_cache_lock(mount) != 0)
         return(-1);
-    };
-    // CHILD MUST NOT EXIST!??!
-    // TODO: complete implementation
     
-    fprintf(stderr, "\nlocal_name is  = %s\n", local_name);
+    for (;;)
+    {
+        // Attempt to find the specified directory
+        if((ret = oufs_find_file(mount, cwd, path, &parent, &child, local_name)) < -1) {
+            if(mount->debug)
+                fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
+            return(-1);
+        };
+        // CHILD MUST NOT EXIST!??!
+        // TODO: complete implementation
+        
+        fprintf(stderr, "\nlocal_name is  = %s\n", local_name);
+        // Nobody else may change the parent until the new entry is in place
+        pthread_rwlock_wrlock(&mount->inode_lock[parent]);
+        
+        // The parent was found without the lock: it may have been removed and
+        //  its inode reused elsewhere.  Now that it cannot be removed, the path
+        //  must still lead to it
+        INODE_REFERENCE again;
+        if (oufs_find_file(mount, cwd, path, &again, &child, local_name) >= -1 && again == parent)
+            break;
+        pthread_rwlock_unlock(&mount->inode_lock[parent]);
+        sched_yield();
+    }
+    // All of the block writes below are one atomic update
+    virtual_disk_begin_transaction(mount->disk);
+    oufs_write_begin(mount, parent);
     // parent inode and block
     INODE parentinode;
-    oufs_read_inode_by_reference(parent, &parentinode);
+    oufs_read_inode_by_reference(mount, parent, &parentinode);
     
     BLOCK pblock;
     // TODO: Is this read in right spot?
-    virtual_disk_read_block(parentinode.content, &pblock);
+    oufs_read_block(mount, parentinode.content, &pblock);
+    
+    // The lookup was done without the lock: the parent may have been removed,
+    //  or the same name created, in the meantime
+    if (parentinode.type != DIRECTORY_TYPE
+        || oufs_find_directory_element(mount, &parentinode, local_name) != UNALLOCATED_INODE)
+    {
+        fprintf(stderr, "oufs_mkdir(): %s already exists or its parent is gone\n", local_name);
+        oufs_write_end(mount, parent);
+        virtual_disk_end_transaction(mount->disk);
+        pthread_rwlock_unlock(&mount->inode_lock[parent]);
+        return (-1);
+    }
     
     
     // add to parent directory and increment size
@@ -360,10 +592,13 @@ int oufs_mkdir(char *cwd, char *path)
         if (pblock.content.directory.entry[i].inode_reference == UNALLOCATED_INODE)
         {
             fprintf(stderr, "allocating directory on inode: %d\n", parent);
-            child = oufs_allocate_new_directory(parent);
+            child = oufs_allocate_new_directory(mount, parent);
             if (child == UNALLOCATED_INODE)
             {
                 fprintf(stderr, "oufs_mkdir(): got UNALLOCATED_INODE calling allocate_new_dir");
+                oufs_write_end(mount, parent);
+                virtual_disk_end_transaction(mount->disk);
+                pthread_rwlock_unlock(&mount->inode_lock[parent]);
                 return (-3);
             }
             // TODO: local_name?????
@@ -373,61 +608,125 @@ int oufs_mkdir(char *cwd, char *path)
             strcpy(pblock.content.directory.entry[i].name, local_name);
             parentinode.size++;
             // write parent directory block and inode back to disk
-            virtual_disk_write_block(parentinode.content, &pblock);
-            oufs_write_inode_by_reference(parent, &parentinode);
+            oufs_write_block(mount, parentinode.content, &pblock);
+            oufs_write_inode_by_reference(mount, parent, &parentinode);
+            oufs_write_end(mount, parent);
+            virtual_disk_end_transaction(mount->disk);
+            pthread_rwlock_unlock(&mount->inode_lock[parent]);
             return 0;
         }
     }
     // no space to store directory if it hits this point
     fprintf(stderr, "No space in directory to store new entry");
+    oufs_write_end(mount, parent);
+    virtual_disk_end_transaction(mount->disk);
+    pthread_rwlock_unlock(&mount->inode_lock[parent]);
     return (-2);
 }
 
 /**
- * Remove a directory
+ * Make a new directory
  *
- * To be successul:
- *  - The directory must exist and must be empty
- *  - The directory must not be . or ..
- *  - The directory must not be /
+ * To be successful:
+ *  - the parent must exist and be a directory
+ *  - the parent must have space for the new directory
+ *  - the child must not exist
  *
  * @param cwd Absolute path representing the current working directory
- * @param path Abslute or relative path to the file/directory
+ * @param path Absolute or relative path to the file/directory
  * @return 0 if success
  *         -x if error
  *
  */
-int oufs_rmdir(char *cwd, char *path)
+int oufs_mkdir(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_MKDIR);
+    int ret = make_directory(mount, cwd, path);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+/**
+ * Find a directory that is to be removed and lock it and its parent for
+ *   writing (the parent first)
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path to the directory
+ * @param parent Set to the parent's inode
+ * @param child Set to the directory's inode
+ * @param local_name Set to the directory's name within the parent
+ * @return 0 if both are locked
+ *         -x if error (nothing is locked)
+ */
+static int lock_for_removal(OUFS_MOUNT *mount, char *cwd, char *path, INODE_REFERENCE *parent,
+                            INODE_REFERENCE *child, char *local_name)
+{
+    for (;;)
+    {
+        // Try to find the inode of the child
+        int result = oufs_find_file(mount, cwd, path, parent, child, local_name);
+        if(result < -1) {
+            return(-4);
+        }
+        else if (result==-1)    // could not find child
+        {
+            return -1;
+        }
+        // TODO: complete implementation
+        // TODO: Will be error for: name does not exist, if its not a directory, if name is . or .., and if not an empty directory
+        // check to make sure name is not . or .. (or the root itself)
+        if (strcmp(local_name, ".") == 0 || strcmp(local_name, "..") == 0)
+            return -2;
+        if (*child == ROOT_DIRECTORY_INODE || *child == *parent)
+            return -2;
+        
+        // Lock parent then child; everything below is checked again under the
+        //  locks.  The lookup was not locked, so the child inode may since have
+        //  been reused above the parent: never wait for it while holding the parent
+        pthread_rwlock_wrlock(&mount->inode_lock[*parent]);
+        if (pthread_rwlock_trywrlock(&mount->inode_lock[*child]) == 0)
+            return 0;
+        pthread_rwlock_unlock(&mount->inode_lock[*parent]);
+        sched_yield();
+    }
+}
+
+/**
+ * oufs_rmdir(), with the trace tag set by the caller
+ */
+static int remove_directory(OUFS_MOUNT *mount, char *cwd, char *path)
 {
     INODE_REFERENCE parent;
     INODE_REFERENCE child;
     char local_name[MAX_PATH_LENGTH];
+    if(oufs_cache_lock(mount) != 0)
+        return(-1);
     
-    // Try to find the inode of the child
-    int result = oufs_find_file(cwd, path, &parent, &child, local_name);
-    if(result < -1) {
-        return(-4);
-    }
-    else if (result==-1)    // could not find child
-    {
-        return -1;
-    }
-    // TODO: complete implementation
-    // TODO: Will be error for: name does not exist, if its not a directory, if name is . or .., and if not an empty directory
+    int result = lock_for_removal(mount, cwd, path, &parent, &child, local_name);
+    if(result != 0)
+        return(result);
     
     //TODO: Remove the entry from the parent's directory block
     INODE pnode;
-    oufs_read_inode_by_reference(parent, &pnode);
+    oufs_read_inode_by_reference(mount, parent, &pnode);
     // error if type isn't directory type
     INODE cnode;
-    oufs_read_inode_by_reference(child, &cnode);
-    if (cnode.type != DIRECTORY_TYPE)
+    oufs_read_inode_by_reference(mount, child, &cnode);
+    if (pnode.type != DIRECTORY_TYPE || cnode.type != DIRECTORY_TYPE
+        || oufs_find_directory_element(mount, &pnode, local_name) != child)
     {
+        pthread_rwlock_unlock(&mount->inode_lock[child]);
+        pthread_rwlock_unlock(&mount->inode_lock[parent]);
         return -2;
     }
     
     BLOCK childdirectory;
-    virtual_disk_read_block(cnode.content, &childdirectory);
+    if (oufs_read_block(mount, cnode.content, &childdirectory) != 0)
+    {
+        pthread_rwlock_unlock(&mount->inode_lock[child]);
+        pthread_rwlock_unlock(&mount->inode_lock[parent]);
+        return -1;
+    }
     int count = 0;
     for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
     {
@@ -439,23 +738,21 @@ int oufs_rmdir(char *cwd, char *path)
     if (count > 2)
     {
         fprintf(stderr, "trying to remove non-empty directory\n");
+        pthread_rwlock_unlock(&mount->inode_lock[child]);
+        pthread_rwlock_unlock(&mount->inode_lock[parent]);
         return -3;
     }
-    // check to make sure name is not . or ..
-    if (strcmp(local_name, ".") == 0)
-        return -2;
-    if (strcmp(local_name, "..") == 0)
-        return -2;
     
         BLOCK directory;
-    virtual_disk_read_block(pnode.content, &directory);
+    oufs_read_block(mount, pnode.content, &directory);
     
     // TODO: check this this. seems weird
     for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
     {
         fprintf(stderr, "checking directory entry %d:%s\n", i, directory.content.directory.entry[i].name);
         // TODO: check this name check NOT SURE ABOUT THIS
-        if (strcmp(directory.content.directory.entry[i].name, local_name) == 0)
+        if (directory.content.directory.entry[i].inode_reference == child
+            && strcmp(directory.content.directory.entry[i].name, local_name) == 0)
         {
             directory.content.directory.entry[i].inode_reference = UNALLOCATED_INODE;
             // TODO: do i need to remove the name??
@@ -463,29 +760,364 @@ int oufs_rmdir(char *cwd, char *path)
             break;
         }
     }
+    // The inode is free again
+    cnode.type = UNUSED_TYPE;
+
+    //write blocks back to disk (as one atomic update)
+    virtual_disk_begin_transaction(mount->disk);
+    oufs_write_begin(mount, parent);
+    oufs_write_begin(mount, child);
+    pthread_mutex_lock(&mount->allocator_lock);
     BLOCK master;
-    virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    oufs_read_block(mount, MASTER_BLOCK_REFERENCE, &master);
     // change bit in master block's inode allocation table
-    int byte = child / 8;
-    int bit = 7 - (child % 8);
-    fprintf(stderr, "byte %d bit %d\n", byte, bit);
-    master.content.master.inode_allocated_flag[byte] = master.content.master.inode_allocated_flag[byte] ^ (1<<bit);
+    fprintf(stderr, "freeing inode %d\n", child);
+    oufs_master_set_inode(&master.content.master, child, 0);
+    
+    oufs_write_inode_by_reference(mount, child, &cnode);
+    oufs_write_block(mount, cnode.content, &childdirectory);
+    oufs_deallocate_block(mount, &master, cnode.content);
+    oufs_write_block(mount, MASTER_BLOCK_REFERENCE, &master);
+    pthread_mutex_unlock(&mount->allocator_lock);
+    oufs_write_block(mount, pnode.content, &directory);
+    oufs_write_inode_by_reference(mount, parent, &pnode);
+    oufs_write_end(mount, child);
+    oufs_write_end(mount, parent);
+    virtual_disk_end_transaction(mount->disk);
+    pthread_rwlock_unlock(&mount->inode_lock[child]);
+    pthread_rwlock_unlock(&mount->inode_lock[parent]);
     
+    // The space of the freed blocks goes back to the host in batches
+    oufs_discard_free_blocks(mount, OUFS_DISCARD_BATCH);
     
-    //if(cnode.size==2)
-    //    cnode.type= UNUSED_TYPE;
+    // Success
+    return(0);
+}
 
-    //write blocks back to disk
+/**
+ * Remove a directory
+ *
+ * To be successul:
+ *  - The directory must exist and must be empty
+ *  - The directory must not be . or ..
+ *  - The directory must not be /
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Abslute or relative path to the file/directory
+ * @return 0 if success
+ *         -x if error
+ *
+ */
+int oufs_rmdir(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_RMDIR);
+    int ret = remove_directory(mount, cwd, path);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+/**
+ * Look up a name in a directory without locking it
+ *
+ * @param dir Directory inode
+ * @param name Name to look up
+ * @param type Set to the type of what was found
+ * @return The inode found; UNALLOCATED_INODE if there is none
+ *         -1 if dir is not a directory
+ */
+static int lookup(OUFS_MOUNT *mount, INODE_REFERENCE dir, char *name, INODE_TYPE *type)
+{
+    INODE inode;
+    int found;
+    unsigned int seq;
+    do {
+        seq = oufs_read_begin(mount, dir);
+        oufs_read_inode_by_reference(mount, dir, &inode);
+        found = oufs_find_directory_element(mount, &inode, name);
+    } while(oufs_read_retry(mount, dir, seq));
+    if (found >= 0 && found < N_INODES)
+    {
+        oufs_read_inode_by_reference(mount, found, &inode);
+        *type = inode.type;
+    }
+    return found;
+}
+
+/**
+ * Follow names from the root for as long as they exist
+ *
+ * @param name The names along the path
+ * @param n Number of names
+ * @param dir Set to the deepest directory found
+ * @return number of names found
+ *         -1 if one of them is not a directory
+ */
+static int walk_names(OUFS_MOUNT *mount, char **name, int n, INODE_REFERENCE *dir)
+{
+    *dir = ROOT_DIRECTORY_INODE;
+    for (int k = 0; k < n; k++)
+    {
+        INODE_TYPE type = UNUSED_TYPE;
+        int found = lookup(mount, *dir, name[k], &type);
+        if (found == UNALLOCATED_INODE)
+            return k;
+        if (found < 0 || found >= N_INODES || type != DIRECTORY_TYPE)
+        {
+            fprintf(stderr, "oufs_mkdir_parents(): %s is not a directory\n", name[k]);
+            return -1;
+        }
+        *dir = found;
+    }
+    return n;
+}
+
+/**
+ * oufs_mkdir_parents(), with the trace tag set by the caller
+ */
+static int make_directory_parents(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    char full_path[2 * MAX_PATH_LENGTH + 2];
+    char *name[MAX_PATH_LENGTH];
+    int n = 0;
     
-    oufs_write_inode_by_reference(child, &cnode);
-    virtual_disk_write_block(cnode.content, &childdirectory);
-    oufs_deallocate_block(&master, cnode.content);
-    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-    virtual_disk_write_block(pnode.content, &directory);
-    oufs_write_inode_by_reference(parent, &pnode);
+    if(oufs_cache_lock(mount) != 0)
+        return(-1);
     
+    // The names along the path (cut to the length that fits an entry)
+    snprintf(full_path, sizeof(full_path), "%s/%s", path[0] == '/' ? "" : cwd, path);
+    char *save_ptr;
+    for (char *s = strtok_r(full_path, "/", &save_ptr); s != NULL && n < MAX_PATH_LENGTH;
+         s = strtok_r(NULL, "/", &save_ptr))
+    {
+        if (strlen(s) >= FILE_NAME_SIZE - 1)
+            s[FILE_NAME_SIZE - 1] = 0;
+        name[n++] = s;
+    }
     
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if (update == NULL)
+        return(-1);
     
-    // Success
-    return(0);
+    for (;;)
+    {
+        // The deepest directory along the path that exists already
+        INODE_REFERENCE dir;
+        int k = walk_names(mount, name, n, &dir);
+        if (k < 0)
+        {
+            free(update);
+            return(-2);
+        }
+        if (k == n)
+        {
+            free(update);
+            return(0);
+        }
+        
+        // Check again under the lock: the rest of the path may have been
+        //  started in the meantime, or the directory removed (and its inode
+        //  reused elsewhere, so the path must still lead to it)
+        pthread_rwlock_wrlock(&mount->inode_lock[dir]);
+        INODE_REFERENCE again;
+        if (walk_names(mount, name, k, &again) != k || again != dir)
+        {
+            pthread_rwlock_unlock(&mount->inode_lock[dir]);
+            sched_yield();
+            continue;
+        }
+        INODE inode;
+        oufs_read_inode_by_reference(mount, dir, &inode);
+        if (inode.type != DIRECTORY_TYPE)
+        {
+            pthread_rwlock_unlock(&mount->inode_lock[dir]);
+            free(update);
+            return(-1);
+        }
+        if (oufs_find_directory_element(mount, &inode, name[k]) != UNALLOCATED_INODE)
+        {
+            pthread_rwlock_unlock(&mount->inode_lock[dir]);
+            continue;
+        }
+        
+        // Nobody can see the new directories until dir has its entry, so
+        //  dir is the only one that needs its lock
+        virtual_disk_begin_transaction(mount->disk);
+        oufs_write_begin(mount, dir);
+        oufs_lock_allocation(mount);
+        oufs_update_init(update);
+        int ret = 0;
+        for (INODE_REFERENCE parent = dir; k < n; k++)
+        {
+            INODE_REFERENCE child = oufs_update_allocate_directory(mount, update, parent);
+            if (child == UNALLOCATED_INODE)
+            {
+                ret = -3;
+                break;
+            }
+            if (oufs_update_add_entry(mount, update, parent, name[k], child) != 0)
+            {
+                ret = -2;
+                break;
+            }
+            parent = child;
+        }
+        // Nothing has been written if something was missing
+        if (ret == 0 && oufs_update_write(mount, update) != 0)
+            ret = -1;
+        oufs_unlock_allocation(mount);
+        oufs_write_end(mount, dir);
+        virtual_disk_end_transaction(mount->disk);
+        pthread_rwlock_unlock(&mount->inode_lock[dir]);
+        free(update);
+        return(ret);
+    }
+}
+
+/**
+ * Make a directory and any of its parents that do not exist yet
+ *
+ * The path is looked up once.  The new directories are built in memory
+ *  and written as one transaction, in which every block that changes
+ *  (the master block, the inode blocks, the directory blocks) is written
+ *  once.
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path to the directory
+ * @return 0 if success (including if the directory exists already)
+ *         -x if error
+ */
+int oufs_mkdir_parents(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_MKDIR);
+    int ret = make_directory_parents(mount, cwd, path);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+/**
+ * oufs_rmdir_recursive(), with the trace tag set by the caller
+ */
+static int remove_directory_recursive(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    INODE_REFERENCE parent;
+    INODE_REFERENCE subtree[N_INODES];
+    char local_name[MAX_PATH_LENGTH];
+    unsigned char seen[N_INODES];
+    int n = 1;
+    if(oufs_cache_lock(mount) != 0)
+        return(-1);
+    
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if (update == NULL)
+        return(-1);
+    int ret = lock_for_removal(mount, cwd, path, &parent, &subtree[0], local_name);
+    if (ret != 0)
+    {
+        free(update);
+        return(ret);
+    }
+    
+    // The lookup was not locked: check it again
+    oufs_update_init(update);
+    INODE pnode;
+    INODE cnode;
+    oufs_read_inode_by_reference(mount, parent, &pnode);
+    oufs_read_inode_by_reference(mount, subtree[0], &cnode);
+    if (pnode.type != DIRECTORY_TYPE || cnode.type != DIRECTORY_TYPE
+        || oufs_find_directory_element(mount, &pnode, local_name) != subtree[0])
+        ret = -2;
+    
+    // Everything below, each directory locked before its block is read.
+    //  An inode that is busy may be the parent of another removal that
+    //  looked it up before it was reused here: let go and start again.
+    for (int k = 0; k < n && ret == 0; k++)
+    {
+        if (k == 0)
+        {
+            memset(seen, 0, sizeof(seen));
+            seen[parent] = seen[subtree[0]] = 1;
+        }
+        INODE inode;
+        oufs_read_inode_by_reference(mount, subtree[k], &inode);
+        if (inode.type != DIRECTORY_TYPE)
+            continue;
+        BLOCK *b = oufs_update_block(mount, update, inode.content);
+        if (b == NULL)
+        {
+            ret = -1;
+            break;
+        }
+        for (int i = 2; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+        {
+            INODE_REFERENCE e = b->content.directory.entry[i].inode_reference;
+            if (e >= N_INODES || seen[e])
+                continue;
+            if (pthread_rwlock_trywrlock(&mount->inode_lock[e]) != 0)
+            {
+                while (n > 1)
+                    pthread_rwlock_unlock(&mount->inode_lock[subtree[--n]]);
+                oufs_update_init(update);
+                sched_yield();
+                k = -1;
+                break;
+            }
+            seen[e] = 1;
+            subtree[n++] = e;
+        }
+    }
+    
+    if (ret == 0)
+    {
+        virtual_disk_begin_transaction(mount->disk);
+        oufs_write_begin(mount, parent);
+        for (int k = 0; k < n; k++)
+            oufs_write_begin(mount, subtree[k]);
+        oufs_lock_allocation(mount);
+        if (oufs_update_remove_entry(mount, update, parent, local_name) != 0)
+            ret = -2;
+        for (int k = 0; k < n && ret == 0; k++)
+        {
+            if (oufs_update_free_inode(mount, update, subtree[k]) != 0)
+                ret = -1;
+        }
+        // Nothing has been written if something could not be read
+        if (ret == 0 && oufs_update_write(mount, update) != 0)
+            ret = -1;
+        oufs_unlock_allocation(mount);
+        for (int k = 0; k < n; k++)
+            oufs_write_end(mount, subtree[k]);
+        oufs_write_end(mount, parent);
+        virtual_disk_end_transaction(mount->disk);
+    }
+    
+    for (int k = n - 1; k >= 0; k--)
+        pthread_rwlock_unlock(&mount->inode_lock[subtree[k]]);
+    pthread_rwlock_unlock(&mount->inode_lock[parent]);
+    free(update);
+    
+    // The space of the freed blocks goes back to the host in batches
+    if (ret == 0)
+        oufs_discard_free_blocks(mount, OUFS_DISCARD_BATCH);
+    return(ret);
+}
+
+/**
+ * Remove a directory and everything below it
+ *
+ * Every directory of the subtree is locked, ancestors first.  The
+ *  entries, inodes, allocation flags and free block list are then
+ *  changed in memory and written as one transaction, in which every
+ *  block that changes is written once.
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path to the directory
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_rmdir_recursive(OUFS_MOUNT *mount, char *cwd, char *path)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_RMDIR);
+    int ret = remove_directory_recursive(mount, cwd, path);
+    virtual_disk_set_caller(caller);
+    return(ret);
 }
@@ -1,17 +1,89 @@
 #ifndef OUFS_LIB_H
 #define OUFS_LIB_H
+#include <stddef.h>
 #include "oufs.h"
 
 #define MAX_PATH_LENGTH 200
 
+// Bytes of file data in each block of a file.  The blocks of a file are
+//  linked through next_block; the padding that aligns the content of a
+//  BLOCK in memory is not part of the BLOCK_SIZE bytes on the disk.
+#define OUFS_FILE_BLOCK_DATA ((int)(BLOCK_SIZE - offsetof(BLOCK, content)))
+
+// A mounted OUFS disk (safe to share between threads)
+typedef struct oufs_mount_s OUFS_MOUNT;
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name, char *pipe_name_base);
 
+OUFS_MOUNT *oufs_mount(char *disk_name, char *pipe_name_base);
+int oufs_unmount(OUFS_MOUNT *mount);
+int oufs_flush(OUFS_MOUNT *mount);
+
 // PROJECT 3: to implement
 int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base);
-int oufs_mkdir(char *cwd, char *path);
-int oufs_list(char *cwd, char *path);
-int oufs_rmdir(char *cwd, char *path);
+int oufs_mkdir(OUFS_MOUNT *mount, char *cwd, char *path);
+int oufs_list(OUFS_MOUNT *mount, char *cwd, char *path);
+int oufs_rmdir(OUFS_MOUNT *mount, char *cwd, char *path);
+int oufs_mkdir_parents(OUFS_MOUNT *mount, char *cwd, char *path);
+int oufs_rmdir_recursive(OUFS_MOUNT *mount, char *cwd, char *path);
 
-#endif
+// Subtree walks (oufs_walk.c)
+typedef struct oufs_walk_entry_s
+{
+  // Full path and name within its directory
+  const char *path;
+  const char *name;
+
+  INODE_REFERENCE inode;
+  INODE_REFERENCE parent;
+
+  // 0 for the starting point
+  int depth;
+  INODE_TYPE type;
+  int size;
+} OUFS_WALK_ENTRY;
+
+// Called once for every entry, from several threads at once.  Returns 0
+//  to go on, 1 to skip the entries below a directory, -1 to stop the walk.
+typedef int (*OUFS_WALK_FN)(const OUFS_WALK_ENTRY *entry, void *arg);
+
+int oufs_walk(OUFS_MOUNT *mount, char *cwd, char *path, int threads,
+              OUFS_WALK_FN fn, void *arg);
+int oufs_walk_compare_paths(const char *a, const char *b);
 
+// Batches of operations (oufs_ops.c)
+typedef enum {OUFS_OP_MKDIR, OUFS_OP_RMDIR} OUFS_OP_TYPE;
+
+typedef struct oufs_op_s
+{
+  OUFS_OP_TYPE type;
+  // Absolute, or relative to the working directory of the batch
+  char *path;
+  // Set to what oufs_mkdir() or oufs_rmdir() returned
+  int result;
+} OUFS_OP;
+
+int oufs_run_ops(OUFS_MOUNT *mount, char *cwd, OUFS_OP *op, int n, int threads);
+
+// Whole trees at once (oufs_bulk.c)
+typedef struct oufs_tree_node_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_TYPE type;
+
+  // File contents
+  unsigned char *data;
+  unsigned int size;
+
+  // Directory contents
+  struct oufs_tree_node_s *child;
+  int n_children;
+} OUFS_TREE_NODE;
+
+int oufs_add_tree(OUFS_MOUNT *mount, char *cwd, char *path, OUFS_TREE_NODE *nodes, int n);
+int oufs_read_file(OUFS_MOUNT *mount, INODE_REFERENCE i, unsigned char *buf, unsigned int size);
+int oufs_build_image(OUFS_TREE_NODE *nodes, int n, unsigned char *image);
+int oufs_write_image(char *virtual_disk_name, char *pipe_name_base, unsigned char *image);
+
+#endif
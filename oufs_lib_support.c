@@ -8,15 +8,216 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
 #include "virtual_disk.h"
 #include "oufs_lib_support.h"
 
-extern int debug;
+/**
+ * Bring a set of blocks into the cache.  The reads go out together, so
+ *   the storage works on all of them at once.  Blocks that are already
+ *   cached are skipped.
+ *
+ * @param refs Blocks to load (at most OUFS_READAHEAD_MAX)
+ * @param n Number of blocks
+ */
+void oufs_prefetch_blocks(OUFS_MOUNT *mount, BLOCK_REFERENCE *refs, int n)
+{
+    VDISK_REQUEST request[OUFS_READAHEAD_MAX];
+    BLOCK block[OUFS_READAHEAD_MAX];
+    int started[OUFS_READAHEAD_MAX];
+    
+    for(int k = 0; k < n; ++k) {
+        BLOCK_REFERENCE ref = refs[k];
+        started[k] = ref < N_BLOCKS
+            && __atomic_load_n(&mount->cache->block[ref].seq, __ATOMIC_ACQUIRE) == 0
+            && virtual_disk_read_block_async(mount->disk, &request[k], ref, &block[k]) == 0;
+    }
+    virtual_disk_submit(mount->disk);
+    for(int k = 0; k < n; ++k) {
+        if(started[k] && virtual_disk_wait(mount->disk, &request[k]) == 0)
+            oufs_cache_fill(mount, &mount->cache->block[refs[k]], &block[k]);
+    }
+}
+
+/**
+ * Load the stripe around a block that has missed the cache, so that
+ *   every backing store works on its part at once
+ *
+ * @param block_ref Block that missed
+ */
+static void cache_readahead(OUFS_MOUNT *mount, BLOCK_REFERENCE block_ref)
+{
+    BLOCK_REFERENCE refs[OUFS_READAHEAD_MAX];
+    BLOCK_REFERENCE first = block_ref - block_ref % mount->readahead;
+    for(int k = 0; k < mount->readahead; ++k) {
+        refs[k] = first + k;
+    }
+    oufs_prefetch_blocks(mount, refs, mount->readahead);
+}
+
+/**
+ * Wait for a change in progress in the cache: a short spin (the writer
+ *   is usually done within a few copies), then yield the processor
+ *
+ * @param waits Times the caller has waited so far on this change
+ */
+static void cache_wait(OUFS_MOUNT *mount, unsigned long waits)
+{
+    if(waits < OUFS_CACHE_SPINS) {
+#if defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }else{
+        sched_yield();
+    }
+    // The writer may have died part way through
+    if(waits % OUFS_CACHE_WAITS == 0)
+        oufs_cache_check(mount);
+}
+
+/**
+ * Read a block through the mount's cache.  Never waits for a lock: a copy
+ *   that changes while it is taken is simply taken again.
+ *
+ * @param block_ref Block to read
+ * @param block Buffer for the contents
+ * @return 0 if success
+ *         -1 if the block reference is not valid or the disk read fails
+ */
+int oufs_read_block(OUFS_MOUNT *mount, BLOCK_REFERENCE block_ref, BLOCK *block)
+{
+    if(block_ref >= N_BLOCKS) {
+        fprintf(stderr, "oufs_read_block: bad block %d\n", block_ref);
+        return(-1);
+    }
+    OUFS_CACHED_BLOCK *c = &mount->cache->block[block_ref];
+    int read_ahead = 0;
+    unsigned long waits = 0;
+    for(;;) {
+        unsigned int seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        if(seq == 0 && mount->readahead > 0 && !read_ahead) {
+            // Bring in the stripe (this block too, unless that fails)
+            read_ahead = 1;
+            cache_readahead(mount, block_ref);
+            continue;
+        }
+        if(seq == 0) {
+            // First use: load from the disk (unless a writer gets there first)
+            if(virtual_disk_read_block(mount->disk, block_ref, block) != 0)
+                return(-1);
+            oufs_cache_fill(mount, c, block);
+            continue;
+        }
+        if(seq & 1) {
+            cache_wait(mount, ++waits);
+            continue;
+        }
+        memcpy(block, c->data, BLOCK_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq)
+            return(0);
+    }
+}
+
+/**
+ * Write a run of consecutive blocks that nothing refers to yet with a few
+ *   large writes (not journaled), and publish them to the cache
+ *
+ * @param first First block to write
+ * @param n Number of blocks
+ * @param blocks New contents, packed BLOCK_SIZE bytes apart
+ * @return 0 if success
+ *         -1 if the disk write fails
+ */
+int oufs_write_blocks(OUFS_MOUNT *mount, BLOCK_REFERENCE first, int n, unsigned char *blocks)
+{
+    if(virtual_disk_write_blocks(mount->disk, first, n, blocks) != 0)
+        return(-1);
+    for(int i = 0; i < n; ++i) {
+        BLOCK b;
+        memcpy(&b, blocks + i * BLOCK_SIZE, BLOCK_SIZE);
+        if(mount->cache_shared)
+            mount->cache->owner[first + i] = getpid();
+        oufs_cache_publish(&mount->cache->block[first + i], &b, 0);
+    }
+    return(0);
+}
+
+/**
+ * Write a block to the disk and publish it to the cache
+ *
+ * @param block_ref Block to write
+ * @param block New contents
+ * @return 0 if success
+ *         -1 if the disk write fails
+ */
+int oufs_write_block(OUFS_MOUNT *mount, BLOCK_REFERENCE block_ref, BLOCK *block)
+{
+    if(virtual_disk_write_block(mount->disk, block_ref, block) != 0)
+        return(-1);
+    // Until this process unmounts, the change may only be in the cache
+    if(mount->cache_shared)
+        mount->cache->owner[block_ref] = getpid();
+    oufs_cache_publish(&mount->cache->block[block_ref], block, 0);
+    return(0);
+}
+
+/**
+ * Start looking at a directory without locking it
+ *
+ * @param i Directory inode
+ * @return Version to hand to oufs_read_retry()
+ */
+unsigned int oufs_read_begin(OUFS_MOUNT *mount, INODE_REFERENCE i)
+{
+    unsigned int seq;
+    unsigned long waits = 0;
+    while((seq = __atomic_load_n(&mount->cache->inode_seq[i].seq, __ATOMIC_ACQUIRE)) & 1)
+        cache_wait(mount, ++waits);
+    return(seq);
+}
+
+/**
+ * Finish looking at a directory
+ *
+ * @param i Directory inode
+ * @param seq Version returned by oufs_read_begin()
+ * @return 1 if the directory changed in the meantime (look again); 0 if not
+ */
+int oufs_read_retry(OUFS_MOUNT *mount, INODE_REFERENCE i, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return(__atomic_load_n(&mount->cache->inode_seq[i].seq, __ATOMIC_RELAXED) != seq);
+}
+
+/**
+ * Start changing a directory.  The caller holds its inode lock for writing.
+ *
+ * @param i Directory inode
+ */
+void oufs_write_begin(OUFS_MOUNT *mount, INODE_REFERENCE i)
+{
+    unsigned int *seq = &mount->cache->inode_seq[i].seq;
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Done changing a directory
+ *
+ * @param i Directory inode
+ */
+void oufs_write_end(OUFS_MOUNT *mount, INODE_REFERENCE i)
+{
+    unsigned int *seq = &mount->cache->inode_seq[i].seq;
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
 
 /**
  * Deallocate a single block.
  * - Modify the in-memory copy of the master block
- * - Add the specified block to THE END of the free block linked list
+ * - Add the specified block to THE END of its free block linked list (the
+ *     master block's, or its group's)
  * - Modify the disk copy of the deallocated block: next_block points to
  *     UNALLOCATED_BLOCK
  *
@@ -27,41 +228,43 @@ extern int debug;
  * @param block_reference Reference to the block that is being deallocated
  *
  */
-int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference)
+int oufs_deallocate_block(OUFS_MOUNT *mount, BLOCK *master_block, BLOCK_REFERENCE block_reference)
 {
     BLOCK b;
+    MASTER_BLOCK *m = &master_block->content.master;
+    int list = oufs_free_list_of(m, block_reference);
     
-    if(master_block->content.master.unallocated_front == UNALLOCATED_BLOCK) {
+    if(*oufs_free_front(m, list) == UNALLOCATED_BLOCK) {
         // No blocks on the free list.  Both pointers point to this block now
-        master_block->content.master.unallocated_front = master_block->content.master.unallocated_end =
-        block_reference;
+        *oufs_free_front(m, list) = *oufs_free_end(m, list) = block_reference;
         fprintf(stderr, "Resetting master unallocated end and front to point to newly empty block.\n");
         
     }else{
         BLOCK prevEndBlock;
         BLOCK_REFERENCE prevEnd;
-        prevEnd = master_block->content.master.unallocated_end;
-        if(virtual_disk_read_block(prevEnd, &prevEndBlock) != 0) {
+        prevEnd = *oufs_free_end(m, list);
+        if(oufs_read_block(mount, prevEnd, &prevEndBlock) != 0) {
             fprintf(stderr, "deallocate_block: error reading old end block\n");
             return(-1);
         }
         
         prevEndBlock.next_block = block_reference;
         
-        if(virtual_disk_write_block(prevEnd, &prevEndBlock) != 0) {
+        if(oufs_write_block(mount, prevEnd, &prevEndBlock) != 0) {
             fprintf(stderr, "deallocate_block: error writing old end block\n");
             return(-1);
         }
         
-        master_block->content.master.unallocated_end = block_reference;
+        *oufs_free_end(m, list) = block_reference;
         
         fprintf(stderr, "Resetting master unallocated end to point to newly empty block.\n");
     }
+    oufs_master_count_block(m, block_reference, 1);
     
     //add block back to unallocated block list
     
     // Update the new end block
-    if(virtual_disk_read_block(block_reference, &b) != 0) {
+    if(oufs_read_block(mount, block_reference, &b) != 0) {
         fprintf(stderr, "deallocate_block: error reading new end block\n");
         return(-1);
     }
@@ -74,15 +277,60 @@ int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference)
     }
     
     // Write the block back
-    if(virtual_disk_write_block(block_reference, &b) != 0) {
+    if(oufs_write_block(mount, block_reference, &b) != 0) {
         fprintf(stderr, "deallocate_block: error writing new end block\n");
         return(-1);
     }
     
+    ++mount->freed;
     fprintf(stderr, "Writing block back to disk.\n");
     return(0);
 };
 
+/**
+ * Give the space of the free blocks back to the host, once at least
+ *   batch blocks have been freed through the mount since the last time
+ *   (see virtual_disk_discard_blocks()).  Each block keeps its link in the
+ *   free list.  Cached copies keep the old contents of the blocks; nothing
+ *   but the link of a free block is ever used.
+ *
+ * @param batch Blocks that must have been freed first (0: discard anyway)
+ * @return Number of blocks discarded
+ *         -1 if the free list cannot be read
+ */
+int oufs_discard_free_blocks(OUFS_MOUNT *mount, int batch)
+{
+    pthread_mutex_lock(&mount->allocator_lock);
+    if(batch > 0 && mount->freed < batch) {
+        pthread_mutex_unlock(&mount->allocator_lock);
+        return(0);
+    }
+
+    BLOCK master;
+    BLOCK block;
+    BLOCK_REFERENCE refs[N_BLOCKS];
+    int n = 0;
+    int ret = oufs_read_block(mount, MASTER_BLOCK_REFERENCE, &master);
+    for(int k = 0; ret == 0 && k < oufs_n_free_lists(&master.content.master); ++k) {
+        BLOCK_REFERENCE b = *oufs_free_front(&master.content.master, k);
+        while(b != UNALLOCATED_BLOCK) {
+            if(b >= N_BLOCKS || n == N_BLOCKS || oufs_read_block(mount, b, &block) != 0) {
+                fprintf(stderr, "oufs_discard_free_blocks: free list broken at block %d\n", b);
+                ret = -1;
+                break;
+            }
+            refs[n++] = b;
+            b = block.next_block;
+        }
+    }
+    if(ret == 0)
+        ret = virtual_disk_discard_blocks(mount->disk, refs, n);
+    if(ret >= 0)
+        mount->freed = 0;
+    pthread_mutex_unlock(&mount->allocator_lock);
+    return(ret);
+}
+
 
 /**
  *  Initialize an inode and a directory block structure as a new directory.
@@ -136,9 +384,9 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
  *         -1 = an error has occurred
  *
  */
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_read_inode_by_reference(OUFS_MOUNT *mount, INODE_REFERENCE i, INODE *inode)
 {
-    if(debug)
+    if(mount->debug)
         fprintf(stderr, "\tDEBUG: Fetching inode %d\n", i);
     
     // Find the address of the inode block and the inode within the block
@@ -147,7 +395,7 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
     
     // Load the block that contains the inode
     BLOCK b;
-    if(virtual_disk_read_block(block, &b) == 0) {
+    if(oufs_read_block(mount, block, &b) == 0) {
         // Successfully loaded the block: copy just this inode
         *inode = b.content.inodes.inode[element];
         return(0);
@@ -166,9 +414,9 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
  *         -x if error
  *
  */
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_write_inode_by_reference(OUFS_MOUNT *mount, INODE_REFERENCE i, INODE *inode)
 {
-    if(debug)
+    if(mount->debug)
         fprintf(stderr, "\tDEBUG: Writing inode %d\n", i);
     
     // TODO:
@@ -177,8 +425,11 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
     
     BLOCK tempBlock;
     memset(&tempBlock, 0, BLOCK_SIZE);
+    // Other inodes share this block: no other read-modify-write in between
+    pthread_mutex_lock(&mount->inode_block_lock[b - 1]);
     // read the block from disk to tempBlock
-    if(virtual_disk_read_block(b, &tempBlock) != 0) {
+    if(oufs_read_block(mount, b, &tempBlock) != 0) {
+        pthread_mutex_unlock(&mount->inode_block_lock[b - 1]);
         fprintf(stderr, "deallocate_block: error reading inode block\n");
         return(-1);
     }
@@ -186,10 +437,12 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
     tempBlock.content.inodes.inode[element] = *inode;
     
     // Write the block back
-    if(virtual_disk_write_block(b, &tempBlock) != 0) {
+    if(oufs_write_block(mount, b, &tempBlock) != 0) {
+        pthread_mutex_unlock(&mount->inode_block_lock[b - 1]);
         fprintf(stderr, "deallocate_block: error writing inode block\n");
         return(-1);
     }
+    pthread_mutex_unlock(&mount->inode_block_lock[b - 1]);
     
     // Success
     return(0);
@@ -227,9 +480,9 @@ void oufs_set_inode(INODE *inode, INODE_TYPE type, int n_references,
  * @return = INODE_REFERENCE for the sub-item if found; UNALLOCATED_INODE if not found
  */
 
-int oufs_find_directory_element(INODE *inode, char *element_name)
+int oufs_find_directory_element(OUFS_MOUNT *mount, INODE *inode, char *element_name)
 {
-    if(debug)
+    if(mount->debug)
         fprintf(stderr,"\tDEBUG: oufs_find_directory_element: %s\n", element_name);
     
     // TODO
@@ -238,7 +491,7 @@ int oufs_find_directory_element(INODE *inode, char *element_name)
     {
         BLOCK b;
         memset(&b, 0, sizeof(BLOCK));
-        virtual_disk_read_block(inode->content, &b);
+        oufs_read_block(mount, inode->content, &b);
         for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
         {
             if(strcmp(b.content.directory.entry[i].name, element_name) == 0)
@@ -270,7 +523,7 @@ int oufs_find_directory_element(INODE *inode, char *element_name)
  *         -x if an error
  *
  */
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child,
+int oufs_find_file(OUFS_MOUNT *mount, char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child,
                    char *local_name)
 {
     INODE_REFERENCE grandparent;
@@ -290,23 +543,24 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
         }
     }
     
-    if(debug) {
+    if(mount->debug) {
         fprintf(stderr, "\tDEBUG: Full path: %s\n", full_path);
     };
     
     // Start scanning from the root directory
     grandparent = *parent = *child = 0;
-    if(debug)
+    if(mount->debug)
         fprintf(stderr, "\tDEBUG: Start search: %d\n", *parent);
     
     // Parse the full path
     char *directory_name;
-    directory_name = strtok(full_path, "/");
+    char *save_ptr;
+    directory_name = strtok_r(full_path, "/", &save_ptr);
     while(directory_name != NULL) {
         if(strlen(directory_name) >= FILE_NAME_SIZE-1)
             // Truncate the name
             directory_name[FILE_NAME_SIZE - 1] = 0;
-        if(debug){
+        if(mount->debug){
             fprintf(stderr, "\tDEBUG: Searching Directory: %s\n", directory_name);
         }
         // TODO: finish
@@ -314,12 +568,20 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
         INODE start;
         BLOCK b;
         memset(&b, 0, sizeof(BLOCK));
-        oufs_read_inode_by_reference(*child, &start);
-        INODE_REFERENCE temp = (INODE_REFERENCE)oufs_find_directory_element(&start, directory_name);
+        // Scan the directory as it was at one moment (without locking it)
+        INODE_REFERENCE temp;
+        unsigned int seq;
+        do {
+            seq = oufs_read_begin(mount, *child);
+            oufs_read_inode_by_reference(mount, *child, &start);
+            temp = (INODE_REFERENCE)oufs_find_directory_element(mount, &start, directory_name);
+        } while(oufs_read_retry(mount, *child, seq));
         if ((int)temp == -1)
         {
-            // inode is a file
+            // inode is a file: nothing can be below it
             fprintf(stderr, "\tThis is a file not a directory\n");
+            *child = UNALLOCATED_INODE;
+            return (-2);
         }
         else if (temp != UNALLOCATED_INODE) 
         {
@@ -330,7 +592,7 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
             
             if(local_name!=NULL)
                 strcpy(local_name, directory_name);
-            directory_name = strtok(NULL, "/");
+            directory_name = strtok_r(NULL, "/", &save_ptr);
             if(directory_name!=NULL)
                 *parent = temp;
         }
@@ -357,7 +619,7 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
         *parent = grandparent;
     }
                                 */
-    if(debug) {
+    if(mount->debug) {
         fprintf(stderr, "\tDEBUG: Found: parent %d, child %d\n", *parent, *child);
     }
     // Success!
@@ -403,83 +665,281 @@ int oufs_find_open_bit(unsigned char value)
 }
 
 /**
- *  Allocate a new directory (an inode and block to contain the directory).  This
- *  includes initialization of the new directory.
+ *  Allocate a new directory (an inode, and a block where the disk's
+ *  allocation policy says) and initialize it.  The thread's reservations
+ *  are used first: then only the new inode and block are written.
+ *  Otherwise it is one update; allocations (and deallocations) are
+ *  serialized on the mount.
  *
  * @param parent_reference The inode of the parent directory
  * @return The inode reference of the new directory
  *         UNALLOCATED_INODE if we cannot allocate the directory
  */
-int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
+int oufs_allocate_new_directory(OUFS_MOUNT *mount, INODE_REFERENCE parent_reference)
 {
-    BLOCK block;
-    BLOCK block2;
-    // Read the master block
-    if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &block) != 0) {
-        // Read error
+    INODE parent;
+    INODE_REFERENCE i;
+    BLOCK_REFERENCE block_ref;
+    if(oufs_read_inode_by_reference(mount, parent_reference, &parent) == 0
+       && oufs_reserve_take(mount, parent.content, &i, &block_ref) == 0) {
+        // Nobody else has the inode or the block
+        INODE inode;
+        BLOCK block;
+        memset(&block, 0, BLOCK_SIZE);
+        oufs_init_directory_structures(&inode, &block, block_ref, i, parent_reference);
+        if(oufs_write_block(mount, block_ref, &block) != 0
+           || oufs_write_inode_by_reference(mount, i, &inode) != 0)
+            return(UNALLOCATED_INODE);
+        return(i);
+    }
+
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if(update == NULL) {
+        fprintf(stderr, "oufs_allocate_new_directory: out of memory\n");
         return(UNALLOCATED_INODE);
     }
-    // TODO
-    INODE_REFERENCE newdir = UNALLOCATED_INODE;
-    int byte = -1;
-    int bit = -1;
-    
-    //FIXME: this looping is wrong. uses already used inodes
-    for (int i=0; i<N_INODES; i++)
-    {
-        // TODO: double check all this
-        byte = i/8;
-        // TODO: must make sure find_open_bit works for this function to work
-        //fprintf(stderr, "before find_open_bit in allocate_new_dir line 403");
-        bit = oufs_find_open_bit(block.content.master.inode_allocated_flag[byte]);
-        fprintf(stderr, "\n bit is %d \n", bit);
-        if (bit != -1)
-        {
-            // INODE REFERENCE may be j*8 + (7-i)
-            newdir = (INODE_REFERENCE)((7-bit) +(i));
-            fprintf(stderr, "\n i is %d \n", i);
-            fprintf(stderr, "\n newdir is %d \n", newdir);
-            // TODO: make sure this shift works correctly
-            
-            block.content.master.inode_allocated_flag[byte] = (block.content.master.inode_allocated_flag[byte] | (1<<bit) );
-            break;
+    oufs_lock_allocation(mount);
+    oufs_update_init(update);
+    INODE_REFERENCE newdir = oufs_update_allocate_directory(mount, update, parent_reference);
+    if(newdir != UNALLOCATED_INODE && oufs_update_write(mount, update) != 0)
+        newdir = UNALLOCATED_INODE;
+    oufs_unlock_allocation(mount);
+    free(update);
+    return newdir;
+}
+
+/**
+ * Take the allocator lock and every inode block lock, for an update that
+ *   allocates or releases many inodes
+ */
+void oufs_lock_allocation(OUFS_MOUNT *mount)
+{
+    pthread_mutex_lock(&mount->allocator_lock);
+    for(int i = 0; i < N_INODE_BLOCKS; ++i)
+        pthread_mutex_lock(&mount->inode_block_lock[i]);
+}
+
+void oufs_unlock_allocation(OUFS_MOUNT *mount)
+{
+    for(int i = N_INODE_BLOCKS - 1; i >= 0; --i)
+        pthread_mutex_unlock(&mount->inode_block_lock[i]);
+    pthread_mutex_unlock(&mount->allocator_lock);
+}
+
+/**
+ * Start an update that changes many blocks at once.  Blocks are read
+ *   into the update the first time they are used and written back, each
+ *   once, by oufs_update_write().  The caller holds the locks of
+ *   everything it is going to change.
+ */
+void oufs_update_init(OUFS_UPDATE *update)
+{
+    memset(update->loaded, 0, sizeof(update->loaded));
+    memset(update->dirty, 0, sizeof(update->dirty));
+}
+
+/**
+ * A block as the update sees it
+ *
+ * @param block_ref Block to look at
+ * @return The update's copy; NULL if the block cannot be read
+ */
+BLOCK *oufs_update_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref)
+{
+    if(block_ref >= N_BLOCKS)
+        return(NULL);
+    if(!update->loaded[block_ref]) {
+        if(oufs_read_block(mount, block_ref, &update->block[block_ref]) != 0)
+            return(NULL);
+        update->loaded[block_ref] = 1;
+    }
+    return(&update->block[block_ref]);
+}
+
+/**
+ * A block that the update fills in from scratch (it is not read)
+ *
+ * @param block_ref Block to fill in
+ * @return The update's copy, zeroed
+ */
+BLOCK *oufs_update_fresh(OUFS_UPDATE *update, BLOCK_REFERENCE block_ref)
+{
+    memset(&update->block[block_ref], 0, sizeof(BLOCK));
+    update->loaded[block_ref] = 1;
+    update->dirty[block_ref] = 1;
+    return(&update->block[block_ref]);
+}
+
+/**
+ * A block that the update is going to change
+ *
+ * @param block_ref Block to change
+ * @return The update's copy; NULL if the block cannot be read
+ */
+BLOCK *oufs_update_change(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref)
+{
+    BLOCK *b = oufs_update_block(mount, update, block_ref);
+    if(b != NULL)
+        update->dirty[block_ref] = 1;
+    return(b);
+}
+
+/**
+ * An inode that the update is going to change
+ *
+ * @param i Inode reference
+ * @return The inode within the update's copy of its block; NULL if the
+ *         block cannot be read
+ */
+INODE *oufs_update_inode(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE i)
+{
+    if(i >= N_INODES)
+        return(NULL);
+    BLOCK *b = oufs_update_change(mount, update, i / N_INODES_PER_BLOCK + 1);
+    return(b == NULL ? NULL : &b->content.inodes.inode[i % N_INODES_PER_BLOCK]);
+}
+
+/**
+ * Allocate and set up a new directory within an update.  The caller
+ *   holds the allocator lock and the inode block locks.
+ *
+ * @param parent_reference The inode of the parent directory
+ * @return The inode reference of the new directory
+ *         UNALLOCATED_INODE if there is no inode or block left
+ */
+INODE_REFERENCE oufs_update_allocate_directory(OUFS_MOUNT *mount, OUFS_UPDATE *update,
+                                               INODE_REFERENCE parent_reference)
+{
+    // A free block where the disk's policy says (next to the parent's),
+    //  then an inode (from the block's group)
+    BLOCK *parent_inodes = oufs_update_block(mount, update,
+                                             parent_reference / N_INODES_PER_BLOCK + 1);
+    BLOCK_REFERENCE near = parent_inodes == NULL ? ROOT_DIRECTORY_BLOCK
+        : parent_inodes->content.inodes.inode[parent_reference % N_INODES_PER_BLOCK].content;
+    BLOCK_REFERENCE block_ref = oufs_update_take_block(mount, update, near);
+    if(block_ref == UNALLOCATED_BLOCK)
+        return(UNALLOCATED_INODE);
+    INODE_REFERENCE i = oufs_update_take_inode(mount, update, block_ref);
+    if(i == UNALLOCATED_INODE)
+        return(UNALLOCATED_INODE);
+    BLOCK *b = oufs_update_change(mount, update, block_ref);
+    INODE *inode = oufs_update_inode(mount, update, i);
+    if(b == NULL || inode == NULL)
+        return(UNALLOCATED_INODE);
+
+    oufs_init_directory_structures(inode, b, block_ref, i, parent_reference);
+    return(i);
+}
+
+/**
+ * Release an inode and its blocks within an update (the blocks go at the
+ *   end of their free lists).  The caller holds the allocator lock and the
+ *   inode block locks.
+ *
+ * @param i Inode to release
+ * @return 0 if success
+ *         -1 if a block cannot be read
+ */
+int oufs_update_free_inode(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE i)
+{
+    BLOCK *master = oufs_update_change(mount, update, MASTER_BLOCK_REFERENCE);
+    INODE *inode = oufs_update_inode(mount, update, i);
+    if(master == NULL || inode == NULL)
+        return(-1);
+
+    // A directory has one block; a file has a chain of them (none if empty)
+    BLOCK_REFERENCE block_ref = inode->content;
+    for(int n = 0; block_ref != UNALLOCATED_BLOCK && n < N_BLOCKS; ++n) {
+        BLOCK *b = oufs_update_change(mount, update, block_ref);
+        if(b == NULL)
+            return(-1);
+        BLOCK_REFERENCE next = inode->type == FILE_TYPE ? b->next_block : UNALLOCATED_BLOCK;
+
+        if(oufs_update_put_block(mount, update, block_ref) != 0)
+            return(-1);
+        for(int k = 0; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+            b->content.directory.entry[k].inode_reference = UNALLOCATED_INODE;
         }
+        ++mount->freed;
+        block_ref = next;
     }
-    // couldn't find an open bit
-    if (bit == -1)
-        return UNALLOCATED_INODE;
-    // change allocation table to mark new one being allocated
-    
-    INODE inode;
-    // read the inode from virtual disk TODO: need this??
-    oufs_read_inode_by_reference(newdir, &inode);
-    
-    // using a temporary variable for the block at front of list
-    BLOCK_REFERENCE temp = block.content.master.unallocated_front;
-    if (temp == UNALLOCATED_BLOCK)
-    {
-        fprintf(stderr, "\n unallocated_front was an unallocated block. \n");
-        return UNALLOCATED_INODE;
+
+    inode->type = UNUSED_TYPE;
+    oufs_master_set_inode(&master->content.master, i, 0);
+    return(0);
+}
+
+/**
+ * Add an entry to a directory within an update
+ *
+ * @param dir Directory inode
+ * @param name Name of the new entry
+ * @param child Inode of the new entry
+ * @return 0 if success
+ *         -1 if the directory is full or cannot be read
+ */
+int oufs_update_add_entry(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE dir,
+                          char *name, INODE_REFERENCE child)
+{
+    INODE *inode = oufs_update_inode(mount, update, dir);
+    BLOCK *b = inode == NULL ? NULL : oufs_update_change(mount, update, inode->content);
+    if(b == NULL)
+        return(-1);
+    for(int k = 2; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+        DIRECTORY_ENTRY *e = &b->content.directory.entry[k];
+        if(e->inode_reference == UNALLOCATED_INODE) {
+            strncpy(e->name, name, FILE_NAME_SIZE - 1);
+            e->name[FILE_NAME_SIZE - 1] = 0;
+            e->inode_reference = child;
+            inode->size++;
+            return(0);
+        }
     }
-    virtual_disk_read_block(temp, &block2);
-    
-    //TODO: set the end of the chain to UNALLOCATED IF NONE LEFT
-    if (block2.next_block == UNALLOCATED_BLOCK)
-    {
-        block.content.master.unallocated_front = UNALLOCATED_BLOCK;
+    fprintf(stderr, "No space in directory to store new entry\n");
+    return(-1);
+}
+
+/**
+ * Take an entry out of a directory within an update
+ *
+ * @param dir Directory inode
+ * @param name Name of the entry
+ * @return 0 if success
+ *         -1 if there is no such entry or the directory cannot be read
+ */
+int oufs_update_remove_entry(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE dir,
+                             char *name)
+{
+    INODE *inode = oufs_update_inode(mount, update, dir);
+    BLOCK *b = inode == NULL ? NULL : oufs_update_change(mount, update, inode->content);
+    if(b == NULL)
+        return(-1);
+    for(int k = 2; k < N_DIRECTORY_ENTRIES_PER_BLOCK; ++k) {
+        DIRECTORY_ENTRY *e = &b->content.directory.entry[k];
+        if(e->inode_reference != UNALLOCATED_INODE && strncmp(e->name, name, FILE_NAME_SIZE) == 0) {
+            e->inode_reference = UNALLOCATED_INODE;
+            inode->size--;
+            return(0);
+        }
     }
-    else        // TODO: double check this logic
-    {
-        block.content.master.unallocated_front = block2.next_block;
+    return(-1);
+}
+
+/**
+ * Write every block the update has changed, each once, in block order.
+ *   Called within a transaction.
+ *
+ * @return 0 if success
+ *         -1 if a block could not be written
+ */
+int oufs_update_write(OUFS_MOUNT *mount, OUFS_UPDATE *update)
+{
+    int ret = 0;
+    for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+        if(update->dirty[i] && oufs_write_block(mount, i, &update->block[i]) != 0) {
+            fprintf(stderr, "oufs_update_write: error writing block %d\n", i);
+            ret = -1;
+        }
     }
-    // TODO: double check this call that all parameters are correct
-    fprintf(stderr, "\n about to init directory structures \n");
-    oufs_init_directory_structures(&inode, &block2, temp, newdir, parent_reference);
-    // write inode and block to virtual disk
-    oufs_write_inode_by_reference(newdir, &inode);
-    //  changed allocation table. write master block back to disk
-    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &block);
-    virtual_disk_write_block(temp, &block2); // TODO: changed to temp from inode.content. Check this
-    return newdir;
-    
-};
+    return(ret);
+}
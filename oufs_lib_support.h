@@ -1,11 +1,241 @@
 #ifndef OUFS_LIB_SUPPORT_H
 #define OUFS_LIB_SUPPORT_H
 
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
 #include "oufs_lib.h"
+#include "virtual_disk.h"
+
+// Keeps state that is written by one thread and read by many on its own
+//  cache line
+#define OUFS_CACHE_LINE 64
+
+// Times a reader spins on a change in progress before it starts to yield
+//  the processor, and waits in all before it checks that the writer is
+//  still alive
+#define OUFS_CACHE_SPINS 64
+#define OUFS_CACHE_WAITS 1024
+
+// Most blocks read ahead when a block of a striped disk misses the cache
+#define OUFS_READAHEAD_MAX 64
+
+// Blocks freed before their space is given back to the host: one page of
+//  the host file system, the least it can release
+#define OUFS_DISCARD_BATCH (4096 / BLOCK_SIZE)
+
+// Policies for the block of a new directory (oufs_alloc.c), chosen when
+//  the disk is formatted (OUFS_ALLOCATION=<name>)
+#define OUFS_ALLOC_FRONT 0      // "front": the front of the free list
+#define OUFS_ALLOC_NEAR 1       // "near": the free block closest to the parent's
+#define OUFS_ALLOC_GROUP 2      // "group": the parent's block group, else the emptiest
+#define OUFS_ALLOC_SPREAD 3     // "spread": the emptiest block group
+#define OUFS_N_ALLOC_POLICIES 4
+
+// Pairs of an inode and a block that a thread reserves at a time, at most
+//  (OUFS_RESERVE=<n> when the disk is mounted; 0: none), and threads
+//  that can have reservations at once (oufs_reserve.c)
+#define OUFS_RESERVE_MAX 8
+#define OUFS_RESERVE_SLOTS 32
+
+// Inodes (of RESERVED_TYPE) and the blocks they hold, set aside for one
+//  thread.  state is the next pair to hand out (low 16 bits) and the
+//  number of pairs (high 16 bits); pairs are claimed by moving it on.
+typedef struct
+{
+  INODE_REFERENCE inode[OUFS_RESERVE_MAX];
+  BLOCK_REFERENCE block[OUFS_RESERVE_MAX];
+  unsigned int state;
+
+  // Pairs to reserve next time; is the pool held by a thread?
+  int batch;
+  int owned;
+} __attribute__((aligned(OUFS_CACHE_LINE))) OUFS_RESERVATION;
+
+// A cached copy of a block.  seq is odd while the copy is being replaced
+//  and 0 until the block is first loaded.
+typedef struct
+{
+  unsigned int seq;
+  unsigned char data[BLOCK_SIZE];
+} __attribute__((aligned(OUFS_CACHE_LINE))) OUFS_CACHED_BLOCK;
+
+// Changes to a directory (its inode and its block).  Odd while a writer
+//  that holds the inode lock is part way through.
+typedef struct
+{
+  unsigned int seq;
+} __attribute__((aligned(OUFS_CACHE_LINE))) OUFS_INODE_SEQ;
+
+// Block cache and directory versions of a disk.  Private to one mount, or
+//  (OUFS_SHARED_CACHE=1) a shared memory segment that every process that
+//  mounts the same disk image maps (see oufs_cache.c).
+typedef struct oufs_cache_s
+{
+  // Segment header: layout check and set-up state (0 new, 1 being set up,
+  //  2 ready)
+  unsigned int magic;
+  unsigned int size;
+  unsigned int state;
+
+  // Protects writer, stamp and owner (robust: survives a dead holder)
+  pthread_mutex_t lock;
+
+  // The one process that may change the disk (0 if none)
+  pid_t writer;
+
+  // The image file as the last writer left it.  Anything else means the
+  //  file was changed behind the cache's back.
+  struct timespec stamp_mtime;
+  off_t stamp_size;
+
+  // Process whose change to a cached block may not be on the disk yet
+  pid_t owner[N_BLOCKS];
+
+  OUFS_INODE_SEQ inode_seq[N_INODES];
+  OUFS_CACHED_BLOCK block[N_BLOCKS];
+} OUFS_CACHE;
+
+// State of a mounted disk
+struct oufs_mount_s
+{
+  VDISK *disk;
+
+  // Print debugging information
+  int debug;
+
+  // Every block that has been read or written through the mount, and the
+  //  directory versions
+  OUFS_CACHE *cache;
+
+  // Blocks read together when one misses the cache (one full stripe of a
+  //  striped disk; 0 for none)
+  int readahead;
+
+  // Is the cache a shared segment?  Then the image file it belongs to, and
+  //  whether this process is the writer
+  int cache_shared;
+  char *cache_file;
+  int cache_writer;
+  pthread_mutex_t cache_writer_lock;
+
+  // Directory inodes: held for writing by updates, always ancestor before
+  //  descendant.  Lookups and listings do not lock; they retry if inode_seq
+  //  moves while they look.
+  pthread_rwlock_t inode_lock[N_INODES];
+
+  // Read-modify-write of the blocks of the inode table
+  pthread_mutex_t inode_block_lock[N_INODE_BLOCKS];
+
+  // Master block: inode allocation table and free block list
+  pthread_mutex_t allocator_lock;
+
+  // Blocks freed through the mount since their space was last given back
+  //  to the host (under the allocator lock)
+  int freed;
+
+  // Reservations: the pool of each thread (the key leads to it) and the
+  //  largest batch
+  pthread_key_t reserve_key;
+  int reserve_limit;
+  OUFS_RESERVATION reserve[OUFS_RESERVE_SLOTS];
+};
+
+// A whole disk loaded into memory (oufs_image.c)
+typedef struct oufs_image_s
+{
+  OUFS_MOUNT *mount;
+  BLOCK block[N_BLOCKS];
+
+  // Blocks that could not be read (zero filled), and changed blocks
+  unsigned char damaged[N_BLOCKS];
+  unsigned char dirty[N_BLOCKS];
+} OUFS_IMAGE;
+
+// Blocks read and changed by one update, so that each is written once
+//  (oufs_lib_support.c)
+typedef struct oufs_update_s
+{
+  BLOCK block[N_BLOCKS];
+  unsigned char loaded[N_BLOCKS];
+  unsigned char dirty[N_BLOCKS];
+} OUFS_UPDATE;
+
+// Cache set-up and cross-process writer (oufs_cache.c)
+int oufs_cache_open(OUFS_MOUNT *mount, char *disk_name);
+int oufs_cache_close(OUFS_MOUNT *mount);
+int oufs_cache_lock(OUFS_MOUNT *mount);
+void oufs_cache_unlock(OUFS_MOUNT *mount);
+void oufs_cache_check(OUFS_MOUNT *mount);
+void oufs_cache_publish(OUFS_CACHED_BLOCK *c, BLOCK *block, int only_if_empty);
+void oufs_cache_fill(OUFS_MOUNT *mount, OUFS_CACHED_BLOCK *c, BLOCK *block);
+
+// Whole-disk images (oufs_image.c)
+OUFS_IMAGE *oufs_image_load(char *disk_name, char *pipe_name_base);
+INODE *oufs_image_inode(OUFS_IMAGE *image, INODE_REFERENCE i);
+int oufs_image_inode_allocated(OUFS_IMAGE *image, INODE_REFERENCE i);
+void oufs_image_set_inode_allocated(OUFS_IMAGE *image, INODE_REFERENCE i, int allocated);
+void oufs_image_dirty(OUFS_IMAGE *image, BLOCK_REFERENCE block_ref);
+void oufs_image_link_free(OUFS_IMAGE *image, const unsigned char *is_free);
+int oufs_image_relocate(OUFS_IMAGE *image, const BLOCK_REFERENCE *order, int n);
+int oufs_image_save(OUFS_IMAGE *image);
+int oufs_image_close(OUFS_IMAGE *image);
+
+// Block cache and directory versions
+int oufs_read_block(OUFS_MOUNT *mount, BLOCK_REFERENCE block_ref, BLOCK *block);
+int oufs_write_block(OUFS_MOUNT *mount, BLOCK_REFERENCE block_ref, BLOCK *block);
+int oufs_write_blocks(OUFS_MOUNT *mount, BLOCK_REFERENCE first, int n, unsigned char *blocks);
+void oufs_prefetch_blocks(OUFS_MOUNT *mount, BLOCK_REFERENCE *refs, int n);
+unsigned int oufs_read_begin(OUFS_MOUNT *mount, INODE_REFERENCE i);
+int oufs_read_retry(OUFS_MOUNT *mount, INODE_REFERENCE i, unsigned int seq);
+void oufs_write_begin(OUFS_MOUNT *mount, INODE_REFERENCE i);
+void oufs_write_end(OUFS_MOUNT *mount, INODE_REFERENCE i);
+
+// Allocation policies and free lists (oufs_alloc.c)
+int oufs_alloc_policy(const char *name);
+const char *oufs_alloc_policy_name(int policy);
+int oufs_n_free_lists(const MASTER_BLOCK *m);
+int oufs_free_list_of(const MASTER_BLOCK *m, BLOCK_REFERENCE b);
+BLOCK_REFERENCE *oufs_free_front(MASTER_BLOCK *m, int k);
+BLOCK_REFERENCE *oufs_free_end(MASTER_BLOCK *m, int k);
+int oufs_master_inode_allocated(const MASTER_BLOCK *m, INODE_REFERENCE i);
+void oufs_master_set_inode(MASTER_BLOCK *m, INODE_REFERENCE i, int allocated);
+void oufs_master_count_block(MASTER_BLOCK *m, BLOCK_REFERENCE b, int delta);
+void oufs_master_recount(MASTER_BLOCK *m, const unsigned char *is_free);
+BLOCK_REFERENCE oufs_update_take_block(OUFS_MOUNT *mount, OUFS_UPDATE *update,
+                                       BLOCK_REFERENCE near);
+INODE_REFERENCE oufs_update_take_inode(OUFS_MOUNT *mount, OUFS_UPDATE *update,
+                                       BLOCK_REFERENCE near);
+int oufs_update_put_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref);
+int oufs_update_return_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref);
+
+// Reservations of inodes and blocks (oufs_reserve.c)
+void oufs_reserve_init(OUFS_MOUNT *mount);
+void oufs_reserve_destroy(OUFS_MOUNT *mount);
+int oufs_reserve_take(OUFS_MOUNT *mount, BLOCK_REFERENCE near, INODE_REFERENCE *inode,
+                      BLOCK_REFERENCE *block);
+int oufs_reserve_return(OUFS_MOUNT *mount);
+
+// Updates that change many blocks
+void oufs_lock_allocation(OUFS_MOUNT *mount);
+void oufs_unlock_allocation(OUFS_MOUNT *mount);
+void oufs_update_init(OUFS_UPDATE *update);
+BLOCK *oufs_update_block(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref);
+BLOCK *oufs_update_fresh(OUFS_UPDATE *update, BLOCK_REFERENCE block_ref);
+BLOCK *oufs_update_change(OUFS_MOUNT *mount, OUFS_UPDATE *update, BLOCK_REFERENCE block_ref);
+INODE *oufs_update_inode(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE i);
+INODE_REFERENCE oufs_update_allocate_directory(OUFS_MOUNT *mount, OUFS_UPDATE *update,
+                                               INODE_REFERENCE parent_reference);
+int oufs_update_free_inode(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE i);
+int oufs_update_add_entry(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE dir,
+                          char *name, INODE_REFERENCE child);
+int oufs_update_remove_entry(OUFS_MOUNT *mount, OUFS_UPDATE *update, INODE_REFERENCE dir,
+                             char *name);
+int oufs_update_write(OUFS_MOUNT *mount, OUFS_UPDATE *update);
 
 // Implement these for project 3
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
+int oufs_read_inode_by_reference(OUFS_MOUNT *mount, INODE_REFERENCE i, INODE *inode);
+int oufs_write_inode_by_reference(OUFS_MOUNT *mount, INODE_REFERENCE i, INODE *inode);
 void oufs_set_inode(INODE *inode, INODE_TYPE type, int n_references,
 		    BLOCK_REFERENCE content, int size);
 void oufs_init_directory_structures(INODE *inode, BLOCK *block,
@@ -13,12 +243,14 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
 				    INODE_REFERENCE self_inode_reference,
 				    INODE_REFERENCE parent_inode_reference);
 
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent,
+int oufs_find_directory_element(OUFS_MOUNT *mount, INODE *inode, char *element_name);
+int oufs_find_file(OUFS_MOUNT *mount, char *cwd, char * path, INODE_REFERENCE *parent,
 		   INODE_REFERENCE *child, char *local_name);
  
-int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference);
+int oufs_deallocate_block(OUFS_MOUNT *mount, BLOCK *master_block, BLOCK_REFERENCE block_reference);
+int oufs_discard_free_blocks(OUFS_MOUNT *mount, int batch);
 
-int oufs_allocate_new_directory(INODE_REFERENCE parent_reference);
+int oufs_allocate_new_directory(OUFS_MOUNT *mount, INODE_REFERENCE parent_reference);
 int oufs_find_open_bit(unsigned char value);
 
 #endif
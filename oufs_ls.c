@@ -13,16 +13,19 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Open the virtual disk
-  virtual_disk_attach(disk_name, pipe_name_base);
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL) {
+    return(-1);
+  }
 
   if(argc == 1) {
-    oufs_list(cwd, "");
+    oufs_list(mount, cwd, "");
   }else if(argc == 2){
-    oufs_list(cwd, argv[1]);
+    oufs_list(mount, cwd, argv[1]);
   }else{
     fprintf(stderr, "Usage: oufs_ls [<name>]\n");
   }
 
   // Clean up
-  virtual_disk_detach();
+  oufs_unmount(mount);
 }
@@ -1,5 +1,6 @@
 /**
-Make a directory in the OU File System.
+Make a directory in the OU File System.  With -p, also make any of its
+parents that do not exist yet.
 
 CS3113
 
@@ -20,22 +21,26 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Check arguments
-  if(argc == 2) {
+  int parents = argc == 3 && strcmp(argv[1], "-p") == 0;
+  if(argc == 2 || parents) {
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
+    OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+    if(mount == NULL) {
+      return(-1);
+    }
 
     // Make the specified directory
-    int ret = oufs_mkdir(cwd, argv[1]);
+    int ret = parents ? oufs_mkdir_parents(mount, cwd, argv[2]) : oufs_mkdir(mount, cwd, argv[1]);
     if(ret != 0) {
       fprintf(stderr, "Error (%d)\n", ret);
     }
 
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mount);
     
   }else{
     // Wrong number of parameters
-    fprintf(stderr, "Usage: oufs_mkdir <dirname>\n");
+    fprintf(stderr, "Usage: oufs_mkdir [-p] <dirname>\n");
   }
 
 }
@@ -0,0 +1,213 @@
+/**
+ *  oufs_mkimage
+ *
+ *  Builds a disk from a manifest, without going through the file system:
+ *  the whole disk is laid out in memory (see oufs_build_image()) and
+ *  written in one go over whatever the disk held.  Entries are sorted by
+ *  name, so a manifest gives the same image byte for byte however its
+ *  lines are ordered.
+ *
+ *  Manifest: one entry per line; blank lines and lines starting with #
+ *  are ignored.  Missing parent directories are added.
+ *    d <path>                 directory
+ *    f <path> [<host file>]   file, empty or with the contents of <host file>
+ *
+ *  Usage: oufs_mkimage [-o <disk>] <manifest>    ("-": standard input)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "oufs_lib.h"
+
+/**
+ *  Find or add a child of a directory node
+ *
+ *  @param type Type of the child
+ *  @return The child; NULL if it exists with the other type or the name
+ *          is bad
+ */
+static OUFS_TREE_NODE *child_node(OUFS_TREE_NODE *dir, char *name, INODE_TYPE type)
+{
+  for(int k = 0; k < dir->n_children; ++k) {
+    if(strcmp(dir->child[k].name, name) == 0)
+      return(dir->child[k].type == type && type == DIRECTORY_TYPE ? &dir->child[k] : NULL);
+  }
+  if(strlen(name) > FILE_NAME_SIZE - 2 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    return(NULL);
+  OUFS_TREE_NODE *child = realloc(dir->child, (dir->n_children + 1) * sizeof(OUFS_TREE_NODE));
+  if(child == NULL)
+    return(NULL);
+  dir->child = child;
+  OUFS_TREE_NODE *node = &dir->child[dir->n_children++];
+  memset(node, 0, sizeof(OUFS_TREE_NODE));
+  strcpy(node->name, name);
+  node->type = type;
+  return(node);
+}
+
+/**
+ *  Read the whole of a host file into a node
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int load_contents(OUFS_TREE_NODE *node, char *host_file)
+{
+  struct stat st;
+  int fd = open(host_file, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "oufs_mkimage: cannot read %s\n", host_file);
+    if(fd >= 0)
+      close(fd);
+    return(-1);
+  }
+  if(st.st_size > MAX_BLOCKS_IN_FILE * OUFS_FILE_BLOCK_DATA) {
+    fprintf(stderr, "oufs_mkimage: %s is too large\n", host_file);
+    close(fd);
+    return(-1);
+  }
+  node->size = st.st_size;
+  node->data = malloc(node->size + 1);
+  int ret = node->data == NULL ? -1 : 0;
+  for(unsigned int done = 0; ret == 0 && done < node->size; ) {
+    ssize_t k = read(fd, node->data + done, node->size - done);
+    if(k <= 0) {
+      fprintf(stderr, "oufs_mkimage: cannot read %s\n", host_file);
+      ret = -1;
+    }else{
+      done += k;
+    }
+  }
+  close(fd);
+  return(ret);
+}
+
+/**
+ *  Add one manifest entry to the tree
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int add_entry(OUFS_TREE_NODE *root, char type, char *path, char *host_file)
+{
+  OUFS_TREE_NODE *dir = root;
+  char *save;
+  char *name = strtok_r(path, "/", &save);
+  if(name == NULL)
+    return(type == 'd' ? 0 : -1);
+  for(char *next; (next = strtok_r(NULL, "/", &save)) != NULL; name = next) {
+    if((dir = child_node(dir, name, DIRECTORY_TYPE)) == NULL)
+      return(-1);
+  }
+  OUFS_TREE_NODE *node = child_node(dir, name, type == 'd' ? DIRECTORY_TYPE : FILE_TYPE);
+  if(node == NULL)
+    return(-1);
+  if(host_file != NULL)
+    return(load_contents(node, host_file));
+  return(0);
+}
+
+static int compare_nodes(const void *a, const void *b)
+{
+  return(strcmp(((const OUFS_TREE_NODE *) a)->name, ((const OUFS_TREE_NODE *) b)->name));
+}
+
+/**
+ *  Put every directory's entries in name order; count what the tree holds
+ */
+static void sort_tree(OUFS_TREE_NODE *node, int *directories, int *files)
+{
+  qsort(node->child, node->n_children, sizeof(OUFS_TREE_NODE), compare_nodes);
+  for(int k = 0; k < node->n_children; ++k) {
+    if(node->child[k].type == DIRECTORY_TYPE) {
+      ++*directories;
+      sort_tree(&node->child[k], directories, files);
+    }else{
+      ++*files;
+    }
+  }
+}
+
+static void free_tree(OUFS_TREE_NODE *node)
+{
+  for(int k = 0; k < node->n_children; ++k)
+    free_tree(&node->child[k]);
+  free(node->child);
+  free(node->data);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int opt;
+  while((opt = getopt(argc, argv, "o:")) != -1) {
+    switch(opt) {
+    case 'o':
+      snprintf(disk_name, MAX_PATH_LENGTH, "%s", optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: oufs_mkimage [-o <disk>] <manifest>\n");
+      return(-1);
+    }
+  }
+  if(argc - optind != 1) {
+    fprintf(stderr, "Usage: oufs_mkimage [-o <disk>] <manifest>\n");
+    return(-1);
+  }
+  FILE *manifest = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+  if(manifest == NULL) {
+    fprintf(stderr, "oufs_mkimage: cannot open %s\n", argv[optind]);
+    return(-1);
+  }
+
+  // Read the manifest into a tree
+  OUFS_TREE_NODE root;
+  memset(&root, 0, sizeof(root));
+  root.type = DIRECTORY_TYPE;
+  char line[3 * MAX_PATH_LENGTH];
+  int ret = 0;
+  for(int n = 1; ret == 0 && fgets(line, sizeof(line), manifest) != NULL; ++n) {
+    char *save;
+    char *type = strtok_r(line, " \t\r\n", &save);
+    if(type == NULL || type[0] == '#')
+      continue;
+    char *path = strtok_r(NULL, " \t\r\n", &save);
+    char *host_file = strtok_r(NULL, " \t\r\n", &save);
+    if(path == NULL || type[1] != 0 || (type[0] != 'd' && type[0] != 'f')
+       || (type[0] == 'd' && host_file != NULL) || strtok_r(NULL, " \t\r\n", &save) != NULL
+       || add_entry(&root, type[0], path, host_file) != 0) {
+      fprintf(stderr, "oufs_mkimage: bad entry on line %d\n", n);
+      ret = -1;
+    }
+  }
+  if(manifest != stdin)
+    fclose(manifest);
+
+  // Lay the disk out and write it
+  int directories = 1;
+  int files = 0;
+  unsigned char *image = malloc(N_BLOCKS * BLOCK_SIZE);
+  if(image == NULL)
+    ret = -1;
+  if(ret == 0) {
+    sort_tree(&root, &directories, &files);
+    ret = oufs_build_image(root.child, root.n_children, image);
+    if(ret == 0)
+      ret = oufs_write_image(disk_name, pipe_name_base, image);
+    if(ret == 0)
+      printf("%s: %d directories, %d files\n", disk_name, directories, files);
+    else
+      fprintf(stderr, "Error (%d)\n", ret);
+  }
+  free(image);
+  free_tree(&root);
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,485 @@
+/**
+ *  oufs_ops.c
+ *
+ *  Runs a batch of mkdir and rmdir operations with several threads.  The
+ *  operations form a graph: a directory is made before anything below it
+ *  and removed after everything below it, and the operations on one path
+ *  keep the order of the list.  An operation is ready once every one it
+ *  waits for has finished, so subtrees that have nothing to do with each
+ *  other are worked on at the same time.
+ *
+ *  The threads share the ready operations the way oufs_walk() shares
+ *  directories: each thread keeps its own queue, adds the operations that
+ *  a finished one lets go at the back and takes its next one from the back
+ *  as well (so it goes on down the subtree it is in), while a thread that
+ *  runs out of work steals from the front of another thread's queue.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include "oufs_lib_support.h"
+
+// Most threads in a batch
+#define OUFS_OPS_MAX_THREADS 64
+
+// Times an idle thread yields before it starts to sleep between looks
+#define OUFS_OPS_SPINS 64
+
+// Ready operations of one thread: its own end is the back, thieves take
+//  the front.  Each operation is queued once, so n places are enough.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *op;
+    int front;
+    int back;
+} __attribute__((aligned(OUFS_CACHE_LINE))) OPS_QUEUE;
+
+// One operation in path order
+typedef struct
+{
+    const char *path;
+    int op;
+} OPS_KEY;
+
+// One operation waits for another
+typedef struct
+{
+    int before;
+    int after;
+} OPS_EDGE;
+
+typedef struct ops_s
+{
+    OUFS_MOUNT *mount;
+    OUFS_OP *op;
+    char (*full)[MAX_PATH_LENGTH];
+
+    // The operations that wait for operation k are
+    //  after[first[k]] .. after[first[k + 1] - 1]
+    int *first;
+    int *after;
+
+    // Operations that each one still waits for
+    int *waiting;
+
+    int n_threads;
+    OPS_QUEUE *queue;
+
+    // Operations not finished yet; the batch is over at 0
+    long pending;
+} OPS;
+
+typedef struct
+{
+    OPS *ops;
+    int self;
+} OPS_THREAD;
+
+/**
+ * Absolute path of a file, with "." and ".." worked out and the /'s that
+ *   do not separate names taken out
+ *
+ * @param cwd Absolute path for the current working directory
+ * @param path Absolute or relative path
+ * @param full Buffer of MAX_PATH_LENGTH bytes for the result
+ */
+static void ops_full_path(char *cwd, char *path, char *full)
+{
+    char joined[2 * MAX_PATH_LENGTH + 2];
+    snprintf(joined, sizeof(joined), "%s/%s", path[0] == '/' ? "" : cwd, path);
+    int n = 1;
+    full[0] = '/';
+    char *save_ptr;
+    for(char *s = strtok_r(joined, "/", &save_ptr); s != NULL; s = strtok_r(NULL, "/", &save_ptr)) {
+        if(strcmp(s, ".") == 0)
+            continue;
+        if(strcmp(s, "..") == 0) {
+            while(n > 1 && full[n - 1] != '/')
+                --n;
+            if(n > 1)
+                --n;
+            continue;
+        }
+        if(n > 1 && n < MAX_PATH_LENGTH - 1)
+            full[n++] = '/';
+        for(; *s != 0 && n < MAX_PATH_LENGTH - 1; ++s)
+            full[n++] = *s;
+    }
+    full[n] = 0;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const OPS_KEY *x = a;
+    const OPS_KEY *y = b;
+    int ret = strcmp(x->path, y->path);
+    return(ret != 0 ? ret : x->op - y->op);
+}
+
+/**
+ * @return The first key in path order with the given path, or where it
+ *         would be
+ */
+static int ops_find(OPS_KEY *key, int n, const char *path)
+{
+    int low = 0;
+    int high = n;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(strcmp(key[middle].path, path) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return(low);
+}
+
+/**
+ * Add an edge to a list that grows as needed
+ *
+ * @return 0 if success; -1 if out of memory
+ */
+static int ops_add_edge(OPS_EDGE **edge, int *n, int *size, int before, int after)
+{
+    if(*n == *size) {
+        int new_size = *size ? 2 * *size : 256;
+        OPS_EDGE *e = realloc(*edge, new_size * sizeof(OPS_EDGE));
+        if(e == NULL)
+            return(-1);
+        *edge = e;
+        *size = new_size;
+    }
+    (*edge)[(*n)++] = (OPS_EDGE) {before, after};
+    return(0);
+}
+
+/**
+ * Work out which operations wait for which.  An operation on a directory
+ *   is placed among the operations on each directory above it by its
+ *   position in the list: it comes after the one listed before it and
+ *   ahead of the one listed after it.  If it is listed ahead of them all
+ *   and the first makes the directory, it comes after the first instead;
+ *   if it is listed after them all and the last removes the directory, it
+ *   comes ahead of the last.
+ *
+ * @return Number of edges in edge (to be freed); -1 if out of memory
+ */
+static int ops_edges(OPS *ops, int n, OPS_EDGE **edge)
+{
+    OPS_KEY *key = malloc(n * sizeof(OPS_KEY));
+    int n_edges = 0;
+    int size = 0;
+    *edge = NULL;
+    if(key == NULL)
+        return(-1);
+    for(int k = 0; k < n; ++k) {
+        key[k] = (OPS_KEY) {ops->full[k], k};
+    }
+    qsort(key, n, sizeof(OPS_KEY), compare_keys);
+
+    // The same path: in the order of the list
+    int ret = 0;
+    for(int k = 0; k + 1 < n && ret == 0; ++k) {
+        if(strcmp(key[k].path, key[k + 1].path) == 0)
+            ret = ops_add_edge(edge, &n_edges, &size, key[k].op, key[k + 1].op);
+    }
+
+    // The directories above
+    for(int k = 0; k < n && ret == 0; ++k) {
+        const char *full = ops->full[k];
+        char above[MAX_PATH_LENGTH];
+        for(int len = 0; full[len] != 0 && ret == 0; ++len) {
+            if(full[len] != '/' || full[1] == 0)
+                continue;
+            if(len == 0) {
+                strcpy(above, "/");
+            }else{
+                memcpy(above, full, len);
+                above[len] = 0;
+            }
+
+            // Its place among the operations on the directory above
+            int first = ops_find(key, n, above);
+            int count = 0;
+            int place = 0;
+            for(; first + count < n && strcmp(key[first + count].path, above) == 0; ++count) {
+                place += key[first + count].op < k;
+            }
+            if(count == 0)
+                continue;
+            if(place == 0 && ops->op[key[first].op].type == OUFS_OP_MKDIR)
+                place = 1;
+            else if(place == count && ops->op[key[first + count - 1].op].type == OUFS_OP_RMDIR)
+                place = count - 1;
+            if(place > 0)
+                ret |= ops_add_edge(edge, &n_edges, &size, key[first + place - 1].op, k);
+            if(place < count)
+                ret |= ops_add_edge(edge, &n_edges, &size, k, key[first + place].op);
+        }
+    }
+    free(key);
+    if(ret != 0) {
+        free(*edge);
+        *edge = NULL;
+        return(-1);
+    }
+    return(n_edges);
+}
+
+/**
+ * Turn the edges into the lists of operations that wait for each one
+ *
+ * @return 0 if success
+ *         -1 if the operations wait for each other in a cycle
+ *         -2 if out of memory
+ */
+static int ops_graph(OPS *ops, int n, OPS_EDGE *edge, int n_edges)
+{
+    memset(ops->first, 0, (n + 1) * sizeof(int));
+    memset(ops->waiting, 0, n * sizeof(int));
+    for(int e = 0; e < n_edges; ++e) {
+        ++ops->first[edge[e].before + 1];
+        ++ops->waiting[edge[e].after];
+    }
+    for(int k = 0; k < n; ++k) {
+        ops->first[k + 1] += ops->first[k];
+    }
+    int *fill = ops->queue[0].op;
+    memcpy(fill, ops->first, n * sizeof(int));
+    for(int e = 0; e < n_edges; ++e) {
+        ops->after[fill[edge[e].before]++] = edge[e].after;
+    }
+
+    // Every operation can be reached by taking them in order (the queue of
+    //  thread 0 serves for the counts and the order)
+    int *left = malloc(n * sizeof(int));
+    if(left == NULL)
+        return(-2);
+    memcpy(left, ops->waiting, n * sizeof(int));
+    int *order = ops->queue[0].op;
+    int taken = 0;
+    int found = 0;
+    for(int k = 0; k < n; ++k) {
+        if(left[k] == 0)
+            order[found++] = k;
+    }
+    while(taken < found) {
+        int k = order[taken++];
+        for(int s = ops->first[k]; s < ops->first[k + 1]; ++s) {
+            if(--left[ops->after[s]] == 0)
+                order[found++] = ops->after[s];
+        }
+    }
+    free(left);
+    return(found == n ? 0 : -1);
+}
+
+/**
+ * Add an operation at the back of a queue
+ */
+static void ops_push(OPS *ops, int self, int k)
+{
+    OPS_QUEUE *q = &ops->queue[self];
+    pthread_mutex_lock(&q->lock);
+    q->op[q->back++] = k;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Take an operation from a queue
+ *
+ * @param from_back 1 for the owner of the queue; 0 for a thief
+ * @return 0 if an operation was taken; -1 if the queue is empty
+ */
+static int ops_take(OPS_QUEUE *q, int from_back, int *k)
+{
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    if(q->front < q->back) {
+        *k = from_back ? q->op[--q->back] : q->op[q->front++];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return(ret);
+}
+
+/**
+ * Find the next operation: from the thread's own queue, or else stolen
+ *   from the others, starting with the next thread along
+ *
+ * @return 0 if one was found; -1 if every queue is empty
+ */
+static int ops_next(OPS *ops, int self, int *k)
+{
+    if(ops_take(&ops->queue[self], 1, k) == 0)
+        return(0);
+    for(int i = 1; i < ops->n_threads; ++i) {
+        if(ops_take(&ops->queue[(self + i) % ops->n_threads], 0, k) == 0)
+            return(0);
+    }
+    return(-1);
+}
+
+/**
+ * Run an operation and queue the ones that were waiting only for it
+ */
+static void ops_run(OPS *ops, int self, int k)
+{
+    OUFS_OP *op = &ops->op[k];
+    if(op->type == OUFS_OP_MKDIR)
+        op->result = oufs_mkdir(ops->mount, "/", ops->full[k]);
+    else
+        op->result = oufs_rmdir(ops->mount, "/", ops->full[k]);
+
+    for(int s = ops->first[k]; s < ops->first[k + 1]; ++s) {
+        if(__atomic_sub_fetch(&ops->waiting[ops->after[s]], 1, __ATOMIC_ACQ_REL) == 0)
+            ops_push(ops, self, ops->after[s]);
+    }
+    // What it let go was queued before it is counted as finished
+    __atomic_sub_fetch(&ops->pending, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Run operations until all of them have finished
+ */
+static void *ops_thread(void *arg)
+{
+    OPS_THREAD *t = arg;
+    OPS *ops = t->ops;
+    int idle = 0;
+    int k;
+
+    while(__atomic_load_n(&ops->pending, __ATOMIC_ACQUIRE) > 0) {
+        if(ops_next(ops, t->self, &k) == 0) {
+            idle = 0;
+            ops_run(ops, t->self, k);
+        }else if(++idle < OUFS_OPS_SPINS) {
+            sched_yield();
+        }else{
+            struct timespec pause = {0, 50000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return(NULL);
+}
+
+/**
+ * Free what a batch was given
+ */
+static void ops_free(OPS *ops, int threads)
+{
+    for(int k = 0; ops->queue != NULL && k < threads; ++k) {
+        free(ops->queue[k].op);
+        pthread_mutex_destroy(&ops->queue[k].lock);
+    }
+    free(ops->queue);
+    free(ops->full);
+    free(ops->first);
+    free(ops->after);
+    free(ops->waiting);
+}
+
+/**
+ * Make and remove a batch of directories, several at once where they do
+ *   not depend on each other
+ *
+ * A directory is made before the operations on the paths below it, and
+ *  removed after them; where a path has several operations they are run
+ *  in the order of the list (see ops_edges() for a path that is also the
+ *  parent of others).  Every operation is run, whatever became of the
+ *  ones before it, and the changes are flushed at the end.
+ *
+ * @param cwd Absolute path for the current working directory
+ * @param op Operations; each one's result is set
+ * @param n Number of operations
+ * @param threads Threads to use (0: one per processor)
+ * @return Number of operations that failed
+ *         -1 if the operations wait for each other in a cycle (none is run)
+ *         -2 if out of memory (none is run) or the changes could not be
+ *            flushed
+ */
+int oufs_run_ops(OUFS_MOUNT *mount, char *cwd, OUFS_OP *op, int n, int threads)
+{
+    if(n <= 0)
+        return(0);
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+    if(threads > OUFS_OPS_MAX_THREADS)
+        threads = OUFS_OPS_MAX_THREADS;
+    if(threads > n)
+        threads = n;
+
+    OPS ops = {mount, op, NULL, NULL, NULL, NULL, threads, NULL, n};
+    ops.full = malloc(n * sizeof(*ops.full));
+    ops.first = malloc((n + 1) * sizeof(int));
+    ops.waiting = malloc(n * sizeof(int));
+    ops.queue = aligned_alloc(OUFS_CACHE_LINE, threads * sizeof(OPS_QUEUE));
+    int allocated = ops.full != NULL && ops.first != NULL && ops.waiting != NULL && ops.queue != NULL;
+    if(ops.queue != NULL) {
+        memset(ops.queue, 0, threads * sizeof(OPS_QUEUE));
+        for(int k = 0; k < threads; ++k) {
+            pthread_mutex_init(&ops.queue[k].lock, NULL);
+            ops.queue[k].op = malloc(n * sizeof(int));
+            allocated &= ops.queue[k].op != NULL;
+        }
+    }
+    OPS_EDGE *edge = NULL;
+    int n_edges = -1;
+    if(allocated) {
+        for(int k = 0; k < n; ++k) {
+            ops_full_path(cwd, op[k].path, ops.full[k]);
+        }
+        n_edges = ops_edges(&ops, n, &edge);
+    }
+    if(n_edges >= 0)
+        ops.after = malloc((n_edges + 1) * sizeof(int));
+    int ret = ops.after == NULL ? -2 : ops_graph(&ops, n, edge, n_edges);
+    free(edge);
+    if(ret != 0) {
+        if(ret == -1)
+            fprintf(stderr, "oufs_run_ops: the operations wait for each other in a cycle\n");
+        else
+            fprintf(stderr, "oufs_run_ops: out of memory\n");
+        ops_free(&ops, threads);
+        return(ret);
+    }
+
+    // What is ready to start with is dealt out to the threads
+    int ready = 0;
+    for(int k = 0; k < n; ++k) {
+        if(ops.waiting[k] == 0)
+            ops_push(&ops, ready++ % threads, k);
+    }
+
+    // This thread is thread 0
+    OPS_THREAD t[OUFS_OPS_MAX_THREADS];
+    pthread_t tid[OUFS_OPS_MAX_THREADS];
+    int started = 1;
+    for(int k = 0; k < threads; ++k) {
+        t[k] = (OPS_THREAD) {&ops, k};
+    }
+    while(started < threads && pthread_create(&tid[started], NULL, ops_thread, &t[started]) == 0) {
+        ++started;
+    }
+    ops_thread(&t[0]);
+    for(int k = 1; k < started; ++k) {
+        pthread_join(tid[k], NULL);
+    }
+    ops_free(&ops, threads);
+
+    int failed = 0;
+    for(int k = 0; k < n; ++k) {
+        failed += op[k].result != 0;
+    }
+    if(oufs_flush(mount) != 0)
+        return(-2);
+    return(failed);
+}
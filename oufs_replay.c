@@ -0,0 +1,242 @@
+/**
+ *  oufs_replay
+ *
+ *  Re-issue a block I/O trace (recorded with OUFS_TRACE) against the
+ *  virtual disk named by OUFS_DISK.  Reads are issued as recorded; writes
+ *  put back the block contents as they were when the replay started, so
+ *  the image is left intact.
+ *
+ *  Usage: oufs_replay [-o] [-q <depth>] <trace file>
+ *    -o  Replay at the original speed (default: as fast as possible)
+ *    -q  Keep up to depth block operations in flight (default: 1, one
+ *        at a time); use with a uring: disk to overlap them
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+// An operation in flight (-q)
+typedef struct
+{
+  VDISK_REQUEST request;
+  BLOCK block;
+  int caller;
+  int op;
+  uint64_t start;
+} SLOT;
+
+// Names for the VDISK_CALLER values
+static const char *CALLER_NAME[] = {"none", "format", "mkdir", "list", "rmdir",
+                                    "inspect", "replay", "fsck", "walk", "import",
+                                    "snapshot", "delta", "compact", "defrag"};
+
+/**
+ *  Current CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return((uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec);
+}
+
+/**
+ *  Sleep until the monotonic clock reaches target (in nanoseconds)
+ */
+static void sleep_until(uint64_t target)
+{
+  struct timespec t;
+  t.tv_sec = target / 1000000000ULL;
+  t.tv_nsec = target % 1000000000ULL;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+    ;
+}
+
+int main(int argc, char** argv) {
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  int original_speed = 0;
+  int depth = 1;
+  char *trace_name = NULL;
+
+  // Parse the arguments
+  for(int i = 1; i < argc; ++i) {
+    if(strcmp(argv[i], "-o") == 0) {
+      original_speed = 1;
+    }else if(strcmp(argv[i], "-q") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      depth = atoi(argv[++i]);
+    }else if(trace_name == NULL) {
+      trace_name = argv[i];
+    }else{
+      trace_name = NULL;
+      break;
+    }
+  }
+  if(trace_name == NULL) {
+    fprintf(stderr, "Usage: oufs_replay [-o] [-q <depth>] <trace file>\n");
+    return(-1);
+  }
+
+  // Load the trace
+  FILE *fp = fopen(trace_name, "rb");
+  if(fp == NULL) {
+    fprintf(stderr, "Unable to open %s\n", trace_name);
+    return(-1);
+  }
+  VDISK_TRACE_HEADER header;
+  if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != VDISK_TRACE_MAGIC
+     || header.record_size != sizeof(VDISK_TRACE_RECORD)) {
+    fprintf(stderr, "%s is not a block trace\n", trace_name);
+    fclose(fp);
+    return(-1);
+  }
+  if(header.block_size != BLOCK_SIZE || header.n_blocks != N_BLOCKS) {
+    fprintf(stderr, "Trace geometry (%d x %d) does not match this build\n",
+            header.n_blocks, header.block_size);
+    fclose(fp);
+    return(-1);
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long n_records = (ftell(fp) - (long)sizeof(header)) / (long)sizeof(VDISK_TRACE_RECORD);
+  fseek(fp, sizeof(header), SEEK_SET);
+  VDISK_TRACE_RECORD *records = malloc(n_records * sizeof(VDISK_TRACE_RECORD) + 1);
+  if(fread(records, sizeof(VDISK_TRACE_RECORD), n_records, fp) != (size_t)n_records) {
+    fprintf(stderr, "Error reading %s\n", trace_name);
+    fclose(fp);
+    free(records);
+    return(-1);
+  }
+  fclose(fp);
+
+  // Never append the replay to the trace that is being replayed
+  char *trace_env = getenv("OUFS_TRACE");
+  if(trace_env != NULL && strcmp(trace_env, trace_name) == 0)
+    unsetenv("OUFS_TRACE");
+
+  // Connect to the target disk
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+  VDISK *disk = virtual_disk_attach(disk_name, pipe_name_base);
+  if(disk == NULL) {
+    free(records);
+    return(-1);
+  }
+  virtual_disk_set_caller(VDISK_CALLER_REPLAY);
+
+  // Snapshot the current contents: replayed writes put them back
+  BLOCK *shadow = malloc(N_BLOCKS * sizeof(BLOCK));
+  memset(shadow, 0, N_BLOCKS * sizeof(BLOCK));
+  for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
+    virtual_disk_read_block(disk, i, &shadow[i]);
+  }
+
+  // Replay
+  long n_ops[VDISK_N_CALLERS][2];
+  uint64_t op_time[VDISK_N_CALLERS][2];
+  memset(n_ops, 0, sizeof(n_ops));
+  memset(op_time, 0, sizeof(op_time));
+  int errors = 0;
+  BLOCK block;
+
+  // Operations in flight, oldest first, and how many there are per block
+  SLOT *slots = malloc(depth * sizeof(SLOT));
+  int oldest = 0;
+  int in_flight = 0;
+  int busy[N_BLOCKS];
+  memset(busy, 0, sizeof(busy));
+
+  uint64_t start = now_ns();
+  for(long i = 0; i < n_records; ++i) {
+    VDISK_TRACE_RECORD *r = &records[i];
+    int caller = r->caller < VDISK_N_CALLERS ? r->caller : VDISK_CALLER_NONE;
+    int op = r->op == VDISK_TRACE_WRITE;
+
+    // Keep the original inter-arrival times
+    if(original_speed && r->timestamp > records[0].timestamp)
+      sleep_until(start + (r->timestamp - records[0].timestamp));
+
+    if(depth == 1) {
+      uint64_t t = now_ns();
+      int ret;
+      if(op)
+        ret = virtual_disk_write_block(disk, r->block_ref, &shadow[r->block_ref % N_BLOCKS]);
+      else
+        ret = virtual_disk_read_block(disk, r->block_ref, &block);
+      op_time[caller][op] += now_ns() - t;
+      ++n_ops[caller][op];
+      if(ret != 0)
+        ++errors;
+      continue;
+    }
+
+    // Make room (and never have two operations on one block in flight)
+    BLOCK_REFERENCE ref = r->block_ref % N_BLOCKS;
+    while(in_flight == depth || (in_flight > 0 && busy[ref] > 0)) {
+      SLOT *slot = &slots[oldest];
+      if(virtual_disk_wait(disk, &slot->request) != 0)
+        ++errors;
+      op_time[slot->caller][slot->op] += now_ns() - slot->start;
+      ++n_ops[slot->caller][slot->op];
+      --busy[slot->request.block_ref];
+      oldest = (oldest + 1) % depth;
+      --in_flight;
+    }
+
+    SLOT *slot = &slots[(oldest + in_flight) % depth];
+    slot->caller = caller;
+    slot->op = op;
+    slot->start = now_ns();
+    int ret;
+    if(op)
+      ret = virtual_disk_write_block_async(disk, &slot->request, ref, &shadow[ref]);
+    else
+      ret = virtual_disk_read_block_async(disk, &slot->request, ref, &slot->block);
+    if(ret != 0) {
+      ++errors;
+      continue;
+    }
+    ++busy[ref];
+    ++in_flight;
+  }
+
+  // Finish the operations that are still in flight
+  while(in_flight > 0) {
+    SLOT *slot = &slots[oldest];
+    if(virtual_disk_wait(disk, &slot->request) != 0)
+      ++errors;
+    op_time[slot->caller][slot->op] += now_ns() - slot->start;
+    ++n_ops[slot->caller][slot->op];
+    oldest = (oldest + 1) % depth;
+    --in_flight;
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  // Report
+  printf("Replayed %ld block operations in %.3f ms (%s speed, queue depth %d)\n",
+         n_records, elapsed / 1e6, original_speed ? "original" : "maximum", depth);
+  printf("%-8s %10s %12s %10s %12s\n", "caller", "reads", "avg read us",
+         "writes", "avg write us");
+  for(int c = 0; c < VDISK_N_CALLERS; ++c) {
+    if(n_ops[c][0] + n_ops[c][1] == 0)
+      continue;
+    printf("%-8s %10ld %12.2f %10ld %12.2f\n", CALLER_NAME[c],
+           n_ops[c][0], n_ops[c][0] ? op_time[c][0] / 1e3 / n_ops[c][0] : 0.0,
+           n_ops[c][1], n_ops[c][1] ? op_time[c][1] / 1e3 / n_ops[c][1] : 0.0);
+  }
+  if(errors)
+    printf("Errors: %d\n", errors);
+
+  // All done
+  virtual_disk_detach(disk);
+  free(slots);
+  free(shadow);
+  free(records);
+  return(errors ? -1 : 0);
+}
@@ -0,0 +1,258 @@
+/**
+ *  oufs_reserve.c
+ *
+ *  Reservations: pairs of a free inode and a free block that a thread
+ *  takes from the allocator a batch at a time, so that making a directory
+ *  does not take the allocator lock or change the master block.  A
+ *  reserved inode has RESERVED_TYPE and its block as its content, so a
+ *  disk that was not unmounted cleanly shows what was left reserved (see
+ *  oufs_fsck).
+ *
+ *  Each thread has a pool in the mount.  Its owner claims pairs from it
+ *  without a lock.  Pools are filled, and handed back, under the allocator
+ *  lock; that is the only way another thread touches a pool, and it claims
+ *  pairs the same way as the owner.  A thread's batches grow from one pair
+ *  (a single mkdir reserves nothing it does not use) up to the mount's
+ *  limit.  What is left goes back at oufs_flush() and at unmount, to the
+ *  front of the free lists it came from; when the allocator runs dry, the
+ *  other threads' pools are emptied first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib_support.h"
+
+/**
+ * A thread that ends gives up its pool; the pairs in it stay reserved for
+ *   the next thread that takes the pool, or until they are handed back
+ */
+static void pool_release(void *arg)
+{
+    OUFS_RESERVATION *r = arg;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Set up the pools of a new mount (OUFS_RESERVE: the largest batch)
+ */
+void oufs_reserve_init(OUFS_MOUNT *mount)
+{
+    char *limit = getenv("OUFS_RESERVE");
+    mount->reserve_limit = limit == NULL ? OUFS_RESERVE_MAX : atoi(limit);
+    if(mount->reserve_limit > OUFS_RESERVE_MAX)
+        mount->reserve_limit = OUFS_RESERVE_MAX;
+    if(mount->reserve_limit > 0 && pthread_key_create(&mount->reserve_key, pool_release) != 0)
+        mount->reserve_limit = 0;
+}
+
+/**
+ * Release the pools of a mount (oufs_reserve_return() first)
+ */
+void oufs_reserve_destroy(OUFS_MOUNT *mount)
+{
+    if(mount->reserve_limit > 0)
+        pthread_key_delete(mount->reserve_key);
+}
+
+/**
+ * @return The calling thread's pool; NULL if every pool is held
+ */
+static OUFS_RESERVATION *thread_pool(OUFS_MOUNT *mount)
+{
+    OUFS_RESERVATION *r = pthread_getspecific(mount->reserve_key);
+    if(r != NULL)
+        return(r);
+    for(int k = 0; k < OUFS_RESERVE_SLOTS; ++k) {
+        int held = 0;
+        if(__atomic_compare_exchange_n(&mount->reserve[k].owned, &held, 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            pthread_setspecific(mount->reserve_key, &mount->reserve[k]);
+            return(&mount->reserve[k]);
+        }
+    }
+    return(NULL);
+}
+
+/**
+ * Claim the next pair of a pool
+ *
+ * @return 0 if claimed; -1 if the pool is empty
+ */
+static int pool_claim(OUFS_RESERVATION *r, INODE_REFERENCE *inode, BLOCK_REFERENCE *block)
+{
+    unsigned int state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+    while((state & 0xffff) < (state >> 16)) {
+        *inode = r->inode[state & 0xffff];
+        *block = r->block[state & 0xffff];
+        if(__atomic_compare_exchange_n(&r->state, &state, state + 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return(0);
+    }
+    return(-1);
+}
+
+/**
+ * @return 1 if the allocator has both an inode and a block left; 0 if not
+ */
+static int room_left(MASTER_BLOCK *m)
+{
+    int block = 0;
+    for(int k = 0; k < oufs_n_free_lists(m) && !block; ++k) {
+        block = *oufs_free_front(m, k) != UNALLOCATED_BLOCK;
+    }
+    for(INODE_REFERENCE i = 0; i < N_INODES && block; ++i) {
+        if(!oufs_master_inode_allocated(m, i))
+            return(1);
+    }
+    return(0);
+}
+
+/**
+ * Reserve pairs for an empty pool within an update, each block next to
+ *   the one before.  The caller holds the allocation locks.
+ *
+ * @param near Block the first belongs next to
+ * @param want Most pairs to reserve
+ * @return Number of pairs reserved
+ *         -1 if the inode table cannot be read
+ */
+static int pool_fill(OUFS_MOUNT *mount, OUFS_UPDATE *update, OUFS_RESERVATION *r,
+                     BLOCK_REFERENCE near, int want)
+{
+    BLOCK *master = oufs_update_block(mount, update, MASTER_BLOCK_REFERENCE);
+    int n = 0;
+    while(master != NULL && n < want && room_left(&master->content.master)) {
+        BLOCK_REFERENCE b = oufs_update_take_block(mount, update, near);
+        if(b == UNALLOCATED_BLOCK)
+            break;
+        INODE_REFERENCE i = oufs_update_take_inode(mount, update, b);
+        INODE *inode = i == UNALLOCATED_INODE ? NULL : oufs_update_inode(mount, update, i);
+        if(inode == NULL)
+            return(-1);
+        oufs_set_inode(inode, RESERVED_TYPE, 0, b, 0);
+        r->inode[n] = i;
+        r->block[n] = b;
+        ++n;
+        near = b;
+    }
+    return(n);
+}
+
+/**
+ * Hand the unclaimed pairs of a pool back within an update, the last
+ *   reserved first, so that the free lists are as they were.  The caller
+ *   holds the allocation locks.
+ *
+ * @return 0 if success
+ *         -1 if a block cannot be read
+ */
+static int pool_return(OUFS_MOUNT *mount, OUFS_UPDATE *update, OUFS_RESERVATION *r)
+{
+    // Claim them all at once
+    unsigned int state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&r->state, &state, (state & 0xffff0000) | (state >> 16), 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+    if((state & 0xffff) >= (state >> 16))
+        return(0);
+
+    BLOCK *master = oufs_update_change(mount, update, MASTER_BLOCK_REFERENCE);
+    if(master == NULL)
+        return(-1);
+    for(int k = (int) (state >> 16) - 1; k >= (int) (state & 0xffff); --k) {
+        INODE *inode = oufs_update_inode(mount, update, r->inode[k]);
+        if(inode == NULL || oufs_update_return_block(mount, update, r->block[k]) != 0)
+            return(-1);
+        oufs_set_inode(inode, UNUSED_TYPE, 0, UNALLOCATED_BLOCK, 0);
+        oufs_master_set_inode(&master->content.master, r->inode[k], 0);
+    }
+    return(0);
+}
+
+/**
+ * Take a reserved inode and its block for the calling thread, reserving
+ *   another batch if its pool is empty.  The inode stays RESERVED_TYPE
+ *   until the caller writes it.
+ *
+ * @param near Block the new one belongs next to, if a batch is reserved
+ *             (the parent directory's)
+ * @param inode Set to the inode
+ * @param block Set to its block
+ * @return 0 if success
+ *         -1 if there is nothing left to reserve, reservations are off or
+ *            every pool is held (the caller allocates the usual way)
+ */
+int oufs_reserve_take(OUFS_MOUNT *mount, BLOCK_REFERENCE near, INODE_REFERENCE *inode,
+                      BLOCK_REFERENCE *block)
+{
+    if(mount->reserve_limit <= 0)
+        return(-1);
+    OUFS_RESERVATION *r = thread_pool(mount);
+    if(r == NULL)
+        return(-1);
+    if(pool_claim(r, inode, block) == 0)
+        return(0);
+
+    // Each batch is twice the last one
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if(update == NULL)
+        return(-1);
+    r->batch = r->batch == 0 ? 1 : r->batch * 2;
+    if(r->batch > mount->reserve_limit)
+        r->batch = mount->reserve_limit;
+    oufs_lock_allocation(mount);
+    oufs_update_init(update);
+    int n = pool_fill(mount, update, r, near, r->batch);
+
+    // The allocator has run dry: the other pools give theirs back first
+    for(int k = 0; n == 0 && k < OUFS_RESERVE_SLOTS; ++k) {
+        if(&mount->reserve[k] != r && pool_return(mount, update, &mount->reserve[k]) != 0)
+            n = -1;
+    }
+    if(n == 0)
+        n = pool_fill(mount, update, r, near, r->batch);
+    if(n >= 0 && oufs_update_write(mount, update) != 0)
+        n = -1;
+    if(n > 0)
+        __atomic_store_n(&r->state, (unsigned int) n << 16, __ATOMIC_RELEASE);
+    oufs_unlock_allocation(mount);
+    free(update);
+    return(n > 0 ? pool_claim(r, inode, block) : -1);
+}
+
+/**
+ * Hand back every pair that the threads of the mount have reserved but
+ *   not claimed, as one update
+ *
+ * @return 0 if success
+ *         -1 if the blocks cannot be read or written
+ */
+int oufs_reserve_return(OUFS_MOUNT *mount)
+{
+    int reserved = 0;
+    for(int k = 0; k < OUFS_RESERVE_SLOTS && mount->reserve_limit > 0; ++k) {
+        unsigned int state = __atomic_load_n(&mount->reserve[k].state, __ATOMIC_ACQUIRE);
+        reserved |= (state & 0xffff) < (state >> 16);
+    }
+    if(!reserved)
+        return(0);
+
+    OUFS_UPDATE *update = malloc(sizeof(OUFS_UPDATE));
+    if(update == NULL) {
+        fprintf(stderr, "oufs_reserve_return: out of memory\n");
+        return(-1);
+    }
+    int ret = 0;
+    virtual_disk_begin_transaction(mount->disk);
+    oufs_lock_allocation(mount);
+    oufs_update_init(update);
+    for(int k = 0; k < OUFS_RESERVE_SLOTS && ret == 0; ++k)
+        ret = pool_return(mount, update, &mount->reserve[k]);
+    if(ret == 0)
+        ret = oufs_update_write(mount, update);
+    oufs_unlock_allocation(mount);
+    virtual_disk_end_transaction(mount->disk);
+    free(update);
+    return(ret);
+}
@@ -1,5 +1,6 @@
 /**
-Remove a directory from the OU File System.
+Remove a directory from the OU File System.  With -r, also remove
+everything below it.
 
 CS3113
 
@@ -19,16 +20,23 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Check arguments
-  if(argc == 2) {
+  int recursive = argc == 3 && strcmp(argv[1], "-r") == 0;
+  if(argc == 2 || recursive) {
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
-
-    oufs_rmdir(cwd, argv[1]);
+    OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+    if(mount == NULL) {
+      return(-1);
+    }
+
+    if(recursive)
+      oufs_rmdir_recursive(mount, cwd, argv[2]);
+    else
+      oufs_rmdir(mount, cwd, argv[1]);
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mount);
     
   }else{
-    fprintf(stderr, "Usage: oufs_rmdir <directory name>\n");
+    fprintf(stderr, "Usage: oufs_rmdir [-r] <directory name>\n");
   }
 
 }
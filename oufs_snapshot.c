@@ -0,0 +1,166 @@
+/**
+ *  oufs_snapshot
+ *
+ *  Manages the copy-on-write snapshots of the disk (see vdisk_snapshot.c).
+ *  Taking a snapshot copies nothing; a block is copied the first time it
+ *  is overwritten afterwards.
+ *
+ *  Usage: oufs_snapshot                  list the snapshots
+ *         oufs_snapshot -c <name>        take a snapshot
+ *         oufs_snapshot -d <name>        drop a snapshot
+ *         oufs_snapshot -r <name>        bring the disk back to a snapshot
+ *         oufs_snapshot -x <name> <disk> write a snapshot out as a new disk
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oufs_lib_support.h"
+
+#define USAGE "Usage: oufs_snapshot [-c <name> | -d <name> | -r <name> | -x <name> <disk>]\n"
+
+/**
+ *  Print the snapshots, oldest first
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int list(OUFS_MOUNT *mount)
+{
+  VDISK_SNAPSHOT_INFO info[VDISK_MAX_SNAPSHOTS];
+  int n = virtual_disk_list_snapshots(mount->disk, info);
+  for(int k = 0; k < n; ++k)
+    printf("%-16s %6d %4d blocks preserved\n", info[k].name, info[k].generation,
+           info[k].preserved);
+  return(0);
+}
+
+/**
+ *  Bring the disk back to a snapshot: the blocks that differ are written
+ *   as one transaction.  The snapshot itself is kept.
+ *
+ *  @return 0 if success; -1 if error; -2 if there is no such snapshot
+ */
+static int restore(char *disk_name, char *pipe_name_base, char *name)
+{
+  unsigned char *blocks = malloc(N_BLOCKS * BLOCK_SIZE);
+  OUFS_IMAGE *image = blocks == NULL ? NULL : oufs_image_load(disk_name, pipe_name_base);
+  if(image == NULL) {
+    free(blocks);
+    return(-1);
+  }
+  virtual_disk_set_caller(VDISK_CALLER_SNAPSHOT);
+  int ret = virtual_disk_read_snapshot(image->mount->disk, name, blocks);
+  int changed = 0;
+  if(ret == 0) {
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS; ++b) {
+      if(image->damaged[b] || memcmp(&image->block[b], blocks + b * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+        memcpy(&image->block[b], blocks + b * BLOCK_SIZE, BLOCK_SIZE);
+        oufs_image_dirty(image, b);
+        ++changed;
+      }
+    }
+    ret = oufs_image_save(image);
+  }
+  if(oufs_image_close(image) != 0)
+    ret = -1;
+  if(ret == 0)
+    printf("%s: %d blocks restored from %s\n", disk_name, changed, name);
+  free(blocks);
+  return(ret);
+}
+
+/**
+ *  Write a snapshot out as a new disk
+ *
+ *  @return 0 if success; -1 if error; -2 if there is no such snapshot
+ */
+static int extract(OUFS_MOUNT *mount, char *name, char *new_disk_name, char *pipe_name_base)
+{
+  unsigned char *blocks = malloc(N_BLOCKS * BLOCK_SIZE);
+  if(blocks == NULL)
+    return(-1);
+  int ret = virtual_disk_read_snapshot(mount->disk, name, blocks);
+  if(ret == 0)
+    ret = oufs_write_image(new_disk_name, pipe_name_base, blocks);
+  free(blocks);
+  return(ret);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int op = 'l';
+  char *name = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "c:d:r:x:")) != -1) {
+    switch(opt) {
+    case 'c':
+    case 'd':
+    case 'r':
+    case 'x':
+      if(op != 'l') {
+        fprintf(stderr, USAGE);
+        return(-1);
+      }
+      op = opt;
+      name = optarg;
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return(-1);
+    }
+  }
+  if(argc - optind != (op == 'x' ? 1 : 0)) {
+    fprintf(stderr, USAGE);
+    return(-1);
+  }
+  if(op == 'x' && strcmp(argv[optind], disk_name) == 0) {
+    fprintf(stderr, "oufs_snapshot: %s is the disk itself\n", argv[optind]);
+    return(-1);
+  }
+
+  int ret;
+  if(op == 'r') {
+    ret = restore(disk_name, pipe_name_base, name);
+  }else{
+    // Open the virtual disk
+    OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+    if(mount == NULL)
+      return(-1);
+    virtual_disk_set_caller(VDISK_CALLER_SNAPSHOT);
+
+    // Pending changes go to the disk before a snapshot is taken
+    ret = oufs_cache_lock(mount);
+    if(ret == 0) {
+      switch(op) {
+      case 'c':
+        ret = virtual_disk_create_snapshot(mount->disk, name);
+        break;
+      case 'd':
+        ret = virtual_disk_delete_snapshot(mount->disk, name);
+        break;
+      case 'x':
+        ret = extract(mount, name, argv[optind], pipe_name_base);
+        break;
+      default:
+        ret = list(mount);
+        break;
+      }
+    }
+    if(oufs_unmount(mount) != 0)
+      ret = -1;
+  }
+
+  if(ret == -2)
+    fprintf(stderr, "oufs_snapshot: %s: no such snapshot, name in use or no free slot\n", name);
+  else if(ret != 0)
+    fprintf(stderr, "Error (%d)\n", ret);
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,126 @@
+/**
+ *  oufs_tree
+ *
+ *  Shows a subtree, one entry per line, indented by depth.  The tree is
+ *  walked by several threads (see oufs_walk.c) and then put in order.
+ *
+ *  Usage: oufs_tree [-j threads] [<name>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+// An entry as it will be shown
+typedef struct
+{
+  char *path;
+  char *name;
+  int depth;
+  int directory;
+} TREE_LINE;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  TREE_LINE *line;
+  int n;
+  int size;
+} TREE;
+
+/**
+ *  Keep an entry (called by the walk)
+ */
+static int collect(const OUFS_WALK_ENTRY *entry, void *arg)
+{
+  TREE *tree = arg;
+  int ret = 0;
+  pthread_mutex_lock(&tree->lock);
+  if(tree->n == tree->size) {
+    int size = tree->size ? 2 * tree->size : 256;
+    TREE_LINE *line = realloc(tree->line, size * sizeof(TREE_LINE));
+    if(line == NULL) {
+      pthread_mutex_unlock(&tree->lock);
+      fprintf(stderr, "oufs_tree: out of memory\n");
+      return(-1);
+    }
+    tree->line = line;
+    tree->size = size;
+  }
+  TREE_LINE *l = &tree->line[tree->n];
+  l->path = strdup(entry->path);
+  l->name = strdup(entry->depth == 0 ? entry->path : entry->name);
+  l->depth = entry->depth;
+  l->directory = entry->type == DIRECTORY_TYPE;
+  if(l->path == NULL || l->name == NULL) {
+    free(l->path);
+    free(l->name);
+    ret = -1;
+  }else{
+    ++tree->n;
+  }
+  pthread_mutex_unlock(&tree->lock);
+  return(ret);
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+  return(oufs_walk_compare_paths(((const TREE_LINE *) a)->path, ((const TREE_LINE *) b)->path));
+}
+
+int main(int argc, char **argv)
+{
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  int threads = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "j:")) != -1) {
+    switch(opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: oufs_tree [-j threads] [<name>]\n");
+      return(-1);
+    }
+  }
+  if(argc - optind > 1) {
+    fprintf(stderr, "Usage: oufs_tree [-j threads] [<name>]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mount = oufs_mount(disk_name, pipe_name_base);
+  if(mount == NULL) {
+    return(-1);
+  }
+
+  TREE tree = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+  int ret = oufs_walk(mount, cwd, optind < argc ? argv[optind] : "", threads, collect, &tree);
+  if(ret == 0) {
+    qsort(tree.line, tree.n, sizeof(TREE_LINE), compare_lines);
+    for(int i = 0; i < tree.n; ++i) {
+      printf("%*s%s%s\n", 2 * tree.line[i].depth, "", tree.line[i].name,
+             tree.line[i].directory && tree.line[i].depth > 0 ? "/" : "");
+    }
+  }else{
+    fprintf(stderr, "Error (%d)\n", ret);
+  }
+  for(int i = 0; i < tree.n; ++i) {
+    free(tree.line[i].path);
+    free(tree.line[i].name);
+  }
+  free(tree.line);
+
+  // Clean up
+  oufs_unmount(mount);
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,418 @@
+/**
+ *  oufs_walk.c
+ *
+ *  Walks a subtree with several threads.  Every directory still to be
+ *  listed is a task.  Each thread keeps its own queue of tasks: it adds
+ *  the directories it finds at the back and takes its next task from the
+ *  back as well (so it stays on the part of the tree whose blocks it has
+ *  just loaded), while a thread that runs out of work steals from the
+ *  front of another thread's queue (where the largest subtrees are).
+ *
+ *  Directories are read without locks, like oufs_list() does.  When a
+ *  directory has been read, the blocks of all of its subdirectories are
+ *  loaded into the cache with one batch of reads, before any thread gets
+ *  to them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include "oufs_lib_support.h"
+#include "virtual_disk.h"
+
+// Most threads in a walk
+#define OUFS_WALK_MAX_THREADS 64
+
+// Times an idle thread yields before it starts to sleep between looks
+#define OUFS_WALK_SPINS 64
+
+// A directory still to be listed
+typedef struct walk_task_s
+{
+    INODE_REFERENCE inode;
+    int depth;
+    char *path;
+} WALK_TASK;
+
+// Tasks of one thread: its own end is the back, thieves take the front
+typedef struct
+{
+    pthread_mutex_t lock;
+    WALK_TASK *task;
+    int front;
+    int back;
+    int size;
+} __attribute__((aligned(OUFS_CACHE_LINE))) WALK_QUEUE;
+
+typedef struct walk_s
+{
+    OUFS_MOUNT *mount;
+    OUFS_WALK_FN fn;
+    void *arg;
+
+    int n_threads;
+    WALK_QUEUE *queue;
+
+    // Tasks queued or being worked on; the walk is over at 0
+    long pending;
+
+    // Set when the callback asks to stop, and when a directory cannot be read
+    int stop;
+    int error;
+} WALK;
+
+typedef struct
+{
+    WALK *walk;
+    int self;
+} WALK_THREAD;
+
+/**
+ * Add a task at the back of a queue (the task owns path from here on)
+ *
+ * @return 0 if success; -1 if out of memory
+ */
+static int walk_push(WALK *walk, int self, INODE_REFERENCE inode, int depth, char *path)
+{
+    WALK_QUEUE *q = &walk->queue[self];
+    pthread_mutex_lock(&q->lock);
+    if(q->back == q->size) {
+        int size = q->size ? 2 * q->size : 64;
+        WALK_TASK *task = realloc(q->task, size * sizeof(WALK_TASK));
+        if(task == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return(-1);
+        }
+        q->task = task;
+        q->size = size;
+    }
+    q->task[q->back++] = (WALK_TASK) {inode, depth, path};
+    __atomic_add_fetch(&walk->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+    return(0);
+}
+
+/**
+ * Take a task from a queue
+ *
+ * @param from_back 1 for the owner of the queue; 0 for a thief
+ * @return 0 if a task was taken; -1 if the queue is empty
+ */
+static int walk_take(WALK_QUEUE *q, int from_back, WALK_TASK *task)
+{
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    if(q->front < q->back) {
+        *task = from_back ? q->task[--q->back] : q->task[q->front++];
+        if(q->front == q->back)
+            q->front = q->back = 0;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return(ret);
+}
+
+/**
+ * Find the next task: from the thread's own queue, or else stolen from
+ *   the others, starting with the next thread along
+ *
+ * @return 0 if a task was found; -1 if every queue is empty
+ */
+static int walk_next(WALK *walk, int self, WALK_TASK *task)
+{
+    if(walk_take(&walk->queue[self], 1, task) == 0)
+        return(0);
+    for(int k = 1; k < walk->n_threads; ++k) {
+        if(walk_take(&walk->queue[(self + k) % walk->n_threads], 0, task) == 0)
+            return(0);
+    }
+    return(-1);
+}
+
+/**
+ * @param parent Path of a directory
+ * @param name Name of an entry in it
+ * @return The path of the entry (to be freed); NULL if out of memory
+ */
+static char *walk_join(const char *parent, const char *name)
+{
+    size_t len = strlen(parent);
+    char *path = malloc(len + strlen(name) + 2);
+    if(path != NULL) {
+        strcpy(path, parent);
+        if(len == 0 || parent[len - 1] != '/')
+            strcat(path, "/");
+        strcat(path, name);
+    }
+    return(path);
+}
+
+/**
+ * List one directory: hand its entries to the callback and queue its
+ *   subdirectories
+ *
+ * @param self Thread that does the work
+ * @param task Directory to list
+ */
+static void walk_directory(WALK *walk, int self, WALK_TASK *task)
+{
+    OUFS_MOUNT *mount = walk->mount;
+    INODE inode;
+    BLOCK b;
+    unsigned int seq;
+
+    // The directory as it was at one moment
+    do {
+        seq = oufs_read_begin(mount, task->inode);
+        if(oufs_read_inode_by_reference(mount, task->inode, &inode) != 0) {
+            __atomic_store_n(&walk->error, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        // Removed while the walk was on its way
+        if(inode.type != DIRECTORY_TYPE)
+            return;
+        if(oufs_read_block(mount, inode.content, &b) != 0) {
+            fprintf(stderr, "oufs_walk: unable to read %s\n", task->path);
+            __atomic_store_n(&walk->error, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while(oufs_read_retry(mount, task->inode, seq));
+
+    // Its entries, and the blocks of the subdirectories to load at once
+    INODE_REFERENCE child_ref[N_DIRECTORY_ENTRIES_PER_BLOCK];
+    INODE child[N_DIRECTORY_ENTRIES_PER_BLOCK];
+    char name[N_DIRECTORY_ENTRIES_PER_BLOCK][FILE_NAME_SIZE + 1];
+    BLOCK_REFERENCE prefetch[N_DIRECTORY_ENTRIES_PER_BLOCK];
+    int n = 0;
+    int n_prefetch = 0;
+    for(int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+        DIRECTORY_ENTRY *e = &b.content.directory.entry[i];
+        if(e->inode_reference >= N_INODES || strcmp(e->name, ".") == 0
+           || strcmp(e->name, "..") == 0)
+            continue;
+        do {
+            seq = oufs_read_begin(mount, e->inode_reference);
+            if(oufs_read_inode_by_reference(mount, e->inode_reference, &child[n]) != 0) {
+                __atomic_store_n(&walk->error, 1, __ATOMIC_RELAXED);
+                return;
+            }
+        } while(oufs_read_retry(mount, e->inode_reference, seq));
+        if(child[n].type == UNUSED_TYPE)
+            continue;
+        child_ref[n] = e->inode_reference;
+        memcpy(name[n], e->name, FILE_NAME_SIZE);
+        name[n][FILE_NAME_SIZE] = 0;
+        if(child[n].type == DIRECTORY_TYPE && child[n].content < N_BLOCKS)
+            prefetch[n_prefetch++] = child[n].content;
+        ++n;
+    }
+    oufs_prefetch_blocks(mount, prefetch, n_prefetch);
+
+    for(int i = 0; i < n && !__atomic_load_n(&walk->stop, __ATOMIC_RELAXED); ++i) {
+        char *path = walk_join(task->path, name[i]);
+        if(path == NULL) {
+            fprintf(stderr, "oufs_walk: out of memory\n");
+            __atomic_store_n(&walk->error, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        OUFS_WALK_ENTRY entry = {path, name[i], child_ref[i], task->inode, task->depth + 1,
+                                 child[i].type, child[i].size};
+        int ret = walk->fn(&entry, walk->arg);
+        if(ret < 0) {
+            __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+        }else if(ret == 0 && child[i].type == DIRECTORY_TYPE) {
+            if(walk_push(walk, self, child_ref[i], task->depth + 1, path) == 0)
+                continue;
+            fprintf(stderr, "oufs_walk: out of memory\n");
+            __atomic_store_n(&walk->error, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+        }
+        free(path);
+    }
+}
+
+/**
+ * Work on tasks until there are none left anywhere
+ */
+static void *walk_thread(void *arg)
+{
+    WALK_THREAD *t = arg;
+    WALK *walk = t->walk;
+    WALK_TASK task;
+    int idle = 0;
+    virtual_disk_set_caller(VDISK_CALLER_WALK);
+
+    while(!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED)) {
+        if(walk_next(walk, t->self, &task) == 0) {
+            idle = 0;
+            walk_directory(walk, t->self, &task);
+            free(task.path);
+            // The subdirectories were counted before the task is let go
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_RELEASE);
+        }else if(__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }else if(++idle < OUFS_WALK_SPINS) {
+            sched_yield();
+        }else{
+            struct timespec pause = {0, 50000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return(NULL);
+}
+
+/**
+ * Absolute path of a file, with the /'s that do not separate names taken out
+ *
+ * @param cwd Absolute path for the current working directory
+ * @param path Absolute or relative path
+ * @param full Buffer of MAX_PATH_LENGTH bytes for the result
+ */
+static void walk_full_path(char *cwd, char *path, char *full)
+{
+    char joined[2 * MAX_PATH_LENGTH + 2];
+    snprintf(joined, sizeof(joined), "%s/%s", path[0] == '/' ? "" : cwd, path);
+    int n = 0;
+    for(char *p = joined; *p != 0 && n < MAX_PATH_LENGTH - 1; ++p) {
+        if(*p != '/' || n == 0 || full[n - 1] != '/')
+            full[n++] = *p;
+    }
+    if(n > 1 && full[n - 1] == '/')
+        --n;
+    full[n] = 0;
+}
+
+/**
+ * oufs_walk(), with the trace tag set by the caller
+ */
+static int walk_subtree(OUFS_MOUNT *mount, char *cwd, char *path, int threads,
+                        OUFS_WALK_FN fn, void *arg)
+{
+    INODE_REFERENCE parent;
+    INODE_REFERENCE child;
+    char name[FILE_NAME_SIZE + 1] = "";
+    char full[MAX_PATH_LENGTH];
+    INODE inode;
+
+    // The starting point
+    if(oufs_find_file(mount, cwd, path, &parent, &child, name) != 0
+       || child == UNALLOCATED_INODE) {
+        fprintf(stderr, "Not found\n");
+        return(-1);
+    }
+    if(oufs_read_inode_by_reference(mount, child, &inode) != 0) {
+        return(-2);
+    }
+    walk_full_path(cwd, path, full);
+    OUFS_WALK_ENTRY entry = {full, name[0] ? name : "/", child, parent, 0,
+                             inode.type, inode.size};
+    int ret = fn(&entry, arg);
+    if(ret != 0 || inode.type != DIRECTORY_TYPE)
+        return(ret < 0 ? 1 : 0);
+
+    // The threads
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+    if(threads > OUFS_WALK_MAX_THREADS)
+        threads = OUFS_WALK_MAX_THREADS;
+
+    WALK walk = {mount, fn, arg, threads, NULL, 0, 0, 0};
+    walk.queue = aligned_alloc(OUFS_CACHE_LINE, threads * sizeof(WALK_QUEUE));
+    char *start = strdup(full);
+    if(walk.queue == NULL || start == NULL) {
+        fprintf(stderr, "oufs_walk: out of memory\n");
+        free(walk.queue);
+        free(start);
+        return(-2);
+    }
+    memset(walk.queue, 0, threads * sizeof(WALK_QUEUE));
+    for(int k = 0; k < threads; ++k) {
+        pthread_mutex_init(&walk.queue[k].lock, NULL);
+    }
+
+    WALK_THREAD t[OUFS_WALK_MAX_THREADS];
+    pthread_t tid[OUFS_WALK_MAX_THREADS];
+    int started = 1;
+    if(walk_push(&walk, 0, child, 0, start) != 0) {
+        free(start);
+        walk.error = 1;
+    }else{
+        // This thread is thread 0
+        for(int k = 0; k < threads; ++k) {
+            t[k] = (WALK_THREAD) {&walk, k};
+        }
+        while(started < threads && pthread_create(&tid[started], NULL, walk_thread, &t[started]) == 0) {
+            ++started;
+        }
+        walk_thread(&t[0]);
+        for(int k = 1; k < started; ++k) {
+            pthread_join(tid[k], NULL);
+        }
+    }
+
+    // Tasks left behind by a walk that was stopped
+    for(int k = 0; k < threads; ++k) {
+        WALK_QUEUE *q = &walk.queue[k];
+        for(int i = q->front; i < q->back; ++i) {
+            free(q->task[i].path);
+        }
+        free(q->task);
+        pthread_mutex_destroy(&q->lock);
+    }
+    free(walk.queue);
+
+    if(walk.error)
+        return(-2);
+    return(walk.stop ? 1 : 0);
+}
+
+/**
+ * Visit every file and directory in a subtree
+ *
+ * The callback sees the starting point first, and every other entry after
+ *  the directory that holds it; apart from that, the order is not fixed.
+ *  It is called from several threads at once.  "." and ".." are not
+ *  visited.
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path of the starting point
+ * @param threads Threads to use (0: one per processor)
+ * @param fn Called for every entry
+ * @param arg Handed to fn
+ * @return 0 if success
+ *         1 if the callback stopped the walk
+ *         -1 if the starting point was not found
+ *         -2 if part of the tree could not be read
+ */
+int oufs_walk(OUFS_MOUNT *mount, char *cwd, char *path, int threads,
+              OUFS_WALK_FN fn, void *arg)
+{
+    int caller = virtual_disk_set_caller(VDISK_CALLER_WALK);
+    int ret = walk_subtree(mount, cwd, path, threads, fn, arg);
+    virtual_disk_set_caller(caller);
+    return(ret);
+}
+
+/**
+ * Order paths as a listing shows them: a directory comes right before
+ *   what is in it, and names within a directory are in strcmp() order
+ *
+ * @return <0, 0 or >0, as for strcmp()
+ */
+int oufs_walk_compare_paths(const char *a, const char *b)
+{
+    for(; *a != 0 && *a == *b; ++a, ++b)
+        ;
+    if(*a == *b)
+        return(0);
+    if(*a == '/' || *b == '/')
+        return(*a == '/' ? (*b == 0 ? 1 : -1) : (*a == 0 ? -1 : 1));
+    return((unsigned char) *a - (unsigned char) *b);
+}
@@ -6,31 +6,64 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <string.h>
+#include <fcntl.h>
 #include "storage.h"
 
+// Known backends (the plain file backend is the default)
+static const STORAGE_OPS *BACKENDS[] = {&STORAGE_FILE_OPS, &STORAGE_URING_OPS,
+                                        &STORAGE_DIRECT_OPS, &STORAGE_MEM_OPS,
+                                        &STORAGE_STRIPE_OPS, &STORAGE_MIRROR_OPS, NULL};
+
+/**
+ * Split a storage name into its backend and the name the backend sees
+ *
+ * @param name Storage name, possibly prefixed with a scheme
+ * @param rest Set to the name without the scheme
+ * @return The backend
+ */
+static const STORAGE_OPS *find_backend(char *name, char **rest)
+{
+  *rest = name;
+  for(int i = 0; BACKENDS[i] != NULL; ++i) {
+    size_t len = strlen(BACKENDS[i]->scheme);
+    if(strncmp(name, BACKENDS[i]->scheme, len) == 0 && name[len] == ':') {
+      *rest = name + len + 1;
+      return(BACKENDS[i]);
+    }
+  }
+  return(&STORAGE_FILE_OPS);
+}
+
 /**
  * Initialize the storage file
  *
- * @param name Name of the storage file
+ * @param name Name of the storage file, optionally prefixed with the
+ *   backend scheme ("uring:vdisk1", "direct:vdisk1", "mem:scratch",
+ *   "stripe:4096:vdisk1a,vdisk1b", "mirror:vdisk1a,vdisk1b")
  * @return NULL if there is an error;
  *         otherwise, a poiner to the initialized STORAGE object
  */
 
 STORAGE * init_storage(char * name, char *pipe_name_base)
 {
-  // Open the file
-  int fd = open(name, O_RDWR | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-  // Is there an error?
-  if(fd <= 0) {
-    fprintf(stderr, "Unable to open %s\n", name);
-    return NULL;
-  }
+  // Select the backend
+  const STORAGE_OPS *ops = find_backend(name, &name);
 
   // Allocate the STORAGE object and populate it
   STORAGE *s = malloc(sizeof(STORAGE));
-  s->fd = fd;
+  if(s == NULL)
+    return NULL;
+  s->ops = ops;
+  s->fd = -1;
+  s->backend = NULL;
+
+  // Open the backend
+  if(ops->open(s, name) != 0) {
+    free(s);
+    return NULL;
+  }
 
   // Success
   return s;
@@ -46,45 +79,220 @@ STORAGE * init_storage(char * name, char *pipe_name_base)
  */
 int close_storage(STORAGE *storage)
 {
-  // Close the storage file
-  int ret = close(storage->fd);
+  // Close the backend
+  int ret = storage->ops->close(storage);
 
-  // Was there an error?
-  if(ret < 0) {
-    fprintf(stderr, "Unable to close storage.\n");
-    return(-1);
-  };
-
-  // Closed: now free the allocated space
+  // Now free the allocated space
   free(storage);
-
-  // Success
-  return(0);
+  return(ret);
 }
 
 /**
- *  Read a set of bytes from the storage file.
+ *  Read a set of bytes from the storage file.  Safe to call from several
+ *   threads at once (there is no shared file position).
  *
  * @param storage A pointer to an initialized storage object
  * @param buf The buffer to place the read bytes into
  * @param location The point in the file to start reading from
  * @param len The number of bytes to read
- * @return -1 if an error; 
+ * @return -1 if an error;
  *         otherwise, the number of bytes read from the storage file
  */
 int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
 {
-  // Seek to the starting location
-  int ret = lseek(storage->fd, location, SEEK_SET);
+  return(storage->ops->get(storage, buf, location, len));
+};
+
+/**
+ *  Write a set of bytes to the storage file.  Safe to call from several
+ *   threads at once.
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param buf The buffer containing the bytes to be written
+ * @param location The point in the file to start writing to
+ * @param len The number of bytes to write
+ * @return -1 if an error;
+ *         otherwise, the number of bytes written to the storage file
+ */
+int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  return(storage->ops->put(storage, buf, location, len));
+};
+
+
+/**
+ *  Force all written bytes of the storage file to stable storage
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param data_only Only the data (and the file size) must be durable,
+ *    not the other file metadata (fdatasync)
+ * @return -1 if an error; 0 on success
+ */
+int sync_storage(STORAGE *storage, int data_only)
+{
+  return(storage->ops->sync(storage, data_only));
+};
+
+/**
+ *  Start an asynchronous transfer.  The request (and its buffer) must stay
+ *   put until wait_bytes() has returned for it.  Queued requests may wait
+ *   to be handed to the device until submit_storage() or wait_bytes().
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param request The transfer (write, buf, location and len filled in)
+ * @return -1 if the request could not be queued; 0 on success
+ */
+int queue_bytes(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  request->done = 0;
+  if(storage->ops->queue != NULL)
+    return(storage->ops->queue(storage, request));
+
+  // Synchronous backend
+  if(request->write)
+    request->result = put_bytes(storage, request->buf, request->location, request->len);
+  else
+    request->result = get_bytes(storage, request->buf, request->location, request->len);
+  request->done = 1;
+  return(0);
+}
+
+/**
+ *  Hand all queued requests to the device
+ *
+ * @param storage A pointer to an initialized storage object
+ * @return -1 if an error; 0 on success
+ */
+int submit_storage(STORAGE *storage)
+{
+  if(storage->ops->submit != NULL)
+    return(storage->ops->submit(storage));
+  return(0);
+}
+
+/**
+ *  Wait for an asynchronous transfer to complete
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param request A request started with queue_bytes()
+ * @return -1 if an error;
+ *         otherwise, the number of bytes transferred
+ */
+int wait_bytes(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  // Completed when it was started (or never handed to the backend)
+  if(request->done)
+    return(request->result);
+  if(storage->ops->wait != NULL)
+    return(storage->ops->wait(storage, request));
+  return(request->result);
+}
+
+/**
+ *  The file that holds a storage object
+ *
+ * @param name Storage name as given to init_storage()
+ * @return The file name (within name); NULL if the backend does not keep
+ *         the disk in a single file
+ */
+char *storage_file_name(char *name)
+{
+  const STORAGE_OPS *ops = find_backend(name, &name);
+  return(ops->file_backed ? name : NULL);
+}
+
+/**
+ *  Striping of a storage object (so that readers can keep every backing
+ *   file busy)
+ *
+ * @param storage A pointer to an initialized storage object
+ * @return Bytes in one full stripe (one unit on every backing file);
+ *         0 if the storage is not striped
+ */
+int storage_stripe_size(STORAGE *storage)
+{
+  if(storage->ops->stripe_size != NULL)
+    return(storage->ops->stripe_size(storage));
+  return(0);
+}
+
+/**
+ *  Give the space of a range back to the host.  The range reads as zeros
+ *   afterwards.
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param location First byte of the range
+ * @param len Number of bytes
+ * @return -1 if the backend cannot do it or an error; 0 on success
+ */
+int discard_bytes(STORAGE *storage, int location, int len)
+{
+  if(storage->ops->discard == NULL)
+    return(-1);
+  return(storage->ops->discard(storage, location, len));
+}
+
+/**********************************************************************/
+// Plain file backend
+
+/**
+ * Open (or create) the storage file
+ *
+ * @param name Name of the storage file
+ * @param flags Flags to open(2) in addition to O_RDWR | O_CREAT
+ * @return -1 if the file cannot be opened; 0 on success
+ */
+int storage_file_open(STORAGE *storage, char *name, int flags)
+{
+  // Open the file
+  int fd = open(name, O_RDWR | O_CREAT | flags,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+  // Is there an error?
+  if(fd <= 0) {
+    fprintf(stderr, "Unable to open %s\n", name);
+    return(-1);
+  }
+  storage->fd = fd;
+  return(0);
+}
+
+static int file_open(STORAGE *storage, char *name)
+{
+  return(storage_file_open(storage, name, 0));
+}
+
+/**
+ * Close the storage file
+ *
+ * @return -1 on error; 0 on success
+ */
+int storage_file_close(STORAGE *storage)
+{
+  // Close the storage file
+  int ret = close(storage->fd);
 
   // Was there an error?
   if(ret < 0) {
-    fprintf(stderr, "Unable to seek\n");
+    fprintf(stderr, "Unable to close storage.\n");
     return(-1);
   };
 
-  // Read the bytes
-  if((ret = read(storage->fd, buf, len)) < 0){
+  // Success
+  return(0);
+}
+
+/**
+ * Read bytes from the storage file
+ *
+ * @return -1 if an error; otherwise, the number of bytes read
+ */
+int storage_file_get(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  int ret;
+
+  // Read the bytes at the starting location
+  if((ret = pread(storage->fd, buf, len, location)) < 0){
     // There was a reading error
     fprintf(stderr, "Error reading fd\n");
     return(-1);
@@ -92,31 +300,19 @@ int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
 
   // Success: return the number of bytes read
   return(ret);
-};
+}
 
 /**
- *  Write a set of bytes to the storage file
+ * Write bytes to the storage file
  *
- * @param storage A pointer to an initialized storage object
- * @param buf The buffer containing the bytes to be written
- * @param location The point in the file to start writing to
- * @param len The number of bytes to write
- * @return -1 if an error; 
- *         otherwise, the number of bytes written to the storage file
+ * @return -1 if an error; otherwise, the number of bytes written
  */
-int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
+int storage_file_put(STORAGE *storage, unsigned char *buf, int location, int len)
 {
-  // Seek to the point in the file
-  int ret = lseek(storage->fd, location, SEEK_SET);
+  int ret;
 
-  // Was there an error?
-  if(ret < 0) {
-    fprintf(stderr, "Unable to seek\n");
-    return(-1);
-  };
-
-  // Write te  bytes to the  file
-  if((ret = write(storage->fd, buf, len)) < 0){
+  // Write the bytes at the point in the file
+  if((ret = pwrite(storage->fd, buf, len, location)) < 0){
     // There was an error
     fprintf(stderr, "Error reading fd\n");
     return(-1);
@@ -124,5 +320,46 @@ int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
 
   // Success: return the number of bytes written
   return(ret);
-};
+}
 
+/**
+ * fsync (or fdatasync) the storage file
+ *
+ * @return -1 if an error; 0 on success
+ */
+int storage_file_sync(STORAGE *storage, int data_only)
+{
+  int ret = data_only ? fdatasync(storage->fd) : fsync(storage->fd);
+  if(ret < 0) {
+    fprintf(stderr, "Unable to sync storage\n");
+    return(-1);
+  };
+
+  // Success
+  return(0);
+}
+
+/**
+ * Punch a hole in the storage file (the file keeps its size).  Only whole
+ *   blocks of the host file system are released; the rest of the range
+ *   is zeroed.
+ *
+ * @return -1 if the file system cannot do it or an error; 0 on success
+ */
+int storage_file_discard(STORAGE *storage, int location, int len)
+{
+  if(fallocate(storage->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, location, len) < 0)
+    return(-1);
+  return(0);
+}
+
+const STORAGE_OPS STORAGE_FILE_OPS = {
+  .scheme = "file",
+  .file_backed = 1,
+  .open = file_open,
+  .close = storage_file_close,
+  .get = storage_file_get,
+  .put = storage_file_put,
+  .sync = storage_file_sync,
+  .discard = storage_file_discard,
+};
@@ -1,3 +1,6 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -5,14 +8,89 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-typedef struct 
+typedef struct storage_s STORAGE;
+
+// One asynchronous transfer (see queue_bytes())
+typedef struct storage_request_s
+{
+  // Filled in by the caller
+  int write;
+  unsigned char *buf;
+  int location;
+  int len;
+
+  // Filled in when the transfer is complete: number of bytes or -1
+  int result;
+  int done;
+
+  // For the backend
+  void *backend;
+} STORAGE_REQUEST;
+
+// A storage backend.  The name given to init_storage() selects one by its
+//  scheme ("uring:vdisk1"); names without a scheme are plain files.
+typedef struct storage_ops_s
+{
+  const char *scheme;
+
+  // The name (after the scheme) is that of a single file holding the disk
+  int file_backed;
+
+  int (*open)(STORAGE *storage, char *name);
+  int (*close)(STORAGE *storage);
+  int (*get)(STORAGE *storage, unsigned char *buf, int location, int len);
+  int (*put)(STORAGE *storage, unsigned char *buf, int location, int len);
+  int (*sync)(STORAGE *storage, int data_only);
+
+  // Bytes in one full stripe (NULL: the disk is not striped)
+  int (*stripe_size)(STORAGE *storage);
+
+  // Give the space of a range back; it reads as zeros afterwards (NULL:
+  //  not supported)
+  int (*discard)(STORAGE *storage, int location, int len);
+
+  // Asynchronous transfers.  NULL: queue_bytes() does the transfer at once.
+  int (*queue)(STORAGE *storage, STORAGE_REQUEST *request);
+  int (*submit)(STORAGE *storage);
+  int (*wait)(STORAGE *storage, STORAGE_REQUEST *request);
+} STORAGE_OPS;
+
+struct storage_s
 {
+  const STORAGE_OPS *ops;
   int fd;
-} STORAGE;
+
+  // Backend state
+  void *backend;
+};
 
 
 STORAGE * init_storage(char * name, char *pipe_name_base);
 int close_storage(STORAGE *storage);
 int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len);
 int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len);
+int sync_storage(STORAGE *storage, int data_only);
+int queue_bytes(STORAGE *storage, STORAGE_REQUEST *request);
+int submit_storage(STORAGE *storage);
+int wait_bytes(STORAGE *storage, STORAGE_REQUEST *request);
+char *storage_file_name(char *name);
+int storage_stripe_size(STORAGE *storage);
+int discard_bytes(STORAGE *storage, int location, int len);
+
+// Backends
+extern const STORAGE_OPS STORAGE_FILE_OPS;
+extern const STORAGE_OPS STORAGE_URING_OPS;
+extern const STORAGE_OPS STORAGE_DIRECT_OPS;
+extern const STORAGE_OPS STORAGE_MEM_OPS;
+extern const STORAGE_OPS STORAGE_STRIPE_OPS;
+extern const STORAGE_OPS STORAGE_MIRROR_OPS;
+
+// Plain file operations (for backends that keep their data in storage->fd)
+int storage_file_open(STORAGE *storage, char *name, int flags);
+int storage_file_close(STORAGE *storage);
+int storage_file_get(STORAGE *storage, unsigned char *buf, int location, int len);
+int storage_file_put(STORAGE *storage, unsigned char *buf, int location, int len);
+int storage_file_sync(STORAGE *storage, int data_only);
+int storage_file_discard(STORAGE *storage, int location, int len);
 
+#endif
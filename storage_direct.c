@@ -0,0 +1,246 @@
+/**
+ *  storage_direct.c
+ *
+ *  Storage backend that bypasses the kernel page cache ("direct:name").
+ *  The file is opened with O_DIRECT, so every transfer must cover whole
+ *  logical blocks of the device, and the memory must be aligned too.
+ *  Requests are widened to those blocks through aligned bounce buffers.
+ *
+ *  Writes are coalesced: the last device block that was written is kept
+ *  in memory, and later writes that fall inside it only change that copy.
+ *  It is written out when a write goes elsewhere, and at sync and close
+ *  (like the write cache of a disk: only a sync makes writes durable).
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "storage.h"
+
+// Alignment to use when the device does not say
+#define DIRECT_DEFAULT_ALIGN 4096
+
+typedef struct
+{
+  // Device block size (offsets and lengths) and memory alignment
+  int align;
+  int mem_align;
+
+  // Serializes every transfer (they share the write-back block)
+  pthread_mutex_t lock;
+
+  // Write-back block: device block number (-1 if none) and its contents
+  long pending;
+  unsigned char *pending_buf;
+} DIRECT;
+
+/**
+ *  Find the alignment that O_DIRECT transfers need on this file
+ */
+static void direct_alignment(int fd, DIRECT *d)
+{
+  d->align = d->mem_align = DIRECT_DEFAULT_ALIGN;
+
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+  if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+     && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0) {
+    d->align = stx.stx_dio_offset_align;
+    d->mem_align = stx.stx_dio_mem_align;
+    return;
+  }
+#endif
+
+  // Block device: its logical block size
+  int size;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &size) == 0
+     && size > 0)
+    d->align = d->mem_align = size;
+}
+
+/**
+ *  Read whole device blocks into an aligned buffer.  Blocks past the end of
+ *   the file read as zeros.
+ *
+ *  @return -1 if error; otherwise the number of bytes that exist in the file
+ */
+static int direct_read(STORAGE *storage, unsigned char *buf, long offset, int len)
+{
+  int ret = pread(storage->fd, buf, len, offset);
+  if(ret < 0) {
+    fprintf(stderr, "Error reading fd\n");
+    return(-1);
+  }
+  if(ret < len)
+    memset(buf + ret, 0, len - ret);
+  return(ret);
+}
+
+/**
+ *  Write out the write-back block.  Called with d->lock held.
+ *
+ *  @return -1 if error; 0 if success
+ */
+static int direct_write_back(STORAGE *storage, DIRECT *d)
+{
+  if(d->pending < 0)
+    return(0);
+  int ret = pwrite(storage->fd, d->pending_buf, d->align, d->pending * d->align);
+  d->pending = -1;
+  if(ret != d->align) {
+    fprintf(stderr, "Error writing fd\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ *  Bounce buffer covering [location, location + len) widened to device
+ *   blocks
+ */
+static unsigned char *direct_bounce(DIRECT *d, int location, int len, long *first, int *span)
+{
+  *first = location / d->align;
+  long last = (location + len + d->align - 1) / d->align;
+  *span = (last - *first) * d->align;
+  void *buf;
+  if(posix_memalign(&buf, d->mem_align, *span) != 0)
+    return(NULL);
+  return(buf);
+}
+
+static int direct_open(STORAGE *storage, char *name)
+{
+  if(storage_file_open(storage, name, O_DIRECT) != 0)
+    return(-1);
+
+  DIRECT *d = malloc(sizeof(DIRECT));
+  if(d == NULL) {
+    storage_file_close(storage);
+    return(-1);
+  }
+  direct_alignment(storage->fd, d);
+  if(posix_memalign((void **)&d->pending_buf, d->mem_align, d->align) != 0) {
+    free(d);
+    storage_file_close(storage);
+    return(-1);
+  }
+  d->pending = -1;
+  pthread_mutex_init(&d->lock, NULL);
+  storage->backend = d;
+  return(0);
+}
+
+static int direct_close(STORAGE *storage)
+{
+  DIRECT *d = storage->backend;
+  int ret = direct_write_back(storage, d);
+  pthread_mutex_destroy(&d->lock);
+  free(d->pending_buf);
+  free(d);
+  if(storage_file_close(storage) != 0)
+    ret = -1;
+  return(ret);
+}
+
+static int direct_get(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  DIRECT *d = storage->backend;
+  long first;
+  int span;
+  unsigned char *bounce = direct_bounce(d, location, len, &first, &span);
+  if(bounce == NULL)
+    return(-1);
+
+  pthread_mutex_lock(&d->lock);
+  int ret = direct_read(storage, bounce, first * d->align, span);
+  long size = first * d->align + (ret < 0 ? 0 : ret);
+
+  // The write-back block is newer than the file
+  if(ret >= 0 && d->pending >= first && d->pending * d->align < first * d->align + span) {
+    memcpy(bounce + (d->pending - first) * d->align, d->pending_buf, d->align);
+    if(size < (d->pending + 1) * d->align)
+      size = (d->pending + 1) * d->align;
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  if(ret >= 0) {
+    memcpy(buf, bounce + (location - first * d->align), len);
+    // Bytes that exist (as for pread at the end of the file)
+    ret = size <= location ? 0 : (size < location + len ? size - location : len);
+  }
+  free(bounce);
+  return(ret);
+}
+
+static int direct_put(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  DIRECT *d = storage->backend;
+  int ret = len;
+  pthread_mutex_lock(&d->lock);
+
+  // Falls inside one device block: coalesce it in the write-back block
+  long block = location / d->align;
+  if((location + len - 1) / d->align == block) {
+    if(d->pending != block) {
+      if(direct_write_back(storage, d) != 0 ||
+         direct_read(storage, d->pending_buf, block * d->align, d->align) < 0) {
+        pthread_mutex_unlock(&d->lock);
+        return(-1);
+      }
+      d->pending = block;
+    }
+    memcpy(d->pending_buf + (location - block * d->align), buf, len);
+    pthread_mutex_unlock(&d->lock);
+    return(ret);
+  }
+
+  // Larger writes go straight out (partial end blocks are read first)
+  long first;
+  int span;
+  unsigned char *bounce = direct_bounce(d, location, len, &first, &span);
+  if(bounce == NULL || direct_write_back(storage, d) != 0) {
+    pthread_mutex_unlock(&d->lock);
+    free(bounce);
+    return(-1);
+  }
+  if(location % d->align != 0 || (location + len) % d->align != 0) {
+    if(direct_read(storage, bounce, first * d->align, span) < 0)
+      ret = -1;
+  }
+  if(ret >= 0) {
+    memcpy(bounce + (location - first * d->align), buf, len);
+    if(pwrite(storage->fd, bounce, span, first * d->align) != span) {
+      fprintf(stderr, "Error writing fd\n");
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  free(bounce);
+  return(ret);
+}
+
+static int direct_sync(STORAGE *storage, int data_only)
+{
+  DIRECT *d = storage->backend;
+  pthread_mutex_lock(&d->lock);
+  int ret = direct_write_back(storage, d);
+  pthread_mutex_unlock(&d->lock);
+  if(storage_file_sync(storage, data_only) != 0)
+    ret = -1;
+  return(ret);
+}
+
+const STORAGE_OPS STORAGE_DIRECT_OPS = {
+  .scheme = "direct",
+  .file_backed = 1,
+  .open = direct_open,
+  .close = direct_close,
+  .get = direct_get,
+  .put = direct_put,
+  .sync = direct_sync,
+};
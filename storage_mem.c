@@ -0,0 +1,240 @@
+/**
+ *  storage_mem.c
+ *
+ *  Storage backend that keeps the disk in memory ("mem:name").  No file
+ *  is touched: the disk lives until the process exits, and attaching the
+ *  same name again (in the same process) finds it as it was left, so a
+ *  disk can be formatted and then mounted.
+ *
+ *  OUFS_MEM_LOAD=file      A new in-memory disk starts as a copy of file
+ *  OUFS_MEM_SNAPSHOT=file  The disk is copied to file at every close
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "storage.h"
+
+// Smallest allocation for the contents of a disk
+#define MEM_MIN_CAPACITY (64 * 1024)
+
+typedef struct mem_image_s
+{
+  char *name;
+
+  // Transfers share; writes (which may move the contents) exclude
+  pthread_rwlock_t lock;
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+
+  struct mem_image_s *next;
+} MEM_IMAGE;
+
+// Every in-memory disk of the process
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static MEM_IMAGE *images = NULL;
+
+/**
+ *  Make room for size bytes.  Called with the image locked for writing.
+ *
+ *  @return 0 if success; -1 if out of memory
+ */
+static int mem_reserve(MEM_IMAGE *image, size_t size)
+{
+  if(size <= image->capacity)
+    return(0);
+  size_t capacity = image->capacity < MEM_MIN_CAPACITY ? MEM_MIN_CAPACITY : image->capacity;
+  while(capacity < size)
+    capacity *= 2;
+  unsigned char *data = realloc(image->data, capacity);
+  if(data == NULL) {
+    fprintf(stderr, "Out of memory for disk %s\n", image->name);
+    return(-1);
+  }
+  // Never written: reads as zeros (like a hole in a file)
+  memset(data + image->capacity, 0, capacity - image->capacity);
+  image->data = data;
+  image->capacity = capacity;
+  return(0);
+}
+
+/**
+ *  Fill a new image from a file
+ *
+ *  @return 0 if success; -1 if the file cannot be read
+ */
+static int mem_load(MEM_IMAGE *image, char *file)
+{
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Unable to open %s\n", file);
+    if(fd >= 0)
+      close(fd);
+    return(-1);
+  }
+  if(mem_reserve(image, st.st_size) != 0) {
+    close(fd);
+    return(-1);
+  }
+  size_t done = 0;
+  while(done < (size_t) st.st_size) {
+    ssize_t ret = read(fd, image->data + done, st.st_size - done);
+    if(ret < 0 && errno == EINTR)
+      continue;
+    if(ret <= 0) {
+      fprintf(stderr, "Error reading %s\n", file);
+      close(fd);
+      return(-1);
+    }
+    done += ret;
+  }
+  image->size = done;
+  close(fd);
+  return(0);
+}
+
+/**
+ *  Copy an image to a file.  The file is replaced only once the copy is
+ *   complete.
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int mem_snapshot(MEM_IMAGE *image, char *file)
+{
+  char tmp[strlen(file) + 8];
+  sprintf(tmp, "%s.tmp", file);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0) {
+    fprintf(stderr, "Unable to open %s\n", tmp);
+    return(-1);
+  }
+  size_t done = 0;
+  while(done < image->size) {
+    ssize_t ret = write(fd, image->data + done, image->size - done);
+    if(ret < 0 && errno == EINTR)
+      continue;
+    if(ret <= 0)
+      break;
+    done += ret;
+  }
+  if(close(fd) != 0 || done < image->size || rename(tmp, file) != 0) {
+    fprintf(stderr, "Unable to write snapshot %s\n", file);
+    unlink(tmp);
+    return(-1);
+  }
+  return(0);
+}
+
+static int mem_open(STORAGE *storage, char *name)
+{
+  pthread_mutex_lock(&images_lock);
+  MEM_IMAGE *image;
+  for(image = images; image != NULL; image = image->next) {
+    if(strcmp(image->name, name) == 0)
+      break;
+  }
+
+  if(image == NULL) {
+    image = malloc(sizeof(MEM_IMAGE));
+    if(image == NULL || (image->name = strdup(name)) == NULL) {
+      pthread_mutex_unlock(&images_lock);
+      free(image);
+      return(-1);
+    }
+    image->data = NULL;
+    image->size = image->capacity = 0;
+    pthread_rwlock_init(&image->lock, NULL);
+
+    char *load = getenv("OUFS_MEM_LOAD");
+    if(load != NULL && load[0] != 0 && mem_load(image, load) != 0) {
+      pthread_mutex_unlock(&images_lock);
+      pthread_rwlock_destroy(&image->lock);
+      free(image->data);
+      free(image->name);
+      free(image);
+      return(-1);
+    }
+    image->next = images;
+    images = image;
+  }
+  pthread_mutex_unlock(&images_lock);
+
+  storage->backend = image;
+  return(0);
+}
+
+static int mem_close(STORAGE *storage)
+{
+  // The image stays for the next attach
+  MEM_IMAGE *image = storage->backend;
+  char *file = getenv("OUFS_MEM_SNAPSHOT");
+  int ret = 0;
+  if(file != NULL && file[0] != 0) {
+    pthread_rwlock_rdlock(&image->lock);
+    ret = mem_snapshot(image, file);
+    pthread_rwlock_unlock(&image->lock);
+  }
+  return(ret);
+}
+
+static int mem_get(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  MEM_IMAGE *image = storage->backend;
+  pthread_rwlock_rdlock(&image->lock);
+  // Bytes that exist (as for pread at the end of a file)
+  int ret = 0;
+  if((size_t) location < image->size) {
+    ret = image->size - location < (size_t) len ? (int) (image->size - location) : len;
+    memcpy(buf, image->data + location, ret);
+  }
+  pthread_rwlock_unlock(&image->lock);
+  return(ret);
+}
+
+static int mem_put(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  MEM_IMAGE *image = storage->backend;
+  pthread_rwlock_wrlock(&image->lock);
+  size_t end = (size_t) location + len;
+  if(mem_reserve(image, end) != 0) {
+    pthread_rwlock_unlock(&image->lock);
+    return(-1);
+  }
+  memcpy(image->data + location, buf, len);
+  if(end > image->size)
+    image->size = end;
+  pthread_rwlock_unlock(&image->lock);
+  return(len);
+}
+
+static int mem_discard(STORAGE *storage, int location, int len)
+{
+  MEM_IMAGE *image = storage->backend;
+  pthread_rwlock_wrlock(&image->lock);
+  // Like a hole punched in a file: the bytes that exist read as zeros
+  if((size_t) location < image->size) {
+    size_t n = image->size - location < (size_t) len ? image->size - location : (size_t) len;
+    memset(image->data + location, 0, n);
+  }
+  pthread_rwlock_unlock(&image->lock);
+  return(0);
+}
+
+static int mem_sync(STORAGE *storage, int data_only)
+{
+  // Nothing is ever more durable than memory
+  return(0);
+}
+
+const STORAGE_OPS STORAGE_MEM_OPS = {
+  .scheme = "mem",
+  .file_backed = 0,
+  .open = mem_open,
+  .close = mem_close,
+  .get = mem_get,
+  .put = mem_put,
+  .sync = mem_sync,
+  .discard = mem_discard,
+};
@@ -0,0 +1,637 @@
+/**
+ *  storage_mirror.c
+ *
+ *  Storage backend that keeps the disk on several replicas (RAID-1):
+ *  "mirror:name1,name2,...".  Every write goes to every replica; each
+ *  read goes to the up-to-date replica with the fewest transfers in
+ *  flight.  Each replica name is opened with init_storage() and may have
+ *  a scheme of its own.
+ *
+ *  A replica that is backed by a file keeps its state next to it in
+ *  "file.mirror": the generation it is current for, and whether it was
+ *  closed cleanly.  At open, the replicas with the newest generation are
+ *  current and the others are stale (all but the first are stale after an
+ *  unclean close, or when no replica has any state yet).  A background
+ *  thread copies a current replica onto each stale one; until it is done,
+ *  a stale replica takes writes but serves no reads.  A replica that fails
+ *  is dropped, and the generation of the others moves on.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "storage.h"
+
+#define MIRROR_MAGIC 0x5252494d
+
+// Bytes copied at a time by the resync
+#define MIRROR_RESYNC_CHUNK 4096
+
+// State of a replica
+typedef enum {MIRROR_CURRENT = 0, MIRROR_STALE, MIRROR_FAILED} MIRROR_STATUS;
+
+// Replica state file
+typedef struct
+{
+  uint32_t magic;
+  uint32_t clean;
+  uint64_t generation;
+} MIRROR_STATE;
+
+typedef struct
+{
+  STORAGE *storage;
+
+  // State file (-1 if the replica is not a file) and what it said at open
+  int state_fd;
+  int has_state;
+  MIRROR_STATE state;
+
+  MIRROR_STATUS status;
+
+  // Transfers in flight
+  int depth;
+} MIRROR_MEMBER;
+
+// A write in flight (the resync must not copy under it)
+typedef struct mirror_write_s
+{
+  int location;
+  int len;
+  struct mirror_write_s *next;
+} MIRROR_WRITE;
+
+typedef struct
+{
+  int n;
+  MIRROR_MEMBER *member;
+  uint64_t generation;
+
+  // Protects the status of the members and everything below
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  MIRROR_WRITE *writes;
+
+  // Range being copied by the resync, and whether a write into it has
+  //  started since the copy began
+  int copy_location;
+  int copy_len;
+  int copy_conflict;
+
+  pthread_t resync;
+  int resync_running;
+  int stop;
+
+  // Set once the status of every replica is known (until then, close
+  //  leaves the state files as they were)
+  int decided;
+
+  // Tie breaker between equally busy replicas
+  unsigned int next_read;
+} MIRROR;
+
+// An asynchronous request: one part per replica for a write, one for a read
+typedef struct
+{
+  int member;
+  STORAGE_REQUEST io;
+} MIRROR_PART;
+
+typedef struct
+{
+  MIRROR_WRITE write;
+  int n;
+  MIRROR_PART part[];
+} MIRROR_REQUEST;
+
+/**
+ *  Record the state of a replica.  Called with m->lock held (or before
+ *   any other thread can see m).
+ */
+static void mirror_save_state(MIRROR *m, int i, int clean)
+{
+  MIRROR_MEMBER *r = &m->member[i];
+  if(r->state_fd < 0)
+    return;
+  MIRROR_STATE state = {MIRROR_MAGIC, clean, m->generation};
+  if(pwrite(r->state_fd, &state, sizeof(state), 0) != sizeof(state) || fsync(r->state_fd) != 0)
+    fprintf(stderr, "Unable to record the state of mirror replica %d\n", i);
+}
+
+/**
+ *  Drop a replica that has failed.  Called with m->lock held.
+ *
+ *  @return 0 if a current replica remains; -1 if not
+ */
+static int mirror_fail(MIRROR *m, int i)
+{
+  int current = 0;
+  if(m->member[i].status != MIRROR_FAILED) {
+    fprintf(stderr, "Mirror replica %d failed\n", i);
+    int was_current = m->member[i].status == MIRROR_CURRENT;
+    m->member[i].status = MIRROR_FAILED;
+
+    // It must not look current at the next open
+    if(was_current) {
+      ++m->generation;
+      for(int k = 0; k < m->n; ++k) {
+        if(m->member[k].status == MIRROR_CURRENT)
+          mirror_save_state(m, k, 0);
+      }
+    }
+  }
+  for(int k = 0; k < m->n; ++k) {
+    if(m->member[k].status == MIRROR_CURRENT)
+      ++current;
+  }
+  return(current > 0 ? 0 : -1);
+}
+
+/**
+ *  Choose the replica for a read: the current one with the fewest
+ *   transfers in flight.  Counts the read in.
+ *
+ *  @return The replica; -1 if there is none
+ */
+static int mirror_pick(MIRROR *m)
+{
+  pthread_mutex_lock(&m->lock);
+  int best = -1;
+  unsigned int start = m->next_read++;
+  for(int k = 0; k < m->n; ++k) {
+    int i = (start + k) % m->n;
+    if(m->member[i].status == MIRROR_CURRENT &&
+       (best < 0 || m->member[i].depth < m->member[best].depth))
+      best = i;
+  }
+  if(best >= 0)
+    ++m->member[best].depth;
+  pthread_mutex_unlock(&m->lock);
+  return(best);
+}
+
+/**
+ *  A read is done
+ *
+ *  @param ok Did it succeed?
+ *  @return 0 if another replica can be tried (or none is needed)
+ */
+static int mirror_read_done(MIRROR *m, int i, int ok)
+{
+  pthread_mutex_lock(&m->lock);
+  --m->member[i].depth;
+  int ret = ok ? 0 : mirror_fail(m, i);
+  pthread_mutex_unlock(&m->lock);
+  return(ret);
+}
+
+/**
+ *  Which replicas take writes?
+ *
+ *  @param target Set for each replica
+ */
+static void mirror_targets(MIRROR *m, int *target)
+{
+  pthread_mutex_lock(&m->lock);
+  for(int i = 0; i < m->n; ++i)
+    target[i] = m->member[i].status != MIRROR_FAILED;
+  pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ *  @return 1 if a replica is current; 0 if every replica is lost
+ */
+static int mirror_alive(MIRROR *m)
+{
+  int alive = 0;
+  pthread_mutex_lock(&m->lock);
+  for(int i = 0; i < m->n; ++i) {
+    if(m->member[i].status == MIRROR_CURRENT)
+      alive = 1;
+  }
+  pthread_mutex_unlock(&m->lock);
+  return(alive);
+}
+
+/**
+ *  A write is starting: keep the resync off its range
+ */
+static void mirror_write_begin(MIRROR *m, MIRROR_WRITE *w, int location, int len)
+{
+  w->location = location;
+  w->len = len;
+  pthread_mutex_lock(&m->lock);
+  w->next = m->writes;
+  m->writes = w;
+  if(m->copy_len > 0 && location < m->copy_location + m->copy_len
+     && m->copy_location < location + len)
+    m->copy_conflict = 1;
+  pthread_mutex_unlock(&m->lock);
+}
+
+static void mirror_write_end(MIRROR *m, MIRROR_WRITE *w)
+{
+  pthread_mutex_lock(&m->lock);
+  for(MIRROR_WRITE **p = &m->writes; *p != NULL; p = &(*p)->next) {
+    if(*p == w) {
+      *p = w->next;
+      break;
+    }
+  }
+  pthread_cond_broadcast(&m->changed);
+  pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ *  Copy one chunk from a current replica to a stale one, again if a
+ *   write to the chunk starts in the meantime
+ *
+ *  @return Bytes copied (0 at the end of the source); -1 if the copy
+ *          cannot go on
+ */
+static int mirror_copy_chunk(MIRROR *m, int dst, int location, unsigned char *buf)
+{
+  for(;;) {
+    pthread_mutex_lock(&m->lock);
+    // Writes already in flight over the chunk must land first
+    int busy;
+    do {
+      busy = 0;
+      for(MIRROR_WRITE *w = m->writes; w != NULL; w = w->next) {
+        if(w->location < location + MIRROR_RESYNC_CHUNK && location < w->location + w->len)
+          busy = 1;
+      }
+      if(busy && !m->stop)
+        pthread_cond_wait(&m->changed, &m->lock);
+    }while(busy && !m->stop);
+
+    int src = -1;
+    for(int k = 0; k < m->n && src < 0; ++k) {
+      if(m->member[k].status == MIRROR_CURRENT)
+        src = k;
+    }
+    if(m->stop || src < 0 || m->member[dst].status != MIRROR_STALE) {
+      pthread_mutex_unlock(&m->lock);
+      return(-1);
+    }
+    m->copy_location = location;
+    m->copy_len = MIRROR_RESYNC_CHUNK;
+    m->copy_conflict = 0;
+    pthread_mutex_unlock(&m->lock);
+
+    int n = get_bytes(m->member[src].storage, buf, location, MIRROR_RESYNC_CHUNK);
+    int put = n > 0 ? put_bytes(m->member[dst].storage, buf, location, n) : 0;
+
+    pthread_mutex_lock(&m->lock);
+    m->copy_len = 0;
+    int conflict = m->copy_conflict;
+    if(n < 0)
+      mirror_fail(m, src);
+    else if(put != n)
+      mirror_fail(m, dst);
+    pthread_mutex_unlock(&m->lock);
+    if(n < 0)
+      continue;
+    if(put != n)
+      return(-1);
+    if(!conflict)
+      return(n);
+  }
+}
+
+/**
+ *  Background resync: bring every stale replica up to date
+ */
+static void *mirror_resync(void *arg)
+{
+  MIRROR *m = arg;
+  unsigned char buf[MIRROR_RESYNC_CHUNK];
+  for(int i = 0; i < m->n; ++i) {
+    pthread_mutex_lock(&m->lock);
+    int stale = m->member[i].status == MIRROR_STALE;
+    pthread_mutex_unlock(&m->lock);
+    if(!stale)
+      continue;
+    int location = 0;
+    int n;
+    while((n = mirror_copy_chunk(m, i, location, buf)) > 0)
+      location += n;
+    if(n < 0)
+      continue;
+    if(sync_storage(m->member[i].storage, 0) != 0) {
+      pthread_mutex_lock(&m->lock);
+      mirror_fail(m, i);
+      pthread_mutex_unlock(&m->lock);
+      continue;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if(m->member[i].status == MIRROR_STALE) {
+      m->member[i].status = MIRROR_CURRENT;
+      mirror_save_state(m, i, 0);
+    }
+    pthread_mutex_unlock(&m->lock);
+  }
+  return(NULL);
+}
+
+static int mirror_close(STORAGE *storage)
+{
+  MIRROR *m = storage->backend;
+  if(m->resync_running) {
+    pthread_mutex_lock(&m->lock);
+    m->stop = 1;
+    pthread_cond_broadcast(&m->changed);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->resync, NULL);
+  }
+
+  int ret = 0;
+  for(int i = 0; i < m->n; ++i) {
+    MIRROR_MEMBER *r = &m->member[i];
+    if(r->storage == NULL)
+      continue;
+    if(m->decided && r->status == MIRROR_CURRENT && sync_storage(r->storage, 0) != 0)
+      mirror_fail(m, i);
+    if(close_storage(r->storage) != 0)
+      ret = -1;
+    // Only a replica that is complete and on stable storage is clean
+    if(m->decided && r->status == MIRROR_CURRENT)
+      mirror_save_state(m, i, 1);
+    if(r->state_fd >= 0)
+      close(r->state_fd);
+  }
+  pthread_mutex_destroy(&m->lock);
+  pthread_cond_destroy(&m->changed);
+  free(m->member);
+  free(m);
+  return(ret);
+}
+
+/**
+ *  Open a replica and read its state
+ *
+ *  @return 0 if success; -1 if the replica cannot be opened
+ */
+static int mirror_open_member(MIRROR_MEMBER *r, char *name)
+{
+  r->state_fd = -1;
+  r->storage = init_storage(name, NULL);
+  if(r->storage == NULL)
+    return(-1);
+
+  char *file = storage_file_name(name);
+  if(file != NULL) {
+    char state_name[strlen(file) + 8];
+    sprintf(state_name, "%s.mirror", file);
+    r->state_fd = open(state_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(r->state_fd < 0)
+      fprintf(stderr, "Unable to open %s\n", state_name);
+    else if(pread(r->state_fd, &r->state, sizeof(r->state), 0) == sizeof(r->state)
+            && r->state.magic == MIRROR_MAGIC)
+      r->has_state = 1;
+  }
+  return(0);
+}
+
+static int mirror_open(STORAGE *storage, char *name)
+{
+  MIRROR *m = malloc(sizeof(MIRROR));
+  char *list = strdup(name);
+  if(m == NULL || list == NULL) {
+    free(m);
+    free(list);
+    return(-1);
+  }
+  memset(m, 0, sizeof(MIRROR));
+  m->n = 1;
+  for(char *c = list; *c != 0; ++c) {
+    if(*c == ',')
+      ++m->n;
+  }
+  m->member = calloc(m->n, sizeof(MIRROR_MEMBER));
+  if(m->member == NULL) {
+    free(m);
+    free(list);
+    return(-1);
+  }
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->changed, NULL);
+  storage->backend = m;
+
+  char *save;
+  char *member = strtok_r(list, ",", &save);
+  for(int i = 0; i < m->n; ++i) {
+    m->member[i].state_fd = -1;
+    if(member == NULL || mirror_open_member(&m->member[i], member) != 0) {
+      fprintf(stderr, "Unable to open mirror replica %d of %s\n", i, name);
+      free(list);
+      mirror_close(storage);
+      return(-1);
+    }
+    member = strtok_r(NULL, ",", &save);
+  }
+  free(list);
+
+  // The replicas with the newest generation are current.  With no state
+  //  at all, or after an unclean close, only the first of them is.
+  uint64_t newest = 0;
+  int first = -1;
+  int unclean = 0;
+  for(int i = 0; i < m->n; ++i) {
+    if(m->member[i].has_state && m->member[i].state.generation >= newest)
+      newest = m->member[i].state.generation;
+  }
+  for(int i = 0; i < m->n; ++i) {
+    MIRROR_MEMBER *r = &m->member[i];
+    int current = r->has_state ? r->state.generation == newest : newest == 0;
+    r->status = current ? MIRROR_CURRENT : MIRROR_STALE;
+    if(current) {
+      if(first < 0)
+        first = i;
+      if(r->has_state && !r->state.clean)
+        unclean = 1;
+    }
+  }
+  int stale = 0;
+  for(int i = 0; i < m->n; ++i) {
+    if(i != first && (unclean || newest == 0))
+      m->member[i].status = MIRROR_STALE;
+    if(m->member[i].status == MIRROR_STALE)
+      stale = 1;
+  }
+
+  // A new generation, in use (not clean) until close
+  m->generation = newest + 1;
+  m->decided = 1;
+  for(int i = 0; i < m->n; ++i) {
+    if(m->member[i].status == MIRROR_CURRENT)
+      mirror_save_state(m, i, 0);
+  }
+
+  if(stale) {
+    if(pthread_create(&m->resync, NULL, mirror_resync, m) != 0) {
+      fprintf(stderr, "Unable to start the mirror resync\n");
+      mirror_close(storage);
+      return(-1);
+    }
+    m->resync_running = 1;
+  }
+  return(0);
+}
+
+static int mirror_get(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  MIRROR *m = storage->backend;
+  for(;;) {
+    int i = mirror_pick(m);
+    if(i < 0)
+      return(-1);
+    int ret = get_bytes(m->member[i].storage, buf, location, len);
+    if(mirror_read_done(m, i, ret >= 0) != 0 || ret >= 0)
+      return(ret);
+  }
+}
+
+static int mirror_put(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  MIRROR *m = storage->backend;
+  MIRROR_WRITE w;
+  int target[m->n];
+  mirror_write_begin(m, &w, location, len);
+  mirror_targets(m, target);
+  for(int i = 0; i < m->n; ++i) {
+    if(target[i] && put_bytes(m->member[i].storage, buf, location, len) != len) {
+      pthread_mutex_lock(&m->lock);
+      mirror_fail(m, i);
+      pthread_mutex_unlock(&m->lock);
+    }
+  }
+  mirror_write_end(m, &w);
+  return(mirror_alive(m) ? len : -1);
+}
+
+static int mirror_sync(STORAGE *storage, int data_only)
+{
+  MIRROR *m = storage->backend;
+  int target[m->n];
+  mirror_targets(m, target);
+  for(int i = 0; i < m->n; ++i) {
+    if(target[i] && sync_storage(m->member[i].storage, data_only) != 0) {
+      pthread_mutex_lock(&m->lock);
+      mirror_fail(m, i);
+      pthread_mutex_unlock(&m->lock);
+    }
+  }
+  return(mirror_alive(m) ? 0 : -1);
+}
+
+static int mirror_queue(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  MIRROR *m = storage->backend;
+  int parts = request->write ? m->n : 1;
+  MIRROR_REQUEST *r = malloc(sizeof(MIRROR_REQUEST) + parts * sizeof(MIRROR_PART));
+  if(r == NULL)
+    return(-1);
+  r->n = 0;
+  request->backend = r;
+
+  if(!request->write) {
+    int i = mirror_pick(m);
+    if(i < 0) {
+      free(r);
+      return(-1);
+    }
+    r->part[0].member = i;
+    r->part[0].io = *request;
+    if(queue_bytes(m->member[i].storage, &r->part[0].io) != 0) {
+      mirror_read_done(m, i, 0);
+      free(r);
+      return(-1);
+    }
+    r->n = 1;
+    return(0);
+  }
+
+  int target[m->n];
+  mirror_write_begin(m, &r->write, request->location, request->len);
+  mirror_targets(m, target);
+  for(int i = 0; i < m->n; ++i) {
+    if(!target[i])
+      continue;
+    MIRROR_PART *part = &r->part[r->n];
+    part->member = i;
+    part->io = *request;
+    pthread_mutex_lock(&m->lock);
+    ++m->member[i].depth;
+    pthread_mutex_unlock(&m->lock);
+    if(queue_bytes(m->member[i].storage, &part->io) != 0) {
+      pthread_mutex_lock(&m->lock);
+      --m->member[i].depth;
+      mirror_fail(m, i);
+      pthread_mutex_unlock(&m->lock);
+      continue;
+    }
+    ++r->n;
+  }
+  return(0);
+}
+
+static int mirror_submit(STORAGE *storage)
+{
+  MIRROR *m = storage->backend;
+  int target[m->n];
+  int ret = 0;
+  mirror_targets(m, target);
+  for(int i = 0; i < m->n; ++i) {
+    if(target[i] && submit_storage(m->member[i].storage) != 0)
+      ret = -1;
+  }
+  return(ret);
+}
+
+static int mirror_wait(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  MIRROR *m = storage->backend;
+  MIRROR_REQUEST *r = request->backend;
+  int ret;
+
+  if(!request->write) {
+    int i = r->part[0].member;
+    ret = wait_bytes(m->member[i].storage, &r->part[0].io);
+    // Another replica may have it
+    if(mirror_read_done(m, i, ret >= 0) == 0 && ret < 0)
+      ret = mirror_get(storage, request->buf, request->location, request->len);
+  }else{
+    for(int k = 0; k < r->n; ++k) {
+      int i = r->part[k].member;
+      int got = wait_bytes(m->member[i].storage, &r->part[k].io);
+      pthread_mutex_lock(&m->lock);
+      --m->member[i].depth;
+      if(got != request->len)
+        mirror_fail(m, i);
+      pthread_mutex_unlock(&m->lock);
+    }
+    mirror_write_end(m, &r->write);
+    ret = mirror_alive(m) ? request->len : -1;
+  }
+  free(r);
+  request->backend = NULL;
+  request->result = ret;
+  request->done = 1;
+  return(ret);
+}
+
+const STORAGE_OPS STORAGE_MIRROR_OPS = {
+  .scheme = "mirror",
+  .file_backed = 0,
+  .open = mirror_open,
+  .close = mirror_close,
+  .get = mirror_get,
+  .put = mirror_put,
+  .sync = mirror_sync,
+  .queue = mirror_queue,
+  .submit = mirror_submit,
+  .wait = mirror_wait,
+};
@@ -0,0 +1,272 @@
+/**
+ *  storage_stripe.c
+ *
+ *  Storage backend that stripes the disk across several backing stores
+ *  (RAID-0): "stripe:UNIT:name1,name2,...".  The disk is cut into units
+ *  of UNIT bytes that go to the backing stores in turn, so unit u is at
+ *  offset (u / n) * UNIT of store u % n.  A UNIT that is a multiple of
+ *  the block size keeps every block on one store.
+ *
+ *  Each backing name is opened with init_storage() and may have a scheme
+ *  of its own ("stripe:4096:uring:a,uring:b").  Asynchronous requests are
+ *  split into one request per unit and handed to the backing stores, so
+ *  they all work at once.
+ */
+
+#include <string.h>
+#include "storage.h"
+
+typedef struct
+{
+  int unit;
+  int n;
+  STORAGE **member;
+} STRIPE;
+
+// An asynchronous request split over the backing stores
+typedef struct
+{
+  int member;
+  STORAGE_REQUEST io;
+} STRIPE_PART;
+
+typedef struct
+{
+  int n;
+  STRIPE_PART part[];
+} STRIPE_REQUEST;
+
+/**
+ *  Where does a byte of the disk live?
+ *
+ *  @param location Offset on the disk
+ *  @param len Bytes wanted from there
+ *  @param member Set to the backing store
+ *  @param offset Set to the offset on that store
+ *  @return Number of bytes (at most len) that are contiguous on the store
+ */
+static int stripe_map(STRIPE *s, int location, int len, int *member, int *offset)
+{
+  int unit = location / s->unit;
+  int within = location % s->unit;
+  *member = unit % s->n;
+  *offset = (unit / s->n) * s->unit + within;
+  return(len < s->unit - within ? len : s->unit - within);
+}
+
+/**
+ *  Number of pieces a transfer is split into
+ */
+static int stripe_count(STRIPE *s, int location, int len)
+{
+  int first = location / s->unit;
+  int last = (location + len - 1) / s->unit;
+  return(len <= 0 ? 0 : last - first + 1);
+}
+
+/**
+ *  Result of a read: bytes that exist (as for pread at the end of a file).
+ *   Missing pieces are zero filled.
+ *
+ *  @param piece Offset of the piece within the transfer
+ *  @param n Bytes wanted for the piece
+ *  @param ret Bytes read for the piece
+ *  @param end Running end of the bytes that exist (within the transfer)
+ */
+static void stripe_read_piece(unsigned char *buf, int piece, int n, int ret, int *end)
+{
+  if(ret < 0)
+    ret = 0;
+  if(ret < n)
+    memset(buf + piece + ret, 0, n - ret);
+  if(ret > 0 && piece + ret > *end)
+    *end = piece + ret;
+}
+
+static int stripe_close(STORAGE *storage)
+{
+  STRIPE *s = storage->backend;
+  int ret = 0;
+  for(int i = 0; i < s->n; ++i) {
+    if(s->member[i] != NULL && close_storage(s->member[i]) != 0)
+      ret = -1;
+  }
+  free(s->member);
+  free(s);
+  return(ret);
+}
+
+static int stripe_open(STORAGE *storage, char *name)
+{
+  // UNIT:name1,name2,...
+  char *end;
+  long unit = strtol(name, &end, 10);
+  if(unit <= 0 || *end != ':' || end[1] == 0) {
+    fprintf(stderr, "Bad stripe specification (%s)\n", name);
+    return(-1);
+  }
+  char *list = strdup(end + 1);
+  STRIPE *s = malloc(sizeof(STRIPE));
+  if(list == NULL || s == NULL) {
+    free(list);
+    free(s);
+    return(-1);
+  }
+  s->unit = unit;
+  s->n = 1;
+  for(char *c = list; *c != 0; ++c) {
+    if(*c == ',')
+      ++s->n;
+  }
+  s->member = calloc(s->n, sizeof(STORAGE *));
+  if(s->member == NULL) {
+    free(list);
+    free(s);
+    return(-1);
+  }
+  storage->backend = s;
+
+  char *save;
+  char *member = strtok_r(list, ",", &save);
+  for(int i = 0; i < s->n; ++i) {
+    if(member == NULL || (s->member[i] = init_storage(member, NULL)) == NULL) {
+      fprintf(stderr, "Unable to open stripe member %d of %s\n", i, name);
+      free(list);
+      stripe_close(storage);
+      return(-1);
+    }
+    member = strtok_r(NULL, ",", &save);
+  }
+  free(list);
+  return(0);
+}
+
+static int stripe_get(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  STRIPE *s = storage->backend;
+  int end = 0;
+  for(int piece = 0; piece < len;) {
+    int member, offset;
+    int n = stripe_map(s, location + piece, len - piece, &member, &offset);
+    int ret = get_bytes(s->member[member], buf + piece, offset, n);
+    if(ret < 0)
+      return(-1);
+    stripe_read_piece(buf, piece, n, ret, &end);
+    piece += n;
+  }
+  return(end);
+}
+
+static int stripe_put(STORAGE *storage, unsigned char *buf, int location, int len)
+{
+  STRIPE *s = storage->backend;
+  for(int piece = 0; piece < len;) {
+    int member, offset;
+    int n = stripe_map(s, location + piece, len - piece, &member, &offset);
+    if(put_bytes(s->member[member], buf + piece, offset, n) != n)
+      return(-1);
+    piece += n;
+  }
+  return(len);
+}
+
+static int stripe_sync(STORAGE *storage, int data_only)
+{
+  STRIPE *s = storage->backend;
+  int ret = 0;
+  for(int i = 0; i < s->n; ++i) {
+    if(sync_storage(s->member[i], data_only) != 0)
+      ret = -1;
+  }
+  return(ret);
+}
+
+static int stripe_queue(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  STRIPE *s = storage->backend;
+  int count = stripe_count(s, request->location, request->len);
+  STRIPE_REQUEST *split = malloc(sizeof(STRIPE_REQUEST) + count * sizeof(STRIPE_PART));
+  if(split == NULL)
+    return(-1);
+
+  split->n = 0;
+  for(int piece = 0; piece < request->len;) {
+    int offset;
+    STRIPE_PART *part = &split->part[split->n];
+    part->io.len = stripe_map(s, request->location + piece, request->len - piece,
+                              &part->member, &offset);
+    part->io.write = request->write;
+    part->io.buf = request->buf + piece;
+    part->io.location = offset;
+    if(queue_bytes(s->member[part->member], &part->io) != 0)
+      break;
+    ++split->n;
+    piece += part->io.len;
+  }
+
+  request->backend = split;
+  if(split->n < count) {
+    // Finish what was started before giving up
+    for(int i = 0; i < split->n; ++i)
+      wait_bytes(s->member[split->part[i].member], &split->part[i].io);
+    free(split);
+    return(-1);
+  }
+  return(0);
+}
+
+static int stripe_submit(STORAGE *storage)
+{
+  STRIPE *s = storage->backend;
+  int ret = 0;
+  for(int i = 0; i < s->n; ++i) {
+    if(submit_storage(s->member[i]) != 0)
+      ret = -1;
+  }
+  return(ret);
+}
+
+static int stripe_wait(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  STRIPE *s = storage->backend;
+  STRIPE_REQUEST *split = request->backend;
+  int ret = request->len;
+  int end = 0;
+  int piece = 0;
+  for(int i = 0; i < split->n; ++i) {
+    STRIPE_PART *part = &split->part[i];
+    int got = wait_bytes(s->member[part->member], &part->io);
+    if(got < 0 || (request->write && got != part->io.len))
+      ret = -1;
+    else if(!request->write)
+      stripe_read_piece(request->buf, piece, part->io.len, got, &end);
+    piece += part->io.len;
+  }
+  free(split);
+  request->backend = NULL;
+  if(ret >= 0 && !request->write)
+    ret = end;
+  request->result = ret;
+  request->done = 1;
+  return(ret);
+}
+
+static int stripe_size(STORAGE *storage)
+{
+  STRIPE *s = storage->backend;
+  return(s->unit * s->n);
+}
+
+const STORAGE_OPS STORAGE_STRIPE_OPS = {
+  .scheme = "stripe",
+  .file_backed = 0,
+  .open = stripe_open,
+  .close = stripe_close,
+  .get = stripe_get,
+  .put = stripe_put,
+  .sync = stripe_sync,
+  .stripe_size = stripe_size,
+  .queue = stripe_queue,
+  .submit = stripe_submit,
+  .wait = stripe_wait,
+};
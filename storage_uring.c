@@ -0,0 +1,361 @@
+/**
+ *  storage_uring.c
+ *
+ *  Storage backend that starts transfers through an io_uring ("uring:name").
+ *  Queued requests are handed to the kernel in batches, and several
+ *  transfers can be in flight at once.  Completions are polled for a short
+ *  while before a waiter sleeps in the kernel.
+ *
+ *  Single-request get/put/sync go straight to pread/pwrite/fsync.  If the
+ *  kernel has no io_uring, every request is done synchronously.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "storage.h"
+
+// Submission queue entries (the completion queue is twice as long)
+#define URING_ENTRIES 64
+
+// Times to look at the completion queue before sleeping in the kernel
+#define URING_POLL_SPINS 2000
+
+typedef struct
+{
+  int ring_fd;
+
+  // Submission queue
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+
+  // Completion queue
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  unsigned int cq_entries;
+  struct io_uring_cqe *cqes;
+
+  // Mappings (to undo at close)
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // Protects everything below and the ring indices
+  pthread_mutex_t lock;
+  pthread_cond_t completed;
+
+  // Queued but not yet submitted / submitted but not yet completed
+  unsigned int queued;
+  unsigned int in_flight;
+
+  // Is a thread sleeping in the kernel for completions?
+  int reaping;
+} URING;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags)
+{
+  return(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+/**
+ *  Map the rings of a new io_uring
+ *
+ *  @return 0 if success; -1 if io_uring is not available
+ */
+static int uring_map(URING *u)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->ring_fd = uring_setup(URING_ENTRIES, &p);
+  if(u->ring_fd < 0)
+    return(-1);
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(u->cq_ring_size > u->sq_ring_size)
+      u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+  if(u->sq_ring == MAP_FAILED) {
+    close(u->ring_fd);
+    return(-1);
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  }else{
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+    if(u->cq_ring == MAP_FAILED) {
+      munmap(u->sq_ring, u->sq_ring_size);
+      close(u->ring_fd);
+      return(-1);
+    }
+  }
+
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+  if(u->sqes == MAP_FAILED) {
+    if(u->cq_ring != u->sq_ring)
+      munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->ring_fd);
+    return(-1);
+  }
+
+  unsigned char *sq = u->sq_ring;
+  u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+  unsigned char *cq = u->cq_ring;
+  u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  u->cq_entries = p.cq_entries;
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return(0);
+}
+
+/**
+ *  Mark every posted completion.  Called with u->lock held.
+ *
+ *  @return Number of completions found
+ */
+static int uring_reap(URING *u)
+{
+  unsigned int head = *u->cq_head;
+  unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+  while(head != tail) {
+    struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    STORAGE_REQUEST *request = (STORAGE_REQUEST *)(uintptr_t)cqe->user_data;
+    request->result = cqe->res < 0 ? -1 : cqe->res;
+    request->done = 1;
+    ++head;
+    ++n;
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  u->in_flight -= n;
+  if(n > 0)
+    pthread_cond_broadcast(&u->completed);
+  return(n);
+}
+
+/**
+ *  Hand the queued requests to the kernel.  Called with u->lock held.
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int uring_submit_locked(URING *u)
+{
+  while(u->queued > 0) {
+    int ret = uring_enter(u->ring_fd, u->queued, 0, 0);
+    if(ret < 0) {
+      if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      fprintf(stderr, "io_uring submit failed\n");
+      return(-1);
+    }
+    u->queued -= ret;
+  }
+  return(0);
+}
+
+/**
+ *  Sleep in the kernel until at least one completion is posted (or let
+ *   the thread that is already sleeping do it).  Called with u->lock held.
+ */
+static void uring_wait_completion(URING *u)
+{
+  if(u->reaping) {
+    pthread_cond_wait(&u->completed, &u->lock);
+    return;
+  }
+  u->reaping = 1;
+  pthread_mutex_unlock(&u->lock);
+  uring_enter(u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+  pthread_mutex_lock(&u->lock);
+  u->reaping = 0;
+  if(uring_reap(u) == 0)
+    // Let the other waiters try themselves
+    pthread_cond_broadcast(&u->completed);
+}
+
+static int uring_open(STORAGE *storage, char *name)
+{
+  if(storage_file_open(storage, name, 0) != 0)
+    return(-1);
+
+  URING *u = malloc(sizeof(URING));
+  if(u == NULL) {
+    storage_file_close(storage);
+    return(-1);
+  }
+  memset(u, 0, sizeof(URING));
+  if(uring_map(u) != 0) {
+    // No io_uring here: fall back to synchronous transfers
+    free(u);
+    return(0);
+  }
+  pthread_mutex_init(&u->lock, NULL);
+  pthread_cond_init(&u->completed, NULL);
+  storage->backend = u;
+  return(0);
+}
+
+static int uring_close(STORAGE *storage)
+{
+  URING *u = storage->backend;
+  if(u != NULL) {
+    // Nothing may be left in flight on buffers that are about to go away
+    pthread_mutex_lock(&u->lock);
+    uring_submit_locked(u);
+    while(u->in_flight > 0) {
+      if(uring_reap(u) == 0)
+        uring_wait_completion(u);
+    }
+    pthread_mutex_unlock(&u->lock);
+
+    munmap(u->sqes, u->sqes_size);
+    if(u->cq_ring != u->sq_ring)
+      munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->ring_fd);
+    pthread_mutex_destroy(&u->lock);
+    pthread_cond_destroy(&u->completed);
+    free(u);
+  }
+  return(storage_file_close(storage));
+}
+
+static int uring_queue(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  URING *u = storage->backend;
+  if(u == NULL) {
+    // Synchronous fallback
+    if(request->write)
+      request->result = storage_file_put(storage, request->buf, request->location, request->len);
+    else
+      request->result = storage_file_get(storage, request->buf, request->location, request->len);
+    request->done = 1;
+    return(0);
+  }
+
+  pthread_mutex_lock(&u->lock);
+
+  // Never put more in flight than the completion queue can hold
+  while(u->in_flight >= u->cq_entries) {
+    if(uring_submit_locked(u) != 0) {
+      pthread_mutex_unlock(&u->lock);
+      return(-1);
+    }
+    if(uring_reap(u) == 0)
+      uring_wait_completion(u);
+  }
+
+  // Submission queue full: push it to the kernel
+  unsigned int tail = *u->sq_tail;
+  if(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries
+     && uring_submit_locked(u) != 0) {
+    pthread_mutex_unlock(&u->lock);
+    return(-1);
+  }
+
+  unsigned int index = tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = storage->fd;
+  sqe->addr = (uintptr_t)request->buf;
+  sqe->len = request->len;
+  sqe->off = request->location;
+  sqe->user_data = (uintptr_t)request;
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  ++u->queued;
+  ++u->in_flight;
+  pthread_mutex_unlock(&u->lock);
+  return(0);
+}
+
+static int uring_submit(STORAGE *storage)
+{
+  URING *u = storage->backend;
+  if(u == NULL)
+    return(0);
+  pthread_mutex_lock(&u->lock);
+  int ret = uring_submit_locked(u);
+  pthread_mutex_unlock(&u->lock);
+  return(ret);
+}
+
+static int uring_wait(STORAGE *storage, STORAGE_REQUEST *request)
+{
+  URING *u = storage->backend;
+  if(u == NULL)
+    return(request->result);
+
+  pthread_mutex_lock(&u->lock);
+  if(uring_submit_locked(u) != 0) {
+    pthread_mutex_unlock(&u->lock);
+    return(-1);
+  }
+  while(!request->done) {
+    if(uring_reap(u) > 0)
+      continue;
+
+    // Poll for a while: the transfer is often done by the time we look
+    if(!u->reaping) {
+      unsigned int head = *u->cq_head;
+      int i;
+      pthread_mutex_unlock(&u->lock);
+      for(i = 0; i < URING_POLL_SPINS && __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) == head; ++i)
+        ;
+      pthread_mutex_lock(&u->lock);
+      if(i < URING_POLL_SPINS)
+        continue;
+    }
+    uring_wait_completion(u);
+  }
+  pthread_mutex_unlock(&u->lock);
+  return(request->result);
+}
+
+const STORAGE_OPS STORAGE_URING_OPS = {
+  .scheme = "uring",
+  .file_backed = 1,
+  .open = uring_open,
+  .close = uring_close,
+  .get = storage_file_get,
+  .put = storage_file_put,
+  .sync = storage_file_sync,
+  .discard = storage_file_discard,
+  .queue = uring_queue,
+  .submit = uring_submit,
+  .wait = uring_wait,
+};
@@ -0,0 +1,227 @@
+/**
+ *  vdisk_cbt.c
+ *
+ *  Changed-block tracking, for incremental copies of a disk.  The disk's
+ *  history is cut into epochs; a table after the snapshot area records,
+ *  for every block, the epoch in which it was last written.  The blocks
+ *  changed since some epoch are then the ones whose entry is at least
+ *  that epoch: the table holds the changed-block bitmap of every epoch
+ *  at once.
+ *
+ *  The first write of a block in an epoch changes its entry, and the
+ *  entry is made durable before the block is written in place, so a
+ *  change is never missed.  Later writes of the block in the same epoch
+ *  cost nothing.  A disk gets its table, with a new history id, the first
+ *  time a delta is exported from it or applied to it; writes before that
+ *  are not tracked (so that images built from the same files are the
+ *  same), and the first delta of a history covers the whole disk.
+ *
+ *  A replica records the disk it follows and the first epoch of that disk
+ *  it has not seen, so that changes are applied without gaps.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "vdisk_internal.h"
+
+#define CBT_MAGIC 0x20544243
+#define CBT_VERSION 1
+
+// Changed-block tracking superblock
+typedef struct cbt_super_s
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_blocks;
+  uint32_t epoch;
+  uint64_t id;
+  uint64_t source;
+  uint32_t synced;
+} CBT_SUPER;
+
+/**
+ *  Start tracking: a new history, in its first epoch
+ */
+static void cbt_init(VDISK *disk)
+{
+  VDISK_CBT *c = &disk->cbt;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  memset(c, 0, sizeof(VDISK_CBT));
+  c->present = 1;
+  c->id = ((uint64_t) now.tv_sec << 32) ^ ((uint64_t) now.tv_nsec << 12) ^ (uint64_t) getpid();
+  if(c->id == 0)
+    c->id = 1;
+  c->epoch = 1;
+  c->super_dirty = 1;
+  memset(c->dirty, 1, sizeof(c->dirty));
+}
+
+/**
+ *  Load the table if the disk has one
+ *
+ *  @return 0 if success (including no table); -1 if error
+ */
+int vdisk_cbt_open(VDISK *disk)
+{
+  VDISK_CBT *c = &disk->cbt;
+  unsigned char b[BLOCK_SIZE];
+  memset(c, 0, sizeof(VDISK_CBT));
+  if(vdisk_raw_read(disk, CBT_SUPER_LBA, b) != 0)
+    return(0);
+  CBT_SUPER *super = (CBT_SUPER *) b;
+  if(super->magic != CBT_MAGIC)
+    return(0);
+  if(super->version != CBT_VERSION || super->n_blocks != N_BLOCKS) {
+    fprintf(stderr, "Changed-block tracking: unknown table format (version %u)\n",
+            super->version);
+    return(-1);
+  }
+  c->id = super->id;
+  c->epoch = super->epoch;
+  c->source = super->source;
+  c->synced = super->synced;
+  for(int k = 0; k < CBT_MAP_BLOCKS; ++k) {
+    if(vdisk_raw_read(disk, CBT_MAP_LBA + k, &c->changed[k * CBT_PER_BLOCK]) != 0) {
+      fprintf(stderr, "Changed-block tracking: unable to read the table\n");
+      return(-1);
+    }
+  }
+  c->present = 1;
+  return(0);
+}
+
+/**
+ *  A block is about to be written in place (untracked if the disk has no
+ *   table yet).  The change is not safe until vdisk_cbt_commit() has
+ *   returned.
+ *
+ *  @param block_ref Block about to be written
+ */
+void vdisk_cbt_mark(VDISK *disk, BLOCK_REFERENCE block_ref)
+{
+  VDISK_CBT *c = &disk->cbt;
+  if(!c->present)
+    return;
+  if(c->changed[block_ref] != c->epoch) {
+    c->changed[block_ref] = c->epoch;
+    c->dirty[block_ref / CBT_PER_BLOCK] = 1;
+  }
+}
+
+/**
+ *  Write out the parts of the table that have changed (the caller makes
+ *   them durable)
+ *
+ *  @return 1 if something was written; 0 if nothing had changed; -1 if error
+ */
+int vdisk_cbt_commit(VDISK *disk)
+{
+  VDISK_CBT *c = &disk->cbt;
+  int written = 0;
+  for(int k = 0; k < CBT_MAP_BLOCKS; ++k) {
+    if(c->dirty[k]) {
+      if(vdisk_raw_write(disk, CBT_MAP_LBA + k, &c->changed[k * CBT_PER_BLOCK]) != 0) {
+        fprintf(stderr, "Changed-block tracking: unable to write the table\n");
+        return(-1);
+      }
+      c->dirty[k] = 0;
+      written = 1;
+    }
+  }
+  if(c->super_dirty) {
+    unsigned char b[BLOCK_SIZE];
+    memset(b, 0, sizeof(b));
+    CBT_SUPER *super = (CBT_SUPER *) b;
+    super->magic = CBT_MAGIC;
+    super->version = CBT_VERSION;
+    super->n_blocks = N_BLOCKS;
+    super->epoch = c->epoch;
+    super->id = c->id;
+    super->source = c->source;
+    super->synced = c->synced;
+    if(vdisk_raw_write(disk, CBT_SUPER_LBA, b) != 0) {
+      fprintf(stderr, "Changed-block tracking: unable to write the superblock\n");
+      return(-1);
+    }
+    c->super_dirty = 0;
+    written = 1;
+  }
+  return(written);
+}
+
+/**
+ *  Describe the tracking state of the disk
+ */
+void vdisk_cbt_info(VDISK *disk, VDISK_CBT_INFO *info)
+{
+  VDISK_CBT *c = &disk->cbt;
+  memset(info, 0, sizeof(VDISK_CBT_INFO));
+  if(!c->present)
+    return;
+  info->id = c->id;
+  info->epoch = c->epoch;
+  info->source = c->source;
+  info->synced = c->synced;
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref)
+    info->changed += c->changed[ref] == c->epoch;
+}
+
+/**
+ *  End the current epoch.  Finished transactions are committed first;
+ *   none may be open.  Writes from here on belong to the next epoch.
+ *
+ *  @param since First epoch of interest (0: every block)
+ *  @param changed Set, for each of the N_BLOCKS blocks, to 1 if it has
+ *         changed since the start of that epoch and 0 if not
+ *  @param epoch Set to the epoch that has ended
+ *  @return 0 if success; -1 if error; -2 if since is a future epoch
+ */
+int vdisk_cbt_next_epoch(VDISK *disk, unsigned int since, unsigned char *changed,
+                         unsigned int *epoch)
+{
+  VDISK_CBT *c = &disk->cbt;
+  if(disk->journal.handles > 0) {
+    fprintf(stderr, "Changed-block tracking: transactions are open\n");
+    return(-1);
+  }
+  if(vdisk_journal_flush(disk) != 0)
+    return(-1);
+  // A new history knows nothing of what came before it
+  if(!c->present && since > 0)
+    return(-2);
+  if(!c->present)
+    cbt_init(disk);
+  if(since > c->epoch)
+    return(-2);
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref)
+    changed[ref] = since == 0 || c->changed[ref] >= since;
+  *epoch = c->epoch++;
+  c->super_dirty = 1;
+  if(vdisk_cbt_commit(disk) < 0)
+    return(-1);
+  return(vdisk_durability_barrier(disk));
+}
+
+/**
+ *  Record that the disk is a replica of another one
+ *
+ *  @param source History id of the disk it follows
+ *  @param synced First epoch of that disk it has not seen
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_cbt_set_source(VDISK *disk, uint64_t source, unsigned int synced)
+{
+  VDISK_CBT *c = &disk->cbt;
+  if(!c->present)
+    cbt_init(disk);
+  c->source = source;
+  c->synced = synced;
+  c->super_dirty = 1;
+  if(vdisk_cbt_commit(disk) < 0)
+    return(-1);
+  return(vdisk_durability_barrier(disk));
+}
@@ -0,0 +1,307 @@
+/**
+ *  vdisk_checksum.c
+ *
+ *  Per-block CRC32C checksums.  Disks formatted with checksums have a
+ *  checksum superblock after the journal, followed by a table with the
+ *  CRC32C of every block as it was last written.  The table is kept in
+ *  memory while the disk is attached: a write updates the entry for its
+ *  block, and every read that goes to the storage is checked against it
+ *  (blocks that are found in a cache are never checked again).
+ *
+ *  Changed parts of the table are written out at every journal flush,
+ *  every sync and at detach.  A block written after the last of those is
+ *  brought back in line by the journal replay if it was written in a
+ *  transaction; otherwise it is reported as damaged, which it may well be.
+ *
+ *  The CRC32C instruction of SSE4.2 is used when the processor has it.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "vdisk_internal.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CHECKSUM_MAGIC 0x4d555343
+#define CHECKSUM_VERSION 1
+
+// Checksum superblock
+typedef struct checksum_super_s
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_blocks;
+  uint32_t table_blocks;
+} CHECKSUM_SUPER;
+
+/**********************************************************************/
+// CRC32C (Castagnoli, reflected polynomial 0x82f63b78)
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t crc32c_table[256];
+
+/**
+ *  One byte at a time, from a table
+ */
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while(len-- > 0)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return(crc);
+}
+
+#if defined(__x86_64__)
+/**
+ *  Eight bytes per instruction.  A block is short enough that the
+ *   dependency chain (32 instructions) costs less than folding several
+ *   streams together would.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+  for(; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = c;
+  for(; len > 0; ++p, --len)
+    crc = _mm_crc32_u8(crc, *p);
+  return(crc);
+}
+#endif
+
+/**
+ *  Pick the implementation for this processor
+ */
+static void crc32c_init(void)
+{
+  for(uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for(int k = 0; k < 8; ++k)
+      c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crc32c_table[i] = c;
+  }
+  crc32c_update = crc32c_soft;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2"))
+    crc32c_update = crc32c_sse42;
+#endif
+}
+
+/**
+ *  CRC32C of a byte range
+ *
+ *  @param buf Bytes to check
+ *  @param len Number of bytes
+ *  @return The checksum
+ */
+uint32_t vdisk_crc32c(const void *buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return(~crc32c_update(~0U, buf, len));
+}
+
+/**********************************************************************/
+
+/**
+ *  Write one block of the table
+ *
+ *  @param i Table block
+ *  @return 0 if success; -1 if error
+ */
+static int checksum_write_table(VDISK *disk, int i)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  uint32_t table[CHECKSUM_PER_BLOCK];
+  for(int k = 0; k < CHECKSUM_PER_BLOCK; ++k)
+    table[k] = __atomic_load_n(&c->crc[i * CHECKSUM_PER_BLOCK + k], __ATOMIC_RELAXED);
+  return(vdisk_raw_write(disk, CHECKSUM_TABLE_LBA + i, table));
+}
+
+/**
+ *  Load the checksum table if the disk has one.  Called when the disk is
+ *   attached (before the journal is replayed).
+ *
+ *  @return 0 if success (including no checksums on this disk); -1 if error
+ */
+int vdisk_checksum_open(VDISK *disk)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  BLOCK b;
+  c->enabled = 0;
+  memset(c->dirty, 0, sizeof(c->dirty));
+
+  // Older images (and disks formatted without them) have no checksums
+  if(vdisk_raw_read(disk, CHECKSUM_SUPER_LBA, &b) != 0)
+    return(0);
+  CHECKSUM_SUPER *super = (CHECKSUM_SUPER *) &b;
+  if(super->magic != CHECKSUM_MAGIC)
+    return(0);
+  if(super->version != CHECKSUM_VERSION || super->n_blocks != N_BLOCKS
+     || super->table_blocks != CHECKSUM_TABLE_BLOCKS) {
+    fprintf(stderr, "Checksums: unknown table format (version %u)\n", super->version);
+    return(-1);
+  }
+
+  for(int i = 0; i < CHECKSUM_TABLE_BLOCKS; ++i) {
+    if(vdisk_raw_read(disk, CHECKSUM_TABLE_LBA + i, &c->crc[i * CHECKSUM_PER_BLOCK]) != 0) {
+      fprintf(stderr, "Checksums: unable to read the table\n");
+      return(-1);
+    }
+  }
+  c->enabled = 1;
+  return(0);
+}
+
+/**
+ *  Checksum every block as it is now and start keeping the table (used
+ *   when formatting).  Called with disk->lock held.
+ *
+ *  @param enable 0: remove the checksums that the disk may have had
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_checksum_create(VDISK *disk, int enable)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  BLOCK b;
+  if(!enable) {
+    c->enabled = 0;
+    memset(&b, 0, sizeof(BLOCK));
+    if(vdisk_raw_write(disk, CHECKSUM_SUPER_LBA, &b) != 0)
+      return(-1);
+    return(vdisk_durability_barrier(disk));
+  }
+
+  memset(c->crc, 0, sizeof(c->crc));
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    if(vdisk_raw_read(disk, ref, &b) != 0)
+      return(-1);
+    c->crc[ref] = vdisk_crc32c(&b, BLOCK_SIZE);
+  }
+  for(int i = 0; i < CHECKSUM_TABLE_BLOCKS; ++i) {
+    if(checksum_write_table(disk, i) != 0)
+      return(-1);
+  }
+
+  memset(&b, 0, sizeof(BLOCK));
+  CHECKSUM_SUPER *super = (CHECKSUM_SUPER *) &b;
+  super->magic = CHECKSUM_MAGIC;
+  super->version = CHECKSUM_VERSION;
+  super->n_blocks = N_BLOCKS;
+  super->table_blocks = CHECKSUM_TABLE_BLOCKS;
+  if(vdisk_raw_write(disk, CHECKSUM_SUPER_LBA, &b) != 0)
+    return(-1);
+  memset(c->dirty, 0, sizeof(c->dirty));
+  c->enabled = 1;
+  return(vdisk_durability_barrier(disk));
+}
+
+/**
+ *  @return 1 if the disk keeps checksums; 0 otherwise
+ */
+int vdisk_checksum_enabled(VDISK *disk)
+{
+  return(disk->checksum.enabled);
+}
+
+/**
+ *  A block is about to be written to its home location.  Called with the
+ *   block locked for writing.
+ *
+ *  @param block_ref Block being written
+ *  @param block Its new contents
+ *  @return The entry that was replaced (to put back if the write cannot
+ *          be started)
+ */
+uint32_t vdisk_checksum_update(VDISK *disk, BLOCK_REFERENCE block_ref, const void *block)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  if(!c->enabled)
+    return(0);
+  uint32_t old = c->crc[block_ref];
+  __atomic_store_n(&c->crc[block_ref], vdisk_crc32c(block, BLOCK_SIZE), __ATOMIC_RELAXED);
+  __atomic_store_n(&c->dirty[block_ref / CHECKSUM_PER_BLOCK], 1, __ATOMIC_RELEASE);
+  return(old);
+}
+
+/**
+ *  Put back the entry of a block whose write was never started.  Called
+ *   with the block locked for writing.
+ *
+ *  @param crc Value returned by vdisk_checksum_update()
+ */
+void vdisk_checksum_restore(VDISK *disk, BLOCK_REFERENCE block_ref, uint32_t crc)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  if(c->enabled)
+    __atomic_store_n(&c->crc[block_ref], crc, __ATOMIC_RELAXED);
+}
+
+/**
+ *  Check a block that has just been read from the storage.  Called with
+ *   the block locked for reading.
+ *
+ *  @param block_ref Block that was read
+ *  @param block Its contents
+ *  @return 0 if the block is intact (or the disk has no checksums);
+ *          -1 if it does not match its checksum
+ */
+int vdisk_checksum_verify(VDISK *disk, BLOCK_REFERENCE block_ref, const void *block)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  if(!c->enabled)
+    return(0);
+  uint32_t crc = vdisk_crc32c(block, BLOCK_SIZE);
+  uint32_t expected = __atomic_load_n(&c->crc[block_ref], __ATOMIC_RELAXED);
+  if(crc == expected)
+    return(0);
+
+  // Another process may have written the block since the table was
+  //  loaded: its entry on the disk is newer unless this process changed it
+  int i = block_ref / CHECKSUM_PER_BLOCK;
+  uint32_t table[CHECKSUM_PER_BLOCK];
+  if(!__atomic_load_n(&c->dirty[i], __ATOMIC_ACQUIRE)
+     && vdisk_raw_read(disk, CHECKSUM_TABLE_LBA + i, table) == 0) {
+    expected = table[block_ref % CHECKSUM_PER_BLOCK];
+    if(crc == expected) {
+      __atomic_store_n(&c->crc[block_ref], crc, __ATOMIC_RELAXED);
+      return(0);
+    }
+  }
+  fprintf(stderr, "Checksum error in block %d (%08x, expected %08x)\n",
+          block_ref, crc, expected);
+  return(-1);
+}
+
+/**
+ *  Write out the parts of the table that have changed.  Called with
+ *   disk->lock held.
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_checksum_flush(VDISK *disk)
+{
+  VDISK_CHECKSUM *c = &disk->checksum;
+  if(!c->enabled)
+    return(0);
+  int ret = 0;
+  for(int i = 0; i < CHECKSUM_TABLE_BLOCKS; ++i) {
+    // An update from here on marks the block again
+    if(__atomic_exchange_n(&c->dirty[i], 0, __ATOMIC_ACQ_REL)
+       && checksum_write_table(disk, i) != 0) {
+      __atomic_store_n(&c->dirty[i], 1, __ATOMIC_RELEASE);
+      ret = -1;
+    }
+  }
+  if(ret != 0)
+    fprintf(stderr, "Checksums: error writing the table\n");
+  return(ret);
+}
@@ -0,0 +1,262 @@
+/**
+ *  vdisk_discard.c
+ *
+ *  Discarded blocks: blocks whose space has been given back to the host
+ *  (a hole punched in the storage file).  A discarded block reads as
+ *  zeros, apart from its first VDISK_DISCARD_KEEP bytes, which the table
+ *  after the changed-block tracking keeps for it; that is where a free
+ *  block has its link in the free list.
+ *
+ *  The table is made durable before any space is released, and a
+ *  discarded block that is written again first has its kept bytes put
+ *  back in place, durably, before it leaves the table.  Either way a
+ *  crash leaves every block readable as it was or as it is meant to be.
+ *  Only whole blocks of the host file system are released, so blocks are
+ *  best discarded in runs.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "vdisk_internal.h"
+
+#define DISCARD_MAGIC 0x44534944
+#define DISCARD_VERSION 1
+
+// Set in the entry of a discarded block (below it: the bytes it keeps)
+#define DISCARD_FLAG 0x80000000
+
+#if VDISK_DISCARD_KEEP > 3
+#error "The bytes a discarded block keeps do not fit in its entry"
+#endif
+
+// Discard superblock
+typedef struct discard_super_s
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_blocks;
+  uint32_t keep;
+} DISCARD_SUPER;
+
+/**
+ *  The contents of a discarded block
+ */
+static void discard_contents(uint32_t entry, unsigned char *block)
+{
+  memset(block, 0, BLOCK_SIZE);
+  for(int i = 0; i < VDISK_DISCARD_KEEP; ++i)
+    block[i] = (entry >> (8 * i)) & 0xff;
+}
+
+/**
+ *  Write out the parts of the table that have changed
+ *
+ *  @return 1 if something was written; 0 if nothing had changed; -1 if error
+ */
+static int discard_write_table(VDISK *disk)
+{
+  VDISK_DISCARD *d = &disk->discard;
+  int written = 0;
+  for(int k = 0; k < DISCARD_MAP_BLOCKS; ++k) {
+    if(d->dirty[k]) {
+      if(vdisk_raw_write(disk, DISCARD_MAP_LBA + k, &d->entry[k * DISCARD_PER_BLOCK]) != 0) {
+        fprintf(stderr, "Discard: unable to write the table\n");
+        return(-1);
+      }
+      d->dirty[k] = 0;
+      written = 1;
+    }
+  }
+  return(written);
+}
+
+/**
+ *  Load the table if the disk has one
+ *
+ *  @return 0 if success (including no table); -1 if error
+ */
+int vdisk_discard_open(VDISK *disk)
+{
+  VDISK_DISCARD *d = &disk->discard;
+  unsigned char b[BLOCK_SIZE];
+  memset(d, 0, sizeof(VDISK_DISCARD));
+  if(vdisk_raw_read(disk, DISCARD_SUPER_LBA, b) != 0)
+    return(0);
+  DISCARD_SUPER *super = (DISCARD_SUPER *) b;
+  if(super->magic != DISCARD_MAGIC)
+    return(0);
+  if(super->version != DISCARD_VERSION || super->n_blocks != N_BLOCKS
+     || super->keep != VDISK_DISCARD_KEEP) {
+    fprintf(stderr, "Discard: unknown table format (version %u)\n", super->version);
+    return(-1);
+  }
+  for(int k = 0; k < DISCARD_MAP_BLOCKS; ++k) {
+    if(vdisk_raw_read(disk, DISCARD_MAP_LBA + k, &d->entry[k * DISCARD_PER_BLOCK]) != 0) {
+      fprintf(stderr, "Discard: unable to read the table\n");
+      return(-1);
+    }
+  }
+  d->present = 1;
+  return(0);
+}
+
+/**
+ *  A block has just been read from its home location: if it is discarded,
+ *   give it its contents.  Called with the block locked.
+ *
+ *  @param block The block as read
+ */
+void vdisk_discard_fill(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  uint32_t entry = disk->discard.entry[block_ref];
+  if(entry & DISCARD_FLAG)
+    discard_contents(entry, block);
+}
+
+/**
+ *  A block is about to be written: if it is discarded, put its contents
+ *   back in place.  It leaves the table at vdisk_discard_commit().
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_discard_restore(VDISK *disk, BLOCK_REFERENCE block_ref)
+{
+  VDISK_DISCARD *d = &disk->discard;
+  if(!(d->entry[block_ref] & DISCARD_FLAG) || d->restored[block_ref])
+    return(0);
+  unsigned char b[BLOCK_SIZE];
+  discard_contents(d->entry[block_ref], b);
+  vdisk_block_lock(disk, block_ref, 1);
+  int ret = vdisk_raw_write(disk, block_ref, b);
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  if(ret != 0) {
+    fprintf(stderr, "Discard: unable to restore block %d\n", block_ref);
+    return(-1);
+  }
+  d->restored[block_ref] = 1;
+  ++d->n_restored;
+  return(0);
+}
+
+/**
+ *  Take the blocks restored by vdisk_discard_restore() out of the table,
+ *   once their contents are durable, and write out the table (the caller
+ *   makes it durable)
+ *
+ *  @return 1 if something was written; 0 if nothing had changed; -1 if error
+ */
+int vdisk_discard_commit(VDISK *disk)
+{
+  VDISK_DISCARD *d = &disk->discard;
+  if(d->n_restored > 0) {
+    if(vdisk_durability_barrier(disk) != 0)
+      return(-1);
+    for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+      if(d->restored[ref]) {
+        vdisk_block_lock(disk, ref, 1);
+        d->entry[ref] = 0;
+        pthread_rwlock_unlock(&disk->block_lock[ref]);
+        d->dirty[ref / DISCARD_PER_BLOCK] = 1;
+        d->restored[ref] = 0;
+      }
+    }
+    d->n_restored = 0;
+  }
+  return(discard_write_table(disk));
+}
+
+/**
+ *  Give the space of some blocks back to the host.  Each keeps its first
+ *   VDISK_DISCARD_KEEP bytes and reads as zeros otherwise.  Finished
+ *   transactions are committed first if none is open; blocks that an
+ *   open transaction has written are left alone.  Nothing may be writing
+ *   the blocks meanwhile.
+ *
+ *  @param refs Blocks to discard (in any order)
+ *  @param n Number of blocks
+ *  @return Number of blocks discarded (0 if the storage cannot release
+ *          space); -1 if error
+ */
+int vdisk_discard_blocks(VDISK *disk, BLOCK_REFERENCE *refs, int n)
+{
+  VDISK_DISCARD *d = &disk->discard;
+  if(disk->storage->ops->discard == NULL)
+    return(0);
+  if(vdisk_journal_flush(disk) != 0)
+    return(-1);
+
+  // What each block keeps; the snapshots and the changed-block tracking
+  //  see the change like any other write
+  unsigned char take[N_BLOCKS];
+  uint32_t entry[N_BLOCKS];
+  int count = 0;
+  memset(take, 0, sizeof(take));
+  for(int k = 0; k < n; ++k) {
+    BLOCK_REFERENCE ref = refs[k];
+    if(ref >= N_BLOCKS || take[ref] || (d->entry[ref] & DISCARD_FLAG)
+       || disk->journal.group_dirty[ref])
+      continue;
+    unsigned char b[BLOCK_SIZE];
+    vdisk_block_lock(disk, ref, 0);
+    int ret = vdisk_raw_read(disk, ref, b);
+    pthread_rwlock_unlock(&disk->block_lock[ref]);
+    if(ret != 0 || vdisk_track_write(disk, ref) != 0)
+      return(-1);
+    entry[ref] = DISCARD_FLAG;
+    for(int i = 0; i < VDISK_DISCARD_KEEP; ++i)
+      entry[ref] |= (uint32_t) b[i] << (8 * i);
+    take[ref] = 1;
+    ++count;
+  }
+  if(count == 0)
+    return(0);
+  if(vdisk_track_commit(disk) != 0)
+    return(-1);
+
+  // The table is durable before any space is released
+  if(!d->present) {
+    unsigned char b[BLOCK_SIZE];
+    memset(b, 0, sizeof(b));
+    DISCARD_SUPER *super = (DISCARD_SUPER *) b;
+    super->magic = DISCARD_MAGIC;
+    super->version = DISCARD_VERSION;
+    super->n_blocks = N_BLOCKS;
+    super->keep = VDISK_DISCARD_KEEP;
+    if(vdisk_raw_write(disk, DISCARD_SUPER_LBA, b) != 0) {
+      fprintf(stderr, "Discard: unable to write the superblock\n");
+      return(-1);
+    }
+    memset(d->dirty, 1, sizeof(d->dirty));
+    d->present = 1;
+  }
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    if(take[ref]) {
+      unsigned char b[BLOCK_SIZE];
+      discard_contents(entry[ref], b);
+      vdisk_block_lock(disk, ref, 1);
+      d->entry[ref] = entry[ref];
+      ++disk->write_generation[ref];
+      vdisk_checksum_update(disk, ref, b);
+      pthread_rwlock_unlock(&disk->block_lock[ref]);
+      d->dirty[ref / DISCARD_PER_BLOCK] = 1;
+    }
+  }
+  if(discard_write_table(disk) < 0 || vdisk_durability_barrier(disk) != 0)
+    return(-1);
+
+  // One hole per run of discarded blocks, old and new, so that the host
+  //  can release the pages the run covers.  A hole that cannot be punched
+  //  only costs space: the blocks read the same either way.
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ) {
+    if(!(d->entry[ref] & DISCARD_FLAG)) {
+      ++ref;
+      continue;
+    }
+    BLOCK_REFERENCE first = ref;
+    while(ref < N_BLOCKS && (d->entry[ref] & DISCARD_FLAG))
+      ++ref;
+    discard_bytes(disk->storage, first * BLOCK_SIZE, (ref - first) * BLOCK_SIZE);
+  }
+  return(count);
+}
@@ -0,0 +1,221 @@
+/**
+ *  vdisk_durability.c
+ *
+ *  When do writes to the virtual disk reach stable storage?  The policy is
+ *  chosen with the OUFS_DURABILITY environment variable:
+ *
+ *  none          Never sync (journal ordering is not enforced either)
+ *  detach        Sync when the disk is detached (default)
+ *  periodic[:ms] A background thread commits and syncs every ms (1000)
+ *  sync          Every transaction is committed and synced when it ends;
+ *                 every write outside of a transaction is synced
+ *  group[:ms]    A background thread commits all finished transactions
+ *                 and fdatasyncs every ms (5); a transaction does not
+ *                 end until the sync that covers it is done
+ *
+ *  Except under none, journal commits always sync between the journal
+ *  record and the home writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "vdisk_internal.h"
+
+// Policy names (same order as DURABILITY_MODE)
+static const char *MODE_NAME[] = {"none", "detach", "periodic", "sync", "group"};
+
+/**
+ *  Commit everything that is pending and make it durable.  Nothing is
+ *   done while a transaction is open: its writes share the running group
+ *   with the finished ones, so the group waits for the next tick.
+ *   Called with disk->lock held.
+ *
+ *  @param data_only Use fdatasync rather than fsync
+ */
+static int durability_sync_all(VDISK *disk, int data_only)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  if(disk->journal.handles > 0)
+    return(0);
+  unsigned long generation = d->commit_generation;
+  int ret = vdisk_journal_flush(disk);
+  if(vdisk_raw_sync(disk, data_only) != 0)
+    ret = -1;
+  d->dirty = 0;
+  d->durable_generation = generation;
+  pthread_cond_broadcast(&d->durable);
+  return(ret);
+}
+
+/**
+ *  Background flush thread (periodic and group modes)
+ */
+static void *durability_flusher(void *arg)
+{
+  VDISK *disk = arg;
+  VDISK_DURABILITY *d = &disk->durability;
+  pthread_mutex_lock(&disk->lock);
+  while(!d->flusher_stop) {
+    // Sleep for one interval (or until told to stop)
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += d->interval_ms / 1000;
+    deadline.tv_nsec += (d->interval_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while(!d->flusher_stop &&
+          pthread_cond_timedwait(&d->flusher_wakeup, &disk->lock, &deadline) != ETIMEDOUT)
+      ;
+
+    if(d->dirty || d->commit_generation != d->durable_generation)
+      durability_sync_all(disk, d->mode == DURABILITY_GROUP);
+  }
+  pthread_mutex_unlock(&disk->lock);
+  return(NULL);
+}
+
+/**
+ *  Select the policy from OUFS_DURABILITY and start the flush thread if
+ *   the policy needs one.  Called when the disk is attached.
+ *
+ *  @return 0 if success; -1 if the policy is not valid
+ */
+int vdisk_durability_open(VDISK *disk)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  char *str = getenv("OUFS_DURABILITY");
+  char name[32];
+  int ms = -1;
+
+  d->mode = DURABILITY_DETACH;
+  if(str != NULL && str[0] != 0) {
+    // Split "name[:ms]"
+    strncpy(name, str, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    char *colon = strchr(name, ':');
+    if(colon != NULL) {
+      *colon = 0;
+      ms = atoi(colon + 1);
+    }
+
+    int i;
+    for(i = 0; i < DURABILITY_N_MODES; ++i) {
+      if(strcmp(name, MODE_NAME[i]) == 0)
+        break;
+    }
+    if(i == DURABILITY_N_MODES || (colon != NULL && ms <= 0)) {
+      fprintf(stderr, "Unknown OUFS_DURABILITY policy (%s)\n", str);
+      return(-1);
+    }
+    d->mode = i;
+  }
+
+  d->commit_generation = d->durable_generation = 0;
+  d->dirty = 0;
+  pthread_cond_init(&d->flusher_wakeup, NULL);
+  pthread_cond_init(&d->durable, NULL);
+
+  // Timed policies
+  if(d->mode == DURABILITY_PERIODIC || d->mode == DURABILITY_GROUP) {
+    d->interval_ms = ms > 0 ? ms : (d->mode == DURABILITY_PERIODIC ? 1000 : 5);
+    d->flusher_stop = 0;
+    if(pthread_create(&d->flusher, NULL, durability_flusher, disk) != 0) {
+      fprintf(stderr, "Unable to start the flush thread\n");
+      return(-1);
+    }
+    d->flusher_running = 1;
+  }
+
+  // Every transaction is its own group
+  vdisk_journal_set_group_size(disk, d->mode == DURABILITY_SYNC ? 1 : 0);
+  return(0);
+}
+
+/**
+ *  Stop the flush thread.  Called (without disk->lock) before the
+ *   journal is closed at detach.
+ */
+void vdisk_durability_stop(VDISK *disk)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  if(!d->flusher_running)
+    return;
+
+  pthread_mutex_lock(&disk->lock);
+  d->flusher_stop = 1;
+  pthread_cond_signal(&d->flusher_wakeup);
+  pthread_mutex_unlock(&disk->lock);
+  pthread_join(d->flusher, NULL);
+  d->flusher_running = 0;
+}
+
+/**
+ *  Final sync at detach (after the journal has been closed)
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_durability_close(VDISK *disk)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  pthread_cond_destroy(&d->flusher_wakeup);
+  pthread_cond_destroy(&d->durable);
+  if(d->mode == DURABILITY_NONE)
+    return(0);
+  return(vdisk_raw_sync(disk, 0));
+}
+
+/**
+ *  Ordering point between a journal record and its home writes
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_durability_barrier(VDISK *disk)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  if(d->mode == DURABILITY_NONE)
+    return(0);
+  return(vdisk_raw_sync(disk, 1));
+}
+
+/**
+ *  A block was written outside of a transaction.  Called with disk->lock
+ *   held; when the write must be made durable now, the caller does that
+ *   with sync_storage() once it has let go of the lock.
+ *
+ *  @return 1 if the caller must sync; 0 if not; -1 if error
+ */
+int vdisk_durability_write(VDISK *disk)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  d->dirty = 1;
+  if(d->mode == DURABILITY_SYNC) {
+    d->dirty = 0;
+    // The checksums of what has been written go with it
+    return(vdisk_checksum_flush(disk) != 0 ? -1 : 1);
+  }
+  return(0);
+}
+
+/**
+ *  A thread's outermost transaction has ended.  Under group commit, wait
+ *   for the background sync that covers it (one that starts once no
+ *   transaction is open).  Called with disk->lock held.
+ *
+ *  @return 0 if success
+ */
+int vdisk_durability_commit(VDISK *disk)
+{
+  VDISK_DURABILITY *d = &disk->durability;
+  unsigned long generation = ++d->commit_generation;
+  if(d->mode == DURABILITY_GROUP) {
+    while(d->durable_generation < generation && d->flusher_running)
+      pthread_cond_wait(&d->durable, &disk->lock);
+  }
+  return(0);
+}
@@ -0,0 +1,301 @@
+/**
+ *  Definitions shared between the pieces of the virtual disk
+ *  implementation.  Nothing outside of the vdisk_*.c / virtual_disk.c
+ *  files should include this.
+ *
+ *  Block addresses at or above N_BLOCKS (LBAs) are not visible through
+ *  the BLOCK_REFERENCE interface; they hold virtual disk metadata such as
+ *  the journal.
+ */
+
+#ifndef VDISK_INTERNAL_H
+#define VDISK_INTERNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "oufs.h"
+#include "storage.h"
+#include "vdisk_trace.h"
+#include "virtual_disk.h"
+
+/**********************************************************************/
+// Metadata area layout (in blocks, starting at N_BLOCKS)
+
+// Journal: one superblock followed by a circular log
+#define JOURNAL_SUPER_LBA N_BLOCKS
+#define JOURNAL_LOG_LBA (JOURNAL_SUPER_LBA + 1)
+#define JOURNAL_LOG_BLOCKS (2 * N_BLOCKS)
+#define JOURNAL_END_LBA (JOURNAL_LOG_LBA + JOURNAL_LOG_BLOCKS)
+
+// Checksums: one superblock followed by the CRC32C of every block
+#define CHECKSUM_PER_BLOCK (BLOCK_SIZE / 4)
+#define CHECKSUM_TABLE_BLOCKS ((N_BLOCKS + CHECKSUM_PER_BLOCK - 1) / CHECKSUM_PER_BLOCK)
+#define CHECKSUM_SUPER_LBA JOURNAL_END_LBA
+#define CHECKSUM_TABLE_LBA (CHECKSUM_SUPER_LBA + 1)
+#define CHECKSUM_END_LBA (CHECKSUM_TABLE_LBA + CHECKSUM_TABLE_BLOCKS)
+
+// Snapshots: one table, one block map per snapshot, then the store of
+//  preserved blocks (room for every block of every snapshot)
+#define SNAPSHOT_SUPER_LBA CHECKSUM_END_LBA
+#define SNAPSHOT_MAP_LBA (SNAPSHOT_SUPER_LBA + 1)
+#define SNAPSHOT_STORE_LBA (SNAPSHOT_MAP_LBA + VDISK_MAX_SNAPSHOTS)
+#define SNAPSHOT_STORE_BLOCKS (VDISK_MAX_SNAPSHOTS * N_BLOCKS)
+#define SNAPSHOT_END_LBA (SNAPSHOT_STORE_LBA + SNAPSHOT_STORE_BLOCKS)
+
+#if N_BLOCKS * 2 > BLOCK_SIZE || VDISK_MAX_SNAPSHOTS > 8
+#error "Snapshot block map does not fit in a block"
+#endif
+
+// Changed-block tracking: one superblock followed by the epoch in which
+//  every block last changed
+#define CBT_PER_BLOCK (BLOCK_SIZE / 4)
+#define CBT_MAP_BLOCKS ((N_BLOCKS + CBT_PER_BLOCK - 1) / CBT_PER_BLOCK)
+#define CBT_SUPER_LBA SNAPSHOT_END_LBA
+#define CBT_MAP_LBA (CBT_SUPER_LBA + 1)
+#define CBT_END_LBA (CBT_MAP_LBA + CBT_MAP_BLOCKS)
+
+// Discarded blocks: one superblock followed by an entry for every block
+#define DISCARD_PER_BLOCK (BLOCK_SIZE / 4)
+#define DISCARD_MAP_BLOCKS ((N_BLOCKS + DISCARD_PER_BLOCK - 1) / DISCARD_PER_BLOCK)
+#define DISCARD_SUPER_LBA CBT_END_LBA
+#define DISCARD_MAP_LBA (DISCARD_SUPER_LBA + 1)
+#define DISCARD_END_LBA (DISCARD_MAP_LBA + DISCARD_MAP_BLOCKS)
+
+/**********************************************************************/
+// Per-disk state
+
+// Number of trace records buffered before they are appended to the trace
+#define TRACE_BUFFER_RECORDS 1024
+
+// Metadata journal (vdisk_journal.c)
+typedef struct vdisk_journal_s
+{
+  // Is the journal present on this disk?
+  int enabled;
+
+  // Next record position / sequence number
+  uint32_t head;
+  uint32_t head_seq;
+
+  // Oldest record that may need replay (as stored in the superblock)
+  uint32_t tail;
+  uint32_t tail_seq;
+
+  // Transaction nesting depth (over all threads) and the running group
+  int group_size;
+  int handles;
+  int group_transactions;
+  // A commit was asked for while transactions were open (it is done when
+  //  the last of them ends)
+  int flush_deferred;
+  int group_count;
+  unsigned char group_dirty[N_BLOCKS];
+  BLOCK group_block[N_BLOCKS];
+
+  // Blocks in records from the tail on (replay would write them again)
+  unsigned char logged[N_BLOCKS];
+
+  // Space to assemble a record (descriptor + every block + commit).  Blocks
+  //  are packed BLOCK_SIZE bytes apart, exactly as they are on the disk.
+  unsigned char record[(N_BLOCKS + 2) * BLOCK_SIZE];
+} VDISK_JOURNAL;
+
+// Durability policy (vdisk_durability.c)
+typedef enum {DURABILITY_NONE=0, DURABILITY_DETACH, DURABILITY_PERIODIC,
+              DURABILITY_SYNC, DURABILITY_GROUP, DURABILITY_N_MODES} DURABILITY_MODE;
+
+typedef struct vdisk_durability_s
+{
+  DURABILITY_MODE mode;
+  int interval_ms;
+
+  // Background flush thread
+  pthread_t flusher;
+  int flusher_running;
+  int flusher_stop;
+  pthread_cond_t flusher_wakeup;
+
+  // Group commit: transactions that have ended / are known to be durable
+  unsigned long commit_generation;
+  unsigned long durable_generation;
+  int dirty;
+  pthread_cond_t durable;
+} VDISK_DURABILITY;
+
+// Per-block checksums (vdisk_checksum.c)
+typedef struct vdisk_checksum_s
+{
+  // Does this disk keep checksums?
+  int enabled;
+
+  // CRC32C of every block as last written (each entry is changed with its
+  //  block locked for writing), and the table blocks not yet written out
+  uint32_t crc[CHECKSUM_TABLE_BLOCKS * CHECKSUM_PER_BLOCK];
+  unsigned char dirty[CHECKSUM_TABLE_BLOCKS];
+} VDISK_CHECKSUM;
+
+// Copy-on-write snapshots (vdisk_snapshot.c)
+typedef struct vdisk_snapshot_s
+{
+  // Snapshot slots in use (generation 0: free) and their names
+  uint32_t generation[VDISK_MAX_SNAPSHOTS];
+  char name[VDISK_MAX_SNAPSHOTS][VDISK_SNAPSHOT_NAME];
+  uint32_t next_generation;
+
+  // Where each snapshot keeps each block: 0 while it is shared with the
+  //  live disk, otherwise 1 + its place in the store
+  uint16_t map[VDISK_MAX_SNAPSHOTS][N_BLOCKS];
+
+  // Snapshots that still share each live block (one bit per snapshot),
+  //  maps not yet written out, and the snapshots using each store block
+  unsigned char shared[N_BLOCKS];
+  unsigned char map_dirty[VDISK_MAX_SNAPSHOTS];
+  unsigned char store_users[SNAPSHOT_STORE_BLOCKS];
+} VDISK_SNAPSHOT;
+
+// Changed-block tracking (vdisk_cbt.c)
+typedef struct vdisk_cbt_s
+{
+  // Does the disk have a table yet? (it is made by the first write)
+  int present;
+
+  // This disk's history and its current epoch; for a replica, the disk
+  //  it follows and the first epoch of that disk it has not seen
+  uint64_t id;
+  uint32_t epoch;
+  uint64_t source;
+  uint32_t synced;
+
+  // Epoch in which each block last changed (0: not since tracking began),
+  //  and the parts of the table not yet written out
+  uint32_t changed[CBT_MAP_BLOCKS * CBT_PER_BLOCK];
+  unsigned char dirty[CBT_MAP_BLOCKS];
+  int super_dirty;
+} VDISK_CBT;
+
+// Discarded blocks (vdisk_discard.c)
+typedef struct vdisk_discard_s
+{
+  // Does the disk have a table yet? (it is made by the first discard)
+  int present;
+
+  // For every block: 0, or DISCARD_FLAG with the bytes the block keeps
+  //  (each entry is changed with its block locked for writing), and the
+  //  parts of the table not yet written out
+  uint32_t entry[DISCARD_MAP_BLOCKS * DISCARD_PER_BLOCK];
+  unsigned char dirty[DISCARD_MAP_BLOCKS];
+
+  // Discarded blocks about to be written again, whose contents have been
+  //  put back in place
+  unsigned char restored[N_BLOCKS];
+  int n_restored;
+} VDISK_DISCARD;
+
+// An attached virtual disk
+struct vdisk_s
+{
+  STORAGE *storage;
+
+  // Protects the trace, journal and durability state
+  pthread_mutex_t lock;
+  // Signalled (with lock) when no transaction is open
+  pthread_cond_t idle;
+
+  // Home location of each block: readers share, writers exclude.
+  //  Taken after lock when both are needed.  Never held while an
+  //  asynchronous transfer is in flight; instead, with the lock held for
+  //  writing, asynchronous writes are counted in and out and every write
+  //  that starts bumps the generation.
+  pthread_rwlock_t block_lock[N_BLOCKS];
+  unsigned int async_writes[N_BLOCKS];
+  unsigned int write_generation[N_BLOCKS];
+
+  // Block I/O trace (trace_fd < 0 means tracing is off)
+  int trace_fd;
+  int trace_count;
+  VDISK_TRACE_RECORD trace_buffer[TRACE_BUFFER_RECORDS];
+
+  VDISK_JOURNAL journal;
+  VDISK_DURABILITY durability;
+  VDISK_CHECKSUM checksum;
+  VDISK_SNAPSHOT snapshot;
+  VDISK_CBT cbt;
+  VDISK_DISCARD discard;
+};
+
+/**********************************************************************/
+// Raw block I/O (virtual_disk.c)
+int vdisk_raw_read(VDISK *disk, unsigned int lba, void *block);
+int vdisk_raw_write(VDISK *disk, unsigned int lba, void *block);
+int vdisk_raw_write_blocks(VDISK *disk, unsigned int lba, int n, void *blocks);
+int vdisk_raw_sync(VDISK *disk, int data_only);
+int vdisk_home_write(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+void vdisk_block_lock(VDISK *disk, BLOCK_REFERENCE block_ref, int write);
+int vdisk_track_write(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_track_commit(VDISK *disk);
+
+/**********************************************************************/
+// Metadata journal (vdisk_journal.c).  Called with disk->lock held.
+int vdisk_journal_open(VDISK *disk);
+int vdisk_journal_create(VDISK *disk);
+int vdisk_journal_close(VDISK *disk);
+int vdisk_journal_enabled(VDISK *disk);
+int vdisk_journal_begin(VDISK *disk);
+int vdisk_journal_end(VDISK *disk);
+int vdisk_journal_in_transaction(VDISK *disk);
+int vdisk_journal_read(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_journal_write(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+void vdisk_journal_update(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_journal_bypass(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_journal_flush(VDISK *disk);
+void vdisk_journal_set_group_size(VDISK *disk, int n);
+
+/**********************************************************************/
+// Durability policy (vdisk_durability.c)
+int vdisk_durability_open(VDISK *disk);
+void vdisk_durability_stop(VDISK *disk);
+int vdisk_durability_close(VDISK *disk);
+int vdisk_durability_barrier(VDISK *disk);
+int vdisk_durability_write(VDISK *disk);
+int vdisk_durability_commit(VDISK *disk);
+
+/**********************************************************************/
+// Per-block checksums (vdisk_checksum.c)
+uint32_t vdisk_crc32c(const void *buf, size_t len);
+int vdisk_checksum_open(VDISK *disk);
+int vdisk_checksum_create(VDISK *disk, int enable);
+int vdisk_checksum_enabled(VDISK *disk);
+uint32_t vdisk_checksum_update(VDISK *disk, BLOCK_REFERENCE block_ref, const void *block);
+void vdisk_checksum_restore(VDISK *disk, BLOCK_REFERENCE block_ref, uint32_t crc);
+int vdisk_checksum_verify(VDISK *disk, BLOCK_REFERENCE block_ref, const void *block);
+int vdisk_checksum_flush(VDISK *disk);
+
+/**********************************************************************/
+// Copy-on-write snapshots (vdisk_snapshot.c).  Called with disk->lock held.
+int vdisk_snapshot_open(VDISK *disk);
+int vdisk_snapshot_preserve(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_snapshot_commit(VDISK *disk);
+int vdisk_snapshot_create(VDISK *disk, char *name);
+int vdisk_snapshot_delete(VDISK *disk, char *name);
+int vdisk_snapshot_list(VDISK *disk, VDISK_SNAPSHOT_INFO *info);
+int vdisk_snapshot_read(VDISK *disk, char *name, void *blocks);
+
+/**********************************************************************/
+// Changed-block tracking (vdisk_cbt.c).  Called with disk->lock held.
+int vdisk_cbt_open(VDISK *disk);
+void vdisk_cbt_mark(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_cbt_commit(VDISK *disk);
+void vdisk_cbt_info(VDISK *disk, VDISK_CBT_INFO *info);
+int vdisk_cbt_next_epoch(VDISK *disk, unsigned int since, unsigned char *changed, unsigned int *epoch);
+int vdisk_cbt_set_source(VDISK *disk, uint64_t source, unsigned int synced);
+
+/**********************************************************************/
+// Discarded blocks (vdisk_discard.c).  Called with disk->lock held, except
+//  vdisk_discard_fill() (called with the block locked).
+int vdisk_discard_open(VDISK *disk);
+void vdisk_discard_fill(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_discard_restore(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_discard_commit(VDISK *disk);
+int vdisk_discard_blocks(VDISK *disk, BLOCK_REFERENCE *refs, int n);
+
+#endif
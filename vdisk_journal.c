@@ -0,0 +1,502 @@
+/**
+ *  vdisk_journal.c
+ *
+ *  Write-ahead journal for virtual disk metadata.
+ *
+ *  Blocks written inside a transaction (virtual_disk_begin_transaction() ...
+ *  virtual_disk_end_transaction()) are held in memory in the running group.
+ *  Finished transactions accumulate in the group until it is flushed
+ *  (group_size transactions, an explicit flush, the durability policy's
+ *  timer, or detach).
+ *  A flush writes the whole group as one journal record with a single
+ *  sequential write, makes it durable with a single sync (group commit),
+ *  and only then writes the blocks to their home locations.
+ *
+ *  Record: descriptor block | data blocks (ascending order) | commit block
+ *
+ *  The home writes of one flush become durable with the sync of a later
+ *  flush.  Log space is reused only after the superblock's tail has been
+ *  moved past records whose home writes are known to be stable.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "vdisk_internal.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4353444a
+#define JOURNAL_COMMIT_MAGIC 0x4d4d434a
+#define JOURNAL_VERSION 1
+
+// Default number of transactions that share one sync
+#define JOURNAL_GROUP_TRANSACTIONS 16
+
+#if (N_BLOCKS / 8) + 12 > BLOCK_SIZE
+#error "Journal descriptor block map does not fit in a block"
+#endif
+
+// Journal superblock
+typedef struct journal_super_s
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t log_blocks;
+
+  // Log offset and sequence number of the oldest record that may need replay
+  uint32_t tail;
+  uint32_t tail_seq;
+} JOURNAL_SUPER;
+
+// First block of a record: which blocks follow
+typedef struct journal_descriptor_s
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t n_blocks;
+
+  // One bit per block reference (same bit order as inode_allocated_flag)
+  unsigned char map[N_BLOCKS >> 3];
+} JOURNAL_DESCRIPTOR;
+
+// Last block of a record: the record is valid only if the checksum matches
+typedef struct journal_commit_s
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t n_blocks;
+  uint32_t checksum;
+} JOURNAL_COMMIT;
+
+#define RECORD_BLOCK(i) (j->record + (i) * BLOCK_SIZE)
+
+/**
+ *  FNV-1a checksum over a byte range
+ *
+ *  @param sum Checksum of the preceding bytes (or 2166136261 to start)
+ */
+static uint32_t journal_checksum(uint32_t sum, const void *buf, int len)
+{
+  const unsigned char *p = buf;
+  for(int i = 0; i < len; ++i) {
+    sum ^= p[i];
+    sum *= 16777619;
+  }
+  return(sum);
+}
+
+/**
+ *  Write the superblock with the current tail
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int journal_write_super(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  BLOCK b;
+  memset(&b, 0, sizeof(BLOCK));
+  JOURNAL_SUPER *super = (JOURNAL_SUPER *) &b;
+  super->magic = JOURNAL_MAGIC;
+  super->version = JOURNAL_VERSION;
+  super->log_blocks = JOURNAL_LOG_BLOCKS;
+  super->tail = j->tail;
+  super->tail_seq = j->tail_seq;
+  return(vdisk_raw_write(disk, JOURNAL_SUPER_LBA, &b));
+}
+
+/**
+ *  Make every home write stable and release all of the log space (on the
+ *   host too, where the storage can punch holes)
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int journal_checkpoint(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(j->tail_seq == j->head_seq)
+    return(0);
+
+  if(vdisk_durability_barrier(disk) != 0)
+    return(-1);
+  j->tail = j->head;
+  j->tail_seq = j->head_seq;
+  memset(j->logged, 0, sizeof(j->logged));
+  if(journal_write_super(disk) != 0 || vdisk_durability_barrier(disk) != 0)
+    return(-1);
+
+  // Once the superblock no longer points at them, the records read the
+  //  same as zeros (replay stops at the first block that is not the next
+  //  record)
+  discard_bytes(disk->storage, JOURNAL_LOG_LBA * BLOCK_SIZE, JOURNAL_LOG_BLOCKS * BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ *  Load and validate the record at a log position
+ *
+ *  @param pos Log offset of the descriptor
+ *  @param seq Expected sequence number
+ *  @return Number of data blocks (loaded into record[]); -1 if no valid record
+ */
+static int journal_load_record(VDISK *disk, uint32_t pos, uint32_t seq)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(vdisk_raw_read(disk, JOURNAL_LOG_LBA + pos, RECORD_BLOCK(0)) != 0)
+    return(-1);
+  JOURNAL_DESCRIPTOR *desc = (JOURNAL_DESCRIPTOR *) RECORD_BLOCK(0);
+  if(desc->magic != JOURNAL_DESCRIPTOR_MAGIC || desc->seq != seq
+     || desc->n_blocks > N_BLOCKS || pos + desc->n_blocks + 2 > JOURNAL_LOG_BLOCKS)
+    return(-1);
+
+  int n = desc->n_blocks;
+  for(int i = 1; i < n + 2; ++i) {
+    if(vdisk_raw_read(disk, JOURNAL_LOG_LBA + pos + i, RECORD_BLOCK(i)) != 0)
+      return(-1);
+  }
+
+  // Check the commit block
+  JOURNAL_COMMIT *commit = (JOURNAL_COMMIT *) RECORD_BLOCK(n + 1);
+  uint32_t sum = journal_checksum(2166136261U, j->record, (n + 1) * BLOCK_SIZE);
+  if(commit->magic != JOURNAL_COMMIT_MAGIC || commit->seq != seq
+     || commit->n_blocks != n || commit->checksum != sum)
+    return(-1);
+
+  return(n);
+}
+
+/**
+ *  Write the data blocks of the loaded record to their home locations
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int journal_apply_record(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  JOURNAL_DESCRIPTOR *desc = (JOURNAL_DESCRIPTOR *) RECORD_BLOCK(0);
+  int i = 1;
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    if(desc->map[ref >> 3] & (0x80 >> (ref & 7))) {
+      if(vdisk_home_write(disk, ref, RECORD_BLOCK(i++)) != 0)
+        return(-1);
+    }
+  }
+  return(0);
+}
+
+/**
+ *  Detect the journal and replay every committed record.  Called when
+ *  the virtual disk is attached.
+ *
+ *  @return 0 if success (including no journal on this disk); -1 if error
+ */
+int vdisk_journal_open(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  BLOCK b;
+  j->enabled = 0;
+  j->group_size = JOURNAL_GROUP_TRANSACTIONS;
+  j->handles = j->group_transactions = j->group_count = j->flush_deferred = 0;
+  memset(j->group_dirty, 0, sizeof(j->group_dirty));
+  memset(j->logged, 0, sizeof(j->logged));
+
+  // Older images have no journal
+  if(vdisk_raw_read(disk, JOURNAL_SUPER_LBA, &b) != 0)
+    return(0);
+  JOURNAL_SUPER *super = (JOURNAL_SUPER *) &b;
+  if(super->magic != JOURNAL_MAGIC || super->log_blocks != JOURNAL_LOG_BLOCKS
+     || super->tail >= JOURNAL_LOG_BLOCKS)
+    return(0);
+
+  j->enabled = 1;
+  j->tail = super->tail;
+  j->tail_seq = super->tail_seq;
+
+  // Replay forward from the tail.  A record that does not fit at the end
+  //  of the log is written at the start.
+  uint32_t pos = j->tail;
+  uint32_t seq = j->tail_seq;
+  int n;
+  while(1) {
+    if(pos >= JOURNAL_LOG_BLOCKS)
+      pos = 0;
+    if((n = journal_load_record(disk, pos, seq)) < 0) {
+      if(pos == 0 || (n = journal_load_record(disk, 0, seq)) < 0)
+        break;
+      pos = 0;
+    }
+    if(journal_apply_record(disk) != 0) {
+      j->enabled = 0;
+      return(-1);
+    }
+    pos += n + 2;
+    ++seq;
+  }
+  j->head = pos % JOURNAL_LOG_BLOCKS;
+  j->head_seq = seq;
+
+  if(j->head_seq != j->tail_seq) {
+    fprintf(stderr, "Journal: replayed %u transaction group(s)\n", j->head_seq - j->tail_seq);
+    return(journal_checkpoint(disk));
+  }
+  return(0);
+}
+
+/**
+ *  Create an empty journal on the disk (used when formatting)
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_journal_create(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  // Clear the log so that no stale record can ever be replayed: with a
+  //  hole where the storage can punch one (it reads as zeros and takes no
+  //  space on the host), with zeros written out where it cannot
+  memset(j->record, 0, sizeof(j->record));
+  if(discard_bytes(disk->storage, JOURNAL_LOG_LBA * BLOCK_SIZE,
+                   JOURNAL_LOG_BLOCKS * BLOCK_SIZE) != 0) {
+    for(uint32_t pos = 0; pos < JOURNAL_LOG_BLOCKS; pos += N_BLOCKS + 2) {
+      int n = MIN(N_BLOCKS + 2, JOURNAL_LOG_BLOCKS - pos);
+      if(vdisk_raw_write_blocks(disk, JOURNAL_LOG_LBA + pos, n, j->record) != 0)
+        return(-1);
+    }
+  }
+
+  j->enabled = 1;
+  j->handles = j->group_transactions = j->group_count = j->flush_deferred = 0;
+  memset(j->group_dirty, 0, sizeof(j->group_dirty));
+  j->head = j->tail = 0;
+  j->head_seq = j->tail_seq = 1;
+  if(journal_write_super(disk) != 0)
+    return(-1);
+  return(vdisk_durability_barrier(disk));
+}
+
+/**
+ *  Commit the running group and leave a clean journal (called at detach)
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_journal_close(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(!j->enabled)
+    return(0);
+  if(j->handles > 0) {
+    fprintf(stderr, "Journal: detaching inside a transaction\n");
+    j->handles = 0;
+  }
+
+  int ret = vdisk_journal_flush(disk);
+  if(journal_checkpoint(disk) != 0)
+    ret = -1;
+  j->enabled = 0;
+  return(ret);
+}
+
+/**
+ *  @return 1 if the journal is in use on this disk; 0 otherwise
+ */
+int vdisk_journal_enabled(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  return(j->enabled);
+}
+
+/**
+ *  Open a (possibly nested) transaction
+ *
+ *  @return 0 if success
+ */
+int vdisk_journal_begin(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(j->enabled)
+    ++j->handles;
+  return(0);
+}
+
+/**
+ *  Close a transaction.  When the outermost transaction ends, it joins the
+ *   running group, which is committed once it is large enough.
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_journal_end(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(!j->enabled || j->handles == 0)
+    return(0);
+  if(--j->handles > 0)
+    return(0);
+
+  if(++j->group_transactions >= j->group_size || j->flush_deferred)
+    return(vdisk_journal_flush(disk));
+  return(0);
+}
+
+/**
+ *  Set how many transactions are committed together
+ *
+ *  @param n Transactions per group (0: the default)
+ */
+void vdisk_journal_set_group_size(VDISK *disk, int n)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  j->group_size = n > 0 ? n : JOURNAL_GROUP_TRANSACTIONS;
+}
+
+/**
+ *  @return 1 if block writes are currently being journaled
+ */
+int vdisk_journal_in_transaction(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  return(j->enabled && j->handles > 0);
+}
+
+/**
+ *  Fetch the running group's copy of a block
+ *
+ *  @return 1 if the block was copied; 0 if the group does not hold it
+ */
+int vdisk_journal_read(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(!j->enabled || !j->group_dirty[block_ref])
+    return(0);
+  memcpy(block, &j->group_block[block_ref], BLOCK_SIZE);
+  return(1);
+}
+
+/**
+ *  Add a block write to the running group
+ *
+ *  @return 0 if success
+ */
+int vdisk_journal_write(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(!j->group_dirty[block_ref]) {
+    j->group_dirty[block_ref] = 1;
+    ++j->group_count;
+  }
+  memcpy(&j->group_block[block_ref], block, BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ *  Keep the running group coherent with a block that was written
+ *   directly (outside of a transaction)
+ */
+void vdisk_journal_update(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(j->enabled && j->group_dirty[block_ref])
+    memcpy(&j->group_block[block_ref], block, BLOCK_SIZE);
+}
+
+/**
+ *  A block is about to be written straight to its home location: if a
+ *   record that may still be replayed holds an older copy of it, move the
+ *   tail past every record first, so that replay cannot put that copy back
+ *
+ *  @return 0 if success; -1 if error
+ */
+int vdisk_journal_bypass(VDISK *disk, BLOCK_REFERENCE block_ref)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(!j->enabled || !j->logged[block_ref])
+    return(0);
+  return(journal_checkpoint(disk));
+}
+
+/**
+ *  Commit the running group: one journal record, one sync, then the
+ *   home writes.  While any transaction is open the group holds part of
+ *   it, so the commit waits for the last of them to end.
+ *
+ *  @return 0 if success (or put off); -1 if error
+ */
+int vdisk_journal_flush(VDISK *disk)
+{
+  VDISK_JOURNAL *j = &disk->journal;
+  if(j->enabled && j->handles > 0) {
+    j->flush_deferred = 1;
+    return(0);
+  }
+  j->flush_deferred = 0;
+  if(!j->enabled || j->group_count == 0) {
+    j->group_transactions = 0;
+    return(0);
+  }
+
+  // Find log space for the record, releasing old records if needed
+  uint32_t k = j->group_count + 2;
+  uint32_t pos = j->head + k <= JOURNAL_LOG_BLOCKS ? j->head : 0;
+  if(j->tail_seq != j->head_seq) {
+    int fits;
+    if(j->tail < j->head)
+      fits = pos == j->head || k <= j->tail;
+    else if(j->tail > j->head)
+      fits = j->head + k <= j->tail;
+    else
+      fits = 0;
+    if(!fits) {
+      if(journal_checkpoint(disk) != 0)
+        return(-1);
+    }
+  }
+
+  // Assemble the record
+  memset(RECORD_BLOCK(0), 0, BLOCK_SIZE);
+  JOURNAL_DESCRIPTOR *desc = (JOURNAL_DESCRIPTOR *) RECORD_BLOCK(0);
+  desc->magic = JOURNAL_DESCRIPTOR_MAGIC;
+  desc->seq = j->head_seq;
+  desc->n_blocks = j->group_count;
+  int i = 1;
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    if(j->group_dirty[ref]) {
+      desc->map[ref >> 3] |= 0x80 >> (ref & 7);
+      memcpy(RECORD_BLOCK(i++), &j->group_block[ref], BLOCK_SIZE);
+    }
+  }
+  memset(RECORD_BLOCK(i), 0, BLOCK_SIZE);
+  JOURNAL_COMMIT *commit = (JOURNAL_COMMIT *) RECORD_BLOCK(i);
+  commit->magic = JOURNAL_COMMIT_MAGIC;
+  commit->seq = j->head_seq;
+  commit->n_blocks = j->group_count;
+  commit->checksum = journal_checksum(2166136261U, j->record, i * BLOCK_SIZE);
+
+  // Group commit: one write, one sync
+  if(vdisk_raw_write_blocks(disk, JOURNAL_LOG_LBA + pos, k, j->record) != 0
+     || vdisk_durability_barrier(disk) != 0) {
+    fprintf(stderr, "Journal: error committing transaction group\n");
+    return(-1);
+  }
+
+  // The record is durable: write the blocks in place, once the snapshots
+  //  that share them have their own copies and the changes are tracked
+  //  (all with one barrier)
+  int ret = 0;
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS && ret == 0; ++ref) {
+    if(j->group_dirty[ref])
+      ret = vdisk_track_write(disk, ref);
+  }
+  if(ret == 0)
+    ret = vdisk_track_commit(disk);
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    if(j->group_dirty[ref]) {
+      if(vdisk_home_write(disk, ref, &j->group_block[ref]) != 0)
+        ret = -1;
+      j->group_dirty[ref] = 0;
+      j->logged[ref] = 1;
+    }
+  }
+  j->head = (pos + k) % JOURNAL_LOG_BLOCKS;
+  ++j->head_seq;
+  j->group_count = j->group_transactions = 0;
+  if(vdisk_checksum_flush(disk) != 0)
+    ret = -1;
+  return(ret);
+}
@@ -0,0 +1,331 @@
+/**
+ *  vdisk_snapshot.c
+ *
+ *  Copy-on-write snapshots of the whole disk.  The snapshot table lives
+ *  after the checksum table; each snapshot has a block map saying, for
+ *  every block, whether the snapshot still shares it with the live disk
+ *  or where its own copy is in the store that follows.
+ *
+ *  Taking a snapshot writes an empty map and the table: nothing is
+ *  copied.  The first time a block is written after that, its old
+ *  contents go to the store once, for every snapshot that still shares
+ *  it, and the maps that changed are made durable before the block is
+ *  overwritten (see vdisk_track_write() in virtual_disk.c).  A snapshot reads its own copies and the live blocks it
+ *  still shares.
+ *
+ *  The table is loaded when the disk is attached, before the journal is
+ *  replayed, so replayed writes preserve what the snapshots need.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "vdisk_internal.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53
+#define SNAPSHOT_VERSION 1
+
+#if 20 + VDISK_MAX_SNAPSHOTS * (4 + VDISK_SNAPSHOT_NAME) > BLOCK_SIZE
+#error "Snapshot table does not fit in a block"
+#endif
+
+typedef struct snapshot_entry_s
+{
+  // 0: slot not in use
+  uint32_t generation;
+  char name[VDISK_SNAPSHOT_NAME];
+} SNAPSHOT_ENTRY;
+
+// Snapshot table
+typedef struct snapshot_super_s
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_blocks;
+  uint32_t max_snapshots;
+  uint32_t next_generation;
+  SNAPSHOT_ENTRY entry[VDISK_MAX_SNAPSHOTS];
+} SNAPSHOT_SUPER;
+
+/**
+ *  Write the table
+ *
+ *  @return 0 if success; -1 if error
+ */
+static int snapshot_write_super(VDISK *disk)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  unsigned char b[BLOCK_SIZE];
+  memset(b, 0, sizeof(b));
+  SNAPSHOT_SUPER *super = (SNAPSHOT_SUPER *) b;
+  super->magic = SNAPSHOT_MAGIC;
+  super->version = SNAPSHOT_VERSION;
+  super->n_blocks = N_BLOCKS;
+  super->max_snapshots = VDISK_MAX_SNAPSHOTS;
+  super->next_generation = s->next_generation;
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    super->entry[k].generation = s->generation[k];
+    memcpy(super->entry[k].name, s->name[k], VDISK_SNAPSHOT_NAME);
+  }
+  return(vdisk_raw_write(disk, SNAPSHOT_SUPER_LBA, b));
+}
+
+/**
+ *  @return The slot of the snapshot with this name; -1 if there is none
+ */
+static int snapshot_find(VDISK *disk, char *name)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    if(s->generation[k] != 0 && strncmp(s->name[k], name, VDISK_SNAPSHOT_NAME) == 0)
+      return(k);
+  }
+  return(-1);
+}
+
+/**
+ *  Load the snapshot table and maps if the disk has them
+ *
+ *  @return 0 if success (including no snapshots on this disk); -1 if error
+ */
+int vdisk_snapshot_open(VDISK *disk)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  unsigned char b[BLOCK_SIZE];
+  memset(s, 0, sizeof(VDISK_SNAPSHOT));
+  s->next_generation = 1;
+
+  // Disks that never had a snapshot have no table
+  if(vdisk_raw_read(disk, SNAPSHOT_SUPER_LBA, b) != 0)
+    return(0);
+  SNAPSHOT_SUPER *super = (SNAPSHOT_SUPER *) b;
+  if(super->magic != SNAPSHOT_MAGIC)
+    return(0);
+  if(super->version != SNAPSHOT_VERSION || super->n_blocks != N_BLOCKS
+     || super->max_snapshots != VDISK_MAX_SNAPSHOTS) {
+    fprintf(stderr, "Snapshots: unknown table format (version %u)\n", super->version);
+    return(-1);
+  }
+
+  s->next_generation = super->next_generation;
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    s->generation[k] = super->entry[k].generation;
+    memcpy(s->name[k], super->entry[k].name, VDISK_SNAPSHOT_NAME);
+    s->name[k][VDISK_SNAPSHOT_NAME - 1] = 0;
+  }
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    if(s->generation[k] == 0)
+      continue;
+    if(vdisk_raw_read(disk, SNAPSHOT_MAP_LBA + k, s->map[k]) != 0) {
+      fprintf(stderr, "Snapshots: unable to read the map of %s\n", s->name[k]);
+      return(-1);
+    }
+    for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+      uint16_t m = s->map[k][ref];
+      if(m > SNAPSHOT_STORE_BLOCKS) {
+        fprintf(stderr, "Snapshots: bad map entry in %s\n", s->name[k]);
+        return(-1);
+      }
+      if(m == 0)
+        s->shared[ref] |= 1 << k;
+      else
+        s->store_users[m - 1] |= 1 << k;
+    }
+  }
+  return(0);
+}
+
+/**
+ *  A block is about to be overwritten: copy its contents to the store for
+ *   the snapshots that still share it.  The copy is not safe until
+ *   vdisk_snapshot_commit() has returned.
+ *
+ *  @param block_ref Block about to be written
+ *  @return 0 if success (including nothing to copy); -1 if the block
+ *          could not be preserved (it must not be written)
+ */
+int vdisk_snapshot_preserve(VDISK *disk, BLOCK_REFERENCE block_ref)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  unsigned char users = s->shared[block_ref];
+  if(users == 0)
+    return(0);
+
+  int slot;
+  for(slot = 0; slot < SNAPSHOT_STORE_BLOCKS && s->store_users[slot] != 0; ++slot)
+    ;
+  if(slot == SNAPSHOT_STORE_BLOCKS) {
+    fprintf(stderr, "Snapshots: the store is full\n");
+    return(-1);
+  }
+
+  // The contents as they are now (once any write in flight has landed)
+  unsigned char b[BLOCK_SIZE];
+  vdisk_block_lock(disk, block_ref, 0);
+  int ret = vdisk_raw_read(disk, block_ref, b);
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  if(ret != 0 || vdisk_raw_write(disk, SNAPSHOT_STORE_LBA + slot, b) != 0) {
+    fprintf(stderr, "Snapshots: unable to preserve block %d\n", block_ref);
+    return(-1);
+  }
+
+  s->store_users[slot] = users;
+  s->shared[block_ref] = 0;
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    if(users & (1 << k)) {
+      s->map[k][block_ref] = slot + 1;
+      s->map_dirty[k] = 1;
+    }
+  }
+  return(0);
+}
+
+/**
+ *  Write out the maps changed by vdisk_snapshot_preserve() (the caller
+ *   makes them durable before the blocks they were taken from are
+ *   overwritten)
+ *
+ *  @return 1 if something was written; 0 if no map had changed; -1 if error
+ */
+int vdisk_snapshot_commit(VDISK *disk)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  int written = 0;
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    if(s->map_dirty[k]) {
+      if(vdisk_raw_write(disk, SNAPSHOT_MAP_LBA + k, s->map[k]) != 0) {
+        fprintf(stderr, "Snapshots: unable to write the map of %s\n", s->name[k]);
+        return(-1);
+      }
+      s->map_dirty[k] = 0;
+      written = 1;
+    }
+  }
+  return(written);
+}
+
+/**
+ *  Take a snapshot of the disk as it is now.  Finished transactions are
+ *   committed first; none may be open.
+ *
+ *  @param name Name of the new snapshot
+ *  @return 0 if success
+ *          -1 if error
+ *          -2 if the name is bad or in use, or every slot is taken
+ */
+int vdisk_snapshot_create(VDISK *disk, char *name)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  if(name[0] == 0 || strlen(name) >= VDISK_SNAPSHOT_NAME || snapshot_find(disk, name) >= 0)
+    return(-2);
+  int k;
+  for(k = 0; k < VDISK_MAX_SNAPSHOTS && s->generation[k] != 0; ++k)
+    ;
+  if(k == VDISK_MAX_SNAPSHOTS)
+    return(-2);
+  if(disk->journal.handles > 0) {
+    fprintf(stderr, "Snapshots: transactions are open\n");
+    return(-1);
+  }
+  if(vdisk_journal_flush(disk) != 0)
+    return(-1);
+
+  // An empty map: every block is shared
+  memset(s->map[k], 0, sizeof(s->map[k]));
+  if(vdisk_raw_write(disk, SNAPSHOT_MAP_LBA + k, s->map[k]) != 0)
+    return(-1);
+  s->generation[k] = s->next_generation++;
+  memset(s->name[k], 0, VDISK_SNAPSHOT_NAME);
+  strcpy(s->name[k], name);
+  if(snapshot_write_super(disk) != 0) {
+    s->generation[k] = 0;
+    return(-1);
+  }
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref)
+    s->shared[ref] |= 1 << k;
+  return(vdisk_durability_barrier(disk));
+}
+
+/**
+ *  Drop a snapshot; the store blocks only it used become free
+ *
+ *  @return 0 if success; -1 if error; -2 if there is no such snapshot
+ */
+int vdisk_snapshot_delete(VDISK *disk, char *name)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  int k = snapshot_find(disk, name);
+  if(k < 0)
+    return(-2);
+  uint32_t generation = s->generation[k];
+  s->generation[k] = 0;
+  if(snapshot_write_super(disk) != 0) {
+    s->generation[k] = generation;
+    return(-1);
+  }
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    s->shared[ref] &= ~(1 << k);
+    if(s->map[k][ref] != 0)
+      s->store_users[s->map[k][ref] - 1] &= ~(1 << k);
+  }
+  s->map_dirty[k] = 0;
+  return(vdisk_durability_barrier(disk));
+}
+
+/**
+ *  Describe the snapshots, oldest first
+ *
+ *  @param info Space for VDISK_MAX_SNAPSHOTS descriptions
+ *  @return Number of snapshots
+ */
+int vdisk_snapshot_list(VDISK *disk, VDISK_SNAPSHOT_INFO *info)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  int n = 0;
+  for(int k = 0; k < VDISK_MAX_SNAPSHOTS; ++k) {
+    if(s->generation[k] == 0)
+      continue;
+    // Insertion by generation
+    int i = n++;
+    for(; i > 0 && info[i - 1].generation > s->generation[k]; --i)
+      info[i] = info[i - 1];
+    memcpy(info[i].name, s->name[k], VDISK_SNAPSHOT_NAME);
+    info[i].generation = s->generation[k];
+    info[i].preserved = 0;
+    for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref)
+      info[i].preserved += s->map[k][ref] != 0;
+  }
+  return(n);
+}
+
+/**
+ *  Read every block of a snapshot
+ *
+ *  @param name Name of the snapshot
+ *  @param blocks Space for N_BLOCKS blocks, packed BLOCK_SIZE bytes apart
+ *  @return 0 if success; -1 if error; -2 if there is no such snapshot
+ */
+int vdisk_snapshot_read(VDISK *disk, char *name, void *blocks)
+{
+  VDISK_SNAPSHOT *s = &disk->snapshot;
+  int k = snapshot_find(disk, name);
+  if(k < 0)
+    return(-2);
+  unsigned char *b = blocks;
+  for(BLOCK_REFERENCE ref = 0; ref < N_BLOCKS; ++ref) {
+    int ret;
+    if(s->map[k][ref] != 0) {
+      ret = vdisk_raw_read(disk, SNAPSHOT_STORE_LBA + s->map[k][ref] - 1, b + ref * BLOCK_SIZE);
+    }else{
+      // Still the live block (as written at home, not as the journal holds it)
+      vdisk_block_lock(disk, ref, 0);
+      ret = vdisk_raw_read(disk, ref, b + ref * BLOCK_SIZE);
+      pthread_rwlock_unlock(&disk->block_lock[ref]);
+    }
+    if(ret != 0) {
+      fprintf(stderr, "Snapshots: unable to read block %d of %s\n", ref, name);
+      return(-1);
+    }
+  }
+  return(0);
+}
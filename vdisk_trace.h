@@ -0,0 +1,51 @@
+/**
+ *  Block I/O trace format
+ *
+ *  A trace file is a VDISK_TRACE_HEADER followed by a stream of fixed-size
+ *  VDISK_TRACE_RECORDs.  Several processes may append to the same trace
+ *  (records are written with O_APPEND in whole-record chunks), so records
+ *  carry absolute timestamps.
+ *
+ *  Recording is enabled by setting OUFS_TRACE to the name of the trace file.
+ */
+
+#ifndef VDISK_TRACE_H
+#define VDISK_TRACE_H
+
+#include <stdint.h>
+
+// "OUFT" in little-endian byte order
+#define VDISK_TRACE_MAGIC 0x5446554f
+#define VDISK_TRACE_VERSION 1
+
+// Operation codes
+#define VDISK_TRACE_READ 0
+#define VDISK_TRACE_WRITE 1
+
+// Originating oufs_* call for each block I/O
+typedef enum {VDISK_CALLER_NONE=0, VDISK_CALLER_FORMAT, VDISK_CALLER_MKDIR,
+              VDISK_CALLER_LIST, VDISK_CALLER_RMDIR, VDISK_CALLER_INSPECT,
+              VDISK_CALLER_REPLAY, VDISK_CALLER_FSCK, VDISK_CALLER_WALK, VDISK_CALLER_IMPORT,
+              VDISK_CALLER_SNAPSHOT, VDISK_CALLER_DELTA, VDISK_CALLER_COMPACT,
+              VDISK_CALLER_DEFRAG,
+              VDISK_N_CALLERS} VDISK_CALLER;
+
+typedef struct __attribute__((packed)) vdisk_trace_header_s
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t block_size;
+  uint32_t n_blocks;
+  uint32_t record_size;
+} VDISK_TRACE_HEADER;
+
+typedef struct __attribute__((packed)) vdisk_trace_record_s
+{
+  // CLOCK_REALTIME in nanoseconds
+  uint64_t timestamp;
+  uint16_t block_ref;
+  uint8_t op;
+  uint8_t caller;
+} VDISK_TRACE_RECORD;
+
+#endif
@@ -8,13 +8,283 @@
  */
 
 
+#include <string.h>
+#include <time.h>
+#include <sched.h>
 #include "oufs.h"
 #include "storage.h"
 #include "virtual_disk.h"
+#include "vdisk_trace.h"
+#include "vdisk_internal.h"
 
-// Yes, another global variable: this is how we achieve persistence in 
-//  this case.
-STORAGE *storage = NULL;
+// Most blocks locked and transferred at once by virtual_disk_read_blocks()
+//  and virtual_disk_write_blocks()
+#define VDISK_BULK_RUN 32
+
+// Most disks one thread may have transactions open on at once
+#define VDISK_THREAD_DISKS 8
+
+// The oufs_* call that the current thread is executing (for traces)
+static __thread int trace_caller = VDISK_CALLER_NONE;
+
+// Transactions the current thread has open, on each disk
+static __thread struct {
+  VDISK *disk;
+  int depth;
+} transaction_depth[VDISK_THREAD_DISKS];
+
+/**
+ *  Append the buffered trace records to the trace file.
+ *   Called with disk->lock held.
+ *
+ *  @return 0 if success; -1 with an error
+ */
+static int trace_flush(VDISK *disk)
+{
+  if(disk->trace_fd < 0 || disk->trace_count == 0)
+    return(0);
+
+  // One write per buffer so that concurrent appenders never split a record
+  ssize_t len = disk->trace_count * sizeof(VDISK_TRACE_RECORD);
+  ssize_t ret = write(disk->trace_fd, disk->trace_buffer, len);
+  disk->trace_count = 0;
+  if(ret != len) {
+    fprintf(stderr, "Error writing block trace\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ *  Open the trace file named by OUFS_TRACE (if set).  A header is written
+ *   when the trace file is new; otherwise records are appended.
+ *
+ *  @return 0 if success (or tracing is off); -1 with an error
+ */
+static int trace_open(VDISK *disk)
+{
+  disk->trace_fd = -1;
+  disk->trace_count = 0;
+
+  char *name = getenv("OUFS_TRACE");
+  if(name == NULL || name[0] == 0)
+    return(0);
+
+  disk->trace_fd = open(name, O_WRONLY | O_CREAT | O_APPEND,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(disk->trace_fd < 0) {
+    fprintf(stderr, "Unable to open trace %s\n", name);
+    return(-1);
+  }
+
+  // New trace: start with the header
+  struct stat st;
+  if(fstat(disk->trace_fd, &st) == 0 && st.st_size == 0) {
+    VDISK_TRACE_HEADER header;
+    header.magic = VDISK_TRACE_MAGIC;
+    header.version = VDISK_TRACE_VERSION;
+    header.block_size = BLOCK_SIZE;
+    header.n_blocks = N_BLOCKS;
+    header.record_size = sizeof(VDISK_TRACE_RECORD);
+    if(write(disk->trace_fd, &header, sizeof(header)) != sizeof(header)) {
+      fprintf(stderr, "Error writing trace header\n");
+      close(disk->trace_fd);
+      disk->trace_fd = -1;
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+/**
+ *  Finish the trace (if tracing is on)
+ */
+static void trace_close(VDISK *disk)
+{
+  if(disk->trace_fd >= 0) {
+    trace_flush(disk);
+    close(disk->trace_fd);
+    disk->trace_fd = -1;
+  }
+}
+
+/**
+ *  Record a single block I/O (if tracing is on).
+ *   Called with disk->lock held.
+ *
+ *  @param block_ref Block that is being accessed
+ *  @param op VDISK_TRACE_READ or VDISK_TRACE_WRITE
+ */
+static void trace_record(VDISK *disk, BLOCK_REFERENCE block_ref, int op)
+{
+  if(disk->trace_fd < 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  VDISK_TRACE_RECORD *r = &disk->trace_buffer[disk->trace_count++];
+  r->timestamp = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+  r->block_ref = block_ref;
+  r->op = op;
+  r->caller = trace_caller;
+
+  if(disk->trace_count == TRACE_BUFFER_RECORDS)
+    trace_flush(disk);
+}
+
+/**
+ *  Tag subsequent block I/O from this thread with the oufs_* call that
+ *   caused it
+ *
+ *  @param caller One of the VDISK_CALLER values
+ *  @return The previous caller tag (so that nested calls can restore it)
+ */
+int virtual_disk_set_caller(int caller)
+{
+  int previous = trace_caller;
+  trace_caller = caller;
+  return(previous);
+}
+
+/**
+ *  Read a block at any address on the disk (including the metadata area).
+ *   No tracing, journaling or locking.
+ *
+ * @param lba Block address
+ * @param block Buffer in which to store the read block
+ * @return -1 if an error has occurred (or the block is past the end of
+ *         the storage file); 0 if successful
+ */
+int vdisk_raw_read(VDISK *disk, unsigned int lba, void *block)
+{
+  int ret = get_bytes(disk->storage, block, lba * BLOCK_SIZE, BLOCK_SIZE);
+  if(ret <= 0)
+    return(-1);
+
+  // Partial block at the end of the file
+  if(ret < BLOCK_SIZE)
+    memset((unsigned char *)block + ret, 0, BLOCK_SIZE - ret);
+  if(lba < N_BLOCKS)
+    vdisk_discard_fill(disk, lba, block);
+  return(0);
+}
+
+/**
+ *  Write a block at any address on the disk.  No tracing, journaling or
+ *   locking.
+ *
+ * @param lba Block address
+ * @param block Buffer containing the block to write
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int vdisk_raw_write(VDISK *disk, unsigned int lba, void *block)
+{
+  return(vdisk_raw_write_blocks(disk, lba, 1, block));
+}
+
+/**
+ *  Write a run of consecutive blocks with a single request
+ *
+ * @param lba Address of the first block
+ * @param n Number of blocks
+ * @param blocks Buffer containing the n blocks
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int vdisk_raw_write_blocks(VDISK *disk, unsigned int lba, int n, void *blocks)
+{
+  int ret = put_bytes(disk->storage, blocks, lba * BLOCK_SIZE, n * BLOCK_SIZE);
+  if(ret != n * BLOCK_SIZE)
+    return(-1);
+  return(0);
+}
+
+/**
+ *  Make all previous writes durable.  Called with disk->lock held.
+ *
+ * @param data_only Skip file metadata that is not needed to read the data
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int vdisk_raw_sync(VDISK *disk, int data_only)
+{
+  // The checksums of what has been written go with it
+  int ret = vdisk_checksum_flush(disk);
+  if(sync_storage(disk->storage, data_only) != 0)
+    ret = -1;
+  return(ret);
+}
+
+/**
+ *  Lock the home location of a block for reading or writing, once no
+ *   asynchronous write of it is in flight
+ */
+void vdisk_block_lock(VDISK *disk, BLOCK_REFERENCE block_ref, int write)
+{
+  for(;;) {
+    if(write)
+      pthread_rwlock_wrlock(&disk->block_lock[block_ref]);
+    else
+      pthread_rwlock_rdlock(&disk->block_lock[block_ref]);
+    if(disk->async_writes[block_ref] == 0)
+      return;
+    pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+    sched_yield();
+  }
+}
+
+/**
+ *  A block is about to be written to its home location: a discarded block
+ *   gets its contents back in place, the snapshots that share it get their
+ *   own copy, and the change is tracked.  Nothing is safe until
+ *   vdisk_track_commit() has returned.
+ *
+ * @param block_ref Block about to be written
+ * @return -1 if the block must not be written; 0 if successful
+ */
+int vdisk_track_write(VDISK *disk, BLOCK_REFERENCE block_ref)
+{
+  if(vdisk_discard_restore(disk, block_ref) != 0
+     || vdisk_snapshot_preserve(disk, block_ref) != 0)
+    return(-1);
+  vdisk_cbt_mark(disk, block_ref);
+  return(0);
+}
+
+/**
+ *  Make what vdisk_track_write() recorded durable, with one barrier
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int vdisk_track_commit(VDISK *disk)
+{
+  int snapshot = vdisk_snapshot_commit(disk);
+  int cbt = vdisk_cbt_commit(disk);
+  int discard = vdisk_discard_commit(disk);
+  if(snapshot < 0 || cbt < 0 || discard < 0)
+    return(-1);
+  if(snapshot > 0 || cbt > 0 || discard > 0)
+    return(vdisk_durability_barrier(disk));
+  return(0);
+}
+
+/**
+ *  Write a block to its home location, excluding readers of that block
+ *
+ * @param block_ref Block to write
+ * @param block Buffer containing the block to write
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int vdisk_home_write(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  if(vdisk_track_write(disk, block_ref) != 0 || vdisk_track_commit(disk) != 0)
+    return(-1);
+  vdisk_block_lock(disk, block_ref, 1);
+  ++disk->write_generation[block_ref];
+  vdisk_checksum_update(disk, block_ref, block);
+  int ret = vdisk_raw_write(disk, block_ref, block);
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  return(ret);
+}
 
 /**
  *  Atttach to the specified virtual disk
@@ -22,35 +292,101 @@ STORAGE *storage = NULL;
  *  @param virtual_disk_name Name of the virtual disk to open
  *  @param pipe_name_base  Base name of the input and outputs
  *    NOTE: NOT USED IN THIS IMPLEMENTATION
- *  @return 0 if success; -1 with an error
+ *  @return The attached disk; NULL with an error
  */
-int virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base)
+VDISK *virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base)
 {
+  VDISK *disk = malloc(sizeof(VDISK));
+  if(disk == NULL)
+    return(NULL);
+  memset(disk, 0, sizeof(VDISK));
+  pthread_mutex_init(&disk->lock, NULL);
+  pthread_cond_init(&disk->idle, NULL);
+  for(int i = 0; i < N_BLOCKS; ++i)
+    pthread_rwlock_init(&disk->block_lock[i], NULL);
+  disk->trace_fd = -1;
+
   // Initialize the general storage system
-  storage = init_storage(virtual_disk_name, pipe_name_base);
+  disk->storage = init_storage(virtual_disk_name, pipe_name_base);
 
   // Parse result
-  if(storage == NULL) 
-    return(-1);
-  else {
-    // Success
-    return(0);
+  if(disk->storage == NULL) {
+    free(disk);
+    return(NULL);
+  }
+
+  // Optional block I/O trace
+  if(trace_open(disk) != 0) {
+    close_storage(disk->storage);
+    free(disk);
+    return(NULL);
+  }
+
+  // Checksums of the blocks (the journal replay keeps them up to date)
+  if(vdisk_checksum_open(disk) != 0) {
+    virtual_disk_detach(disk);
+    return(NULL);
+  }
+
+  // Snapshots, changed-block tracking and discarded blocks (the journal
+  //  replay writes through them like any other writer)
+  if(vdisk_snapshot_open(disk) != 0 || vdisk_cbt_open(disk) != 0
+     || vdisk_discard_open(disk) != 0) {
+    virtual_disk_detach(disk);
+    return(NULL);
   }
+
+  // Bring the disk to a consistent state
+  if(vdisk_journal_open(disk) != 0 || vdisk_checksum_flush(disk) != 0) {
+    fprintf(stderr, "Unable to replay the journal of %s\n", virtual_disk_name);
+    virtual_disk_detach(disk);
+    return(NULL);
+  }
+
+  // When do writes become durable? (OUFS_DURABILITY)
+  if(vdisk_durability_open(disk) != 0) {
+    virtual_disk_detach(disk);
+    return(NULL);
+  }
+
+  // Success
+  return(disk);
 }
 
 /**
- *  Detach from the specified vitual disk.
+ *  Detach from the specified vitual disk.  No other thread may be using
+ *   the disk.
  *
  * @return Status after closing the connection to the server
  * @return 0 if closed succesfully; -1  if an error
  */
-int virtual_disk_detach()
+int virtual_disk_detach(VDISK *disk)
 {
-  if(storage == NULL)
+  if(disk == NULL)
     return(-1);
-  int ret = close_storage(storage);
 
-  storage = NULL;
+  // Commit any outstanding transactions and make everything durable
+  vdisk_durability_stop(disk);
+  pthread_mutex_lock(&disk->lock);
+  int journal_ret = vdisk_journal_close(disk);
+  if(vdisk_checksum_flush(disk) != 0)
+    journal_ret = -1;
+  if(vdisk_durability_close(disk) != 0)
+    journal_ret = -1;
+
+  // Finish the trace
+  trace_close(disk);
+  pthread_mutex_unlock(&disk->lock);
+
+  int ret = close_storage(disk->storage);
+
+  pthread_mutex_destroy(&disk->lock);
+  pthread_cond_destroy(&disk->idle);
+  for(int i = 0; i < N_BLOCKS; ++i)
+    pthread_rwlock_destroy(&disk->block_lock[i]);
+  free(disk);
+  if(journal_ret != 0)
+    return(-1);
   return(ret);
 }
 
@@ -62,15 +398,31 @@ int virtual_disk_detach()
  * @return -1 if an error has occurred; 0 if successful
  */
 
-int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block)
+int virtual_disk_read_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
 {
   if(block_ref >= N_BLOCKS) {
     // Improper ref
     return(-1);
   };
 
+  pthread_mutex_lock(&disk->lock);
+  trace_record(disk, block_ref, VDISK_TRACE_READ);
+
+  // Uncommitted transactions hold the newest copy
+  int found = vdisk_journal_read(disk, block_ref, block);
+  pthread_mutex_unlock(&disk->lock);
+  if(found)
+    return(0);
+
   // Read the bytes
-  int ret = get_bytes(storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
+  vdisk_block_lock(disk, block_ref, 0);
+  int ret = get_bytes(disk->storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
+  if(ret > 0)
+    vdisk_discard_fill(disk, block_ref, block);
+  if(ret > 0 && vdisk_checksum_verify(disk, block_ref, block) != 0)
+    ret = -1;
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+
   if(ret > 0)
     // Success
     return(0);
@@ -78,6 +430,53 @@ int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block)
     // Error
     return(-1);
 }
+/**
+ *  Read a run of consecutive blocks with a few large requests (for tools
+ *   that load the whole disk).  Other block I/O waits until it is done.
+ *
+ * @param first Integer index of the first block to read
+ * @param n Number of blocks
+ * @param blocks Buffer in which to store the blocks, packed BLOCK_SIZE
+ *   bytes apart
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_read_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, void *blocks)
+{
+  if(first >= N_BLOCKS || n <= 0 || n > N_BLOCKS - first) {
+    // Improper ref
+    return(-1);
+  };
+
+  pthread_mutex_lock(&disk->lock);
+  unsigned char *b = blocks;
+  int ret = 0;
+  for(int run = 0; run < n && ret == 0; run += VDISK_BULK_RUN) {
+    int len = MIN(VDISK_BULK_RUN, n - run);
+    for(int i = run; i < run + len; ++i) {
+      trace_record(disk, first + i, VDISK_TRACE_READ);
+      vdisk_block_lock(disk, first + i, 0);
+    }
+
+    // Read the bytes
+    if(get_bytes(disk->storage, b + run * BLOCK_SIZE, (first + run) * BLOCK_SIZE,
+                 len * BLOCK_SIZE) != len * BLOCK_SIZE)
+      ret = -1;
+    for(int i = run; i < run + len; ++i) {
+      if(ret == 0)
+        vdisk_discard_fill(disk, first + i, b + i * BLOCK_SIZE);
+      if(ret == 0 && vdisk_checksum_verify(disk, first + i, b + i * BLOCK_SIZE) != 0)
+        ret = -1;
+      pthread_rwlock_unlock(&disk->block_lock[first + i]);
+    }
+  }
+
+  // Uncommitted transactions hold the newest copies
+  for(int i = 0; i < n; ++i)
+    vdisk_journal_read(disk, first + i, b + i * BLOCK_SIZE);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
 /**
  * Write the specified block to the storage file
  *
@@ -86,20 +485,535 @@ int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block)
  * @return -1 if an error has occurred; 0 if successful
  */
 
-int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block)
+int virtual_disk_write_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
 {
   if(block_ref >= N_BLOCKS) {
     return(-1);
   };
 
-  // Write the bytes
-  int ret = put_bytes(storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
-  
+  pthread_mutex_lock(&disk->lock);
+  trace_record(disk, block_ref, VDISK_TRACE_WRITE);
+
+  // Inside a transaction: the write goes to the journal first
+  if(vdisk_journal_in_transaction(disk)) {
+    int ret = vdisk_journal_write(disk, block_ref, block);
+    pthread_mutex_unlock(&disk->lock);
+    return(ret);
+  }
+  vdisk_journal_update(disk, block_ref, block);
+
+  // An older copy in the log must not be replayed over the new bytes
+  if(vdisk_journal_bypass(disk, block_ref) != 0
+     || vdisk_track_write(disk, block_ref) != 0 || vdisk_track_commit(disk) != 0) {
+    pthread_mutex_unlock(&disk->lock);
+    return(-1);
+  }
+  vdisk_block_lock(disk, block_ref, 1);
+  ++disk->write_generation[block_ref];
+  vdisk_checksum_update(disk, block_ref, block);
+  pthread_mutex_unlock(&disk->lock);
+
+  // Write the bytes, holding up only the users of this block
+  int ret = vdisk_raw_write(disk, block_ref, block);
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  if(ret != 0)
+    return(-1);
+
+  pthread_mutex_lock(&disk->lock);
+  ret = vdisk_durability_write(disk);
+  pthread_mutex_unlock(&disk->lock);
+  if(ret > 0)
+    ret = sync_storage(disk->storage, 1);
+  return(ret);
+}
+
+/**
+ *  Write a run of consecutive blocks with a few large requests, straight
+ *   to their home locations (not through the journal).  Meant for blocks
+ *   that nothing refers to yet: a transaction that links them in must
+ *   come after.  Older copies of them in the journal are checkpointed
+ *   first.  Other block I/O waits until it is done.
+ *
+ * @param first Integer index of the first block to write
+ * @param n Number of blocks
+ * @param blocks Buffer containing the blocks, packed BLOCK_SIZE bytes apart
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_write_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, void *blocks)
+{
+  if(first >= N_BLOCKS || n <= 0 || n > N_BLOCKS - first) {
+    // Improper ref
+    return(-1);
+  };
+
+  pthread_mutex_lock(&disk->lock);
+  unsigned char *b = blocks;
+  int ret = 0;
+  for(int i = 0; i < n && ret == 0; ++i)
+    ret = vdisk_journal_bypass(disk, first + i);
+  for(int i = 0; i < n && ret == 0; ++i)
+    ret = vdisk_track_write(disk, first + i);
+  if(ret == 0)
+    ret = vdisk_track_commit(disk);
+  for(int run = 0; run < n && ret == 0; run += VDISK_BULK_RUN) {
+    int len = MIN(VDISK_BULK_RUN, n - run);
+    for(int i = run; i < run + len; ++i) {
+      trace_record(disk, first + i, VDISK_TRACE_WRITE);
+      vdisk_block_lock(disk, first + i, 1);
+      ++disk->write_generation[first + i];
+      vdisk_checksum_update(disk, first + i, b + i * BLOCK_SIZE);
+      vdisk_journal_update(disk, first + i, b + i * BLOCK_SIZE);
+    }
+
+    // Write the bytes
+    ret = vdisk_raw_write_blocks(disk, first + run, len, b + run * BLOCK_SIZE);
+    for(int i = run; i < run + len; ++i)
+      pthread_rwlock_unlock(&disk->block_lock[first + i]);
+  }
+  if(ret == 0)
+    ret = vdisk_durability_write(disk);
+  pthread_mutex_unlock(&disk->lock);
   if(ret > 0)
-    // SUccess
+    ret = sync_storage(disk->storage, 1);
+  return(ret);
+}
+
+/**
+ *  Start reading a block.  Requests started together are handed to the
+ *   storage in one batch (at the next virtual_disk_submit() or
+ *   virtual_disk_wait()) and may complete in any order.
+ *
+ * @param request Space for the request; must stay put until it is waited for
+ * @param block_ref Integer index of the block to read
+ * @param block Buffer in which to store the read block
+ * @return -1 if the read could not be started; 0 if successful
+ */
+int virtual_disk_read_block_async(VDISK *disk, VDISK_REQUEST *request,
+                                  BLOCK_REFERENCE block_ref, void *block)
+{
+  if(block_ref >= N_BLOCKS) {
+    // Improper ref
+    return(-1);
+  };
+  request->block_ref = block_ref;
+  request->write = 0;
+
+  pthread_mutex_lock(&disk->lock);
+  trace_record(disk, block_ref, VDISK_TRACE_READ);
+  int found = vdisk_journal_read(disk, block_ref, block);
+  pthread_mutex_unlock(&disk->lock);
+  if(found) {
+    // Uncommitted transactions hold the newest copy: done already
+    request->io.buf = NULL;
+    request->io.result = BLOCK_SIZE;
+    request->io.done = 1;
     return(0);
-  else
-    // Error
+  }
+
+  // A write that starts before the read is waited for makes it read again
+  vdisk_block_lock(disk, block_ref, 0);
+  request->generation = disk->write_generation[block_ref];
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  request->io.write = 0;
+  request->io.buf = block;
+  request->io.location = block_ref * BLOCK_SIZE;
+  request->io.len = BLOCK_SIZE;
+  return(queue_bytes(disk->storage, &request->io));
+}
+
+/**
+ *  Start writing a block.  Inside a transaction the write goes to the
+ *   journal and is done at once.
+ *
+ * @param request Space for the request; must stay put until it is waited for
+ * @param block_ref Integer index of the block to write
+ * @param block Buffer containing the block; must stay put until the
+ *   request is waited for
+ * @return -1 if the write could not be started; 0 if successful
+ */
+int virtual_disk_write_block_async(VDISK *disk, VDISK_REQUEST *request,
+                                   BLOCK_REFERENCE block_ref, void *block)
+{
+  if(block_ref >= N_BLOCKS) {
+    return(-1);
+  };
+  request->block_ref = block_ref;
+  request->write = 1;
+
+  pthread_mutex_lock(&disk->lock);
+  trace_record(disk, block_ref, VDISK_TRACE_WRITE);
+  if(vdisk_journal_in_transaction(disk)) {
+    int ret = vdisk_journal_write(disk, block_ref, block);
+    pthread_mutex_unlock(&disk->lock);
+    request->write = 0;
+    request->io.buf = NULL;
+    request->io.result = ret == 0 ? BLOCK_SIZE : -1;
+    request->io.done = 1;
+    return(0);
+  }
+  vdisk_journal_update(disk, block_ref, block);
+  if(vdisk_track_write(disk, block_ref) != 0 || vdisk_track_commit(disk) != 0) {
+    pthread_mutex_unlock(&disk->lock);
+    return(-1);
+  }
+  pthread_mutex_unlock(&disk->lock);
+
+  // Readers of the block wait until the write is waited for
+  vdisk_block_lock(disk, block_ref, 1);
+  ++disk->async_writes[block_ref];
+  ++disk->write_generation[block_ref];
+  uint32_t crc = vdisk_checksum_update(disk, block_ref, block);
+  pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  request->io.write = 1;
+  request->io.buf = block;
+  request->io.location = block_ref * BLOCK_SIZE;
+  request->io.len = BLOCK_SIZE;
+  if(queue_bytes(disk->storage, &request->io) != 0) {
+    pthread_rwlock_wrlock(&disk->block_lock[block_ref]);
+    --disk->async_writes[block_ref];
+    vdisk_checksum_restore(disk, block_ref, crc);
+    pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ *  Hand every started transfer to the storage without waiting for them
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_submit(VDISK *disk)
+{
+  return(submit_storage(disk->storage));
+}
+
+/**
+ *  Wait for a transfer started by this thread
+ *
+ * @param request A request started with virtual_disk_read_block_async()
+ *   or virtual_disk_write_block_async()
+ * @return -1 if the transfer failed; 0 if successful
+ */
+int virtual_disk_wait(VDISK *disk, VDISK_REQUEST *request)
+{
+  BLOCK_REFERENCE block_ref = request->block_ref;
+  int ret = wait_bytes(disk->storage, &request->io);
+
+  if(request->write) {
+    pthread_rwlock_wrlock(&disk->block_lock[block_ref]);
+    --disk->async_writes[block_ref];
+    pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  }else if(request->io.buf != NULL && ret > 0) {
+    // Read again if a write overlapped the read
+    vdisk_block_lock(disk, block_ref, 0);
+    if(disk->write_generation[block_ref] != request->generation)
+      ret = get_bytes(disk->storage, request->io.buf, block_ref * BLOCK_SIZE, BLOCK_SIZE);
+    if(ret > 0)
+      vdisk_discard_fill(disk, block_ref, request->io.buf);
+    if(ret > 0 && vdisk_checksum_verify(disk, block_ref, request->io.buf) != 0)
+      ret = -1;
+    pthread_rwlock_unlock(&disk->block_lock[block_ref]);
+  }
+  if(ret <= 0)
+    return(-1);
+
+  // Apply the durability policy to completed home writes
+  if(request->write) {
+    request->write = 0;
+    pthread_mutex_lock(&disk->lock);
+    ret = vdisk_durability_write(disk);
+    pthread_mutex_unlock(&disk->lock);
+    if(ret > 0)
+      ret = sync_storage(disk->storage, 1);
+    if(ret != 0)
+      return(-1);
+  }
+  return(0);
+}
+
+/**
+ *  Find how many transactions the current thread has open on a disk
+ *
+ * @param add Take a free entry if the disk has none
+ * @return The thread's count for the disk; NULL if it has none (or there
+ *         is no room for one)
+ */
+static int *thread_depth(VDISK *disk, int add)
+{
+  int unused = -1;
+  for(int i = 0; i < VDISK_THREAD_DISKS; ++i) {
+    if(transaction_depth[i].disk == disk)
+      return(&transaction_depth[i].depth);
+    if(unused < 0 && transaction_depth[i].depth == 0)
+      unused = i;
+  }
+  if(!add || unused < 0)
+    return(NULL);
+  transaction_depth[unused].disk = disk;
+  return(&transaction_depth[unused].depth);
+}
+
+/**
+ *  Start a metadata transaction.  Block writes up to the matching
+ *   virtual_disk_end_transaction() reach the disk atomically (on disks
+ *   that have a journal).  Transactions may be nested; transactions from
+ *   several threads share one running group.
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_begin_transaction(VDISK *disk)
+{
+  int *depth = thread_depth(disk, 1);
+  if(depth == NULL) {
+    fprintf(stderr, "virtual_disk_begin_transaction: transactions open on too many disks\n");
+    return(-1);
+  }
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_journal_begin(disk);
+  ++*depth;
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Finish a metadata transaction.  The transaction is committed together
+ *   with others (group commit); use virtual_disk_flush() to force it out.
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_end_transaction(VDISK *disk)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_journal_end(disk);
+
+  // This thread's outermost transaction is done: apply the durability
+  //  policy (other threads may still have theirs open)
+  int *depth = thread_depth(disk, 0);
+  if(depth != NULL && *depth > 0 && --*depth == 0 && vdisk_durability_commit(disk) != 0)
+    ret = -1;
+  if(disk->journal.handles == 0)
+    pthread_cond_broadcast(&disk->idle);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Commit every finished transaction.  Waits for the transactions that
+ *   other threads have open; inside a transaction of its own, the commit
+ *   is left to the end of the outermost one.
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_flush(VDISK *disk)
+{
+  int *depth = thread_depth(disk, 0);
+  pthread_mutex_lock(&disk->lock);
+  while((depth == NULL || *depth == 0) && disk->journal.handles > 0)
+    pthread_cond_wait(&disk->idle, &disk->lock);
+  int ret = vdisk_journal_flush(disk);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Create an empty metadata journal on the attached disk
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_create_journal(VDISK *disk)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_journal_create(disk);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Keep a checksum of every block from now on (see vdisk_checksum.c).
+ *   The blocks must already hold their initial contents.
+ *
+ * @param enable 0: stop keeping checksums (and remove the table)
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_create_checksums(VDISK *disk, int enable)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_checksum_create(disk, enable);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Re-read the journal after another process has changed the disk (it
+ *   may have moved the log, or died and left records to replay).  Only
+ *   valid while this attach has nothing waiting to be committed.
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_refresh(VDISK *disk)
+{
+  pthread_mutex_lock(&disk->lock);
+  VDISK_JOURNAL *j = &disk->journal;
+  if(j->handles > 0 || j->group_count > 0) {
+    pthread_mutex_unlock(&disk->lock);
+    fprintf(stderr, "virtual_disk_refresh: transactions are pending\n");
     return(-1);
+  }
+  // Keep the durability policy's group size
+  int group_size = j->group_size;
+  int ret = vdisk_checksum_flush(disk);
+  if(ret == 0)
+    ret = vdisk_checksum_open(disk);
+  if(ret == 0)
+    ret = vdisk_snapshot_open(disk);
+  if(ret == 0)
+    ret = vdisk_cbt_open(disk);
+  if(ret == 0)
+    ret = vdisk_discard_open(disk);
+  if(ret == 0)
+    ret = vdisk_journal_open(disk);
+  if(ret == 0)
+    ret = vdisk_checksum_flush(disk);
+  j->group_size = group_size;
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  How the disk is striped over its backing stores
+ *
+ * @return Number of blocks in one full stripe (one unit on every backing
+ *         store); 0 if the disk is not striped
+ */
+int virtual_disk_stripe_blocks(VDISK *disk)
+{
+  return(storage_stripe_size(disk->storage) / BLOCK_SIZE);
+}
 
+/**
+ *  Take a copy-on-write snapshot of the disk (see vdisk_snapshot.c).
+ *   Finished transactions are committed first; none may be open.
+ *
+ * @param name Name of the snapshot (shorter than VDISK_SNAPSHOT_NAME)
+ * @return 0 if successful; -1 if an error has occurred; -2 if the name
+ *         is bad or in use, or there are VDISK_MAX_SNAPSHOTS already
+ */
+int virtual_disk_create_snapshot(VDISK *disk, char *name)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_snapshot_create(disk, name);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Drop a snapshot
+ *
+ * @param name Name of the snapshot
+ * @return 0 if successful; -1 if an error has occurred; -2 if there is
+ *         no such snapshot
+ */
+int virtual_disk_delete_snapshot(VDISK *disk, char *name)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_snapshot_delete(disk, name);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Describe the snapshots of the disk, oldest first
+ *
+ * @param info Space for VDISK_MAX_SNAPSHOTS descriptions
+ * @return Number of snapshots
+ */
+int virtual_disk_list_snapshots(VDISK *disk, VDISK_SNAPSHOT_INFO *info)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_snapshot_list(disk, info);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Read every block of a snapshot
+ *
+ * @param name Name of the snapshot
+ * @param blocks Buffer for N_BLOCKS blocks, packed BLOCK_SIZE bytes apart
+ * @return 0 if successful; -1 if an error has occurred; -2 if there is
+ *         no such snapshot
+ */
+int virtual_disk_read_snapshot(VDISK *disk, char *name, void *blocks)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_snapshot_read(disk, name, blocks);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Describe the changed-block tracking state of the disk (see vdisk_cbt.c)
+ *
+ * @return 0
+ */
+int virtual_disk_cbt_info(VDISK *disk, VDISK_CBT_INFO *info)
+{
+  pthread_mutex_lock(&disk->lock);
+  vdisk_cbt_info(disk, info);
+  pthread_mutex_unlock(&disk->lock);
+  return(0);
+}
+
+/**
+ *  End the current epoch of the changed-block tracking and find the blocks
+ *   changed since an earlier one.  Finished transactions are committed
+ *   first; none may be open.
+ *
+ * @param since First epoch of interest (0: every block)
+ * @param changed Space for N_BLOCKS flags: 1 if the block has changed
+ * @param epoch Set to the epoch that has ended
+ * @return 0 if successful; -1 if an error has occurred; -2 if since is
+ *         a future epoch
+ */
+int virtual_disk_cbt_next_epoch(VDISK *disk, unsigned int since, unsigned char *changed,
+                                unsigned int *epoch)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_cbt_next_epoch(disk, since, changed, epoch);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Record that the disk is a replica of another one
+ *
+ * @param source History id of the disk it follows
+ * @param synced First epoch of that disk it has not seen
+ * @return 0 if successful; -1 if an error has occurred
+ */
+int virtual_disk_cbt_set_source(VDISK *disk, uint64_t source, unsigned int synced)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_cbt_set_source(disk, source, synced);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
+}
+
+/**
+ *  Give the space of some blocks back to the host (see vdisk_discard.c).
+ *   Each keeps its first VDISK_DISCARD_KEEP bytes and reads as zeros
+ *   otherwise.  Nothing may be writing the blocks meanwhile.
+ *
+ * @param refs Blocks to discard
+ * @param n Number of blocks
+ * @return Number of blocks discarded (0 if the storage cannot release
+ *         space); -1 if an error has occurred
+ */
+int virtual_disk_discard_blocks(VDISK *disk, BLOCK_REFERENCE *refs, int n)
+{
+  pthread_mutex_lock(&disk->lock);
+  int ret = vdisk_discard_blocks(disk, refs, n);
+  pthread_mutex_unlock(&disk->lock);
+  return(ret);
 }
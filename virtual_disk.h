@@ -1,5 +1,7 @@
 #ifndef VDISK_H
+#define VDISK_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -7,10 +9,83 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "oufs.h"
+#include "storage.h"
+#include "vdisk_trace.h"
 
-int virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base);
-int virtual_disk_detach();
-int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block);
-int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block);
+// An attached virtual disk (one per attach; safe to share between threads)
+typedef struct vdisk_s VDISK;
+
+// An asynchronous block transfer.  Reads of a block wait for asynchronous
+//  writes of it to be waited for, so a thread must wait for its own write
+//  before it reads the same block.
+typedef struct vdisk_request_s
+{
+  BLOCK_REFERENCE block_ref;
+  int write;
+  unsigned int generation;
+  STORAGE_REQUEST io;
+} VDISK_REQUEST;
+
+// Copy-on-write snapshots of the whole disk (see vdisk_snapshot.c)
+#define VDISK_MAX_SNAPSHOTS 8
+#define VDISK_SNAPSHOT_NAME 16
+
+typedef struct vdisk_snapshot_info_s
+{
+  char name[VDISK_SNAPSHOT_NAME];
+  unsigned int generation;
+
+  // Blocks that the snapshot no longer shares with the live disk
+  int preserved;
+} VDISK_SNAPSHOT_INFO;
+
+// Changed-block tracking (see vdisk_cbt.c)
+typedef struct vdisk_cbt_info_s
+{
+  // The disk's history (0: nothing written since tracking began) and the
+  //  current epoch, with the blocks changed in it so far
+  uint64_t id;
+  unsigned int epoch;
+  int changed;
+
+  // A replica: the disk it follows (0: none) and the first epoch of that
+  //  disk it has not seen
+  uint64_t source;
+  unsigned int synced;
+} VDISK_CBT_INFO;
+
+// Discarded blocks read as zeros, apart from the first VDISK_DISCARD_KEEP
+//  bytes, which they keep (room for a block reference) (see vdisk_discard.c)
+#define VDISK_DISCARD_KEEP 2
+
+VDISK *virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base);
+int virtual_disk_detach(VDISK *disk);
+int virtual_disk_read_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_write_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_read_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, void *blocks);
+int virtual_disk_write_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, void *blocks);
+int virtual_disk_read_block_async(VDISK *disk, VDISK_REQUEST *request,
+                                  BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_write_block_async(VDISK *disk, VDISK_REQUEST *request,
+                                   BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_submit(VDISK *disk);
+int virtual_disk_wait(VDISK *disk, VDISK_REQUEST *request);
+int virtual_disk_set_caller(int caller);
+int virtual_disk_begin_transaction(VDISK *disk);
+int virtual_disk_end_transaction(VDISK *disk);
+int virtual_disk_flush(VDISK *disk);
+int virtual_disk_create_journal(VDISK *disk);
+int virtual_disk_create_checksums(VDISK *disk, int enable);
+int virtual_disk_refresh(VDISK *disk);
+int virtual_disk_stripe_blocks(VDISK *disk);
+int virtual_disk_create_snapshot(VDISK *disk, char *name);
+int virtual_disk_delete_snapshot(VDISK *disk, char *name);
+int virtual_disk_list_snapshots(VDISK *disk, VDISK_SNAPSHOT_INFO *info);
+int virtual_disk_read_snapshot(VDISK *disk, char *name, void *blocks);
+int virtual_disk_cbt_info(VDISK *disk, VDISK_CBT_INFO *info);
+int virtual_disk_cbt_next_epoch(VDISK *disk, unsigned int since, unsigned char *changed,
+                                unsigned int *epoch);
+int virtual_disk_cbt_set_source(VDISK *disk, uint64_t source, unsigned int synced);
+int virtual_disk_discard_blocks(VDISK *disk, BLOCK_REFERENCE *refs, int n);
 
 #endif